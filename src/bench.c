@@ -0,0 +1,1192 @@
+/*
+ * Loopback benchmark of bundled and unbundled RADIUS
+ *
+ * For every point of a sweep over transport, concurrency, bundle size and
+ * request count the benchmark starts the test server on a local port,
+ * drives it with closed-loop client threads and reports requests per
+ * second, CPU time, cycles and system calls per request and latency
+ * percentiles, as JSON or CSV.
+ *
+ * Every client thread has its own handle and keeps one bundle in flight,
+ * driven through radius_dev.c as radius_client drives it: the requests
+ * are stamped from a template and queued with my_rad_add_request(), sent
+ * in one datagram (one write on TCP) by my_rad_add_send_request(), and
+ * my_rad_continue_send_request() takes the replies in until all have come
+ * before the next bundle.  The benchmark waits on the socket itself, in
+ * place of my_rad_send_request(), to time every reply and to apply a
+ * timeout in milliseconds.  The latency of a request runs from sending
+ * its bundle to receiving its reply; replies missing after the timeout
+ * are counted as lost.  A bundle size of 1 is this path with one message
+ * per datagram.
+ *
+ * A bundle size of 0 is the unbundled baseline, the client in no_bundle:
+ * like its single_client, every request gets a handle and socket of its
+ * own, is built with rad_put_*() and is sent alone and waited for.  The
+ * old library cannot be linked next to this one, its functions having the
+ * same names, and rad_send_request() here speaks TCP only, so the request
+ * goes out through my_rad_send_request() as a bundle of one; the timeout
+ * is rounded up to whole seconds there.  Against a bundle size of 1 the
+ * baseline adds single_client's cost of a handle per request.
+ *
+ * CPU time comes from the scheduler, for the server summed over its
+ * threads.  Cycles are read from the PMU when perf_event_open() allows it
+ * and otherwise estimated from the CPU time and the TSC rate.  The client
+ * counts its own system calls; the server reports its count when it is
+ * stopped, so that one includes the warm-up requests.
+ *
+ * A fault policy (see radlib_fault.c) damages the requests the clients
+ * send and the replies the server sends.  With retransmission the bundle
+ * is sent again, with the requests still unanswered, when its replies are
+ * not all in by the timeout, as the bundling client does, and the latency
+ * still runs from the first send; the amplification is the number of
+ * requests sent per request answered, which grows with the bundle size as
+ * the loss does.
+ *
+ * The memory mode counts the heap use of the client threads through the
+ * malloc() family defined below over the C library's: the heap a handle
+ * and its request template hold once set up, the allocations and bytes
+ * allocated per request, and the peak heap above the idle handle per
+ * request in flight.  It also reports the peak resident set of the client
+ * process and of the server.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <malloc.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+#include "include/radlib_net.h"
+
+#define BENCH_PORT 18120
+#define BENCH_SECRET "testing123"
+#define BENCH_MAX_BUNDLE RAD_MAX_PENDING  /* Requests radius_dev.c keeps in flight */
+#define BENCH_MAX_VALUES 16         /* Values per swept parameter */
+#define BENCH_MAX_CLIENTS 256
+#define BENCH_MAX_ARGS 32           /* Extra server arguments */
+#define BENCH_TIMEOUT_MS 1000       /* Wait for the replies to a bundle */
+#define BENCH_WARMUP_TRIES 50       /* Of BENCH_WARMUP_MS each, while the server starts */
+#define BENCH_WARMUP_MS 100
+
+struct rad_attr_block *my_rad_nas_block(struct rad_handle *h);
+struct rad_template *my_rad_template(struct rad_handle *h,
+                                     const struct rad_attr_block *nas);
+struct rad_request *my_rad_init(struct rad_handle *h,
+                                const struct rad_template *tpl);
+int my_rad_add_request(unsigned char *msg, long long *len, struct rad_request *r);
+int my_rad_add_send_request(struct rad_handle *h, unsigned char *msg, long long len,
+                            long long *fd, struct timeval *tv, uint proto_tcp);
+int my_rad_continue_send_request(struct rad_handle *h, long long selected, long long *fd,
+                                 struct timeval *tv, uint proto_tcp, long long msg_count,
+                                 long long *recv_msg_count);
+int my_rad_send_request(struct rad_handle *h, unsigned char *msg, long long len,
+                        uint proto_tcp, long long msg_count);
+void my_rad_release(struct rad_handle *h);
+
+typedef struct _bench_config_t
+{
+    const char *server;         /* Server binary */
+    int port;
+    const char *secret;
+    int workers;
+    char *server_args[BENCH_MAX_ARGS];
+    int no_server_args;
+    int timeout_ms;
+    int tries;                  /* Sends of a bundle before its replies are lost */
+    const char *faults;         /* Fault policy of both sides, or NULL */
+    int csv;
+    int memory;                 /* Report the heap use and resident set */
+    int protos[2];              /* 0 UDP, 1 TCP */
+    int no_protos;
+    long long clients[BENCH_MAX_VALUES];
+    int no_clients;
+    long long bundles[BENCH_MAX_VALUES];
+    int no_bundles;
+    long long counts[BENCH_MAX_VALUES];
+    int no_counts;
+}bench_config_t;
+
+/* Heap use of a thread, in usable bytes */
+typedef struct _bench_heap_t
+{
+    long long allocs;
+    long long bytes;            /* Allocated, freed or not */
+    long long live;             /* Allocated and not freed */
+    long long peak;             /* Of live */
+}bench_heap_t;
+
+/* One point of the sweep */
+typedef struct _bench_point_t
+{
+    int tcp;
+    int clients;
+    int bundle;
+    long long requests;
+}bench_point_t;
+
+typedef struct _bench_thread_t
+{
+    const bench_config_t *cfg;
+    const bench_point_t *pt;
+    pthread_t thread;
+    pthread_barrier_t *start;
+    long long requests;         /* Requests this thread sends */
+    long long answered;
+    long long rejected;         /* Answered with anything but Access-Accept */
+    long long lost;
+    long long sent;             /* Requests sent, retransmissions included */
+    long long retransmits;      /* Bundles sent again */
+    long long malformed;        /* Reply datagrams dropped as malformed */
+    long long syscalls;         /* Made while measuring */
+    long long handle_bytes;     /* Heap held by the handle once set up */
+    long long handle_allocs;
+    long long template_bytes;   /* By the NAS block and template on top */
+    long long allocs;           /* Made while measuring */
+    long long alloc_bytes;
+    long long inflight_bytes;   /* Peak heap while measuring above its start */
+    long long *lat;             /* Latency of each answered request in ns */
+    struct timespec end;
+    int error;
+    struct rad_handle *h;
+    struct rad_attr_block *nas;
+    struct rad_template *tpl;
+    unsigned char msg[MSGSIZE];
+}bench_thread_t;
+
+/* Memory figures of a point, -1 where not available */
+typedef struct _bench_memory_t
+{
+    long long client_rss_kb;    /* Peak resident set */
+    long long server_rss_kb;
+    double handle_bytes;        /* Per client thread */
+    double handle_allocs;
+    double template_bytes;
+    double allocs_per_req;
+    double bytes_per_req;
+    double inflight_bytes_per_req;
+}bench_memory_t;
+
+/* CPU time and cycles of a process, -1 where not available */
+typedef struct _bench_usage_t
+{
+    long long cpu_ns;
+    long long cycles;
+}bench_usage_t;
+
+static const char *cycles_source;
+static double tsc_per_ns;
+
+static long long ts_ns(const struct timespec *ts)
+{
+    return (long long)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts_ns(&ts);
+}
+
+/* Parse a comma separated list of numbers from min to max. Returns the count, -1 if invalid. */
+static int parse_list(const char *s, long long *vals, long long min, long long max)
+{
+    char *end;
+    int n = 0;
+
+    for (;;) {
+        if (n == BENCH_MAX_VALUES)
+            return -1;
+        errno = 0;
+        vals[n] = strtoll(s, &end, 10);
+        if (errno || end == s || vals[n] < min || vals[n] > max)
+            return -1;
+        n++;
+        if (*end == '\0')
+            return n;
+        if (*end != ',')
+            return -1;
+        s = end + 1;
+    }
+}
+
+/*
+ * Counting allocations
+ */
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+
+static int heap_counting;       /* Set before the client threads start */
+static __thread bench_heap_t heap;
+
+/*
+ * Count a block as the allocating thread's.  A block freed by another
+ * thread is taken off that thread's live bytes, which the clients, each
+ * freeing its own, never do.
+ */
+static void heap_alloc(void *p)
+{
+    long long n;
+
+    if (!heap_counting || p == NULL)
+        return;
+    n = malloc_usable_size(p);
+    heap.allocs++;
+    heap.bytes += n;
+    heap.live += n;
+    if (heap.live > heap.peak)
+        heap.peak = heap.live;
+}
+
+static void heap_free(void *p)
+{
+    if (heap_counting && p != NULL)
+        heap.live -= malloc_usable_size(p);
+}
+
+void *malloc(size_t n)
+{
+    void *p = __libc_malloc(n);
+
+    heap_alloc(p);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+
+    heap_alloc(p);
+    return p;
+}
+
+void *realloc(void *old, size_t n)
+{
+    long long old_n = heap_counting && old != NULL ? (long long)malloc_usable_size(old) : 0;
+    void *p;
+
+    if ((p = __libc_realloc(old, n)) == NULL && n != 0)
+        return NULL;    /* old is kept */
+    heap.live -= old_n;
+    heap_alloc(p);
+    return p;
+}
+
+void *memalign(size_t align, size_t n)
+{
+    void *p = __libc_memalign(align, n);
+
+    heap_alloc(p);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t n)
+{
+    return memalign(align, n);
+}
+
+int posix_memalign(void **pp, size_t align, size_t n)
+{
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+        return EINVAL;
+    if ((*pp = memalign(align, n)) == NULL)
+        return ENOMEM;
+    return 0;
+}
+
+void free(void *p)
+{
+    heap_free(p);
+    __libc_free(p);
+}
+
+/* Peak resident set of a process (0 for this one) in KB, -1 if unknown */
+static long long peak_rss_kb(pid_t pid)
+{
+    char path[64], line[128];
+    long long kb = -1;
+    FILE *fp;
+
+    if (pid == 0)
+        snprintf(path, sizeof(path), "/proc/self/status");
+    else
+        snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, "VmHWM: %lld kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb;
+}
+
+/*
+ * Start the peak resident set of this process over from its current size.
+ * Returns -1 where the kernel cannot, leaving the peak over the whole run.
+ */
+static int peak_rss_reset(void)
+{
+    int fd, ret;
+
+    if ((fd = open("/proc/self/clear_refs", O_WRONLY)) == -1)
+        return -1;
+    ret = write(fd, "5", 1) == 1 ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Counting cycles
+ */
+
+static int perf_cycles_open(pid_t pid, int exclude_kernel)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit = 1;           /* Count the threads started later too */
+    attr.exclude_kernel = exclude_kernel;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open a cycle counter for a process, as the first one opened could */
+static int cycles_open(pid_t pid)
+{
+    int fd;
+
+    if (cycles_source == NULL) {
+        if ((fd = perf_cycles_open(pid, 0)) != -1) {
+            cycles_source = "pmu";
+            return fd;
+        }
+        if ((fd = perf_cycles_open(pid, 1)) != -1) {
+            cycles_source = "pmu-user";
+            return fd;
+        }
+        cycles_source = tsc_per_ns > 0 ? "tsc-estimate" : "none";
+        return -1;
+    }
+    if (strcmp(cycles_source, "pmu") == 0)
+        return perf_cycles_open(pid, 0);
+    if (strcmp(cycles_source, "pmu-user") == 0)
+        return perf_cycles_open(pid, 1);
+    return -1;
+}
+
+/* Measure the TSC rate for estimating cycles from CPU time */
+static void tsc_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts = { 0, 50000000 };
+    unsigned long long c0, c1;
+    long long t0, t1;
+
+    t0 = now_ns();
+    c0 = __rdtsc();
+    nanosleep(&ts, NULL);
+    c1 = __rdtsc();
+    t1 = now_ns();
+    if (t1 > t0 && c1 > c0)
+        tsc_per_ns = (double)(c1 - c0) / (t1 - t0);
+#endif
+}
+
+/* Sum of the on-CPU time of all threads of a process */
+static long long proc_cpu_ns(pid_t pid)
+{
+    char path[320];
+    struct dirent *de;
+    long long total = 0, ns;
+    FILE *fp;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    if ((dir = opendir(path)) == NULL)
+        return -1;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat", (int)pid, de->d_name);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        if (fscanf(fp, "%lld", &ns) == 1)
+            total += ns;
+        fclose(fp);
+    }
+    closedir(dir);
+    return total;
+}
+
+static void usage_read(pid_t pid, int cycles_fd, bench_usage_t *u)
+{
+    struct timespec ts;
+    long long v;
+
+    if (pid == 0) {
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        u->cpu_ns = ts_ns(&ts);
+    } else
+        u->cpu_ns = proc_cpu_ns(pid);
+    u->cycles = -1;
+    if (cycles_fd != -1 && read(cycles_fd, &v, sizeof(v)) == sizeof(v))
+        u->cycles = v;
+}
+
+/* Cycles spent between two readings, measured or estimated; -1 if unknown */
+static double usage_cycles(const bench_usage_t *a, const bench_usage_t *b)
+{
+    if (a->cycles >= 0 && b->cycles >= 0)
+        return b->cycles - a->cycles;
+    if (tsc_per_ns > 0 && a->cpu_ns >= 0 && b->cpu_ns >= 0)
+        return (b->cpu_ns - a->cpu_ns) * tsc_per_ns;
+    return -1;
+}
+
+/*
+ * Clients
+ */
+
+/* A library counter of the calling thread */
+static long long client_counter(int counter)
+{
+    return rad_stats_self != NULL ? (long long)rad_stats_self[counter] : 0;
+}
+
+/*
+ * Send a bundle of n requests the way radius_client does, through
+ * my_rad_add_send_request(), and wait up to timeout_ms for the replies.
+ * my_rad_continue_send_request() takes the replies in and, on UDP, sends
+ * the unanswered requests again until the bundle has been sent cfg->tries
+ * times.  A reply's code is the one that call returns for its datagram.
+ * Latencies are only recorded when measuring.  Returns the number of
+ * requests answered, -1 on error.
+ */
+static int client_exchange(bench_thread_t *t, int n, int timeout_ms, int measure)
+{
+    struct rad_request *r;
+    struct timeval tv;
+    long long len = 0, fd, answered = 0, before, t0, now, deadline;
+    long long syscalls, retransmits, invalid;
+    int tries, rc, i;
+
+    for (i = 0; i < n; i++) {
+        if ((r = my_rad_init(t->h, t->tpl)) == NULL)
+            break;
+        if (my_rad_add_request(t->msg, &len, r) == -1) {
+            rad_req_free(r);
+            break;
+        }
+    }
+    if (i < n) {
+        my_rad_release(t->h);
+        return -1;
+    }
+
+    syscalls = client_counter(RAD_STAT_SYSCALLS);
+    retransmits = client_counter(RAD_STAT_RETRANSMITS);
+    invalid = client_counter(RAD_STAT_INVALID);
+    t0 = now_ns();
+    deadline = t0 + (long long)timeout_ms * 1000000;
+    rc = my_rad_add_send_request(t->h, t->msg, len, &fd, &tv, t->pt->tcp);
+    t->sent += measure ? n : 0;
+    tries = t->pt->tcp ? 1 : t->cfg->tries;
+
+    while (rc != -1 && answered < n) {
+        now = now_ns();
+        if (now >= deadline) {
+            if (--tries <= 0)
+                break;
+            t->sent += measure ? n - answered : 0;
+            rc = my_rad_continue_send_request(t->h, 0, &fd, &tv, t->pt->tcp, n,
+                    &answered);
+            deadline = now_ns() + (long long)timeout_ms * 1000000;
+            continue;
+        }
+        i = rad_net_wait(fd, deadline - now);
+        t->syscalls += measure;
+        if (i == -1 && errno != EINTR)
+            rc = -1;
+        if (i <= 0)
+            continue;
+
+        before = answered;
+        rc = my_rad_continue_send_request(t->h, 1, &fd, &tv, t->pt->tcp, n, &answered);
+        if (rc == -1 || !measure)
+            continue;
+        now = now_ns();
+        for ( ; before < answered; before++) {
+            if (rc != RAD_ACCESS_ACCEPT)
+                t->rejected++;
+            t->lat[t->answered++] = now - t0;
+        }
+    }
+
+    my_rad_release(t->h);
+    if (measure) {
+        t->syscalls += client_counter(RAD_STAT_SYSCALLS) - syscalls;
+        t->retransmits += client_counter(RAD_STAT_RETRANSMITS) - retransmits;
+        t->malformed += client_counter(RAD_STAT_INVALID) - invalid;
+        t->lost += rc == -1 ? 0 : n - answered;
+    }
+    return rc == -1 ? -1 : answered;
+}
+
+/*
+ * Send n requests the way single_client in no_bundle does: every request
+ * on a handle of its own, built with rad_put_*(), sent alone and waited
+ * for, here with my_rad_send_request().  Its timeout is in whole seconds,
+ * so timeout_ms is rounded up.  Returns the number of requests answered,
+ * -1 on error.
+ */
+static int client_single(bench_thread_t *t, int n, int timeout_ms, int measure)
+{
+    const bench_config_t *cfg = t->cfg;
+    struct rad_handle *h;
+    long long syscalls, retransmits, t0, len;
+    int answered = 0, rc, i;
+
+    syscalls = client_counter(RAD_STAT_SYSCALLS);
+    retransmits = client_counter(RAD_STAT_RETRANSMITS);
+    for (i = 0; i < n; i++) {
+        if ((h = rad_auth_open()) == NULL)
+            return -1;
+        if (rad_add_server(h, "127.0.0.1", cfg->port, cfg->secret,
+                    (timeout_ms + 999) / 1000, t->pt->tcp ? 1 : cfg->tries) == -1 ||
+                rad_create_request(h, RAD_ACCESS_REQUEST) == -1 ||
+                rad_put_string(h, RAD_USER_NAME, "admin") == -1 ||
+                rad_put_string(h, RAD_USER_PASSWORD, "admin") == -1 ||
+                rad_put_int(h, RAD_NAS_PORT, 4223) == -1) {
+            fprintf(stderr, "Request setup: %s\n", rad_strerror(h));
+            rad_close(h);
+            return -1;
+        }
+        t0 = now_ns();
+        len = 0;
+        rc = my_rad_add_request(t->msg, &len, &h->req);
+        if (rc != -1)
+            rc = my_rad_send_request(h, t->msg, len, t->pt->tcp, 1);
+        rad_close(h);
+        if (rc == -1) {
+            t->lost += measure;
+            continue;
+        }
+        answered++;
+        if (!measure)
+            continue;
+        if (rc != RAD_ACCESS_ACCEPT)
+            t->rejected++;
+        t->lat[t->answered++] = now_ns() - t0;
+    }
+    if (measure) {
+        t->sent += n + client_counter(RAD_STAT_RETRANSMITS) - retransmits;
+        t->retransmits += client_counter(RAD_STAT_RETRANSMITS) - retransmits;
+        t->syscalls += client_counter(RAD_STAT_SYSCALLS) - syscalls;
+    }
+    return answered;
+}
+
+static void *client_run(void *arg)
+{
+    bench_thread_t *t = arg;
+    const bench_config_t *cfg = t->cfg;
+    struct timespec ts = { 0, BENCH_WARMUP_MS * 1000000 };
+    int (*exchange)(bench_thread_t *, int, int, int);
+    bench_heap_t heap0;
+    long long done;
+    int step, n, i;
+
+    /* A bundle size of 0 is the unbundled baseline */
+    exchange = t->pt->bundle ? client_exchange : client_single;
+    step = t->pt->bundle ? t->pt->bundle : 1;
+
+    if ((t->h = rad_auth_open()) == NULL ||
+            rad_add_server(t->h, "127.0.0.1", cfg->port, cfg->secret,
+                (cfg->timeout_ms + 999) / 1000, t->pt->tcp ? 1 : cfg->tries) == -1) {
+        fprintf(stderr, "Client setup: %s\n", t->h ? rad_strerror(t->h) : "Out of memory");
+        t->error = 1;
+    }
+    t->handle_bytes = heap.live;
+    t->handle_allocs = heap.allocs;
+    if (!t->error && ((t->nas = my_rad_nas_block(t->h)) == NULL ||
+            (t->tpl = my_rad_template(t->h, t->nas)) == NULL)) {
+        fprintf(stderr, "Client setup: %s\n", rad_strerror(t->h));
+        t->error = 1;
+    }
+    t->template_bytes = heap.live - t->handle_bytes;
+
+    /*
+     * Wait for the server to answer and warm up both sides; it may not be
+     * listening yet, and under faults some replies may not come
+     */
+    for (i = 0; !t->error && i < BENCH_WARMUP_TRIES; i++) {
+        n = exchange(t, step, BENCH_WARMUP_MS, 0);
+        if (n == step || (n > 0 && cfg->faults != NULL))
+            break;
+        nanosleep(&ts, NULL);
+    }
+    if (i == BENCH_WARMUP_TRIES) {
+        fprintf(stderr, "No replies from the server: %s\n", rad_strerror(t->h));
+        t->error = 1;
+    }
+
+    pthread_barrier_wait(t->start);
+    heap0 = heap;
+    heap.peak = heap.live;
+    for (done = 0; !t->error && done < t->requests; done += n) {
+        n = t->requests - done < step ? t->requests - done : step;
+        if (exchange(t, n, cfg->timeout_ms, 1) == -1) {
+            fprintf(stderr, "Exchange failed: %s\n", rad_strerror(t->h));
+            t->error = 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t->end);
+    t->allocs = heap.allocs - heap0.allocs;
+    t->alloc_bytes = heap.bytes - heap0.bytes;
+    t->inflight_bytes = heap.peak - heap0.live;
+    return NULL;
+}
+
+/*
+ * Server
+ */
+
+/*
+ * Start the server, holding it before exec() until the cycle counter is
+ * attached so the counter is inherited by its workers.
+ */
+static pid_t server_start(const bench_config_t *cfg, const bench_point_t *pt, int out,
+                          int *cycles_fd)
+{
+    char port[16], workers[16], *argv[BENCH_MAX_ARGS + 16];
+    int go[2], argc = 0, i;
+    pid_t pid;
+    char c;
+
+    snprintf(port, sizeof(port), "%d", cfg->port);
+    snprintf(workers, sizeof(workers), "%d", cfg->workers);
+    argv[argc++] = (char *)cfg->server;
+    argv[argc++] = "-p";
+    argv[argc++] = port;
+    argv[argc++] = "-P";
+    argv[argc++] = pt->tcp ? "tcp" : "udp";
+    argv[argc++] = "-w";
+    argv[argc++] = workers;
+    argv[argc++] = "-s";
+    argv[argc++] = (char *)cfg->secret;
+    if (cfg->faults != NULL) {
+        argv[argc++] = "-F";
+        argv[argc++] = (char *)cfg->faults;
+    }
+    for (i = 0; i < cfg->no_server_args; i++)
+        argv[argc++] = cfg->server_args[i];
+    argv[argc] = NULL;
+
+    if (pipe(go) == -1)
+        return -1;
+    if ((pid = fork()) == -1)
+        return -1;
+    if (pid == 0) {
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+            _exit(127);
+        dup2(out, STDOUT_FILENO);
+        execv(cfg->server, argv);
+        fprintf(stderr, "Cannot run %s: %s\n", cfg->server, strerror(errno));
+        _exit(127);
+    }
+    close(go[0]);
+    *cycles_fd = cycles_open(pid);
+    c = 0;
+    if (write(go[1], &c, 1) != 1)
+        *cycles_fd = -1;
+    close(go[1]);
+    return pid;
+}
+
+/* Stop the server and read back the totals it prints. Returns -1 if it did not. */
+static int server_stop(pid_t pid, int out, long long *served, long long *syscalls)
+{
+    char buf[4096];
+    ssize_t n, total = 0;
+    int status, ret = -1;
+    off_t size;
+    char *line;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+    /* The totals come last, after whatever the server logged */
+    size = lseek(out, 0, SEEK_END);
+    lseek(out, size > (off_t)sizeof(buf) - 1 ? size - (off_t)sizeof(buf) + 1 : 0, SEEK_SET);
+    while (total < (ssize_t)sizeof(buf) - 1 &&
+            (n = read(out, buf + total, sizeof(buf) - 1 - total)) > 0)
+        total += n;
+    buf[total] = '\0';
+    if ((line = strstr(buf, "Served ")) != NULL &&
+            sscanf(line, "Served %lld requests, %*d dropped, %*d duplicates, %lld syscalls",
+                   served, syscalls) == 2)
+        ret = 0;
+    return ret;
+}
+
+/*
+ * Results
+ */
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Latency percentile in microseconds over sorted samples */
+static double percentile(const long long *lat, long long n, double p)
+{
+    long long i;
+
+    if (n == 0)
+        return -1;
+    i = (long long)(p * n + 0.999999) - 1;
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return lat[i] / 1000.0;
+}
+
+static const char *csv_columns =
+    "proto,clients,workers,bundle,requests,answered,rejected,lost,retransmits,malformed,"
+    "amplification,seconds,rps,"
+    "client_cpu_ns_per_req,server_cpu_ns_per_req,client_cycles_per_req,"
+    "server_cycles_per_req,cycles_source,client_syscalls_per_req,"
+    "server_syscalls_per_req,p50_us,p90_us,p99_us,p999_us,max_us";
+static const char *csv_memory_columns =
+    ",client_peak_rss_kb,server_peak_rss_kb,handle_bytes,handle_allocs,template_bytes,"
+    "allocs_per_req,alloc_bytes_per_req,inflight_bytes_per_req";
+
+/* Print a value, as null in JSON or empty in CSV when not known */
+static void emit_num(const bench_config_t *cfg, const char *name, double v, int prec,
+                     const char *sep)
+{
+    if (cfg->csv) {
+        if (v >= 0)
+            printf("%.*f", prec, v);
+    } else if (v >= 0)
+        printf("\"%s\": %.*f", name, prec, v);
+    else
+        printf("\"%s\": null", name);
+    printf("%s", sep);
+}
+
+static void emit_header(const bench_config_t *cfg)
+{
+    struct utsname u;
+
+    if (cfg->csv) {
+        printf("%s%s\n", csv_columns, cfg->memory ? csv_memory_columns : "");
+        return;
+    }
+    uname(&u);
+    printf("{\n  \"system\": {\"kernel\": \"%s %s\", \"machine\": \"%s\", \"cpus\": %ld, "
+           "\"cycles_source\": \"%s\", \"tsc_ghz\": %.3f},\n  \"runs\": [",
+           u.sysname, u.release, u.machine, sysconf(_SC_NPROCESSORS_ONLN),
+           cycles_source, tsc_per_ns);
+}
+
+static void emit_footer(const bench_config_t *cfg)
+{
+    if (!cfg->csv)
+        printf("\n  ]\n}\n");
+}
+
+static void emit_run(const bench_config_t *cfg, const bench_point_t *pt, int first,
+                     long long answered, long long rejected, long long lost,
+                     long long sent, long long retransmits, long long malformed, double secs,
+                     double client_cpu, double server_cpu, double client_cycles,
+                     double server_cycles, double client_syscalls, double server_syscalls,
+                     const long long *lat, const bench_memory_t *mem)
+{
+    const char *sep = cfg->csv ? "," : ", ";
+    double req = answered ? answered : 1;
+
+    if (cfg->csv)
+        printf("%s,%d,%d,%d,%lld,%lld,%lld,%lld,%lld,%lld,", pt->tcp ? "tcp" : "udp",
+               pt->clients, cfg->workers, pt->bundle, pt->requests, answered, rejected, lost,
+               retransmits, malformed);
+    else
+        printf("%s\n    {\"proto\": \"%s\", \"clients\": %d, \"workers\": %d, \"bundle\": %d, "
+               "\"requests\": %lld, \"answered\": %lld, \"rejected\": %lld, \"lost\": %lld, "
+               "\"retransmits\": %lld, \"malformed\": %lld, ",
+               first ? "" : ",", pt->tcp ? "tcp" : "udp", pt->clients, cfg->workers,
+               pt->bundle, pt->requests, answered, rejected, lost, retransmits, malformed);
+    emit_num(cfg, "amplification", answered ? (double)sent / answered : -1, 3, sep);
+    emit_num(cfg, "seconds", secs, 6, sep);
+    emit_num(cfg, "rps", answered / secs, 0, sep);
+    emit_num(cfg, "client_cpu_ns_per_req", client_cpu < 0 ? -1 : client_cpu / req, 0, sep);
+    emit_num(cfg, "server_cpu_ns_per_req", server_cpu < 0 ? -1 : server_cpu / req, 0, sep);
+    emit_num(cfg, "client_cycles_per_req", client_cycles < 0 ? -1 : client_cycles / req, 0,
+             sep);
+    emit_num(cfg, "server_cycles_per_req", server_cycles < 0 ? -1 : server_cycles / req, 0,
+             sep);
+    printf(cfg->csv ? "%s," : "\"cycles_source\": \"%s\", ", cycles_source);
+    emit_num(cfg, "client_syscalls_per_req", client_syscalls, 3, sep);
+    emit_num(cfg, "server_syscalls_per_req", server_syscalls, 3, sep);
+    if (!cfg->csv)
+        printf("\"latency_us\": {");
+    emit_num(cfg, "p50", percentile(lat, answered, 0.50), 1, sep);
+    emit_num(cfg, "p90", percentile(lat, answered, 0.90), 1, sep);
+    emit_num(cfg, "p99", percentile(lat, answered, 0.99), 1, sep);
+    emit_num(cfg, "p999", percentile(lat, answered, 0.999), 1, sep);
+    emit_num(cfg, "max", percentile(lat, answered, 1.0), 1, "");
+    if (mem != NULL) {
+        printf(cfg->csv ? "," : "}, \"memory\": {");
+        emit_num(cfg, "client_peak_rss_kb", mem->client_rss_kb, 0, sep);
+        emit_num(cfg, "server_peak_rss_kb", mem->server_rss_kb, 0, sep);
+        emit_num(cfg, "handle_bytes", mem->handle_bytes, 0, sep);
+        emit_num(cfg, "handle_allocs", mem->handle_allocs, 1, sep);
+        emit_num(cfg, "template_bytes", mem->template_bytes, 0, sep);
+        emit_num(cfg, "allocs_per_req", mem->allocs_per_req, 3, sep);
+        emit_num(cfg, "alloc_bytes_per_req", mem->bytes_per_req, 1, sep);
+        emit_num(cfg, "inflight_bytes_per_req", mem->inflight_bytes_per_req, 1, "");
+    }
+    printf(cfg->csv ? "\n" : "}}");
+    fflush(stdout);
+}
+
+/* Run one point of the sweep. Returns -1 if it could not be measured. */
+static int bench_point(const bench_config_t *cfg, const bench_point_t *pt, int first)
+{
+    bench_thread_t *threads;
+    pthread_barrier_t start;
+    bench_usage_t cu0, cu1, su0, su1;
+    char out_name[] = "/tmp/radbench.XXXXXX";
+    long long answered = 0, rejected = 0, lost = 0, syscalls = 0, served, srv_syscalls;
+    long long sent = 0, retransmits = 0, malformed = 0;
+    long long handle_bytes = 0, handle_allocs = 0, template_bytes = 0;
+    long long allocs = 0, alloc_bytes = 0, inflight_bytes = 0;
+    bench_memory_t mem;
+    long long t0, t1, *lat, n;
+    int self_cycles, srv_cycles, out, error = 0, i;
+    double server_syscalls = -1;
+    pid_t pid;
+
+    if ((out = mkstemp(out_name)) == -1) {
+        fprintf(stderr, "mkstemp: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(out_name);
+    if ((pid = server_start(cfg, pt, out, &srv_cycles)) == -1) {
+        fprintf(stderr, "Cannot start the server: %s\n", strerror(errno));
+        close(out);
+        return -1;
+    }
+
+    threads = calloc(pt->clients, sizeof(*threads));
+    lat = malloc((pt->requests ? pt->requests : 1) * sizeof(*lat));
+    if (threads == NULL || lat == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    self_cycles = cycles_open(0);
+    if (cfg->memory)
+        peak_rss_reset();
+    pthread_barrier_init(&start, NULL, pt->clients + 1);
+    for (i = 0, n = 0; i < pt->clients; i++) {
+        threads[i].cfg = cfg;
+        threads[i].pt = pt;
+        threads[i].start = &start;
+        threads[i].requests = pt->requests / pt->clients +
+            (i < pt->requests % pt->clients);
+        threads[i].lat = lat + n;
+        n += threads[i].requests;
+        if (pthread_create(&threads[i].thread, NULL, client_run, &threads[i]) != 0) {
+            fprintf(stderr, "Cannot start client %d\n", i);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start);
+    t0 = now_ns();
+    usage_read(0, self_cycles, &cu0);
+    usage_read(pid, srv_cycles, &su0);
+    t1 = t0;
+    for (i = 0; i < pt->clients; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (ts_ns(&threads[i].end) > t1)
+            t1 = ts_ns(&threads[i].end);
+    }
+    usage_read(0, self_cycles, &cu1);
+    usage_read(pid, srv_cycles, &su1);
+    mem.client_rss_kb = peak_rss_kb(0);
+    mem.server_rss_kb = peak_rss_kb(pid);
+
+    if (server_stop(pid, out, &served, &srv_syscalls) == 0 && served > 0)
+        server_syscalls = (double)srv_syscalls / served;
+    else
+        fprintf(stderr, "The server did not report its totals\n");
+
+    /* Gather the latencies of all the clients at the front */
+    for (i = 0, n = 0; i < pt->clients; i++) {
+        error |= threads[i].error;
+        memmove(lat + n, threads[i].lat, threads[i].answered * sizeof(*lat));
+        n += threads[i].answered;
+        answered += threads[i].answered;
+        rejected += threads[i].rejected;
+        lost += threads[i].lost;
+        sent += threads[i].sent;
+        retransmits += threads[i].retransmits;
+        malformed += threads[i].malformed;
+        syscalls += threads[i].syscalls;
+        handle_bytes += threads[i].handle_bytes;
+        handle_allocs += threads[i].handle_allocs;
+        template_bytes += threads[i].template_bytes;
+        allocs += threads[i].allocs;
+        alloc_bytes += threads[i].alloc_bytes;
+        inflight_bytes += threads[i].inflight_bytes;
+        rad_template_free(threads[i].tpl);
+        rad_block_free(threads[i].nas);
+        if (threads[i].h != NULL)
+            rad_close(threads[i].h);
+    }
+    qsort(lat, answered, sizeof(*lat), cmp_ll);
+    mem.handle_bytes = (double)handle_bytes / pt->clients;
+    mem.handle_allocs = (double)handle_allocs / pt->clients;
+    mem.template_bytes = (double)template_bytes / pt->clients;
+    mem.allocs_per_req = answered ? (double)allocs / answered : -1;
+    mem.bytes_per_req = answered ? (double)alloc_bytes / answered : -1;
+    /* Every client keeps one bundle in flight */
+    mem.inflight_bytes_per_req = (double)inflight_bytes / pt->clients /
+        (pt->bundle ? pt->bundle : 1);
+
+    if (!error)
+        emit_run(cfg, pt, first, answered, rejected, lost, sent, retransmits, malformed,
+                 (t1 - t0) / 1e9,
+                 cu0.cpu_ns < 0 ? -1 : cu1.cpu_ns - cu0.cpu_ns,
+                 su0.cpu_ns < 0 || su1.cpu_ns < 0 ? -1 : su1.cpu_ns - su0.cpu_ns,
+                 usage_cycles(&cu0, &cu1), usage_cycles(&su0, &su1),
+                 answered ? (double)syscalls / answered : -1, server_syscalls, lat,
+                 cfg->memory ? &mem : NULL);
+
+    pthread_barrier_destroy(&start);
+    if (self_cycles != -1)
+        close(self_cycles);
+    if (srv_cycles != -1)
+        close(srv_cycles);
+    close(out);
+    free(threads);
+    free(lat);
+    return error ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-S server] [-p port] [-s secret] [-w workers] [-X args]\n"
+            "          [-P udp,tcp] [-c clients] [-b bundles] [-n requests] [-t msec]"
+            " [-R tries]\n"
+            "          [-F faults] [-M] [-f json|csv]\n"
+            "  -S server   test server binary (default ./server)\n"
+            "  -p port     port to start the server on (default %d)\n"
+            "  -s secret   shared secret (default %s)\n"
+            "  -w workers  server worker threads (default 1)\n"
+            "  -X args     more server arguments, e.g. \"-r per\" or \"-L fixed:50\"\n"
+            "  -P protos   transports to sweep (default udp,tcp)\n"
+            "  -c clients  client threads to sweep (default 1,4)\n"
+            "  -b bundles  requests per bundle to sweep, 0 to %d; 0 is the\n"
+            "              unbundled baseline (default 0,1,8,32,128)\n"
+            "  -n counts   requests per run to sweep (default 20000)\n"
+            "  -t msec     time to wait for the replies to a bundle (default %d)\n"
+            "  -R tries    times a UDP bundle is sent before its missing replies\n"
+            "              are lost (default 1)\n"
+            "  -F faults   damage the requests and the replies, e.g.\n"
+            "              drop=1,msgtrunc=0.5 (see the server's -F)\n"
+            "  -M          also report the peak resident sets, the heap a client\n"
+            "              handle holds, allocations and bytes allocated per\n"
+            "              request and heap per request in flight\n"
+            "  -f format   output format (default json)\n"
+            "Lists are comma separated; every combination is run.\n",
+            prog, BENCH_PORT, BENCH_SECRET, BENCH_MAX_BUNDLE, BENCH_TIMEOUT_MS);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config_t cfg;
+    bench_point_t pt;
+    int p, c, b, n, first = 1, failed = 0, opt, fd;
+    struct rad_fault faults;
+    struct rad_fault_stats fst;
+    char *arg, *s;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.server = "./server";
+    cfg.port = BENCH_PORT;
+    cfg.secret = BENCH_SECRET;
+    cfg.workers = 1;
+    cfg.timeout_ms = BENCH_TIMEOUT_MS;
+    cfg.tries = 1;
+    cfg.protos[0] = 0;
+    cfg.protos[1] = 1;
+    cfg.no_protos = 2;
+    cfg.no_clients = parse_list("1,4", cfg.clients, 1, BENCH_MAX_CLIENTS);
+    cfg.no_bundles = parse_list("0,1,8,32,128", cfg.bundles, 0, BENCH_MAX_BUNDLE);
+    cfg.no_counts = parse_list("20000", cfg.counts, 1, 1LL << 40);
+
+    while ((opt = getopt(argc, argv, "S:p:s:w:X:P:c:b:n:t:R:F:Mf:")) != -1) {
+        switch (opt) {
+            case 'S':
+                cfg.server = optarg;
+                break;
+            case 'p':
+                cfg.port = atoi(optarg);
+                break;
+            case 's':
+                cfg.secret = optarg;
+                break;
+            case 'w':
+                cfg.workers = atoi(optarg);
+                break;
+            case 'X':
+                for (s = strtok(optarg, " "); s != NULL; s = strtok(NULL, " ")) {
+                    if (cfg.no_server_args == BENCH_MAX_ARGS) {
+                        fprintf(stderr, "Too many server arguments\n");
+                        return 1;
+                    }
+                    cfg.server_args[cfg.no_server_args++] = s;
+                }
+                break;
+            case 'P':
+                cfg.no_protos = 0;
+                for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ",")) {
+                    if (cfg.no_protos == 2 ||
+                            (strcmp(arg, "udp") != 0 && strcmp(arg, "tcp") != 0)) {
+                        usage(argv[0]);
+                        return 1;
+                    }
+                    cfg.protos[cfg.no_protos++] = strcmp(arg, "tcp") == 0;
+                }
+                break;
+            case 'c':
+                if ((cfg.no_clients = parse_list(optarg, cfg.clients, 1, BENCH_MAX_CLIENTS)) < 0) {
+                    fprintf(stderr, "Invalid clients (1 - %d)\n", BENCH_MAX_CLIENTS);
+                    return 1;
+                }
+                break;
+            case 'b':
+                if ((cfg.no_bundles = parse_list(optarg, cfg.bundles, 0, BENCH_MAX_BUNDLE)) < 0) {
+                    fprintf(stderr, "Invalid bundle size (0 - %d)\n", BENCH_MAX_BUNDLE);
+                    return 1;
+                }
+                break;
+            case 'n':
+                if ((cfg.no_counts = parse_list(optarg, cfg.counts, 1, 1LL << 40)) < 0) {
+                    fprintf(stderr, "Invalid request count\n");
+                    return 1;
+                }
+                break;
+            case 't':
+                cfg.timeout_ms = atoi(optarg);
+                break;
+            case 'R':
+                cfg.tries = atoi(optarg);
+                break;
+            case 'F':
+                if (rad_fault_parse(optarg, &faults) == -1) {
+                    fprintf(stderr, "Invalid fault policy %s\n", optarg);
+                    return 1;
+                }
+                cfg.faults = optarg;
+                break;
+            case 'M':
+                cfg.memory = 1;
+                break;
+            case 'f':
+                if (strcmp(optarg, "json") != 0 && strcmp(optarg, "csv") != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                cfg.csv = strcmp(optarg, "csv") == 0;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.no_protos == 0 || cfg.workers < 1 || cfg.timeout_ms < 1 || cfg.tries < 1 ||
+            cfg.port < 1 || cfg.port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* A dying server must not take the benchmark with it */
+    signal(SIGPIPE, SIG_IGN);
+    tsc_calibrate();
+    if ((fd = cycles_open(0)) != -1)
+        close(fd);
+    if (cfg.faults != NULL && rad_fault_start(&faults) == -1) {
+        fprintf(stderr, "Cannot inject faults: %s\n", strerror(errno));
+        return 1;
+    }
+    heap_counting = cfg.memory;
+    emit_header(&cfg);
+
+    for (p = 0; p < cfg.no_protos; p++)
+        for (c = 0; c < cfg.no_clients; c++)
+            for (b = 0; b < cfg.no_bundles; b++)
+                for (n = 0; n < cfg.no_counts; n++) {
+                    pt.tcp = cfg.protos[p];
+                    pt.clients = cfg.clients[c];
+                    pt.bundle = cfg.bundles[b];
+                    pt.requests = cfg.counts[n];
+                    if (pt.requests < pt.clients)
+                        pt.clients = pt.requests;
+                    fprintf(stderr, "%s clients %d bundle %d requests %lld\n",
+                            pt.tcp ? "tcp" : "udp", pt.clients, pt.bundle, pt.requests);
+                    if (bench_point(&cfg, &pt, first) == 0)
+                        first = 0;
+                    else
+                        failed++;
+                }
+
+    emit_footer(&cfg);
+    if (cfg.faults != NULL) {
+        rad_fault_stop();
+        rad_fault_stats(&fst);
+        fprintf(stderr, "Faults in %llu request datagrams: %llu dropped, %llu delayed,"
+                " %llu duplicated, %llu truncated, %llu messages dropped,"
+                " %llu messages truncated, %llu lengths corrupted\n",
+                (unsigned long long)fst.datagrams, (unsigned long long)fst.dropped,
+                (unsigned long long)fst.delayed, (unsigned long long)fst.duplicated,
+                (unsigned long long)fst.truncated, (unsigned long long)fst.msg_dropped,
+                (unsigned long long)fst.msg_truncated, (unsigned long long)fst.corrupted);
+    }
+    if (failed)
+        fprintf(stderr, "%d runs failed\n", failed);
+    return failed ? 1 : 0;
+}
@@ -31,6 +31,7 @@
 
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <stdio.h>
 
 /* Limits */
 #define RAD_MAX_ATTR_LEN		253
@@ -187,11 +188,85 @@
 
 #define	RAD_ERROR_CAUSE			101	/* Integer */
 
+struct rad_arena;
+struct rad_attr_block;
 struct rad_handle;
+struct rad_request;
+struct rad_template;
+struct rad_dup_cache;
+
+/* Value of a template field, see rad_template_stamp() */
+struct rad_value {
+	const void	*data;
+	size_t		 len;
+};
+struct timespec;
 struct timeval;
 
+/* Latency stages, see rad_latency_get() */
+#define	RAD_LAT_QUEUE		0	/* Created to sent */
+#define	RAD_LAT_WIRE		1	/* Sent to first byte of the reply */
+#define	RAD_LAT_PROCESS		2	/* First byte of the reply to completed */
+#define	RAD_LAT_TOTAL		3	/* Created to completed */
+#define	RAD_LAT_STAGES		4
+
+/* Request kinds */
+#define	RAD_LAT_ACCESS		0
+#define	RAD_LAT_ACCOUNTING	1
+#define	RAD_LAT_OTHER		2
+#define	RAD_LAT_KINDS		3
+
+/* Bundle sizes: 1, 2-4, 5-16, 17-64 and more */
+#define	RAD_LAT_BUNDLES		5
+
+#define	RAD_LAT_ANY		-1
+
+/* Merged latencies in ns */
+struct rad_latency {
+	u_int64_t	 count;
+	u_int64_t	 min;
+	u_int64_t	 mean;
+	u_int64_t	 p50;
+	u_int64_t	 p90;
+	u_int64_t	 p99;
+	u_int64_t	 p999;
+	u_int64_t	 max;
+};
+
+/* Library counters, see rad_stats_snapshot() */
+#define	RAD_STAT_REQUESTS	0	/* Requests created */
+#define	RAD_STAT_BUNDLES	1	/* Bundles sent */
+#define	RAD_STAT_BUNDLED	2	/* Requests sent in bundles */
+#define	RAD_STAT_RECEIVED	3	/* Requests or replies received */
+#define	RAD_STAT_BYTES_SENT	4
+#define	RAD_STAT_BYTES_RECEIVED	5
+#define	RAD_STAT_RETRANSMITS	6	/* Requests or bundles sent again */
+#define	RAD_STAT_TIMEOUTS	7	/* Waits for a reply timed out */
+#define	RAD_STAT_FAILOVERS	8	/* Moves to another server */
+#define	RAD_STAT_INVALID	9	/* Requests or replies failing validation */
+#define	RAD_STAT_COPIED		10	/* Bytes copied between buffers */
+#define	RAD_STAT_SYSCALLS	11
+#define	RAD_STAT_COUNTERS	12
+
+/* Output formats of rad_stats_print() */
+#define	RAD_STATS_TEXT		0
+#define	RAD_STATS_PROMETHEUS	1
+
+struct rad_stats {
+	u_int64_t	 time;		/* CLOCK_MONOTONIC, ns */
+	u_int64_t	 counters[RAD_STAT_COUNTERS];
+};
+
 __BEGIN_DECLS
 struct rad_handle	*rad_acct_open(void);
+void			*rad_arena_alloc(struct rad_arena *, size_t);
+char			*rad_arena_cvt_string(struct rad_arena *, const void *,
+			    size_t);
+u_char			*rad_arena_demangle(struct rad_handle *,
+			    struct rad_arena *, const void *, size_t);
+void			 rad_arena_reset(struct rad_arena *);
+int			 rad_add_client(struct rad_handle *, const char *,
+			    const char *);
 int			 rad_add_server(struct rad_handle *,
 			    const char *, int, const char *, int, int);
 int			 rad_add_server_ex(struct rad_handle *,
@@ -199,25 +274,51 @@ int			 rad_add_server_ex(struct rad_handle *,
 			    int, struct in_addr *);
 struct rad_handle	*rad_auth_open(void);
 void			 rad_bind_to(struct rad_handle *, in_addr_t);
+struct rad_attr_block	*rad_block_create(struct rad_request *);
+void			 rad_block_free(struct rad_attr_block *);
+int			 rad_bundle_scan(const void *, size_t, size_t *, int);
 void			 rad_close(struct rad_handle *);
 int			 rad_config(struct rad_handle *, const char *);
 int			 rad_continue_send_request(struct rad_handle *, int,
 			    int *, struct timeval *);
 int			 rad_create_request(struct rad_handle *, int);
 int			 rad_create_response(struct rad_handle *, int);
+int			 rad_encode_response(struct rad_handle *);
 struct in_addr		 rad_cvt_addr(const void *);
 struct in6_addr		 rad_cvt_addr6(const void *);
 u_int32_t		 rad_cvt_int(const void *);
 char			*rad_cvt_string(const void *, size_t);
+struct rad_dup_cache	*rad_dup_cache_create(u_int, size_t);
+void			 rad_dup_cache_destroy(struct rad_dup_cache *);
+int			 rad_find_attr(struct rad_handle *, int,
+			    const void **, size_t *);
+int			 rad_find_next_attr(struct rad_handle *, int,
+			    const void **, size_t *);
+int			 rad_find_next_vendor_attr(struct rad_handle *, int,
+			    const void **, size_t *);
+int			 rad_find_vendor_attr(struct rad_handle *, u_int32_t,
+			    int, const void **, size_t *);
 int			 rad_get_attr(struct rad_handle *, const void **,
 			    size_t *);
+struct rad_arena	*rad_in_arena(struct rad_handle *);
+int			 rad_index_attrs(struct rad_handle *);
 int			 rad_init_send_request(struct rad_handle *, int *,
 			    struct timeval *);
+int			 rad_latency_dump(FILE *);
+int			 rad_latency_dump_start(FILE *, u_int);
+void			 rad_latency_dump_stop(void);
+int			 rad_latency_get(const struct sockaddr_in *, int, int,
+			    int, struct rad_latency *);
+int			 rad_load_clients(struct rad_handle *, const char *);
+int			 rad_load_request(struct rad_handle *, const void *,
+			    size_t, const struct sockaddr_in *);
 struct rad_handle	*rad_open(void);  /* Deprecated, == rad_auth_open */
 int			 rad_put_addr(struct rad_handle *, int, struct in_addr);
 int			 rad_put_addr6(struct rad_handle *, int, struct in6_addr);
 int			 rad_put_attr(struct rad_handle *, int,
 			    const void *, size_t);
+int			 rad_put_block(struct rad_handle *,
+			    const struct rad_attr_block *);
 int			 rad_put_int(struct rad_handle *, int, u_int32_t);
 int			 rad_put_string(struct rad_handle *, int,
 			    const char *);
@@ -225,11 +326,54 @@ int			 rad_put_message_authentic(struct rad_handle *);
 ssize_t			 rad_request_authenticator(struct rad_handle *, char *,
 			    size_t);
 int			 rad_receive_request(struct rad_handle *);
+void			 rad_req_complete(struct rad_request *, int);
+struct rad_request	*rad_req_create(struct rad_handle *, int);
+int			 rad_req_encode(struct rad_request *, const void **,
+			    size_t *);
+void			 rad_req_free(struct rad_request *);
+struct rad_arena	*rad_req_arena(struct rad_request *);
+int			 rad_req_ident(const struct rad_request *);
+int			 rad_req_is_reply(const struct rad_request *,
+			    const unsigned char *, size_t);
+int			 rad_req_put_addr(struct rad_request *, int,
+			    struct in_addr);
+int			 rad_req_put_addr6(struct rad_request *, int,
+			    struct in6_addr);
+int			 rad_req_put_attr(struct rad_request *, int,
+			    const void *, size_t);
+int			 rad_req_put_block(struct rad_request *,
+			    const struct rad_attr_block *);
+int			 rad_req_put_field(struct rad_request *, int, int);
+int			 rad_req_put_int(struct rad_request *, int, u_int32_t);
+int			 rad_req_put_string(struct rad_request *, int,
+			    const char *);
+int			 rad_req_put_message_authentic(struct rad_request *);
+void			 rad_req_received(struct rad_request *);
+int			 rad_req_reply_code(const struct rad_request *);
+void			 rad_req_schedule(struct rad_request *,
+			    const struct timespec *);
+void			 rad_req_sent(struct rad_request *, int);
 int			 rad_send_request(struct rad_handle *);
 int			 rad_send_response(struct rad_handle *);
 struct rad_handle	*rad_server_open(int fd);
 const char		*rad_server_secret(struct rad_handle *);
+void			 rad_set_dup_cache(struct rad_handle *,
+			    struct rad_dup_cache *);
+void			 rad_set_latency(struct rad_handle *, int);
+void			 rad_stats_diff(const struct rad_stats *,
+			    const struct rad_stats *, struct rad_stats *);
+int			 rad_stats_export_start(const char *, int);
+void			 rad_stats_export_stop(void);
+const char		*rad_stats_name(int);
+int			 rad_stats_print(FILE *, const struct rad_stats *, int);
+void			 rad_stats_snapshot(struct rad_stats *);
 const char		*rad_strerror(struct rad_handle *);
+struct rad_template	*rad_template_create(struct rad_request *);
+void			 rad_template_free(struct rad_template *);
+struct rad_request	*rad_template_stamp(struct rad_handle *,
+			    const struct rad_template *,
+			    const struct rad_value *);
+int			 rad_validate_request(struct rad_handle *);
 u_char			*rad_demangle(struct rad_handle *, const void *,
 			    size_t);
 
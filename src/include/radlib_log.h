@@ -0,0 +1,51 @@
+/*-
+ * Leveled asynchronous logging, see radlib_log.c
+ */
+
+#ifndef _RADLIB_LOG_H_
+#define _RADLIB_LOG_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <stdio.h>
+
+/* Levels */
+#define	RAD_LOG_ERR		0
+#define	RAD_LOG_WARN		1
+#define	RAD_LOG_INFO		2
+#define	RAD_LOG_DEBUG		3
+#define	RAD_LOG_TRACE		4
+#define	RAD_LOG_LEVELS		5
+
+/* Categories */
+#define	RAD_LOGC_GENERAL	0x01
+#define	RAD_LOGC_NET		0x02	/* Sockets, connections, transports */
+#define	RAD_LOGC_BUNDLE		0x04	/* Building and splitting bundles */
+#define	RAD_LOGC_PROTO		0x08	/* Decoding, validating, encoding */
+#define	RAD_LOGC_ALL		0xff
+
+/* Categories enabled at each level; see rad_log_set() */
+extern u_int32_t rad_log_mask[RAD_LOG_LEVELS];
+
+/*
+ * Log a message.  When the level and category are not enabled this is a
+ * load and a branch; the arguments are not evaluated.
+ */
+#define	RAD_LOG(level, cat, ...) do {					\
+	if (__builtin_expect((__atomic_load_n(&rad_log_mask[level],	\
+	    __ATOMIC_RELAXED) & (cat)) != 0, 0))			\
+		rad_log_write(level, cat, __VA_ARGS__);			\
+} while (0)
+
+__BEGIN_DECLS
+u_int64_t	 rad_log_dropped(void);
+void		 rad_log_flush(void);
+int		 rad_log_parse(const char *);
+void		 rad_log_set(int, u_int32_t);
+int		 rad_log_start(FILE *);
+void		 rad_log_stop(void);
+void		 rad_log_write(int, u_int32_t, const char *, ...)
+		    __attribute__((format(printf, 3, 4)));
+__END_DECLS
+
+#endif /* _RADLIB_LOG_H_ */
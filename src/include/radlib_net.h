@@ -0,0 +1,128 @@
+/*-
+ * Pluggable datagram transport, simulated network and fault injection,
+ * see radlib_net.c, radlib_sim.c and radlib_fault.c
+ */
+
+#ifndef _RADLIB_NET_H_
+#define _RADLIB_NET_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <netinet/in.h>
+#include <time.h>
+
+struct mmsghdr;
+
+#define	RAD_NET_FOREVER		(~(u_int64_t)0)	/* rad_net_wait() timeout */
+
+/*
+ * The calls the clients and the test server make to move datagrams and
+ * read the clock.  Each takes the argument given to rad_net_set() first;
+ * they return and set errno as the system calls of the same name do.
+ * wait() returns 1 when fd is readable, 0 when timeout_ns passed, and -1
+ * on an error.  now() is a monotonic clock in nanoseconds, time() the
+ * wall clock in seconds.
+ */
+struct rad_net_ops {
+	int	 (*socket)(void *, int);
+	int	 (*bind)(void *, int, const struct sockaddr_in *);
+	int	 (*connect)(void *, int, const struct sockaddr_in *);
+	ssize_t	 (*sendto)(void *, int, const void *, size_t, int,
+		    const struct sockaddr_in *);
+	ssize_t	 (*recvfrom)(void *, int, void *, size_t, int,
+		    struct sockaddr_in *);
+	int	 (*sendmmsg)(void *, int, struct mmsghdr *, u_int, int);
+	int	 (*close)(void *, int);
+	int	 (*wait)(void *, int, u_int64_t);
+	u_int64_t (*now)(void *);
+	time_t	 (*time)(void *);
+};
+
+/* Link model of the simulated network, see rad_sim_create() */
+struct rad_sim_link {
+	u_int64_t	 latency_ns;	/* One way */
+	u_int64_t	 jitter_ns;	/* Uniform in [0, jitter_ns) on top */
+	double		 loss;		/* Of every IP fragment */
+	double		 reorder;	/* Share of datagrams held back */
+	u_int64_t	 reorder_ns;	/* By how much */
+	u_int64_t	 bandwidth;	/* Bits per second of every sender, 0 unlimited */
+	u_int		 mtu;		/* IP packet size, 0 for no fragmenting */
+};
+
+struct rad_sim_stats {
+	u_int64_t	 now;		/* Virtual nanoseconds since the start */
+	u_int64_t	 events;
+	u_int64_t	 datagrams;	/* Sent */
+	u_int64_t	 bytes;
+	u_int64_t	 fragments;
+	u_int64_t	 lost;		/* A fragment was lost */
+	u_int64_t	 reordered;
+	u_int64_t	 unreachable;	/* Nothing bound to the destination */
+	u_int64_t	 overflows;	/* Receive queue full */
+	u_int64_t	 delivered;
+};
+
+/* Fault policy, chances in percent, see rad_fault_parse() */
+struct rad_fault {
+	double		 drop;		/* Datagram not sent */
+	double		 delay;		/* Datagram sent delay_us later */
+	u_int		 delay_us;
+	double		 dup;		/* Datagram sent twice */
+	double		 trunc;		/* Datagram cut short */
+	double		 msg_drop;	/* Message taken out of the datagram */
+	double		 msg_trunc;	/* Message cut short, length kept */
+	double		 corrupt;	/* Length field of a message rewritten */
+	u_int64_t	 seed;
+};
+
+struct rad_fault_stats {
+	u_int64_t	 datagrams;	/* Sent through the policy */
+	u_int64_t	 dropped;
+	u_int64_t	 delayed;
+	u_int64_t	 duplicated;
+	u_int64_t	 truncated;
+	u_int64_t	 msg_dropped;
+	u_int64_t	 msg_truncated;
+	u_int64_t	 corrupted;
+};
+
+struct rad_sim;
+
+typedef void rad_sim_fn(void *, int);
+
+__BEGIN_DECLS
+void		 rad_net_set(const struct rad_net_ops *, void *);
+void		 rad_net_get(const struct rad_net_ops **, void **);
+int		 rad_net_socket(int);
+int		 rad_net_bind(int, const struct sockaddr_in *);
+int		 rad_net_connect(int, const struct sockaddr_in *);
+ssize_t		 rad_net_sendto(int, const void *, size_t, int,
+		    const struct sockaddr_in *);
+ssize_t		 rad_net_recvfrom(int, void *, size_t, int,
+		    struct sockaddr_in *);
+int		 rad_net_sendmmsg(int, struct mmsghdr *, u_int, int);
+int		 rad_net_close(int);
+int		 rad_net_wait(int, u_int64_t);
+u_int64_t	 rad_net_now(void);
+time_t		 rad_net_time(void);
+
+struct rad_sim	*rad_sim_create(u_int64_t, const struct rad_sim_link *);
+void		 rad_sim_destroy(struct rad_sim *);
+void		 rad_sim_start(struct rad_sim *);
+void		 rad_sim_stop(struct rad_sim *);
+int		 rad_sim_listen(struct rad_sim *, int, rad_sim_fn *, void *);
+int		 rad_sim_timer(struct rad_sim *, u_int64_t, rad_sim_fn *,
+		    void *);
+int		 rad_sim_down(struct rad_sim *, const struct sockaddr_in *,
+		    int);
+int		 rad_sim_run(struct rad_sim *, u_int64_t);
+u_int64_t	 rad_sim_now(const struct rad_sim *);
+void		 rad_sim_stats(const struct rad_sim *, struct rad_sim_stats *);
+
+int		 rad_fault_parse(const char *, struct rad_fault *);
+int		 rad_fault_start(const struct rad_fault *);
+void		 rad_fault_stop(void);
+void		 rad_fault_stats(struct rad_fault_stats *);
+__END_DECLS
+
+#endif /* _RADLIB_NET_H_ */
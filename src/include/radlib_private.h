@@ -55,6 +55,12 @@
 #define MSGSIZE		55000		/* Maximum RADIUS message */
 #define PASSSIZE	128		/* Maximum significant password chars */
 
+/* Size classes of the packet buffer pool */
+#define RAD_BUF_CLASSES	3
+#define RAD_BUF_SMALL	256		/* Typical request or response */
+#define RAD_BUF_MEDIUM	4096		/* Largest RADIUS message (RFC 2865) */
+#define RAD_BUF_LARGE	65536		/* Whole bundles, MSGSIZE */
+
 /* Positions of fields in RADIUS messages */
 #define POS_CODE	0		/* Message code */
 #define POS_IDENT	1		/* Identifier */
@@ -75,13 +81,81 @@ struct rad_server {
 	in_addr_t	 bindto;	/* Bind to address */
 };
 
-struct rad_handle {
-	int		 fd;		/* Socket file descriptor */
-	struct rad_server servers[MAXSERVERS];	/* Servers to contact */
-	int		 num_servers;	/* Number of valid server entries */
-	int		 ident;		/* Current identifier value */
-	char		 errmsg[ERRSIZE];	/* Most recent error message */
-	unsigned char	 out[MSGSIZE];	/* Request to send */
+struct rad_client;
+struct rad_client_table;
+
+/* Identifies a request for duplicate detection (RFC 5080) */
+struct rad_dup_key {
+	in_addr_t	 addr;		/* Client address */
+	in_port_t	 port;		/* Client source port */
+	u_char		 ident;		/* Request identifier */
+	u_char		 auth[LEN_AUTH];	/* Request authenticator */
+};
+
+/* Results of rad_dup_cache_lookup() */
+#define RAD_DUP_NEW		0	/* First time seen */
+#define RAD_DUP_CACHED		1	/* Answered before, response copied */
+#define RAD_DUP_IN_PROGRESS	2	/* Original not answered yet */
+
+/* An attribute of the received message, see rad_index_attrs() */
+struct rad_attr_ref {
+	u_int16_t	 off;		/* Value offset in h->in */
+	u_int8_t	 len;		/* Value length */
+	u_int16_t	 next;		/* Next one of the same type */
+};
+
+/* A sub-attribute of a Vendor-Specific attribute */
+struct rad_vsa_ref {
+	u_int32_t	 vendor;	/* Vendor-Id */
+	u_int8_t	 type;
+	u_int8_t	 len;		/* Value length */
+	u_int16_t	 off;		/* Value offset in h->in */
+	u_int16_t	 next;		/* Next one of the same vendor and type */
+};
+
+/* Index of the received message; the arrays grow as needed */
+struct rad_attr_index {
+	u_int16_t	 first[256];	/* First attribute of each type */
+	struct rad_attr_ref *attrs;	/* In message order */
+	int		 no_attrs;
+	int		 size;
+	struct rad_vsa_ref *vsas;	/* In message order */
+	int		 no_vsas;
+	int		 vsa_size;
+	u_int16_t	*vsa_hash;	/* First sub-attribute of a chain */
+	u_int16_t	*vsa_last;	/* Last sub-attribute of a chain */
+	int		 hash_size;
+};
+
+/* Memory released all at once, see radlib_arena.c */
+struct rad_arena {
+	struct rad_arena_chunk *chunks;	/* Newest first */
+	size_t		 used;		/* Bytes used in the newest chunk */
+};
+
+/* Variable field of a request template, see rad_req_put_field() */
+#define RAD_TEMPLATE_FIELDS	32	/* Maximum fields per template */
+
+struct rad_tpl_field {
+	u_int16_t	 off;		/* Attribute offset in the attributes */
+	u_int8_t	 type;		/* Attribute type */
+	u_int8_t	 width;		/* Value length, 0 if variable */
+};
+
+/* States of a struct rad_request */
+#define RAD_REQ_FREE		0	/* On the free list */
+#define RAD_REQ_BUILDING	1	/* Attributes being added */
+#define RAD_REQ_SENT		2	/* Encoded, waiting for a reply */
+#define RAD_REQ_DONE		3	/* Reply received */
+
+/*
+ * A request and its encoding state.  The servers, secrets and socket are
+ * those of the owning handle.
+ */
+struct rad_request {
+	struct rad_handle *h;		/* Owner */
+	unsigned char	*out;		/* Request to send, from the pool */
+	size_t		 out_size;	/* Size of out */
 	char		 out_created;	/* rad_create_request() called? */
 	int		 out_len;	/* Length of request */
 	char		 pass[PASSSIZE];	/* Cleartext password */
@@ -90,12 +164,89 @@ struct rad_handle {
 	char		 chap_pass;	/* Have we got a CHAP_PASSWORD ? */
 	int		 authentic_pos;	/* Position of message authenticator */
 	char		 eap_msg;	/* Are we an EAP Proxy? */
-	unsigned char	 in[MSGSIZE];	/* Response received */
+	int		 vsa_pos;	/* Vendor-Specific being filled, or 0 */
+	char		 vsa_packing;	/* See rad_req_begin_vendor() */
+	u_int32_t	 vsa_vendor;	/* Vendor of the packed attributes */
+	int		 state;		/* RAD_REQ_* */
+	int		 reply_code;	/* Code of the reply, once done */
+	struct rad_arena arena;		/* See rad_req_arena() */
+	struct rad_tpl_field *fields;	/* Template fields, in arena */
+	int		 no_fields;
+	u_int64_t	 t_created;	/* In ns, 0 unless timed */
+	u_int64_t	 t_sent;	/* See rad_req_sent() */
+	u_int64_t	 t_received;	/* See rad_req_received() */
+	int		 bundle;	/* Requests sent together with it */
+	struct rad_request *next;	/* Free list */
+};
+
+struct rad_req_slab;
+
+/*
+ * Requests of a client bundle in flight, queued per identifier in the
+ * order they were added; a bundle of more than 256 requests reuses
+ * identifiers.  See radius_dev.c.
+ */
+#define RAD_MAX_PENDING	1000
+struct rad_pending {
+	struct rad_request *req[RAD_MAX_PENDING];	/* NULL once answered */
+	int		 next[RAD_MAX_PENDING];	/* Same identifier, or -1 */
+	int		 head[256];	/* First per identifier, or -1 */
+	int		 tail[256];	/* Last per identifier, or -1 */
+	int		 count;		/* Entries of req in use */
+};
+
+struct rad_handle {
+	int		 fd;		/* Socket file descriptor */
+	struct rad_server servers[MAXSERVERS];	/* Servers to contact */
+	int		 num_servers;	/* Number of valid server entries */
+	int		 ident;		/* Current identifier value */
+	char		 errmsg[ERRSIZE];	/* Most recent error message */
+	struct rad_request req;	/* Of rad_create_request(), rad_put_*() */
+	unsigned char	*in;		/* Response received, from the pool */
+	size_t		 in_size;	/* Size of in */
 	int		 in_len;	/* Length of response */
 	int		 in_pos;	/* Current position scanning attrs */
+	struct rad_arena in_arena;	/* Reset for every received message */
+	unsigned char	*stream;	/* Partial TCP replies, client only */
+	size_t		 stream_size;	/* Size of stream */
+	int		 stream_len;	/* Bytes of stream not yet framed */
+	int		 stream_srv;	/* Server the socket is connected to, or -1 */
+	struct rad_pending *pending;	/* Bundle in flight, client only */
 	int		 srv;		/* Server number we did last */
 	int		 type;		/* Handle type */
 	in_addr_t	 bindto;	/* Current bind address */
+	struct rad_client_table *clients;	/* Clients, server only */
+	const struct rad_client *client;	/* Client of the request */
+	struct sockaddr_in peer;	/* Address of the client */
+	struct rad_attr_index *idx;	/* See rad_index_attrs() */
+	char		 idx_valid;	/* idx describes the message in in */
+	struct rad_dup_cache *dup;	/* Duplicate detection, server only */
+	struct rad_dup_key dup_key;	/* Key of the request being answered */
+	char		 dup_pending;	/* Response to be stored in dup */
+	struct rad_req_slab *slabs;	/* See rad_req_create() */
+	struct rad_request *req_free;	/* Unused requests of the slabs */
+	char		 latency;	/* See rad_set_latency() */
+};
+
+/* Encoded attributes, see rad_block_create() */
+struct rad_attr_block {
+	size_t		 len;		/* Of data */
+	int		 authentic_off;	/* Message-Authenticator in data, or -1 */
+	char		 chap_pass;	/* Holds a CHAP password */
+	char		 eap_msg;	/* Holds an EAP-Message */
+	u_char		 data[];
+};
+
+/* A compiled request, see rad_template_create() */
+struct rad_template {
+	int		 code;		/* Request code */
+	size_t		 len;		/* Of data */
+	int		 authentic_off;	/* Message-Authenticator in data, or -1 */
+	char		 chap_pass;
+	char		 eap_msg;
+	int		 no_fields;
+	struct rad_tpl_field fields[RAD_TEMPLATE_FIELDS];
+	u_char		 data[];	/* Attributes, fields left empty */
 };
 
 struct vendor_attribute {
@@ -105,4 +256,53 @@ struct vendor_attribute {
 	u_char attrib_data[1];
 };
 
+struct rad_client_table *rad_client_table_create(void);
+void	 rad_client_table_destroy(struct rad_client_table *);
+int	 rad_client_table_add(struct rad_client_table *, struct in_addr, int,
+	    const char *);
+const struct rad_client *rad_client_table_lookup(
+	    const struct rad_client_table *, struct in_addr);
+const char *rad_client_secret(const struct rad_client *, size_t *);
+void	 rad_client_hmac(const struct rad_client *, const void *,
+	    const void *, const void *, size_t, u_char *);
+
+int	 rad_proxy_request(struct rad_handle *, int, const struct rad_client *,
+	    u_char *);
+int	 rad_proxy_response(struct rad_handle *, u_char *, size_t,
+	    const struct rad_client *, const u_char *,
+	    const struct rad_client *, int, const u_char *);
+
+void	 rad_index_free(struct rad_attr_index *);
+
+u_char	*rad_buf_get(size_t, size_t *);
+void	 rad_buf_put(u_char *, size_t);
+int	 rad_buf_reserve(u_char **, size_t *, size_t, size_t);
+void	 rad_arena_free(struct rad_arena *);
+
+int	 rad_in_reserve(struct rad_handle *, size_t);
+int	 rad_out_reserve(struct rad_request *, size_t);
+
+struct rad_request *rad_req_alloc(struct rad_handle *);
+void	 rad_req_release(struct rad_request *);
+void	 rad_req_slabs_free(struct rad_handle *);
+
+u_int64_t rad_lat_now(void);
+void	 rad_lat_record(const struct rad_request *);
+
+extern __thread u_int64_t *rad_stats_self;
+u_int64_t *rad_stats_thread(void);
+
+/* Add n to a counter of the calling thread, see radlib_stats.c */
+#define	RAD_STAT_ADD(counter, n) do {					\
+	u_int64_t *c_ = rad_stats_self != NULL ? rad_stats_self :	\
+	    rad_stats_thread();						\
+	__atomic_store_n(&c_[counter], c_[counter] + (n),		\
+	    __ATOMIC_RELAXED);						\
+} while (0)
+
+int	 rad_dup_cache_lookup(struct rad_dup_cache *,
+	    const struct rad_dup_key *, void *, size_t, size_t *);
+void	 rad_dup_cache_store(struct rad_dup_cache *,
+	    const struct rad_dup_key *, const void *, size_t);
+
 #endif
@@ -0,0 +1,42 @@
+/*-
+ * Request path tracing, see radlib_trace.c
+ */
+
+#ifndef _RADLIB_TRACE_H_
+#define _RADLIB_TRACE_H_
+
+#include <sys/types.h>
+#include <sys/cdefs.h>
+#include <stdio.h>
+
+/*
+ * Mark the start and end of a stage of the request path.  The name must
+ * be a string literal.  Without RADLIB_TRACE defined at compile time
+ * these are empty; with it, they cost a branch while no capture runs.
+ */
+#ifdef RADLIB_TRACE
+extern int rad_trace_on;
+
+#define	RAD_TRACE_BEGIN(name) do {					\
+	if (__builtin_expect(__atomic_load_n(&rad_trace_on,		\
+	    __ATOMIC_RELAXED), 0))					\
+		rad_trace_event(name, 'B');				\
+} while (0)
+#define	RAD_TRACE_END(name) do {					\
+	if (__builtin_expect(__atomic_load_n(&rad_trace_on,		\
+	    __ATOMIC_RELAXED), 0))					\
+		rad_trace_event(name, 'E');				\
+} while (0)
+#else
+#define	RAD_TRACE_BEGIN(name)	do { } while (0)
+#define	RAD_TRACE_END(name)	do { } while (0)
+#endif
+
+__BEGIN_DECLS
+void	 rad_trace_event(const char *, int);
+int	 rad_trace_start(size_t);
+void	 rad_trace_stop(void);
+int	 rad_trace_write(FILE *);
+__END_DECLS
+
+#endif /* _RADLIB_TRACE_H_ */
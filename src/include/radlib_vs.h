@@ -68,9 +68,13 @@
 
 #define SALT_LEN    2
 
+struct rad_arena;
 struct rad_handle;
+struct rad_request;
 
 __BEGIN_DECLS
+int	 rad_begin_vendor(struct rad_handle *, int);
+int	 rad_end_vendor(struct rad_handle *);
 int	 rad_get_vendor_attr(u_int32_t *, const void **, size_t *);
 int	 rad_put_vendor_addr(struct rad_handle *, int, int, struct in_addr);
 int	 rad_put_vendor_addr6(struct rad_handle *, int, int, struct in6_addr);
@@ -78,8 +82,21 @@ int	 rad_put_vendor_attr(struct rad_handle *, int, int, const void *,
 	    size_t);
 int	 rad_put_vendor_int(struct rad_handle *, int, int, u_int32_t);
 int	 rad_put_vendor_string(struct rad_handle *, int, int, const char *);
+int	 rad_req_begin_vendor(struct rad_request *, int);
+int	 rad_req_end_vendor(struct rad_request *);
+int	 rad_req_put_vendor_addr(struct rad_request *, int, int,
+	    struct in_addr);
+int	 rad_req_put_vendor_addr6(struct rad_request *, int, int,
+	    struct in6_addr);
+int	 rad_req_put_vendor_attr(struct rad_request *, int, int,
+	    const void *, size_t);
+int	 rad_req_put_vendor_int(struct rad_request *, int, int, u_int32_t);
+int	 rad_req_put_vendor_string(struct rad_request *, int, int,
+	    const char *);
 u_char	*rad_demangle_mppe_key(struct rad_handle *, const void *, size_t,
 	    size_t *);
+u_char	*rad_arena_demangle_mppe_key(struct rad_handle *, struct rad_arena *,
+	    const void *, size_t, size_t *);
 __END_DECLS
 
 #endif /* _RADLIB_VS_H_ */
@@ -0,0 +1,211 @@
+/*
+ * Bundle-aware RADIUS test server
+ *
+ * Shared definitions of the worker threads (server_worker.c), the request
+ * handling pipeline (server_pipeline.c) and the TCP transport
+ * (server_tcp.c).
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "radlib.h"
+#include "radlib_private.h"
+#include "radlib_log.h"
+
+#define MSG_SIZE 55000
+#define BUNDLE_MAX_MSGS (MSG_SIZE / 20)    /* Header-only messages in a datagram */
+
+#define SERVER_PORT 1812
+#define SERVER_SECRET "testing123"
+#define MAX_WORKERS 256
+
+#define REPLY_MAX_SIZE 1472     /* Ethernet MTU less IPv4 and UDP headers */
+#define REPLY_MAX_DGRAMS 64     /* Reply datagrams gathered per sendmmsg() */
+#define REPLY_MAX_PACKET 4096   /* Largest single RADIUS reply (RFC 2865) */
+
+/* How replies are sent back to the client */
+#define REPLY_MODE_PER_REQUEST 0    /* One datagram per sub-request */
+#define REPLY_MODE_BUNDLE 1         /* Replies bundled into as few datagrams as fit */
+
+/* Synthetic processing latency added by the pipeline */
+#define LATENCY_NONE 0
+#define LATENCY_FIXED 1             /* Always delay_us */
+#define LATENCY_EXP 2               /* Exponential with mean delay_us */
+#define LATENCY_UNIFORM 3           /* Uniform in [delay_us, max_us] */
+
+#define MAX_PENDING 65536           /* Delayed replies queued by one worker */
+
+#define DUP_MAX_ENTRIES (1024 * 1024)   /* Responses kept for retransmissions */
+
+/* Transports the server listens on */
+#define PROTO_UDP 0x1
+#define PROTO_TCP 0x2
+
+#define MAX_EVENTS 256              /* epoll events handled per wakeup */
+#define CONN_IN_SIZE 8192           /* Stream bytes buffered per TCP connection */
+#define CONN_CHUNK_SIZE 4096        /* Unit of a connection's reply queue */
+#define CONN_OUT_MAX (1024 * 1024)  /* Stop reading while more replies are queued */
+#define CONN_MAX_IOV 64             /* Reply chunks written per writev() */
+
+typedef struct _server_latency_t
+{
+    int model;              /* LATENCY_* */
+    long delay_us;          /* Fixed delay, mean or minimum */
+    long max_us;            /* Maximum of the uniform model */
+    int async;              /* Queue delayed replies instead of blocking */
+}server_latency_t;
+
+/*
+ * Request handler.  Called with the validated request in h, whose
+ * attributes are indexed for rad_find_attr(); it creates the response
+ * with rad_create_response() and adds its attributes.  Returns -1 to send
+ * no response at all; the pipeline encodes and sends the response
+ * otherwise.
+ */
+typedef int (*server_handler_fn)(struct rad_handle *h, int code, void *arg);
+
+typedef struct _server_handler_t
+{
+    const char *name;
+    server_handler_fn fn;
+    const char *help;
+}server_handler_t;
+
+/* Server settings, read-only once the workers are started */
+typedef struct _server_config_t
+{
+    int port;               /* UDP and TCP port to listen on */
+    int protocols;          /* PROTO_* */
+    int reply_mode;         /* REPLY_MODE_* */
+    int reply_max;          /* Largest reply datagram in bundle mode */
+    long linger_us;         /* How long to hold replies for more requests */
+    const char *secret;     /* Secret shared with the local clients */
+    const char *clients;    /* File listing the other clients, or NULL */
+    const server_handler_t *handler;
+    void *handler_arg;
+    server_latency_t latency;
+    struct rad_dup_cache *dup;  /* Shared by the workers, NULL if disabled */
+}server_config_t;
+
+/* Replies waiting to be sent to one client as bundled datagrams */
+typedef struct _reply_batch_t
+{
+    struct sockaddr_in dest;    /* Client the replies go to */
+    int no_dgrams;              /* Datagrams in use, the last one still open */
+    int no_replies;             /* Replies gathered so far */
+    struct timespec deadline;   /* Flush time when lingering */
+    struct iovec iov[REPLY_MAX_DGRAMS];
+    struct mmsghdr msgs[REPLY_MAX_DGRAMS];
+    size_t slot_size;           /* Room for each datagram in buf */
+    unsigned char *buf;
+}reply_batch_t;
+
+/* Part of the reply byte stream queued on a TCP connection */
+typedef struct _out_chunk_t
+{
+    struct _out_chunk_t *next;
+    int off;                    /* First byte not written yet */
+    int len;                    /* Bytes queued in data */
+    unsigned char data[CONN_CHUNK_SIZE];
+}out_chunk_t;
+
+/* A TCP connection from a NAS, indexed by its descriptor */
+typedef struct _server_conn_t
+{
+    int fd;
+    unsigned int gen;           /* Bumped on close; stale references are ignored */
+    int open;
+    int events;                 /* epoll events currently requested */
+    struct sockaddr_in peer;
+    int in_len;                 /* Bytes of incomplete messages in in */
+    out_chunk_t *out_head;
+    out_chunk_t *out_tail;
+    size_t out_bytes;           /* Reply bytes waiting to be written */
+    struct _server_conn_t *next_dirty;
+    int dirty;                  /* On the worker's list of connections to flush */
+    unsigned char in[CONN_IN_SIZE];
+}server_conn_t;
+
+/* A reply held back by the asynchronous latency model */
+typedef struct _pending_reply_t
+{
+    struct timespec due;
+    struct sockaddr_in dest;
+    int conn_fd;                /* TCP connection, -1 for UDP */
+    unsigned int conn_gen;
+    int len;
+    unsigned char *data;
+    int dup;                    /* Goes into the duplicate cache when sent */
+    struct rad_dup_key dup_key;
+}pending_reply_t;
+
+/* Min-heap of delayed replies ordered by due time */
+typedef struct _pending_queue_t
+{
+    int count;
+    pending_reply_t *heap;      /* MAX_PENDING entries */
+    unsigned char **free_bufs;  /* Spare REPLY_MAX_PACKET buffers */
+    int no_free;
+}pending_queue_t;
+
+/* Per-worker state; nothing in here is shared with other workers */
+typedef struct _server_worker_t
+{
+    int id;                 /* Worker index */
+    int cpu;                /* CPU the worker is pinned to, -1 if unpinned */
+    const server_config_t *cfg;
+    int sockfd;             /* Worker's own SO_REUSEPORT UDP socket */
+    int listenfd;           /* Worker's own SO_REUSEPORT TCP listener */
+    int epfd;
+    pthread_t thread;
+    long long msg_no;       /* Requests serviced by this worker */
+    long long dropped;      /* Requests that failed decoding or validation */
+    long long duplicates;   /* Retransmissions answered from the cache */
+    long long syscalls;     /* Socket and event loop system calls made */
+    struct rad_handle *h;   /* Server handle the pipeline decodes into */
+    unsigned short rng[3];  /* Latency model random state */
+    unsigned char mesg[MSG_SIZE];
+    size_t bundle_off[BUNDLE_MAX_MSGS + 1];    /* Messages of the datagram in mesg */
+    reply_batch_t batch;
+    pending_queue_t pending;
+    server_conn_t **conns;  /* TCP connections by descriptor */
+    int no_conns;           /* Size of conns */
+    server_conn_t *dirty;   /* Connections with replies to write */
+    out_chunk_t *free_chunks;
+}server_worker_t;
+
+/* server_worker.c */
+void server_clock(struct timespec *ts);
+int server_socket(int type, int port);
+void server_reply_add(server_worker_t *w, const unsigned char *reply, int len,
+                      const struct sockaddr_in *dest);
+int server_worker_init(server_worker_t *w);
+int server_worker_poll(server_worker_t *w, int readable, struct timespec *next);
+void *server_worker_run(void *arg);
+
+/* server_tcp.c */
+void server_tcp_accept(server_worker_t *w);
+void server_tcp_event(server_worker_t *w, int fd, uint32_t events);
+server_conn_t *server_tcp_conn(server_worker_t *w, int fd, unsigned int gen);
+void server_tcp_reply(server_worker_t *w, server_conn_t *c, const unsigned char *reply,
+                      int len);
+void server_tcp_flush(server_worker_t *w);
+
+/* server_pipeline.c */
+const server_handler_t *server_handler_find(const char *name);
+void server_handler_list(FILE *fp);
+int server_latency_parse(const char *spec, server_latency_t *lat);
+int server_pipeline_init(server_worker_t *w);
+void server_pipeline_process(server_worker_t *w, const unsigned char *msg, int len,
+                             const struct sockaddr_in *from, server_conn_t *conn);
+int server_pipeline_due(server_worker_t *w, struct timespec *next);
+
+#endif
@@ -0,0 +1,771 @@
+/*
+ * Open-loop RADIUS load generator
+ *
+ * Unlike radius_client and the benchmark, which send the next request
+ * only when the previous ones are answered, the load generator sends
+ * Access-Requests on a schedule of its own, at a target rate for a fixed
+ * time, whatever the server does.  The gaps between requests are fixed,
+ * uniform or exponential (Poisson arrivals).  Every request is for a user
+ * drawn from a population of synthetic users and comes from one of a set
+ * of NAS identities, with its own NAS-Identifier and NAS-IP-Address.
+ *
+ * The requests are stamped from a template and sent in bundles: the
+ * requests that are due are held until the bundle is full or the oldest
+ * has waited for the bundle window, and then sent in one datagram.  A
+ * window of 0 sends whatever is due at once, which is one request per
+ * datagram unless the generator falls behind.
+ *
+ * Latency is measured from the time a request was due to be sent, not
+ * from the time it was, so that a server that stalls the generator is
+ * charged with the whole delay (coordinated omission): the queue stage
+ * is how late the requests went out, the total stage what their users
+ * saw.  The times are recorded in the library's latency histograms.
+ *
+ * Every thread sends its share of the rate over connected UDP sockets,
+ * each with a handle of its own.  A socket has at most 256 requests in
+ * flight, one per identifier; when all of them are full, due requests
+ * wait, and their wait counts.  Requests unanswered after the timeout
+ * are counted as timed out, as are the ones still unanswered at the end.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+
+#define LG_PORT 1812
+#define LG_SECRET "testing123"
+#define LG_MAX_BUNDLE 256           /* Identifiers within a bundle must differ */
+#define LG_MAX_CONNS 64             /* Per thread */
+#define LG_MAX_THREADS 64
+#define LG_TIMEOUT_MS 1000
+#define LG_SWEEP_NS 10000000        /* Look for timed out requests every 10 ms */
+#define LG_IDLE_NS 1000000          /* Wait while every socket is full */
+#define LG_START_NS 10000000        /* Let every thread set up before the start */
+#define LG_RCVBUF (4 * 1024 * 1024)
+#define REPLY_MAX_MSGS (MSGSIZE / 20)   /* Header-only messages in a reply */
+
+/* Inter-arrival distributions */
+#define LG_FIXED 0
+#define LG_UNIFORM 1
+#define LG_POISSON 2
+
+static const char *lg_dist_names[] = { "fixed", "uniform", "poisson" };
+
+typedef struct _lg_config_t
+{
+    struct in_addr server;
+    const char *host;
+    int port;
+    const char *secret;
+    double rate;                /* Requests per second, all threads */
+    double duration;            /* Seconds */
+    int dist;
+    long long users;
+    int nas;
+    int bundle;                 /* Most requests per datagram */
+    long long window_ns;        /* Longest a due request waits for a bundle */
+    int conns;                  /* Sockets per thread */
+    int threads;
+    int timeout_ms;
+    unsigned long long seed;
+    int interval;               /* Seconds between progress lines, 0 for none */
+    long long start;            /* CLOCK_MONOTONIC ns of the first arrival */
+    long long end;
+}lg_config_t;
+
+typedef struct _lg_pending_t
+{
+    struct rad_request *r;
+    long long deadline;
+}lg_pending_t;
+
+/* A socket and the requests in flight on it, by identifier */
+typedef struct _lg_conn_t
+{
+    int fd;
+    struct rad_handle *h;
+    struct rad_template *tpl;
+    int used;                   /* Requests have been stamped on h */
+    int last_ident;             /* Of the last one; the next is one more */
+    int outstanding;
+    lg_pending_t pending[256];
+}lg_conn_t;
+
+typedef struct _lg_thread_t
+{
+    const lg_config_t *cfg;
+    pthread_t thread;
+    int index;
+    unsigned long long rng;
+    double gap_ns;              /* Mean time between arrivals */
+    double next;                /* Due time of the next arrival, ns */
+    long long due[LG_MAX_BUNDLE];   /* Arrivals due and not sent yet */
+    int no_due;
+    lg_conn_t conns[LG_MAX_CONNS];
+    int next_conn;
+    long long next_sweep;
+    /* Read by the progress reports */
+    long long sent;
+    long long completed;
+    long long rejected;         /* Answered with anything but Access-Accept */
+    long long timeouts;
+    long long datagrams;
+    long long unsent;           /* Due before the end but never sent */
+    long long errors;           /* Failed sends */
+    long long stray;            /* Replies to no request in flight */
+    int error;
+    struct rad_request *bundle[LG_MAX_BUNDLE];
+    unsigned char msg[MSGSIZE];
+    unsigned char in[MSGSIZE];
+    size_t reply_off[REPLY_MAX_MSGS + 1];
+}lg_thread_t;
+
+static volatile sig_atomic_t lg_stop;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ns_ts(long long ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+/* Counters are read by the main thread while the workers update them */
+static void count(long long *c, long long n)
+{
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static long long counted(const long long *c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* xorshift64*, one state per thread */
+static unsigned long long lg_random(lg_thread_t *t)
+{
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in (0, 1] */
+static double lg_uniform(lg_thread_t *t)
+{
+    return ((lg_random(t) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* Time from one arrival to the next, in ns */
+static double lg_gap(lg_thread_t *t)
+{
+    switch (t->cfg->dist) {
+        case LG_UNIFORM:
+            return 2 * t->gap_ns * lg_uniform(t);
+        case LG_POISSON:
+            return -log(lg_uniform(t)) * t->gap_ns;
+    }
+    return t->gap_ns;
+}
+
+/*
+ * Connections
+ */
+
+/*
+ * Compile the request of every user: User-Name, User-Password,
+ * NAS-Identifier and NAS-IP-Address vary.
+ */
+static struct rad_template *lg_template(struct rad_handle *h)
+{
+    struct rad_request *r;
+    struct rad_template *tpl = NULL;
+
+    if ((r = rad_req_create(h, RAD_ACCESS_REQUEST)) == NULL)
+        return NULL;
+    if (rad_req_put_field(r, RAD_USER_NAME, 0) != -1 &&
+            rad_req_put_field(r, RAD_USER_PASSWORD, 0) != -1 &&
+            rad_req_put_field(r, RAD_NAS_IDENTIFIER, 0) != -1 &&
+            rad_req_put_field(r, RAD_NAS_IP_ADDRESS, 4) != -1 &&
+            rad_req_put_int(r, RAD_NAS_PORT, 4223) != -1)
+        tpl = rad_template_create(r);
+    rad_req_free(r);
+    return tpl;
+}
+
+static int lg_connect(lg_thread_t *t, lg_conn_t *c)
+{
+    const lg_config_t *cfg = t->cfg;
+    struct sockaddr_in sin;
+    int size = LG_RCVBUF;
+
+    c->fd = -1;
+    if ((c->h = rad_auth_open()) == NULL ||
+            rad_add_server(c->h, cfg->host, cfg->port, cfg->secret, 1, 1) == -1 ||
+            (c->tpl = lg_template(c->h)) == NULL) {
+        fprintf(stderr, "Client setup: %s\n", c->h ? rad_strerror(c->h) : "Out of memory");
+        return -1;
+    }
+    rad_set_latency(c->h, 1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr = cfg->server;
+    sin.sin_port = htons(cfg->port);
+    if ((c->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+            connect(c->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+        fprintf(stderr, "Cannot connect to the server: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return 0;
+}
+
+static void lg_disconnect(lg_conn_t *c)
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+        if (c->pending[i].r != NULL)
+            rad_req_free(c->pending[i].r);
+    if (c->tpl != NULL)
+        rad_template_free(c->tpl);
+    if (c->h != NULL)
+        rad_close(c->h);
+    if (c->fd != -1)
+        close(c->fd);
+}
+
+/* Whether the identifier the next request of c gets is free */
+static int lg_room(const lg_conn_t *c)
+{
+    return !c->used || c->pending[(c->last_ident + 1) & 0xff].r == NULL;
+}
+
+/*
+ * Sending
+ */
+
+/* Stamp the request of a random user at a random NAS */
+static struct rad_request *lg_stamp(lg_thread_t *t, lg_conn_t *c)
+{
+    const lg_config_t *cfg = t->cfg;
+    struct rad_value values[4];
+    char user[32], pass[32], nas_id[32];
+    unsigned long long u;
+    u_int32_t nas_ip;
+    int nas;
+
+    u = lg_random(t) % cfg->users;
+    nas = lg_random(t) % cfg->nas;
+    values[0].data = user;
+    values[0].len = snprintf(user, sizeof(user), "user%07llu", u);
+    values[1].data = pass;
+    values[1].len = snprintf(pass, sizeof(pass), "pw%llu", u);
+    values[2].data = nas_id;
+    values[2].len = snprintf(nas_id, sizeof(nas_id), "nas-%04d", nas);
+    nas_ip = htonl(0x0a000001 + nas);   /* 10.0.0.1 on */
+    values[3].data = &nas_ip;
+    values[3].len = sizeof(nas_ip);
+    return rad_template_stamp(c->h, c->tpl, values);
+}
+
+/*
+ * Send the due requests, as many as fit into one bundle on the next
+ * socket with room.  Returns the number sent, 0 if every socket is full,
+ * -1 on error.
+ */
+static int lg_send(lg_thread_t *t)
+{
+    const lg_config_t *cfg = t->cfg;
+    struct rad_request *r;
+    struct timespec due;
+    lg_conn_t *c = NULL;
+    const void *data;
+    size_t data_len, len = 0;
+    long long now;
+    ssize_t sent;
+    int n = 0, i;
+
+    for (i = 0; i < cfg->conns; i++) {
+        c = &t->conns[(t->next_conn + i) % cfg->conns];
+        if (lg_room(c))
+            break;
+    }
+    if (i == cfg->conns)
+        return 0;
+    t->next_conn = (t->next_conn + i + 1) % cfg->conns;
+
+    while (n < t->no_due && lg_room(c)) {
+        if ((r = lg_stamp(t, c)) == NULL) {
+            fprintf(stderr, "Request creation: %s\n", rad_strerror(c->h));
+            return -1;
+        }
+        c->used = 1;
+        c->last_ident = rad_req_ident(r);
+        ns_ts(t->due[n], &due);
+        rad_req_schedule(r, &due);
+        if (rad_req_encode(r, &data, &data_len) == -1) {
+            fprintf(stderr, "Request encoding: %s\n", rad_strerror(c->h));
+            rad_req_free(r);
+            return -1;
+        }
+        if (len + data_len > MSGSIZE) {
+            rad_req_free(r);
+            break;
+        }
+        memcpy(t->msg + len, data, data_len);
+        RAD_STAT_ADD(RAD_STAT_COPIED, data_len);
+        len += data_len;
+        t->bundle[n++] = r;
+    }
+
+    sent = send(c->fd, t->msg, len, 0);
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    if (sent == -1) {
+        /* ECONNREFUSED and the like; the requests will time out */
+        count(&t->errors, 1);
+    } else {
+        RAD_STAT_ADD(RAD_STAT_BYTES_SENT, sent);
+        RAD_STAT_ADD(RAD_STAT_BUNDLES, 1);
+        RAD_STAT_ADD(RAD_STAT_BUNDLED, n);
+    }
+    now = now_ns();
+    for (i = 0; i < n; i++) {
+        rad_req_sent(t->bundle[i], n);
+        c->pending[rad_req_ident(t->bundle[i])].r = t->bundle[i];
+        c->pending[rad_req_ident(t->bundle[i])].deadline =
+            now + (long long)cfg->timeout_ms * 1000000;
+    }
+    c->outstanding += n;
+    count(&t->sent, n);
+    count(&t->datagrams, 1);
+    t->no_due -= n;
+    memmove(t->due, t->due + n, t->no_due * sizeof(t->due[0]));
+    return n;
+}
+
+/*
+ * Receiving
+ */
+
+static void lg_reply(lg_thread_t *t, lg_conn_t *c, const unsigned char *p)
+{
+    lg_pending_t *e = &c->pending[p[POS_IDENT]];
+
+    if (e->r == NULL) {
+        count(&t->stray, 1);    /* Late reply to a timed out request */
+        return;
+    }
+    rad_req_received(e->r);
+    rad_req_complete(e->r, p[POS_CODE]);
+    rad_req_free(e->r);
+    e->r = NULL;
+    c->outstanding--;
+    if (p[POS_CODE] != RAD_ACCESS_ACCEPT)
+        count(&t->rejected, 1);
+    count(&t->completed, 1);
+}
+
+/* Take all waiting replies off a socket */
+static void lg_receive(lg_thread_t *t, lg_conn_t *c)
+{
+    ssize_t len;
+    int n, i;
+
+    for (;;) {
+        len = recv(c->fd, t->in, sizeof(t->in), MSG_DONTWAIT);
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        if (len <= 0)
+            return;     /* EAGAIN, or ECONNREFUSED for an earlier send */
+        RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, len);
+        if ((n = rad_bundle_scan(t->in, len, t->reply_off, REPLY_MAX_MSGS)) < 0) {
+            count(&t->stray, 1);
+            continue;
+        }
+        RAD_STAT_ADD(RAD_STAT_RECEIVED, n);
+        for (i = 0; i < n; i++)
+            lg_reply(t, c, t->in + t->reply_off[i]);
+    }
+}
+
+/* Give up on the requests whose deadline has passed, or all with force */
+static void lg_sweep(lg_thread_t *t, long long now, int force)
+{
+    lg_conn_t *c;
+    int i, j, n = 0;
+
+    for (i = 0; i < t->cfg->conns; i++) {
+        c = &t->conns[i];
+        for (j = 0; j < 256 && c->outstanding > 0; j++) {
+            if (c->pending[j].r == NULL || (!force && c->pending[j].deadline > now))
+                continue;
+            rad_req_free(c->pending[j].r);
+            c->pending[j].r = NULL;
+            c->outstanding--;
+            n++;
+        }
+    }
+    if (n > 0) {
+        count(&t->timeouts, n);
+        RAD_STAT_ADD(RAD_STAT_TIMEOUTS, n);
+    }
+}
+
+/* Wait until wake for replies and take them */
+static int lg_wait(lg_thread_t *t, long long now, long long wake)
+{
+    struct pollfd pfd[LG_MAX_CONNS];
+    struct timespec ts;
+    int i, n;
+
+    for (i = 0; i < t->cfg->conns; i++) {
+        pfd[i].fd = t->conns[i].fd;
+        pfd[i].events = POLLIN;
+    }
+    ns_ts(wake > now ? wake - now : 0, &ts);
+    n = ppoll(pfd, t->cfg->conns, &ts, NULL);
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+    for (i = 0; i < t->cfg->conns && n > 0; i++)
+        if (pfd[i].revents) {
+            lg_receive(t, &t->conns[i]);
+            n--;
+        }
+    return 0;
+}
+
+static int lg_outstanding(const lg_thread_t *t)
+{
+    int i, n = 0;
+
+    for (i = 0; i < t->cfg->conns; i++)
+        n += t->conns[i].outstanding;
+    return n;
+}
+
+static void *lg_run(void *arg)
+{
+    lg_thread_t *t = arg;
+    const lg_config_t *cfg = t->cfg;
+    long long now, wake, drain;
+    int full = 0, i;
+
+    for (i = 0; i < cfg->conns; i++)
+        if (lg_connect(t, &t->conns[i]) == -1) {
+            t->error = 1;
+            return NULL;
+        }
+    t->next = cfg->start + lg_gap(t);
+    t->next_sweep = cfg->start + LG_SWEEP_NS;
+
+    for (;;) {
+        now = now_ns();
+        if (lg_stop || (now >= cfg->end && t->no_due == 0))
+            break;
+
+        /* Take the arrivals that are due, however late */
+        while (t->no_due < cfg->bundle && t->next <= now && t->next < cfg->end) {
+            t->due[t->no_due++] = t->next;
+            t->next += lg_gap(t);
+        }
+        full = 0;
+        if (t->no_due > 0 && (t->no_due == cfg->bundle || now >= cfg->end ||
+                now >= t->due[0] + cfg->window_ns)) {
+            if ((i = lg_send(t)) == -1) {
+                t->error = 1;
+                break;
+            }
+            full = i == 0;
+            if (i > 0)
+                continue;   /* More may be due */
+        }
+        if (now >= t->next_sweep) {
+            lg_sweep(t, now, 0);
+            t->next_sweep = now + LG_SWEEP_NS;
+        }
+
+        /* Sleep until the next arrival or bundle deadline, or a reply */
+        wake = t->next < cfg->end ? (long long)t->next : cfg->end;
+        if (t->no_due == cfg->bundle)
+            wake = now;
+        if (t->no_due > 0 && t->due[0] + cfg->window_ns < wake)
+            wake = t->due[0] + cfg->window_ns;
+        if (full || wake > t->next_sweep)
+            wake = full ? now + LG_IDLE_NS : t->next_sweep;
+        if (lg_wait(t, now, wake) == -1) {
+            fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+            t->error = 1;
+            break;
+        }
+    }
+
+    /* Arrivals the generator fell too far behind to send */
+    while (!lg_stop && (t->no_due > 0 || t->next < cfg->end)) {
+        if (t->no_due > 0)
+            t->no_due--;
+        else
+            t->next += lg_gap(t);
+        count(&t->unsent, 1);
+    }
+
+    /* Wait out the replies still in flight */
+    drain = now_ns() + (long long)cfg->timeout_ms * 1000000;
+    while (!t->error && !lg_stop && lg_outstanding(t) > 0 && (now = now_ns()) < drain)
+        if (lg_wait(t, now, now + LG_SWEEP_NS < drain ? now + LG_SWEEP_NS : drain) == -1)
+            break;
+    lg_sweep(t, 0, 1);
+
+    for (i = 0; i < cfg->conns; i++)
+        lg_disconnect(&t->conns[i]);
+    return NULL;
+}
+
+/*
+ * Reports
+ */
+
+static long long lg_total(const lg_thread_t *threads, int n, size_t off)
+{
+    long long sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        sum += counted((const long long *)((const char *)&threads[i] + off));
+    return sum;
+}
+
+#define LG_TOTAL(threads, n, field) lg_total(threads, n, offsetof(lg_thread_t, field))
+
+static void lg_progress(const lg_thread_t *threads, int n, double elapsed,
+                        long long *last_sent, long long *last_done, double interval)
+{
+    long long sent = LG_TOTAL(threads, n, sent), done = LG_TOTAL(threads, n, completed);
+
+    printf("%7.1fs  sent %9.0f/s  answered %9.0f/s  timeouts %lld\n", elapsed,
+           (sent - *last_sent) / interval, (done - *last_done) / interval,
+           LG_TOTAL(threads, n, timeouts));
+    fflush(stdout);
+    *last_sent = sent;
+    *last_done = done;
+}
+
+static void lg_print_stage(const char *name, int stage)
+{
+    struct rad_latency l;
+
+    if (rad_latency_get(NULL, RAD_LAT_ANY, RAD_LAT_ANY, stage, &l) == -1 || l.count == 0)
+        return;
+    printf("%-6s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+           l.mean / 1e6, l.p50 / 1e6, l.p90 / 1e6, l.p99 / 1e6, l.p999 / 1e6,
+           l.max / 1e6);
+}
+
+static void lg_report(const lg_config_t *cfg, const lg_thread_t *threads, double elapsed)
+{
+    long long sent = LG_TOTAL(threads, cfg->threads, sent);
+    long long datagrams = LG_TOTAL(threads, cfg->threads, datagrams);
+
+    printf("\nTarget %.0f requests/s for %.1f s, %s arrivals, %lld users, %d NAS\n",
+           cfg->rate, cfg->duration, lg_dist_names[cfg->dist], cfg->users, cfg->nas);
+    printf("Sent %lld requests in %lld datagrams (%.2f per datagram), %.0f/s\n",
+           sent, datagrams, datagrams ? (double)sent / datagrams : 0.0, sent / elapsed);
+    printf("Answered %lld (%lld rejected), %lld timed out, %lld never sent,"
+           " %lld send errors, %lld stray replies\n",
+           LG_TOTAL(threads, cfg->threads, completed), LG_TOTAL(threads, cfg->threads, rejected),
+           LG_TOTAL(threads, cfg->threads, timeouts), LG_TOTAL(threads, cfg->threads, unsent),
+           LG_TOTAL(threads, cfg->threads, errors), LG_TOTAL(threads, cfg->threads, stray));
+    printf("\nLatency from the scheduled send time, ms\n");
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "stage", "mean", "p50", "p90", "p99",
+           "p99.9", "max");
+    lg_print_stage("queue", RAD_LAT_QUEUE);
+    lg_print_stage("wire", RAD_LAT_WIRE);
+    lg_print_stage("total", RAD_LAT_TOTAL);
+}
+
+static void lg_signal(int sig)
+{
+    lg_stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-H server] [-p port] [-s secret] [-r rate] [-d seconds]\n"
+            "          [-a fixed|uniform|poisson] [-u users] [-N nas] [-b bundle] [-w usec]\n"
+            "          [-c sockets] [-t threads] [-T msec] [-S seed] [-i seconds]\n"
+            "  -H server   server address (default 127.0.0.1)\n"
+            "  -p port     server port (default %d)\n"
+            "  -s secret   shared secret (default %s)\n"
+            "  -r rate     requests per second (default 10000)\n"
+            "  -d seconds  duration of the run (default 10)\n"
+            "  -a dist     gaps between requests (default poisson)\n"
+            "  -u users    synthetic users (default 1000000)\n"
+            "  -N nas      NAS identities (default 100)\n"
+            "  -b bundle   most requests per datagram, 1 to %d (default 16)\n"
+            "  -w usec     longest a request waits for its bundle to fill (default 1000)\n"
+            "  -c sockets  sockets per thread, 1 to %d (default 4)\n"
+            "  -t threads  sending threads, 1 to %d (default 1)\n"
+            "  -T msec     time to wait for a reply (default %d)\n"
+            "  -S seed     seed of the arrivals, users and NAS (default 1)\n"
+            "  -i seconds  print the rates every so many seconds (default 1, 0 for none)\n",
+            prog, LG_PORT, LG_SECRET, LG_MAX_BUNDLE, LG_MAX_CONNS, LG_MAX_THREADS,
+            LG_TIMEOUT_MS);
+}
+
+int main(int argc, char **argv)
+{
+    lg_config_t cfg;
+    lg_thread_t *threads;
+    struct timespec ts;
+    long long last_sent = 0, last_done = 0, now, report;
+    int opt, i, failed = 0;
+    double elapsed;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = "127.0.0.1";
+    cfg.port = LG_PORT;
+    cfg.secret = LG_SECRET;
+    cfg.rate = 10000;
+    cfg.duration = 10;
+    cfg.dist = LG_POISSON;
+    cfg.users = 1000000;
+    cfg.nas = 100;
+    cfg.bundle = 16;
+    cfg.window_ns = 1000000;
+    cfg.conns = 4;
+    cfg.threads = 1;
+    cfg.timeout_ms = LG_TIMEOUT_MS;
+    cfg.seed = 1;
+    cfg.interval = 1;
+
+    while ((opt = getopt(argc, argv, "H:p:s:r:d:a:u:N:b:w:c:t:T:S:i:")) != -1) {
+        switch (opt) {
+            case 'H':
+                cfg.host = optarg;
+                break;
+            case 'p':
+                cfg.port = atoi(optarg);
+                break;
+            case 's':
+                cfg.secret = optarg;
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'a':
+                for (cfg.dist = 0; cfg.dist < 3; cfg.dist++)
+                    if (strcmp(optarg, lg_dist_names[cfg.dist]) == 0)
+                        break;
+                break;
+            case 'u':
+                cfg.users = atoll(optarg);
+                break;
+            case 'N':
+                cfg.nas = atoi(optarg);
+                break;
+            case 'b':
+                cfg.bundle = atoi(optarg);
+                break;
+            case 'w':
+                cfg.window_ns = atoll(optarg) * 1000;
+                break;
+            case 'c':
+                cfg.conns = atoi(optarg);
+                break;
+            case 't':
+                cfg.threads = atoi(optarg);
+                break;
+            case 'T':
+                cfg.timeout_ms = atoi(optarg);
+                break;
+            case 'S':
+                cfg.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                cfg.interval = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.rate <= 0 || cfg.duration <= 0 || cfg.dist == 3 || cfg.users < 1 ||
+            cfg.nas < 1 || cfg.nas > 0xfffffe || cfg.bundle < 1 ||
+            cfg.bundle > LG_MAX_BUNDLE || cfg.window_ns < 0 || cfg.conns < 1 ||
+            cfg.conns > LG_MAX_CONNS || cfg.threads < 1 || cfg.threads > LG_MAX_THREADS ||
+            cfg.timeout_ms < 1 || cfg.interval < 0 || cfg.port < 1 || cfg.port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (inet_pton(AF_INET, cfg.host, &cfg.server) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", cfg.host);
+        return 1;
+    }
+
+    if ((threads = calloc(cfg.threads, sizeof(*threads))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    signal(SIGINT, lg_signal);
+    signal(SIGTERM, lg_signal);
+
+    cfg.start = now_ns() + LG_START_NS;
+    cfg.end = cfg.start + (long long)(cfg.duration * 1e9);
+    for (i = 0; i < cfg.threads; i++) {
+        threads[i].cfg = &cfg;
+        threads[i].index = i;
+        threads[i].rng = (cfg.seed + i + 1) * 0x9e3779b97f4a7c15ULL;
+        threads[i].gap_ns = 1e9 * cfg.threads / cfg.rate;
+        if ((opt = pthread_create(&threads[i].thread, NULL, lg_run, &threads[i])) != 0) {
+            fprintf(stderr, "Cannot start thread: %s\n", strerror(opt));
+            return 1;
+        }
+    }
+
+    /* Progress lines until the run ends */
+    report = cfg.start + cfg.interval * 1000000000LL;
+    while (cfg.interval > 0 && !lg_stop && (now = now_ns()) < cfg.end) {
+        ns_ts((report < cfg.end ? report : cfg.end) - now, &ts);
+        nanosleep(&ts, NULL);
+        if ((now = now_ns()) >= report) {
+            lg_progress(threads, cfg.threads, (now - cfg.start) / 1e9, &last_sent,
+                        &last_done, cfg.interval);
+            report += cfg.interval * 1000000000LL;
+        }
+    }
+
+    for (i = 0; i < cfg.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        failed |= threads[i].error;
+    }
+    now = now_ns();
+    elapsed = ((now < cfg.end ? now : cfg.end) - cfg.start) / 1e9;
+    lg_report(&cfg, threads, elapsed > 0 ? elapsed : cfg.duration);
+    free(threads);
+    return failed;
+}
@@ -0,0 +1,672 @@
+/*
+ * Bundling RADIUS proxy
+ *
+ * The proxy takes plain RADIUS requests from NAS clients that know
+ * nothing of bundling and passes them on to a home server in bundles:
+ * every request is validated with the NAS's secret, given an identifier
+ * of the proxy's own, signed again with the home server's secret (see
+ * radlib_proxy.c) and appended to the bundle being gathered.  A bundle is
+ * sent when it holds -b requests, would grow past -m bytes, or its first
+ * request has waited -l microseconds.  The replies come back bundled;
+ * each is checked against the request it answers, given back the NAS's
+ * identifier and authenticator, and the replies of a datagram are sent to
+ * their NASes with one sendmmsg().
+ *
+ * Identifiers are per upstream socket, so the proxy keeps up to 256
+ * requests in flight on each of its -n sockets and drops what comes in
+ * beyond that, which the NAS will retransmit.  Unanswered requests are
+ * sent again after -t milliseconds, -r times in all.  Retransmissions from
+ * the NASes are caught by the duplicate cache of the server handle: one
+ * of a request still in flight is dropped, one of a request answered
+ * gets the reply again.
+ *
+ * The proxy is one thread; all of its I/O goes through rad_net_*(), so
+ * the fault injection of radlib_fault.c applies to it too.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <netdb.h>
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+#include "include/radlib_log.h"
+#include "include/radlib_net.h"
+
+#define PROXY_PORT 1812
+#define PROXY_HOME "127.0.0.1:1813"
+#define PROXY_SECRET "testing123"
+#define PROXY_BUNDLE 64             /* Requests per upstream bundle */
+#define PROXY_BUNDLE_SIZE 1472      /* Ethernet MTU less IPv4 and UDP headers */
+#define PROXY_LINGER_US 1000
+#define PROXY_TIMEOUT_MS 1000
+#define PROXY_TRIES 3
+#define PROXY_SOCKETS 4
+#define PROXY_MAX_SOCKETS 64
+#define PROXY_MSG_MAX 4096          /* Largest RADIUS message (RFC 2865) */
+#define PROXY_DGRAM_MAX 65536
+#define PROXY_MAX_MSGS (PROXY_DGRAM_MAX / 20)   /* Header-only messages in a datagram */
+#define PROXY_MAX_REPLIES 256       /* Replies sent per sendmmsg() */
+#define PROXY_READS 64              /* Datagrams read from a socket per wakeup */
+#define PROXY_RCVBUF (4 * 1024 * 1024)
+#define PROXY_DUP_ENTRIES (1024 * 1024)
+
+/* A request in flight to the home server, indexed by its upstream identifier */
+typedef struct _proxy_slot_t
+{
+    int used;
+    int tries;                  /* Times sent */
+    u_int64_t sent;             /* Last sent, ns */
+    struct sockaddr_in nas;
+    const struct rad_client *client;
+    int nas_ident;
+    u_char nas_auth[LEN_AUTH];
+    struct rad_dup_key dup_key;
+    int dup;                    /* The reply goes into the duplicate cache */
+    int len;
+    u_char *msg;                /* As sent upstream, PROXY_MSG_MAX bytes */
+}proxy_slot_t;
+
+/* An upstream socket, its identifiers and the bundle it is gathering */
+typedef struct _proxy_upstream_t
+{
+    int fd;
+    int no_used;
+    int next_ident;
+    proxy_slot_t slots[256];
+    u_char out[PROXY_DGRAM_MAX];
+    int out_len;
+    int out_count;
+    u_int64_t out_since;        /* When the first request was added, ns */
+}proxy_upstream_t;
+
+typedef struct _proxy_config_t
+{
+    int port;
+    struct sockaddr_in home;
+    const char *home_secret;
+    const char *secret;
+    const char *clients;
+    int bundle;
+    int bundle_size;
+    long linger_us;
+    int timeout_ms;
+    int tries;
+    int no_sockets;
+    int dup_ms;
+}proxy_config_t;
+
+typedef struct _proxy_t
+{
+    const proxy_config_t *cfg;
+    struct rad_handle *h;       /* Server handle of the NAS side */
+    const struct rad_client *home;
+    struct rad_client_table *homes;
+    int fd;                     /* NAS side */
+    proxy_upstream_t *up;
+    int cur;                    /* Upstream taking new requests */
+    u_int64_t next_scan;        /* For requests to send again */
+    u_char in[PROXY_DGRAM_MAX];
+    size_t off[PROXY_MAX_MSGS + 1];
+    struct mmsghdr msgs[PROXY_MAX_REPLIES];
+    struct iovec iov[PROXY_MAX_REPLIES];
+    struct sockaddr_in dest[PROXY_MAX_REPLIES];
+    long long requests;         /* Passed on */
+    long long bundles;
+    long long replies;          /* Passed back */
+    long long retransmits;
+    long long timeouts;
+    long long dropped;          /* Requests not passed on */
+    long long duplicates;       /* NAS retransmissions */
+    long long invalid;          /* Replies not passed back */
+}proxy_t;
+
+/* Send the bundle an upstream socket has gathered */
+static void proxy_flush(proxy_t *p, proxy_upstream_t *up)
+{
+    if (up->out_count == 0)
+        return;
+    if (rad_net_sendto(up->fd, up->out, up->out_len, 0, &p->cfg->home) == -1)
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "sendto: %s", strerror(errno));
+    else {
+        RAD_STAT_ADD(RAD_STAT_BUNDLES, 1);
+        RAD_STAT_ADD(RAD_STAT_BUNDLED, up->out_count);
+        RAD_STAT_ADD(RAD_STAT_BYTES_SENT, up->out_len);
+    }
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_BUNDLE, "Bundle of %d requests, %d bytes to the home server",
+            up->out_count, up->out_len);
+    p->bundles++;
+    up->out_len = 0;
+    up->out_count = 0;
+}
+
+/* Add the request of a slot to the bundle of its socket */
+static void proxy_bundle_add(proxy_t *p, proxy_upstream_t *up, proxy_slot_t *s, u_int64_t now)
+{
+    const proxy_config_t *cfg = p->cfg;
+
+    /* A request larger than the limit still goes out, alone in its datagram */
+    if (up->out_count && up->out_len + s->len > cfg->bundle_size)
+        proxy_flush(p, up);
+    if (up->out_count == 0)
+        up->out_since = now;
+    memcpy(up->out + up->out_len, s->msg, s->len);
+    RAD_STAT_ADD(RAD_STAT_COPIED, s->len);
+    up->out_len += s->len;
+    up->out_count++;
+    s->sent = now;
+    s->tries++;
+    if (up->out_count >= cfg->bundle)
+        proxy_flush(p, up);
+}
+
+static void proxy_release(proxy_upstream_t *up, proxy_slot_t *s)
+{
+    s->used = 0;
+    up->no_used--;
+}
+
+/* A free slot for a new request, moving on to the next socket when one is full */
+static proxy_slot_t *proxy_slot(proxy_t *p, proxy_upstream_t **upp)
+{
+    proxy_upstream_t *up;
+    int i, k;
+
+    for (k = 0; k < p->cfg->no_sockets; k++) {
+        up = &p->up[p->cur];
+        if (up->no_used < 256) {
+            for (i = up->next_ident; up->slots[i].used; i = (i + 1) & 0xff)
+                ;
+            up->next_ident = (i + 1) & 0xff;
+            *upp = up;
+            return &up->slots[i];
+        }
+        /* Send what this one gathered rather than leave it to the linger */
+        proxy_flush(p, up);
+        p->cur = (p->cur + 1) % p->cfg->no_sockets;
+    }
+    return NULL;
+}
+
+/* Pass one request of a NAS on to the home server */
+static void proxy_request(proxy_t *p, const u_char *msg, int len, const struct sockaddr_in *from,
+                          u_int64_t now)
+{
+    struct rad_handle *h = p->h;
+    proxy_upstream_t *up;
+    proxy_slot_t *s;
+    int ret;
+
+    if ((s = proxy_slot(p, &up)) == NULL) {
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "No identifier free for request %d", msg[POS_IDENT]);
+        p->dropped++;
+        return;
+    }
+    if ((ret = rad_load_request(h, msg, len, from)) == -4) {
+        /* Retransmission: send the reply again, if there is one yet */
+        p->duplicates++;
+        if (h->req.out_len > 0) {
+            rad_net_sendto(p->fd, h->req.out, h->req.out_len, 0, from);
+            RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        }
+        return;
+    }
+    if (ret != 0 || rad_validate_request(h) < 0) {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping request: %s", rad_strerror(h));
+        p->dropped++;
+        return;
+    }
+    if (s->msg == NULL && (s->msg = malloc(PROXY_MSG_MAX)) == NULL) {
+        p->dropped++;
+        return;
+    }
+    if ((s->len = rad_proxy_request(h, s - up->slots, p->home, s->msg)) == -1) {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping request: %s", rad_strerror(h));
+        p->dropped++;
+        return;
+    }
+
+    /* The reply, not the handle, completes the duplicate cache entry */
+    s->dup = h->dup_pending;
+    s->dup_key = h->dup_key;
+    h->dup_pending = 0;
+    s->used = 1;
+    s->tries = 0;
+    s->nas = *from;
+    s->client = h->client;
+    s->nas_ident = h->in[POS_IDENT];
+    memcpy(s->nas_auth, &h->in[POS_AUTH], LEN_AUTH);
+    up->no_used++;
+    p->requests++;
+    proxy_bundle_add(p, up, s, now);
+}
+
+/* Read the datagrams waiting from the NASes */
+static void proxy_nas_read(proxy_t *p)
+{
+    struct sockaddr_in from;
+    u_int64_t now;
+    ssize_t n;
+    int no_msgs, i, k;
+
+    for (k = 0; k < PROXY_READS; k++) {
+        n = rad_net_recvfrom(p->fd, p->in, sizeof(p->in), MSG_DONTWAIT, &from);
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "recvfrom: %s", strerror(errno));
+            return;
+        }
+        RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, n);
+        /* A NAS that bundles is served as well */
+        if ((no_msgs = rad_bundle_scan(p->in, n, p->off, PROXY_MAX_MSGS)) < 0) {
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping malformed datagram of %zd bytes from %s",
+                    n, inet_ntoa(from.sin_addr));
+            p->dropped++;
+            continue;
+        }
+        now = rad_net_now();
+        for (i = 0; i < no_msgs; i++)
+            proxy_request(p, p->in + p->off[i], p->off[i + 1] - p->off[i], &from, now);
+    }
+}
+
+/* Read the reply bundles waiting on an upstream socket and pass the replies back */
+static void proxy_home_read(proxy_t *p, proxy_upstream_t *up)
+{
+    struct sockaddr_in from;
+    proxy_slot_t *s;
+    u_char *msg;
+    ssize_t n;
+    int no_msgs, no_replies, sent, len, i, k;
+
+    for (k = 0; k < PROXY_READS; k++) {
+        n = rad_net_recvfrom(up->fd, p->in, sizeof(p->in), MSG_DONTWAIT, &from);
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "recvfrom: %s", strerror(errno));
+            return;
+        }
+        RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, n);
+        if (from.sin_addr.s_addr != p->cfg->home.sin_addr.s_addr ||
+                from.sin_port != p->cfg->home.sin_port ||
+                (no_msgs = rad_bundle_scan(p->in, n, p->off, PROXY_MAX_MSGS)) < 0) {
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping datagram of %zd bytes from %s",
+                    n, inet_ntoa(from.sin_addr));
+            p->invalid++;
+            continue;
+        }
+        RAD_STAT_ADD(RAD_STAT_RECEIVED, no_msgs);
+
+        for (i = 0, no_replies = 0; i < no_msgs; i++) {
+            msg = p->in + p->off[i];
+            len = p->off[i + 1] - p->off[i];
+            s = &up->slots[msg[POS_IDENT]];
+            if (!s->used) {
+                RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Late reply %d", msg[POS_IDENT]);
+                continue;
+            }
+            if (rad_proxy_response(p->h, msg, len, p->home, s->msg + POS_AUTH, s->client,
+                        s->nas_ident, s->nas_auth) == -1) {
+                RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping reply %d: %s", msg[POS_IDENT],
+                        rad_strerror(p->h));
+                p->invalid++;
+                continue;
+            }
+            if (s->dup)
+                rad_dup_cache_store(p->h->dup, &s->dup_key, msg, len);
+            p->dest[no_replies] = s->nas;
+            p->iov[no_replies].iov_base = msg;
+            p->iov[no_replies].iov_len = len;
+            no_replies++;
+            proxy_release(up, s);
+        }
+
+        for (i = 0; i < no_replies; i++) {
+            p->msgs[i].msg_hdr.msg_name = &p->dest[i];
+            p->msgs[i].msg_hdr.msg_namelen = sizeof(p->dest[i]);
+            p->msgs[i].msg_hdr.msg_iov = &p->iov[i];
+            p->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        for (sent = 0; sent < no_replies; sent += i) {
+            i = rad_net_sendmmsg(p->fd, &p->msgs[sent],
+                                 no_replies - sent < PROXY_MAX_REPLIES ? no_replies - sent :
+                                 PROXY_MAX_REPLIES, 0);
+            RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+            if (i == -1) {
+                if (errno == EINTR) {
+                    i = 0;
+                    continue;
+                }
+                RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "sendmmsg: %s", strerror(errno));
+                break;
+            }
+        }
+        p->replies += no_replies;
+    }
+}
+
+/* Send again the requests left unanswered, forgetting those out of tries */
+static void proxy_retry(proxy_t *p, u_int64_t now)
+{
+    const proxy_config_t *cfg = p->cfg;
+    u_int64_t timeout = (u_int64_t)cfg->timeout_ms * 1000000;
+    proxy_upstream_t *up;
+    proxy_slot_t *s;
+    int i, k;
+
+    for (k = 0; k < cfg->no_sockets; k++) {
+        up = &p->up[k];
+        for (i = 0; i < 256 && up->no_used; i++) {
+            s = &up->slots[i];
+            if (!s->used || now - s->sent < timeout)
+                continue;
+            if (s->tries >= cfg->tries) {
+                RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Request %d of %s timed out",
+                        s->nas_ident, inet_ntoa(s->nas.sin_addr));
+                RAD_STAT_ADD(RAD_STAT_TIMEOUTS, 1);
+                p->timeouts++;
+                proxy_release(up, s);
+                continue;
+            }
+            RAD_STAT_ADD(RAD_STAT_RETRANSMITS, 1);
+            p->retransmits++;
+            proxy_bundle_add(p, up, s, now);
+        }
+        proxy_flush(p, up);
+    }
+}
+
+/* Only there to end ppoll() */
+static void proxy_signal(int sig)
+{
+    (void)sig;
+}
+
+/* Serve until SIGINT or SIGTERM */
+static void proxy_run(proxy_t *p)
+{
+    const proxy_config_t *cfg = p->cfg;
+    struct pollfd pfds[PROXY_MAX_SOCKETS + 1];
+    struct timespec ts;
+    u_int64_t now, due;
+    sigset_t none;
+    int i, n;
+
+    sigemptyset(&none);
+    pfds[0].fd = p->fd;
+    pfds[0].events = POLLIN;
+    for (i = 0; i < cfg->no_sockets; i++) {
+        pfds[i + 1].fd = p->up[i].fd;
+        pfds[i + 1].events = POLLIN;
+    }
+    p->next_scan = rad_net_now();
+    for (;;) {
+        now = rad_net_now();
+        for (i = 0; i < cfg->no_sockets; i++)
+            if (p->up[i].out_count && now - p->up[i].out_since >= (u_int64_t)cfg->linger_us * 1000)
+                proxy_flush(p, &p->up[i]);
+        if (now >= p->next_scan) {
+            proxy_retry(p, now);
+            /* A request is sent again within a tenth of the timeout of falling due */
+            p->next_scan = now + (u_int64_t)cfg->timeout_ms * 100000;
+        }
+
+        due = p->next_scan;
+        for (i = 0; i < cfg->no_sockets; i++)
+            if (p->up[i].out_count && p->up[i].out_since + cfg->linger_us * 1000 < due)
+                due = p->up[i].out_since + cfg->linger_us * 1000;
+        due = due > now ? due - now : 0;
+        ts.tv_sec = due / 1000000000;
+        ts.tv_nsec = due % 1000000000;
+        /* SIGINT and SIGTERM are blocked but for the wait, where they end it */
+        if ((n = ppoll(pfds, cfg->no_sockets + 1, &ts, &none)) == -1) {
+            if (errno == EINTR)
+                return;
+            RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "ppoll: %s", strerror(errno));
+            return;
+        }
+        if (pfds[0].revents & POLLIN)
+            proxy_nas_read(p);
+        for (i = 0; i < cfg->no_sockets; i++)
+            if (pfds[i + 1].revents & POLLIN)
+                proxy_home_read(p, &p->up[i]);
+    }
+}
+
+/* Bind a UDP socket to a port (0 for any) with a large receive buffer */
+static int proxy_socket(int port)
+{
+    struct sockaddr_in sin;
+    int fd, size = PROXY_RCVBUF;
+
+    if ((fd = rad_net_socket(SOCK_DGRAM)) == -1) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    if (rad_net_bind(fd, &sin) == -1) {
+        fprintf(stderr, "bind: %s\n", strerror(errno));
+        rad_net_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Parse host[:port] of the home server. Returns -1 if it cannot be resolved. */
+static int proxy_home_parse(const char *spec, struct sockaddr_in *sin)
+{
+    char host[256], *colon;
+    struct hostent *hent;
+
+    snprintf(host, sizeof(host), "%s", spec);
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(PROXY_PORT);
+    if ((colon = strrchr(host, ':')) != NULL) {
+        *colon = '\0';
+        if (atoi(colon + 1) < 1 || atoi(colon + 1) > 65535)
+            return -1;
+        sin->sin_port = htons(atoi(colon + 1));
+    }
+    if (inet_aton(host, &sin->sin_addr))
+        return 0;
+    if ((hent = gethostbyname(host)) == NULL)
+        return -1;
+    memcpy(&sin->sin_addr, hent->h_addr, sizeof(sin->sin_addr));
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port] [-H host[:port]] [-S secret] [-s secret] [-C file]"
+            " [-b requests]\n"
+            "          [-m size] [-l usec] [-t msec] [-r tries] [-n sockets] [-D msec]"
+            " [-v level] [-F faults]\n"
+            "  -p port     UDP port the NASes send to (default %d)\n"
+            "  -H home     home server that answers the bundles (default %s)\n"
+            "  -S secret   secret shared with the home server (default %s)\n"
+            "  -s secret   secret shared with the local NASes (default %s)\n"
+            "  -C file     NAS clients, one 'address[/prefix] secret' per line\n"
+            "  -b requests most requests in a bundle (default %d)\n"
+            "  -m size     largest bundle datagram (default %d)\n"
+            "  -l usec     longest a request waits for others to bundle with\n"
+            "              (default %d)\n"
+            "  -t msec     time before a request is sent again (default %d)\n"
+            "  -r tries    times a request is sent (default %d)\n"
+            "  -n sockets  upstream sockets, 256 requests in flight on each\n"
+            "              (default %d)\n"
+            "  -D msec     how long replies are kept for NAS retransmissions\n"
+            "              (default the timeout times the tries)\n"
+            "  -v level    log level[:category,...], as the server's -v\n"
+            "  -F faults   damage what is sent, as the server's -F\n",
+            prog, PROXY_PORT, PROXY_HOME, PROXY_SECRET, PROXY_SECRET, PROXY_BUNDLE,
+            PROXY_BUNDLE_SIZE, PROXY_LINGER_US, PROXY_TIMEOUT_MS, PROXY_TRIES, PROXY_SOCKETS);
+}
+
+int main(int argc, char **argv)
+{
+    proxy_config_t cfg;
+    proxy_t *p;
+    struct rad_fault faults;
+    struct rad_dup_cache *dup;
+    const char *home = PROXY_HOME;
+    struct sigaction sa;
+    sigset_t sigs;
+    int faulty = 0, c, i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = PROXY_PORT;
+    cfg.home_secret = PROXY_SECRET;
+    cfg.secret = PROXY_SECRET;
+    cfg.bundle = PROXY_BUNDLE;
+    cfg.bundle_size = PROXY_BUNDLE_SIZE;
+    cfg.linger_us = PROXY_LINGER_US;
+    cfg.timeout_ms = PROXY_TIMEOUT_MS;
+    cfg.tries = PROXY_TRIES;
+    cfg.no_sockets = PROXY_SOCKETS;
+    cfg.dup_ms = -1;
+
+    while ((c = getopt(argc, argv, "p:H:S:s:C:b:m:l:t:r:n:D:v:F:")) != -1) {
+        switch (c) {
+            case 'p':
+                cfg.port = atoi(optarg);
+                break;
+            case 'H':
+                home = optarg;
+                break;
+            case 'S':
+                cfg.home_secret = optarg;
+                break;
+            case 's':
+                cfg.secret = optarg;
+                break;
+            case 'C':
+                cfg.clients = optarg;
+                break;
+            case 'b':
+                cfg.bundle = atoi(optarg);
+                break;
+            case 'm':
+                cfg.bundle_size = atoi(optarg);
+                break;
+            case 'l':
+                cfg.linger_us = atol(optarg);
+                break;
+            case 't':
+                cfg.timeout_ms = atoi(optarg);
+                break;
+            case 'r':
+                cfg.tries = atoi(optarg);
+                break;
+            case 'n':
+                cfg.no_sockets = atoi(optarg);
+                break;
+            case 'D':
+                cfg.dup_ms = atoi(optarg);
+                break;
+            case 'v':
+                if (rad_log_parse(optarg) == -1) {
+                    fprintf(stderr, "Invalid log level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'F':
+                if (rad_fault_parse(optarg, &faults) == -1) {
+                    fprintf(stderr, "Invalid fault policy %s\n", optarg);
+                    return 1;
+                }
+                faulty = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.port < 1 || cfg.port > 65535 || cfg.bundle < 1 || cfg.bundle > 256 ||
+            cfg.bundle_size < POS_ATTRS || cfg.bundle_size > PROXY_DGRAM_MAX - PROXY_MSG_MAX ||
+            cfg.linger_us < 0 || cfg.timeout_ms < 1 || cfg.tries < 1 ||
+            cfg.no_sockets < 1 || cfg.no_sockets > PROXY_MAX_SOCKETS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (proxy_home_parse(home, &cfg.home) == -1) {
+        fprintf(stderr, "Invalid home server %s\n", home);
+        return 1;
+    }
+    if (cfg.dup_ms < 0)
+        cfg.dup_ms = cfg.timeout_ms * cfg.tries;
+
+    if ((p = calloc(1, sizeof(*p))) == NULL ||
+            (p->up = calloc(cfg.no_sockets, sizeof(*p->up))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    p->cfg = &cfg;
+    if (faulty && rad_fault_start(&faults) == -1) {
+        fprintf(stderr, "Cannot inject faults: %s\n", strerror(errno));
+        return 1;
+    }
+    if ((p->fd = proxy_socket(cfg.port)) == -1)
+        return 1;
+    for (i = 0; i < cfg.no_sockets; i++)
+        if ((p->up[i].fd = proxy_socket(0)) == -1)
+            return 1;
+
+    /* The NAS side is a server handle; the home server is a client of the proxy's secrets */
+    if ((p->h = rad_server_open(p->fd)) == NULL ||
+            (p->homes = rad_client_table_create()) == NULL ||
+            rad_client_table_add(p->homes, cfg.home.sin_addr, 32, cfg.home_secret) == -1) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    p->home = rad_client_table_lookup(p->homes, cfg.home.sin_addr);
+    if (rad_add_client(p->h, "127.0.0.1", cfg.secret) == -1 ||
+            (cfg.clients != NULL && rad_load_clients(p->h, cfg.clients) == -1)) {
+        fprintf(stderr, "%s\n", rad_strerror(p->h));
+        return 1;
+    }
+    if (cfg.dup_ms > 0) {
+        if ((dup = rad_dup_cache_create(cfg.dup_ms, PROXY_DUP_ENTRIES)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        rad_set_dup_cache(p->h, dup);
+    }
+
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = proxy_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if (rad_log_start(stdout) == -1)
+        fprintf(stderr, "Cannot start the logging thread, logging synchronously\n");
+
+    proxy_run(p);
+
+    rad_log_stop();
+    printf("\nProxied %lld requests in %lld bundles, %lld replies, %lld retransmits,"
+           " %lld timed out, %lld dropped, %lld duplicates, %lld invalid replies\n",
+           p->requests, p->bundles, p->replies, p->retransmits, p->timeouts, p->dropped,
+           p->duplicates, p->invalid);
+    fflush(stdout);
+    return 0;
+}
@@ -5,37 +5,51 @@
  *
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include "include/radlib.h"
 #include "include/radlib_private.h"
+#include "include/radlib_log.h"
+#include "include/radlib_net.h"
+#include "include/radlib_trace.h"
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <stdbool.h>
 
-#define TRACE_ENABLE 0
-#define TRACE(args...) if(TRACE_ENABLE) printf(args)
-
 #define LOG_ENABLE 1
 #define LOG(args...) if(LOG_ENABLE) printf(args)
 
-struct rad_handle * my_rad_init(void);
+struct rad_attr_block * my_rad_nas_block(struct rad_handle *h);
+
+struct rad_template * my_rad_template(struct rad_handle *h,
+                                      const struct rad_attr_block *nas);
 
-void my_rad_add_request(unsigned char *msg, long long *len, struct rad_handle *h);
+struct rad_request * my_rad_init(struct rad_handle *h,
+                                 const struct rad_template *tpl);
+
+int my_rad_add_request(unsigned char *msg, long long *len, struct rad_request *r);
 
 int my_rad_send_request(struct rad_handle *h, unsigned char *msg, long long len,
                         uint proto_tcp, long long msg_count);
 
 int main() 
 {
-    struct rad_handle *rad_h1 = NULL;
+    struct rad_request *req = NULL;
+    struct rad_attr_block *nas = NULL;
+    struct rad_template *tpl = NULL;
     struct rad_handle *rad_h = NULL;
     long long  rc = 0, ret_value, i =0;
     uint proto_tcp = 0;
     long long no_clients;
     unsigned char msg[MSGSIZE] = {0};
     long long len = 0;
+    const char *log_spec, *trace_path, *fault_spec;
+    FILE *trace_fp;
+    struct rad_stats stats;
+    struct rad_fault faults;
+    struct rad_fault_stats fstats;
 
     LOG("\n\rTransport Protocol - UDP(0)/TCP(1) ?\n\r");
     scanf("%d", &proto_tcp);
@@ -51,16 +65,24 @@ int main()
         return 0;
     }
 
-    for(i=0; i<no_clients; i++)
-    {
-        rad_h1 = my_rad_init();
-        if(rad_h1 == NULL)
-        {
-            LOG("\n\rInit failed\n\r");
-            return 0;
-        }
-        my_rad_add_request(msg, &len, rad_h1);
+    /* RADIUS_LOG=level[:category,...], e.g. debug:bundle,proto */
+    if ((log_spec = getenv("RADIUS_LOG")) != NULL && rad_log_parse(log_spec) == -1)
+        fprintf(stderr, "Invalid RADIUS_LOG %s\n", log_spec);
+    if (rad_log_start(stdout) == 0)
+        atexit(rad_log_stop);
+    /* RADIUS_TRACE=file captures a Chrome trace, if built with TRACE=1 */
+    if ((trace_path = getenv("RADIUS_TRACE")) != NULL && rad_trace_start(0) == -1) {
+        fprintf(stderr, "Tracing is not compiled in\n");
+        trace_path = NULL;
+    }
+    /* RADIUS_FAULT=policy damages the requests sent, e.g. drop=10,msgtrunc=5 */
+    if ((fault_spec = getenv("RADIUS_FAULT")) != NULL &&
+            (rad_fault_parse(fault_spec, &faults) == -1 || rad_fault_start(&faults) == -1)) {
+        fprintf(stderr, "Invalid RADIUS_FAULT %s\n", fault_spec);
+        fault_spec = NULL;
     }
+
+    /* One handle holds the servers and socket for all the requests */
     if ((rad_h = rad_auth_open ()) == NULL)
     {
         LOG("Authentication init failure");
@@ -74,9 +96,47 @@ int main()
         rad_h = NULL;
         return 0;
     }
+    rad_set_latency(rad_h, 1);
 
-    TRACE("\n\r!!!!Passing len =%llu to final Msg", len);
-    switch((rc = my_rad_send_request(rad_h, msg, len, proto_tcp, no_clients)))
+    if ((nas = my_rad_nas_block(rad_h)) == NULL ||
+            (tpl = my_rad_template(rad_h, nas)) == NULL)
+    {
+        LOG("\n\rRequest template failure %s\n\r", rad_strerror(rad_h));
+        return 0;
+    }
+
+    for(i=0; i<no_clients; i++)
+    {
+        req = my_rad_init(rad_h, tpl);
+        if(req == NULL || my_rad_add_request(msg, &len, req) == -1)
+        {
+            LOG("\n\rInit failed\n\r");
+            return 0;
+        }
+    }
+
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_BUNDLE, "Sending bundle of %lld requests, %lld bytes",
+            no_clients, len);
+    rc = my_rad_send_request(rad_h, msg, len, proto_tcp, no_clients);
+    if (fault_spec != NULL) {
+        rad_fault_stop();
+        rad_fault_stats(&fstats);
+        LOG("\n\rFaults in %llu datagrams: %llu dropped, %llu delayed, %llu duplicated,"
+            " %llu truncated, %llu messages dropped, %llu messages truncated,"
+            " %llu lengths corrupted\n\r",
+            (unsigned long long)fstats.datagrams, (unsigned long long)fstats.dropped,
+            (unsigned long long)fstats.delayed, (unsigned long long)fstats.duplicated,
+            (unsigned long long)fstats.truncated, (unsigned long long)fstats.msg_dropped,
+            (unsigned long long)fstats.msg_truncated, (unsigned long long)fstats.corrupted);
+    }
+    rad_log_stop();
+    if (trace_path != NULL) {
+        rad_trace_stop();
+        if ((trace_fp = fopen(trace_path, "w")) == NULL ||
+                rad_trace_write(trace_fp) == -1 || fclose(trace_fp) == EOF)
+            fprintf(stderr, "Cannot write %s: %s\n", trace_path, strerror(errno));
+    }
+    switch(rc)
     {
         case -1:
             fprintf(stderr, "Processing Error : %s\n", rad_strerror(rad_h));
@@ -86,13 +146,19 @@ int main()
             LOG("\n\r\n\r================================================");
             LOG("\n\rReceived %lld Reply Messages from Server", no_clients);
             LOG("\n\r================================================\n\r\n\r");
+            LOG("Latency by server, request type, bundle size and stage:\n");
+            rad_latency_dump(stdout);
+            LOG("\nLibrary counters:\n");
+            rad_stats_snapshot(&stats);
+            rad_stats_print(stdout, &stats, RAD_STATS_TEXT);
             break;
         default:
-            TRACE("\n\rmessage code %llu", rc);
             fprintf(stderr, "invalid message type in response: %llu\n", rc);
             rc = -1;
     }
 
+    rad_template_free(tpl);
+    rad_block_free(nas);
     rad_close(rad_h);
 
     return rc;
@@ -55,147 +55,287 @@
 #include <stdbool.h>
 
 #include "include/radlib_private.h"
+#include "include/radlib_log.h"
+#include "include/radlib_net.h"
+#include "include/radlib_trace.h"
 
 #ifndef __printflike
 #define __printflike(m, n) __attribute__((format(printf, m, n)));
 #endif
 
-#define TRACE_ENABLE 0
-#define TRACE(args...) if(TRACE_ENABLE) printf(args)
-
-#define LOG_ENABLE 1
-#define LOG(args...) if(LOG_ENABLE) printf(args) 
+#define BUNDLE_MAX_MSGS (MSGSIZE / 20)   /* Header-only messages in a bundle */
+#define REPLY_MIN_LEN POS_ATTRS          /* Header only */
+#define REPLY_MAX_LEN 4096               /* RFC 2865, section 3 */
 
 void     generr(struct rad_handle *, const char *, ...)
                     __printflike(2, 3);
-void     insert_scrambled_password(struct rad_handle *, int);
-void     insert_message_authenticator(struct rad_handle *, int);
-void     insert_request_authenticator(struct rad_handle *, int);
 
 
-/* Initialiaze RADIUS Msg Handle */
-struct rad_handle *my_rad_init(void)
+/* Queue a request of the bundle in flight on its handle */
+static int my_rad_track(struct rad_request *r)
 {
-    int srv;
-    time_t now;
-    struct sockaddr_in sin;
-    int n, cur_srv;
-    int rc = 0, ret_value;
-    struct rad_handle *h = NULL;
-    TRACE("\n\rentering %s\n\r", __FUNCTION__);
-    /** Get Handle from LIBRADIUS library */
-    if ((h = rad_auth_open ()) == NULL)
-    {
-        LOG("Authentication init failure");
-        return NULL;
+    struct rad_pending *p = r->h->pending;
+    int id = rad_req_ident(r);
+
+    if (p == NULL && (p = r->h->pending = calloc(1, sizeof(*p))) == NULL)
+        return -1;
+    if (p->count == RAD_MAX_PENDING)
+        return -1;
+    if (p->count == 0) {
+        memset(p->head, 0xff, sizeof(p->head));
+        memset(p->tail, 0xff, sizeof(p->tail));
     }
-    /** Read the configuration data from radius.conf file */
-    if ((ret_value = rad_config (h, NULL)) != 0)
+    p->req[p->count] = r;
+    p->next[p->count] = -1;
+    if (p->tail[id] == -1)
+        p->head[id] = p->count;
+    else
+        p->next[p->tail[id]] = p->count;
+    p->tail[id] = p->count++;
+    return 0;
+}
+
+/* Number of requests in the bundle in flight, answered or not */
+static int my_rad_pending(struct rad_handle *h)
+{
+    return h->pending == NULL ? 0 : h->pending->count;
+}
+
+/* Mark the requests of the bundle as sent together */
+static void my_rad_sent(struct rad_handle *h)
+{
+    int i;
+
+    for (i = 0; i < my_rad_pending(h); i++)
+        if (h->pending->req[i] != NULL)
+            rad_req_sent(h->pending->req[i], h->pending->count);
+}
+
+/*
+ * Complete the oldest request a reply answers: the identifier must match
+ * and so must the response authenticator, since identifiers repeat in a
+ * bundle of more than 256 requests.  Returns 1, or 0 if no request is
+ * waiting for it, as with a late reply to a bundle that was sent again.
+ */
+static int my_rad_reply(struct rad_handle *h, const unsigned char *msg)
+{
+    struct rad_pending *p = h->pending;
+    struct rad_request *r;
+    int i, prev = -1;
+    size_t len = msg[POS_LENGTH] << 8 | msg[POS_LENGTH + 1];
+
+    if (my_rad_pending(h) == 0)
+        return 0;
+    for (i = p->head[msg[POS_IDENT]]; i != -1; prev = i, i = p->next[i])
+        if (rad_req_is_reply(p->req[i], msg, len))
+            break;
+    if (i == -1)
     {
-        LOG("Authentication configuration "
-                "failure %d", ret_value);
-        return NULL;
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Reply %d matches no request",
+                msg[POS_IDENT]);
+        return 0;
     }
-    /** Construct a new RADIUS Authentication Request */
-    if ((ret_value =
-                rad_create_request (h, RAD_ACCESS_REQUEST)) != 0)
+    if (prev == -1)
+        p->head[msg[POS_IDENT]] = p->next[i];
+    else
+        p->next[prev] = p->next[i];
+    if (p->tail[msg[POS_IDENT]] == i)
+        p->tail[msg[POS_IDENT]] = prev;
+    r = p->req[i];
+    p->req[i] = NULL;
+    rad_req_received(r);
+    rad_req_complete(r, msg[POS_CODE]);
+    rad_req_free(r);
+    return 1;
+}
+
+/* Forget the bundle in flight, dropping the requests left unanswered */
+void my_rad_release(struct rad_handle *h)
+{
+    int i;
+
+    for (i = 0; i < my_rad_pending(h); i++)
+        if (h->pending->req[i] != NULL)
+            rad_req_free(h->pending->req[i]);
+    if (h->pending != NULL)
+        h->pending->count = 0;
+}
+
+/*
+ * Rebuild the bundle in flight in h->req from the requests still waiting
+ * for a reply, each encoded again for the current server: it may have
+ * another secret than the one they were first sent to.
+ */
+static int my_rad_rebundle(struct rad_handle *h)
+{
+    const void *data;
+    size_t data_len;
+    int i;
+
+    h->req.out_len = 0;
+    for (i = 0; i < my_rad_pending(h); i++)
     {
-        LOG("Message creation failure %d",
-                ret_value);
-        return NULL;
+        if (h->pending->req[i] == NULL)
+            continue;
+        if (rad_req_encode(h->pending->req[i], &data, &data_len) == -1 ||
+                rad_out_reserve(&h->req, h->req.out_len + data_len) == -1)
+            return -1;
+        memcpy(h->req.out + h->req.out_len, data, data_len);
+        RAD_STAT_ADD(RAD_STAT_COPIED, data_len);
+        h->req.out_len += data_len;
     }
+    return 0;
+}
 
-    rad_put_string(h, RAD_USER_NAME, "admin");
-    rad_put_string(h, RAD_USER_PASSWORD, "admin");
-    rad_put_int(h, RAD_NAS_PORT, 4223);
+/* Encode the attributes that are the same in every request of this NAS */
+struct rad_attr_block *my_rad_nas_block(struct rad_handle *h)
+{
+    struct rad_request *r;
+    struct rad_attr_block *b;
 
-    /* Fill in the length field in the message */
-    h->out[POS_LENGTH] = h->out_len >> 8;
-    h->out[POS_LENGTH+1] = h->out_len;
+    if ((r = rad_req_create(h, RAD_ACCESS_REQUEST)) == NULL)
+        return NULL;
+    if (rad_req_put_int(r, RAD_NAS_PORT, 4223) == -1)
+        b = NULL;
+    else
+        b = rad_block_create(r);
+    rad_req_free(r);
+    return b;
+}
 
-    h->srv = 0;
-    now = time(NULL);
-    for (srv = 0;  srv < h->num_servers;  srv++)
-        h->servers[srv].num_tries = 0;
-    /* Find a first good server. */
-    for (srv = 0;  srv < h->num_servers;  srv++) {
-        if (h->servers[srv].is_dead == 0)
-            break;
-        if (h->servers[srv].dead_time &&
-                h->servers[srv].next_probe <= now) {
-            h->servers[srv].is_dead = 0;
-            break;
-        }
-        h->srv++;
-    }
+/*
+ * Compile the request sent for every client: User-Name and User-Password
+ * vary, the NAS attributes are the same for all of them.
+ */
+struct rad_template *my_rad_template(struct rad_handle *h,
+                                     const struct rad_attr_block *nas)
+{
+    struct rad_request *r;
+    struct rad_template *t = NULL;
 
-    /* If all servers was dead on the last probe, try from beginning */
-    if (h->srv == h->num_servers) {
-        for (srv = 0;  srv < h->num_servers;  srv++) {
-            h->servers[srv].is_dead = 0;
-            h->servers[srv].next_probe = 0;
-        }
-        h->srv = 0;
+    if ((r = rad_req_create(h, RAD_ACCESS_REQUEST)) == NULL)
+        return NULL;
+    if (rad_req_put_field(r, RAD_USER_NAME, 0) != -1 &&
+            rad_req_put_field(r, RAD_USER_PASSWORD, 0) != -1 &&
+            rad_req_put_block(r, nas) != -1)
+        t = rad_template_create(r);
+    rad_req_free(r);
+    return t;
+}
+
+/* Build the request of one client on the shared handle */
+struct rad_request *my_rad_init(struct rad_handle *h,
+                                const struct rad_template *tpl)
+{
+    struct rad_request *r;
+    struct rad_value values[2] = {
+        { "admin", 5 },     /* User-Name */
+        { "admin", 5 },     /* User-Password */
+    };
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_GENERAL, "Entering %s", __func__);
+    /** Stamp a new RADIUS Authentication Request out of the template */
+    RAD_TRACE_BEGIN("stamp");
+    r = rad_template_stamp(h, tpl, values);
+    RAD_TRACE_END("stamp");
+    if (r == NULL)
+    {
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_PROTO, "Message creation failure %s",
+                rad_strerror(h));
+        return NULL;
     }
 
-    /*
-     * Scan round-robin to the next server that has some
-     * tries left.  There is guaranteed to be one, or we
-     * would have exited this loop by now.
-     */
-    cur_srv = h->srv;
-    now = time(NULL);
-    if (h->servers[h->srv].num_tries >= h->servers[h->srv].max_tries) {
-        /* Set next probe time for this server */
-        if (h->servers[h->srv].dead_time) {
-            h->servers[h->srv].is_dead = 1;
-            h->servers[h->srv].next_probe = now +
-                h->servers[h->srv].dead_time;
-        }
-        do {
-            h->srv++;
-            if (h->srv >= h->num_servers)
-                h->srv = 0;
-            if (h->servers[h->srv].is_dead == 0)
-                break;
-            if (h->servers[h->srv].dead_time &&
-                    h->servers[h->srv].next_probe <= now) {
-                h->servers[h->srv].is_dead = 0;
-                h->servers[h->srv].num_tries = 0;
-                break;
-            }
-        } while (h->srv != cur_srv);
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_GENERAL, "Exiting %s", __func__);
+    return r;
+}
 
-        if (h->srv == cur_srv) {
-            generr(h, "No valid RADIUS responses received");
-            LOG("\n\rNo valid RADIUS responses received\n\r");
-            return NULL;
-        }
+/* Add Message to final Message to be sent to Server */
+int my_rad_add_request(unsigned char *msg, long long *len, struct rad_request *r)
+{
+    const void *data;
+    size_t data_len;
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_GENERAL, "Entering %s", __func__);
+    /* Fill in the length, password and authenticators */
+    if (rad_req_encode(r, &data, &data_len) == -1)
+        return -1;
+    if (*len + data_len > MSGSIZE)
+    {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_BUNDLE, "Bundle full, request not added");
+        return -1;
     }
-
-    if (h->out[POS_CODE] == RAD_ACCESS_REQUEST) {
-        /* Insert the scrambled password into the request */
-        if (h->pass_pos != 0)
-            insert_scrambled_password(h, h->srv);
+    if (my_rad_track(r) == -1)
+    {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_BUNDLE, "Too many requests in the bundle");
+        return -1;
     }
-    insert_message_authenticator(h, 0);
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_BUNDLE, "Adding request %d of %zu bytes at %lld",
+            r->out[POS_IDENT], data_len, *len);
+    RAD_TRACE_BEGIN("bundle_copy");
+    memcpy(msg + *len, data, data_len);
+    RAD_TRACE_END("bundle_copy");
+    RAD_STAT_ADD(RAD_STAT_COPIED, data_len);
+    *len = *len + data_len;
+    return 0;
+}
+
+/*
+ * Open and bind a new socket for the handle, closing the one it had.
+ * A new TCP socket is not connected yet, see my_rad_connect().
+ */
+static int my_rad_open(struct rad_handle *h, uint proto_tcp)
+{
+    struct sockaddr_in sin;
 
-    if (h->out[POS_CODE] != RAD_ACCESS_REQUEST) {
-        /* Insert the request authenticator into the request */
-        memset(&h->out[POS_AUTH], 0, LEN_AUTH);
-        insert_request_authenticator(h, 0);
+    if (h->fd != -1)
+        rad_net_close(h->fd);
+    if ((h->fd = rad_net_socket(proto_tcp ? SOCK_STREAM : SOCK_DGRAM)) == -1)
+    {
+        generr(h, "Cannot create socket: %s", strerror(errno));
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "Cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+    h->stream_len = 0;
+    h->stream_srv = -1;
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = h->bindto;
+    sin.sin_port = htons(0);
+    if (rad_net_bind(h->fd, &sin) == -1)
+    {
+        generr(h, "bind: %s", strerror(errno));
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "bind: %s", strerror(errno));
+        rad_net_close(h->fd);
+        h->fd = -1;
+        return -1;
     }
-    TRACE("\n\rExiting %s\n\r", __FUNCTION__);
-    return h;
+    return 0;
 }
 
-/* Add Message to final Message to be sent to Server */
-void my_rad_add_request(unsigned char *msg, long long *len, struct rad_handle *h)
+/*
+ * Over TCP, make sure the socket is connected to the current server.  A
+ * stream stays open across bundles; one to another server is replaced.
+ */
+static int my_rad_connect(struct rad_handle *h, uint proto_tcp)
 {
-    TRACE("\n\rEntering %s\n\r", __FUNCTION__);
-    TRACE("\n\rin %s len %llu radlen %int\n\r", __FUNCTION__, *len, h->out_len);
-    memcpy(msg + *len, &(h->out), h->out_len);
-    *len = *len + h->out_len;
+    if (!proto_tcp || h->stream_srv == h->srv)
+        return 0;
+    if (h->stream_srv != -1 && my_rad_open(h, proto_tcp) == -1)
+        return -1;
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_NET, "Connecting");
+    RAD_TRACE_BEGIN("connect");
+    if (rad_net_connect(h->fd, &h->servers[h->srv].addr) != 0)
+    {
+        RAD_TRACE_END("connect");
+        generr(h, "connect: %s", strerror(errno));
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "connect: %s", strerror(errno));
+        /* Start afresh with the next bundle */
+        rad_net_close(h->fd);
+        h->fd = -1;
+        return -1;
+    }
+    RAD_TRACE_END("connect");
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    h->stream_srv = h->srv;
+    return 0;
 }
 
 /* Initialize Final Msg handler that will hold the final message to sent to server */
@@ -204,44 +344,14 @@ int my_rad_add_send_request(struct rad_handle *h, unsigned char *msg, long long
 {
     int srv;
     time_t now;
-    struct sockaddr_in sin;
-    int n, cur_srv, ret_value = 0;
+    int n, cur_srv;
 
     /* Make sure we have a socket to use */
-    if (h->fd == -1) 
-    {
-        if(proto_tcp)
-        {
-            if ((h->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) 
-            {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        else
-        {
-            if ((h->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) 
-            {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        memset(&sin, 0, sizeof sin);
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = h->bindto;
-        sin.sin_port = htons(0);
-        if (bind(h->fd, (const struct sockaddr *)&sin,
-                    sizeof sin) == -1) {
-            generr(h, "bind: %s", strerror(errno));
-            LOG("\n\r!!bind error %s!!!\n\r", strerror(errno));
-            close(h->fd);
-            h->fd = -1;
-            return -1;
-        }
-    }
+    if (h->fd == -1 && my_rad_open(h, proto_tcp) == -1)
+        return -1;
 
     h->srv = 0;
-    now = time(NULL);
+    now = rad_net_time();
     for (srv = 0;  srv < h->num_servers;  srv++)
         h->servers[srv].num_tries = 0;
     /* Find a first good server. */
@@ -271,7 +381,7 @@ int my_rad_add_send_request(struct rad_handle *h, unsigned char *msg, long long
      * would have exited this loop by now.
      */
     cur_srv = h->srv;
-    now = time(NULL);
+    now = rad_net_time();
     if (h->servers[h->srv].num_tries >= h->servers[h->srv].max_tries) {
         /* Set next probe time for this server */
         if (h->servers[h->srv].dead_time) {
@@ -297,65 +407,45 @@ int my_rad_add_send_request(struct rad_handle *h, unsigned char *msg, long long
             generr(h, "No valid RADIUS responses received");
             return (-1);
         }
+        RAD_STAT_ADD(RAD_STAT_FAILOVERS, 1);
     }
 
     /* Rebind */
     if (h->bindto != h->servers[h->srv].bindto) {
         h->bindto = h->servers[h->srv].bindto;
-        close(h->fd);
-        if(proto_tcp)
-        {
-            if ((h->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                LOG("\n\rCannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        else
-        {
-            if ((h->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                LOG("\n\rCannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        memset(&sin, 0, sizeof sin);
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = h->bindto;
-        sin.sin_port = 0;
-        if (bind(h->fd, (const struct sockaddr *)&sin,
-                    sizeof sin) == -1) {
-            generr(h, "bind: %s", strerror(errno));
-            LOG("\n\rbind: %s", strerror(errno));
-            close(h->fd);
-            h->fd = -1;
-            return (-1);
-        }
+        if (my_rad_open(h, proto_tcp) == -1)
+            return -1;
     }
 
-    memcpy(&(h->out), msg, len);
-    h->out_len = len;
+    h->req.out_len = 0;
+    if (rad_out_reserve(&h->req, len) == -1)
+        return -1;
+    RAD_TRACE_BEGIN("bundle_copy");
+    memcpy(h->req.out, msg, len);
+    RAD_TRACE_END("bundle_copy");
+    RAD_STAT_ADD(RAD_STAT_COPIED, len);
+    h->req.out_len = len;
 
-    if(proto_tcp)
-    {
-        TRACE("\n\rconnect called\n\r");
-        if(connect(h->fd, (const struct sockaddr *)&h->servers[h->srv].addr,
-                    sizeof h->servers[h->srv].addr) != 0)
-        {
-            LOG("\n\rconnect failed\n\r");
-            return -1;
-        }
-    }
+    if (my_rad_connect(h, proto_tcp) == -1)
+        return -1;
 
     /* Send the request */
-    n = sendto(h->fd, h->out, h->out_len, 0,
-            (const struct sockaddr *)&h->servers[h->srv].addr,
-            sizeof h->servers[h->srv].addr);
-    TRACE("\n\rlen = %d out_len %d\n\r", n, h->out_len);
-    if (n != h->out_len)
+    RAD_TRACE_BEGIN("sendto");
+    n = rad_net_sendto(h->fd, h->req.out, h->req.out_len, 0,
+            &h->servers[h->srv].addr);
+    RAD_TRACE_END("sendto");
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_NET, "Sent %d of %d bytes", n, h->req.out_len);
+    if (n != h->req.out_len)
         tv->tv_sec = 1; /* Do not wait full timeout if send failed. */
     else
+    {
         tv->tv_sec = h->servers[h->srv].timeout;
+        RAD_STAT_ADD(RAD_STAT_BYTES_SENT, n);
+        RAD_STAT_ADD(RAD_STAT_BUNDLES, 1);
+        RAD_STAT_ADD(RAD_STAT_BUNDLED, my_rad_pending(h));
+        my_rad_sent(h);
+    }
     h->servers[h->srv].num_tries++;
     tv->tv_usec = 0;
     *fd = h->fd;
@@ -363,6 +453,56 @@ int my_rad_add_send_request(struct rad_handle *h, unsigned char *msg, long long
     return 0;
 }
 
+/*
+ * Match the complete replies buffered from the TCP stream, keeping a
+ * partial one for the next read.  Returns the code of the last reply, 0
+ * if none is complete yet, or -1 if the stream cannot be framed.
+ */
+static int my_rad_frame(struct rad_handle *h, long long *recv_msg_count)
+{
+    size_t off[2];
+    int pos = 0, packet_len, code = 0;
+
+    while (h->stream_len - pos >= 4)
+    {
+        packet_len = (h->stream[pos + 2] << 8) | h->stream[pos + 3];
+        /* The stream cannot be split on a bad length; give it up */
+        if (packet_len < REPLY_MIN_LEN || packet_len > REPLY_MAX_LEN)
+        {
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Malformed TCP reply length %d",
+                    packet_len);
+            RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+            generr(h, "Malformed reply length %d", packet_len);
+            return -1;
+        }
+        if (h->stream_len - pos < packet_len)
+            break;
+        if (rad_bundle_scan(h->stream + pos, packet_len, off, 1) != 1)
+        {
+            RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Dropping malformed TCP reply code %d",
+                    h->stream[pos]);
+        }
+        else
+        {
+            RAD_STAT_ADD(RAD_STAT_RECEIVED, 1);
+            RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "TCP reply code %d id %d length %d",
+                    h->stream[pos], h->stream[pos + 1], packet_len);
+            *recv_msg_count += my_rad_reply(h, h->stream + pos);
+            code = h->stream[pos];
+        }
+        pos += packet_len;
+    }
+
+    /* Keep the partial reply for the next read */
+    if (pos)
+    {
+        memmove(h->stream, h->stream + pos, h->stream_len - pos);
+        h->stream_len -= pos;
+    }
+    return code;
+}
+
 /* Receive incoming Msg or resend the msg to Server */
 int my_rad_continue_send_request(struct rad_handle *h, long long selected, long long *fd,
                              struct timeval *tv, uint proto_tcp, long long msg_count,
@@ -370,73 +510,87 @@ int my_rad_continue_send_request(struct rad_handle *h, long long selected, long
 {
     long long n, cur_srv;
     time_t now;
-    struct sockaddr_in sin;
-    uint8_t header[4];
     long long data_len, msg_start = 0;
     uint16_t packet_len = 0;
     uint8_t recvd_pkt_id = 0;
+    size_t bundle_off[BUNDLE_MAX_MSGS + 1];
+    int no_msgs, i;
     if (selected) {
-        TRACE("\n\rselected is set\n\r");
-        struct sockaddr_in from;
-        socklen_t fromlen;
-
-        fromlen = sizeof from;
+        RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_NET, "Socket readable");
         if(proto_tcp)
         {
-            /* Peek the received Msg and Get the length */
-            data_len = recvfrom(h->fd, header, sizeof(header), MSG_PEEK,
-                    NULL, NULL);
-            LOG("\n\r====== RECEIVED TCP MSG FROM SERVER ======");
-            TRACE("\n\rdata_len = %llu\n\r", data_len);
-            packet_len = (header[2] * 256) + header[3];
-            TRACE("\n\rpacket_len = %d\n\r", packet_len);
-
-            if(header[0] == 2)
-            LOG("\n\rReceived RADIUS ACCEPT (Code = %d)", h->in[POS_CODE]);
-            recvd_pkt_id = header[1];
-            LOG("\n\rPacket ID %d", recvd_pkt_id);
-            LOG("  Packet Len = %d", packet_len);
-            /* Receive the msg upto packet length */
-            h->in_len=recvfrom(h->fd,h->in,packet_len,0,NULL, NULL);
-            TRACE("\n\rrecvfrom in_len %d\n\r", h->in_len);
-            if (h->in_len == -1) {
-                generr(h, "recvfrom: %s", strerror(errno));
+            /* Append what arrived to the partial replies of the stream */
+            if (rad_buf_reserve(&h->stream, &h->stream_size, RAD_BUF_LARGE,
+                        h->stream_len) == -1)
+            {
+                generr(h, "Out of memory");
                 return -1;
             }
-            TRACE("\n\rReceived Code %d Line %d from-h %d", 
-                    h->in[POS_CODE], __LINE__, h->in[0]);
-//            if (h->in[POS_CODE] == 2)
-  //              LOG("\n\rReceived RADIUS ACCEPT (Code = %d)", h->in[POS_CODE]);
-            (*recv_msg_count)++;
-            return h->in[POS_CODE];
+            RAD_TRACE_BEGIN("recvfrom");
+            data_len = rad_net_recvfrom(h->fd, h->stream + h->stream_len,
+                    h->stream_size - h->stream_len, 0, NULL);
+            RAD_TRACE_END("recvfrom");
+            RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+            RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_NET, "Received %lld bytes", data_len);
+            if (data_len == -1)
+                generr(h, "recvfrom: %s", strerror(errno));
+            else if (data_len == 0)
+                generr(h, "Connection closed by the server");
+            else
+            {
+                RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, data_len);
+                h->stream_len += data_len;
+                RAD_TRACE_BEGIN("parse");
+                n = my_rad_frame(h, recv_msg_count);
+                RAD_TRACE_END("parse");
+                if (n != -1)
+                    return n;
+            }
+            /* The stream is of no further use; the next bundle opens another */
+            rad_net_close(h->fd);
+            h->fd = -1;
+            return -1;
         }
         else
         {
-            LOG("\n\r====== RECEIVED UDP MSG FROM SERVER ======");
-            memset(h->in, 0, MSGSIZE);
-            h->in_len=recvfrom(h->fd,h->in,MSGSIZE,0,NULL, NULL);
-            TRACE("\n\rrecvfrom in_len %d\n\r", h->in_len);
+            if (rad_in_reserve(h, MSGSIZE) == -1)
+                return -1;
+            RAD_TRACE_BEGIN("recvfrom");
+            h->in_len=rad_net_recvfrom(h->fd,h->in,MSGSIZE,0,NULL);
+            RAD_TRACE_END("recvfrom");
+            h->idx_valid = 0;
+            RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+            RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_NET, "Received %d bytes", h->in_len);
             if (h->in_len == -1) {
                 generr(h, "recvfrom: %s", strerror(errno));
                 return -1;
             }
             data_len = h->in_len;
-            msg_start = 0;
-            while(msg_start < data_len)
+            RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, data_len);
+            RAD_TRACE_BEGIN("parse");
+            no_msgs = rad_bundle_scan(h->in, data_len, bundle_off, BUNDLE_MAX_MSGS);
+            if (no_msgs < 0)
             {
-                TRACE("\n\r!!!!received code %d Line %d",
-                        h->in[msg_start], __LINE__);
-                if (h->in[msg_start] == 2)
-                    LOG("\n\rReceived RADIUS ACCEPT (Code = %d)", h->in[POS_CODE]);
+                RAD_TRACE_END("parse");
+                RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+                RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO,
+                        "Dropping malformed bundle of %lld bytes", data_len);
+                /* Keep waiting for the replies, or for the time to resend */
+                return 0;
+            }
+            RAD_STAT_ADD(RAD_STAT_RECEIVED, no_msgs);
+            RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_BUNDLE, "UDP bundle of %d replies, %lld bytes",
+                    no_msgs, data_len);
+            for (i = 0; i < no_msgs; i++)
+            {
+                msg_start = bundle_off[i];
                 recvd_pkt_id = h->in[msg_start+1];
-                LOG("\n\rPacket ID %d", recvd_pkt_id);
-                packet_len = (h->in[msg_start + 2] * 256) + h->in[msg_start + 3];
-                LOG("  Packet Len = %d", packet_len);
-                msg_start += packet_len;
-                (*recv_msg_count)++;
+                packet_len = bundle_off[i + 1] - msg_start;
+                RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Reply code %d id %d length %d",
+                        h->in[msg_start], recvd_pkt_id, packet_len);
+                *recv_msg_count += my_rad_reply(h, h->in + msg_start);
             }
-            TRACE("\n\r!!!!received code %d Line %d from-h %d", 
-                    h->in[POS_CODE], __LINE__, h->in[0]);
+            RAD_TRACE_END("parse");
             return h->in[POS_CODE];
         }
     }
@@ -447,7 +601,7 @@ int my_rad_continue_send_request(struct rad_handle *h, long long selected, long
      * would have exited this loop by now.
      */
     cur_srv = h->srv;
-    now = time(NULL);
+    now = rad_net_time();
     if (h->servers[h->srv].num_tries >= h->servers[h->srv].max_tries) {
         /* Set next probe time for this server */
         if (h->servers[h->srv].dead_time) {
@@ -473,72 +627,39 @@ int my_rad_continue_send_request(struct rad_handle *h, long long selected, long
             generr(h, "No valid RADIUS responses received");
             return (-1);
         }
+        RAD_STAT_ADD(RAD_STAT_FAILOVERS, 1);
     }
 
     /* Rebind */
     if (h->bindto != h->servers[h->srv].bindto) {
         h->bindto = h->servers[h->srv].bindto;
-        close(h->fd);
-        if(proto_tcp)
-        {
-            if ((h->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        else
-        {
-            if ((h->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
-                generr(h, "Cannot create socket: %s", strerror(errno));
-                return -1;
-            }
-        }
-        memset(&sin, 0, sizeof sin);
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = h->bindto;
-        sin.sin_port = 0;
-        if (bind(h->fd, (const struct sockaddr *)&sin,
-                    sizeof sin) == -1) {
-            generr(h, "bind: %s", strerror(errno));
-            close(h->fd);
-            h->fd = -1;
-            return (-1);
-        }
-    }
-
-    if (h->out[POS_CODE] == RAD_ACCESS_REQUEST) {
-        /* Insert the scrambled password into the request */
-        if (h->pass_pos != 0)
-            insert_scrambled_password(h, h->srv);
-    }
-    insert_message_authenticator(h, 0);
-
-    if (h->out[POS_CODE] != RAD_ACCESS_REQUEST) {
-        /* Insert the request authenticator into the request */
-        memset(&h->out[POS_AUTH], 0, LEN_AUTH);
-        insert_request_authenticator(h, 0);
-    }
-
-    if(proto_tcp)
-    {
-        TRACE("\n\rconnect called %s\n\r", __FUNCTION__);
-        if(connect(h->fd, (const struct sockaddr *)&h->servers[h->srv].addr,
-                    sizeof h->servers[h->srv].addr) != 0)
-        {
-            LOG("\n\rconnect failed\n\r");
+        if (my_rad_open(h, proto_tcp) == -1)
             return -1;
-        }
     }
 
-    /* Send the request */
-    n = sendto(h->fd, h->out, h->out_len, 0,
-            (const struct sockaddr *)&h->servers[h->srv].addr,
-            sizeof h->servers[h->srv].addr);
-    TRACE("\n\rlen = %llu out_len %d\n\r", n, h->out_len);
-    if (n != h->out_len)
+    /* Resend only the unanswered requests, signed for this server */
+    if (my_rad_rebundle(h) == -1)
+        return -1;
+
+    /* The stream is reused unless the bundle fails over to another server */
+    if (my_rad_connect(h, proto_tcp) == -1)
+        return -1;
+
+    /* Send the bundle again */
+    RAD_TRACE_BEGIN("sendto");
+    n = rad_net_sendto(h->fd, h->req.out, h->req.out_len, 0,
+            &h->servers[h->srv].addr);
+    RAD_TRACE_END("sendto");
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    RAD_STAT_ADD(RAD_STAT_RETRANSMITS, 1);
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_NET, "Sent %lld of %d bytes", n, h->req.out_len);
+    if (n != h->req.out_len)
         tv->tv_sec = 1; /* Do not wait full timeout if send failed. */
     else
+    {
         tv->tv_sec = h->servers[h->srv].timeout;
+        RAD_STAT_ADD(RAD_STAT_BYTES_SENT, n);
+    }
     h->servers[h->srv].num_tries++;
     tv->tv_usec = 0;
     *fd = h->fd;
@@ -546,63 +667,63 @@ int my_rad_continue_send_request(struct rad_handle *h, long long selected, long
     return 0;
 }
 
-/* Send the Message to RADIUS Server */
+/*
+ * Send the Message to RADIUS Server and wait for the replies to all
+ * msg_count requests, sending it again, and failing over to the next
+ * server, each time the timeout passes without them.  Returns the code of
+ * the last reply datagram, or -1 once every server has been tried.
+ */
 int my_rad_send_request(struct rad_handle *h, unsigned char *msg, long long len, 
                         uint proto_tcp, long long msg_count)
 {
-    struct timeval timelimit;
     struct timeval tv;
+    u_int64_t deadline, now;
     long long fd;
     long long n;
     long long reply_recvd = 0;
 
     n = my_rad_add_send_request(h, msg, len, &fd, &tv, proto_tcp);
     if (n != 0)
+    {
+        my_rad_release(h);
         return n;
-
-    gettimeofday(&timelimit, NULL);
-    timeradd(&tv, &timelimit, &timelimit);
+    }
+    deadline = rad_net_now() + tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
 
     for ( ; ; ) {
-        fd_set readfds;
-
-        FD_ZERO(&readfds);
-        FD_SET(fd, &readfds);
-
-        n = select(fd + 1, &readfds, NULL, NULL, &tv);
+        now = rad_net_now();
+        RAD_TRACE_BEGIN("wait");
+        n = now < deadline ? rad_net_wait(fd, deadline - now) : 0;
+        RAD_TRACE_END("wait");
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
 
         if (n == -1) {
-            generr(h, "select: %s", strerror(errno));
-            LOG("\n\rselect: %s\n\r", strerror(errno));
-            return -1;
-        }
-
-        if (!FD_ISSET(fd, &readfds)) 
-        {
-            /* Compute a new timeout */
-            gettimeofday(&tv, NULL);
-            timersub(&timelimit, &tv, &tv);
-            if (tv.tv_sec > 0 || (tv.tv_sec == 0 && tv.tv_usec > 0))
-            {
-                LOG("\n\rcontinue the select\n\r");
-                /* Continue the select */
+            if (errno == EINTR)
                 continue;
-            }
+            generr(h, "wait: %s", strerror(errno));
+            RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "wait: %s", strerror(errno));
+            break;
         }
 
-        reply_recvd = 0;
-        while(reply_recvd < msg_count)
+        if (n == 0)
         {
-            n = my_rad_continue_send_request(h, n, &fd, &tv, proto_tcp, 
+            /* Timed out: send the bundle again, to the next server if need be */
+            RAD_STAT_ADD(RAD_STAT_TIMEOUTS, 1);
+            n = my_rad_continue_send_request(h, 0, &fd, &tv, proto_tcp,
                     msg_count, &reply_recvd);
-            //            reply_recvd++;
-            LOG("\n\rMessage count - %llu\n\r", reply_recvd);
+            if (n != 0)
+                break;
+            deadline = rad_net_now() + tv.tv_sec * 1000000000ULL +
+                tv.tv_usec * 1000ULL;
+            continue;
         }
 
-        if (n != 0)
-            return n;
-
-        gettimeofday(&timelimit, NULL);
-        timeradd(&tv, &timelimit, &timelimit);
+        n = my_rad_continue_send_request(h, 1, &fd, &tv, proto_tcp,
+                msg_count, &reply_recvd);
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_GENERAL, "Message count %lld", reply_recvd);
+        if (n == -1 || reply_recvd >= msg_count)
+            break;
     }
+    my_rad_release(h);
+    return n;
 }
@@ -58,33 +58,63 @@
 #include <stdbool.h>
 
 #include "include/radlib_private.h"
+#include "include/radlib_trace.h"
 
 #ifndef __printflike
 #define __printflike(m, n) __attribute__((format(printf, m, n)));
 #endif
 
-static void	 clear_password(struct rad_handle *);
+#if defined(WITH_SSL) && OPENSSL_VERSION_NUMBER < 0x10100000L
+/* HMAC_CTX is opaque from OpenSSL 1.1 on; allocate it the same way before */
+static HMAC_CTX *
+HMAC_CTX_new(void)
+{
+	HMAC_CTX *ctx;
+
+	if ((ctx = malloc(sizeof *ctx)) != NULL)
+		HMAC_CTX_init(ctx);
+	return ctx;
+}
+
+static void
+HMAC_CTX_free(HMAC_CTX *ctx)
+{
+	if (ctx != NULL) {
+		HMAC_CTX_cleanup(ctx);
+		free(ctx);
+	}
+}
+#endif
+
+static int	 check_request(struct rad_request *);
+static void	 clear_password(struct rad_request *);
+static const char *peer_secret(struct rad_handle *, size_t *);
 void	 generr(struct rad_handle *, const char *, ...)
 		    __printflike(2, 3);
-void	 insert_scrambled_password(struct rad_handle *, int);
-void	 insert_request_authenticator(struct rad_handle *, int);
-void	 insert_message_authenticator(struct rad_handle *, int);
+void	 insert_scrambled_password(struct rad_request *, int);
+void	 insert_request_authenticator(struct rad_request *, int);
+void	 insert_message_authenticator(struct rad_request *, int);
 static int	 is_valid_response(struct rad_handle *, int,
 		    const struct sockaddr_in *);
-static int	 put_password_attr(struct rad_handle *, int,
+static int	 put_password_attr(struct rad_request *, int,
 		    const void *, size_t);
-static int	 put_raw_attr(struct rad_handle *, int,
+static int	 put_raw_attr(struct rad_request *, int,
 		    const void *, size_t);
+static int	 can_create_request(struct rad_handle *);
+static int	 req_init(struct rad_request *, int);
+static void	 sign_request(struct rad_request *);
 static int	 split(char *, char *[], int, char *, size_t);
+static void	*alloc_result(struct rad_arena *, size_t);
+static void	 close_vendor(struct rad_request *);
 
 static void
-clear_password(struct rad_handle *h)
+clear_password(struct rad_request *r)
 {
-	if (h->pass_len != 0) {
-		memset(h->pass, 0, h->pass_len);
-		h->pass_len = 0;
+	if (r->pass_len != 0) {
+		memset(r->pass, 0, r->pass_len);
+		r->pass_len = 0;
 	}
-	h->pass_pos = 0;
+	r->pass_pos = 0;
 }
 
 void
@@ -97,8 +127,57 @@ generr(struct rad_handle *h, const char *format, ...)
 	va_end(ap);
 }
 
+/* Memory for a decoded value, from the arena if one is given */
+static void *
+alloc_result(struct rad_arena *a, size_t size)
+{
+	return a == NULL ? malloc(size) : rad_arena_alloc(a, size);
+}
+
+/*
+ * Shared secret of the current server or, for server handles, of the
+ * client whose request is being answered.
+ */
+static const char *
+peer_secret(struct rad_handle *h, size_t *len)
+{
+	if (h->type == RADIUS_SERVER)
+		return rad_client_secret(h->client, len);
+	*len = strlen(h->servers[h->srv].secret);
+	return h->servers[h->srv].secret;
+}
+
+/*
+ * Make sure the request buffer holds size bytes, keeping what has been
+ * built so far.
+ */
+int
+rad_out_reserve(struct rad_request *r, size_t size)
+{
+	if (rad_buf_reserve(&r->out, &r->out_size, size, r->out_len) == -1) {
+		generr(r->h, "Out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make sure the receive buffer holds size bytes.  Its contents are lost,
+ * along with what was decoded from them into the handle's arena.
+ */
+int
+rad_in_reserve(struct rad_handle *h, size_t size)
+{
+	rad_arena_reset(&h->in_arena);
+	if (rad_buf_reserve(&h->in, &h->in_size, size, 0) == -1) {
+		generr(h, "Out of memory");
+		return -1;
+	}
+	return 0;
+}
+
 void
-insert_scrambled_password(struct rad_handle *h, int srv)
+insert_scrambled_password(struct rad_request *r, int srv)
 {
 	MD5_CTX ctx;
 	unsigned char md5[MD5_DIGEST_LENGTH];
@@ -106,10 +185,10 @@ insert_scrambled_password(struct rad_handle *h, int srv)
 	int padded_len;
 	int pos;
 
-	srvp = &h->servers[srv];
-	padded_len = h->pass_len == 0 ? 16 : (h->pass_len+15) & ~0xf;
+	srvp = &r->h->servers[srv];
+	padded_len = r->pass_len == 0 ? 16 : (r->pass_len+15) & ~0xf;
 
-	memcpy(md5, &h->out[POS_AUTH], LEN_AUTH);
+	memcpy(md5, &r->out[POS_AUTH], LEN_AUTH);
 	for (pos = 0;  pos < padded_len;  pos += 16) {
 		int i;
 
@@ -126,55 +205,67 @@ insert_scrambled_password(struct rad_handle *h, int srv)
 		 * in calculating the scrambler for next time.
 		 */
 		for (i = 0;  i < 16;  i++)
-			h->out[h->pass_pos + pos + i] =
-			    md5[i] ^= h->pass[pos + i];
+			r->out[r->pass_pos + pos + i] =
+			    md5[i] ^= r->pass[pos + i];
 	}
 }
 
 void
-insert_request_authenticator(struct rad_handle *h, int resp)
+insert_request_authenticator(struct rad_request *r, int resp)
 {
+	struct rad_handle *h = r->h;
 	MD5_CTX ctx;
-	const struct rad_server *srvp;
+	const char *secret;
+	size_t secret_len;
 
-	srvp = &h->servers[h->srv];
+	secret = peer_secret(h, &secret_len);
 
 	/* Create the request authenticator */
 	MD5_Init(&ctx);
-	MD5_Update(&ctx, &h->out[POS_CODE], POS_AUTH - POS_CODE);
+	MD5_Update(&ctx, &r->out[POS_CODE], POS_AUTH - POS_CODE);
 	if (resp)
 	    MD5_Update(&ctx, &h->in[POS_AUTH], LEN_AUTH);
 	else
-	    MD5_Update(&ctx, &h->out[POS_AUTH], LEN_AUTH);
-	MD5_Update(&ctx, &h->out[POS_ATTRS], h->out_len - POS_ATTRS);
-	MD5_Update(&ctx, srvp->secret, strlen(srvp->secret));
-	MD5_Final(&h->out[POS_AUTH], &ctx);
+	    MD5_Update(&ctx, &r->out[POS_AUTH], LEN_AUTH);
+	MD5_Update(&ctx, &r->out[POS_ATTRS], r->out_len - POS_ATTRS);
+	MD5_Update(&ctx, secret, secret_len);
+	MD5_Final(&r->out[POS_AUTH], &ctx);
 }
 
 void
-insert_message_authenticator(struct rad_handle *h, int resp)
+insert_message_authenticator(struct rad_request *r, int resp)
 {
+	struct rad_handle *h = r->h;
+
+	/* Server handles have the keyed HMAC state of each client */
+	if (h->type == RADIUS_SERVER) {
+		if (r->authentic_pos != 0)
+			rad_client_hmac(h->client, &r->out[POS_CODE],
+			    resp ? &h->in[POS_AUTH] : &r->out[POS_AUTH],
+			    &r->out[POS_ATTRS], r->out_len - POS_ATTRS,
+			    &r->out[r->authentic_pos + 2]);
+		return;
+	}
 #ifdef WITH_SSL
 	u_char md[EVP_MAX_MD_SIZE];
 	u_int md_len;
 	const struct rad_server *srvp;
-	HMAC_CTX ctx;
+	HMAC_CTX *ctx;
 	srvp = &h->servers[h->srv];
 
-	if (h->authentic_pos != 0) {
-		HMAC_CTX_init(&ctx);
-		HMAC_Init(&ctx, srvp->secret, strlen(srvp->secret), EVP_md5());
-		HMAC_Update(&ctx, &h->out[POS_CODE], POS_AUTH - POS_CODE);
+	if (r->authentic_pos != 0 && (ctx = HMAC_CTX_new()) != NULL) {
+		HMAC_Init_ex(ctx, srvp->secret, strlen(srvp->secret),
+		    EVP_md5(), NULL);
+		HMAC_Update(ctx, &r->out[POS_CODE], POS_AUTH - POS_CODE);
 		if (resp)
-		    HMAC_Update(&ctx, &h->in[POS_AUTH], LEN_AUTH);
+		    HMAC_Update(ctx, &h->in[POS_AUTH], LEN_AUTH);
 		else
-		    HMAC_Update(&ctx, &h->out[POS_AUTH], LEN_AUTH);
-		HMAC_Update(&ctx, &h->out[POS_ATTRS],
-		    h->out_len - POS_ATTRS);
-		HMAC_Final(&ctx, md, &md_len);
-		HMAC_CTX_cleanup(&ctx);
-		HMAC_cleanup(&ctx);
-		memcpy(&h->out[h->authentic_pos + 2], md, md_len);
+		    HMAC_Update(ctx, &r->out[POS_AUTH], LEN_AUTH);
+		HMAC_Update(ctx, &r->out[POS_ATTRS],
+		    r->out_len - POS_ATTRS);
+		HMAC_Final(ctx, md, &md_len);
+		HMAC_CTX_free(ctx);
+		memcpy(&r->out[r->authentic_pos + 2], md, md_len);
 	}
 #endif
 }
@@ -192,7 +283,7 @@ is_valid_response(struct rad_handle *h, int srv,
 	const struct rad_server *srvp;
 	int len;
 #ifdef WITH_SSL
-	HMAC_CTX hctx;
+	HMAC_CTX *hctx;
 	u_char resp[MSGSIZE], md[EVP_MAX_MD_SIZE];
 	u_int md_len;
 	int pos;
@@ -210,13 +301,13 @@ is_valid_response(struct rad_handle *h, int srv,
 	if (h->in_len < POS_ATTRS)
 		return 0;
 	len = h->in[POS_LENGTH] << 8 | h->in[POS_LENGTH+1];
-	if (len > h->in_len)
+	if (len < POS_ATTRS || len > h->in_len)
 		return 0;
 
 	/* Check the response authenticator */
 	MD5_Init(&ctx);
 	MD5_Update(&ctx, &h->in[POS_CODE], POS_AUTH - POS_CODE);
-	MD5_Update(&ctx, &h->out[POS_AUTH], LEN_AUTH);
+	MD5_Update(&ctx, &h->req.out[POS_AUTH], LEN_AUTH);
 	MD5_Update(&ctx, &h->in[POS_ATTRS], len - POS_ATTRS);
 	MD5_Update(&ctx, srvp->secret, strlen(srvp->secret));
 	MD5_Final(md5, &ctx);
@@ -230,7 +321,7 @@ is_valid_response(struct rad_handle *h, int srv,
 	 */
 	if (h->in[POS_CODE] != RAD_ACCOUNTING_RESPONSE) {
 
-		memcpy(resp, h->in, MSGSIZE);
+		memcpy(resp, h->in, h->in_len);
 		pos = POS_ATTRS;
 
 		/* Search and verify the Message-Authenticator */
@@ -240,18 +331,18 @@ is_valid_response(struct rad_handle *h, int srv,
 				/* zero fill the Message-Authenticator */
 				memset(&resp[pos + 2], 0, MD5_DIGEST_LENGTH);
 
-				HMAC_CTX_init(&hctx);
-				HMAC_Init(&hctx, srvp->secret,
-				    strlen(srvp->secret), EVP_md5());
-				HMAC_Update(&hctx, &h->in[POS_CODE],
+				if ((hctx = HMAC_CTX_new()) == NULL)
+					return 0;
+				HMAC_Init_ex(hctx, srvp->secret,
+				    strlen(srvp->secret), EVP_md5(), NULL);
+				HMAC_Update(hctx, &h->in[POS_CODE],
 				    POS_AUTH - POS_CODE);
-				HMAC_Update(&hctx, &h->out[POS_AUTH],
+				HMAC_Update(hctx, &h->req.out[POS_AUTH],
 				    LEN_AUTH);
-				HMAC_Update(&hctx, &resp[POS_ATTRS],
+				HMAC_Update(hctx, &resp[POS_ATTRS],
 				    h->in_len - POS_ATTRS);
-				HMAC_Final(&hctx, md, &md_len);
-				HMAC_CTX_cleanup(&hctx);
-				HMAC_cleanup(&hctx);
+				HMAC_Final(hctx, md, &md_len);
+				HMAC_CTX_free(hctx);
 				if (memcmp(md, &h->in[pos + 2],
 				    MD5_DIGEST_LENGTH) != 0)
 					return 0;
@@ -272,22 +363,18 @@ is_valid_request(struct rad_handle *h)
 {
 	MD5_CTX ctx;
 	unsigned char md5[MD5_DIGEST_LENGTH];
-	const struct rad_server *srvp;
-	int len;
-#ifdef WITH_SSL
-	HMAC_CTX hctx;
-	u_char resp[MSGSIZE], md[EVP_MAX_MD_SIZE];
-	u_int md_len;
-	int pos;
-#endif
+	u_char resp[MSGSIZE];
+	const char *secret;
+	size_t secret_len;
+	int len, pos;
 
-	srvp = &h->servers[h->srv];
+	secret = peer_secret(h, &secret_len);
 
 	/* Check the message length */
 	if (h->in_len < POS_ATTRS)
 		return (0);
 	len = h->in[POS_LENGTH] << 8 | h->in[POS_LENGTH+1];
-	if (len > h->in_len)
+	if (len < POS_ATTRS || len > h->in_len)
 		return (0);
 
 	if (h->in[POS_CODE] != RAD_ACCESS_REQUEST) {
@@ -297,51 +384,51 @@ is_valid_request(struct rad_handle *h)
 		MD5_Update(&ctx, &h->in[POS_CODE], POS_AUTH - POS_CODE);
 		MD5_Update(&ctx, (char*)zeroes, LEN_AUTH);
 		MD5_Update(&ctx, &h->in[POS_ATTRS], len - POS_ATTRS);
-		MD5_Update(&ctx, srvp->secret, strlen(srvp->secret));
+		MD5_Update(&ctx, secret, secret_len);
 		MD5_Final(md5, &ctx);
 		if (memcmp(&h->in[POS_AUTH], md5, sizeof md5) != 0) {
 			return (0);
 		}
 	}
 
-#ifdef WITH_SSL
 	/* Search and verify the Message-Authenticator */
 	pos = POS_ATTRS;
 	while (pos < len - 2) {
 		if (h->in[pos] == RAD_MESSAGE_AUTHENTIC) {
-			memcpy(resp, h->in, MSGSIZE);
+			if (pos + 2 + MD5_DIGEST_LENGTH > len)
+				return (0);
+			memcpy(resp, h->in, len);
+			RAD_STAT_ADD(RAD_STAT_COPIED, len);
 			/* zero fill the Request-Authenticator */
 			if (h->in[POS_CODE] != RAD_ACCESS_REQUEST)
 				memset(&resp[POS_AUTH], 0, LEN_AUTH);
 			/* zero fill the Message-Authenticator */
 			memset(&resp[pos + 2], 0, MD5_DIGEST_LENGTH);
 
-			HMAC_CTX_init(&hctx);
-			HMAC_Init(&hctx, srvp->secret,
-			    strlen(srvp->secret), EVP_md5());
-			HMAC_Update(&hctx, resp, h->in_len);
-			HMAC_Final(&hctx, md, &md_len);
-			HMAC_CTX_cleanup(&hctx);
-			HMAC_cleanup(&hctx);
-			if (memcmp(md, &h->in[pos + 2],
+			rad_client_hmac(h->client, &resp[POS_CODE],
+			    &resp[POS_AUTH], &resp[POS_ATTRS],
+			    len - POS_ATTRS, md5);
+			if (memcmp(md5, &h->in[pos + 2],
 			    MD5_DIGEST_LENGTH) != 0)
 				return (0);
 			break;
 		}
+		if (h->in[pos + 1] < 2)
+			return (0);
 		pos += h->in[pos + 1];
 	}
-#endif
 	return (1);
 }
 
 static int
-put_password_attr(struct rad_handle *h, int type, const void *value, size_t len)
+put_password_attr(struct rad_request *r, int type, const void *value,
+    size_t len)
 {
 	int padded_len;
 	int pad_len;
 
-	if (h->pass_pos != 0) {
-		generr(h, "Multiple User-Password attributes specified");
+	if (r->pass_pos != 0) {
+		generr(r->h, "Multiple User-Password attributes specified");
 		return -1;
 	}
 	if (len > PASSSIZE)
@@ -353,32 +440,44 @@ put_password_attr(struct rad_handle *h, int type, const void *value, size_t len)
 	 * Put in a place-holder attribute containing all zeros, and
 	 * remember where it is so we can fill it in later.
 	 */
-	clear_password(h);
-	put_raw_attr(h, type, h->pass, padded_len);
-	h->pass_pos = h->out_len - padded_len;
+	clear_password(r);
+	if (put_raw_attr(r, type, r->pass, padded_len) == -1)
+		return -1;
+	r->pass_pos = r->out_len - padded_len;
 
 	/* Save the cleartext password, padded as necessary */
-	memcpy(h->pass, value, len);
-	h->pass_len = len;
-	memset(h->pass + len, 0, pad_len);
+	memcpy(r->pass, value, len);
+	r->pass_len = len;
+	memset(r->pass + len, 0, pad_len);
 	return 0;
 }
 
+/* Stop adding to a Vendor-Specific attribute */
+static void
+close_vendor(struct rad_request *r)
+{
+	r->vsa_pos = 0;
+	r->vsa_packing = 0;
+}
+
 static int
-put_raw_attr(struct rad_handle *h, int type, const void *value, size_t len)
+put_raw_attr(struct rad_request *r, int type, const void *value, size_t len)
 {
+	close_vendor(r);
 	if (len > 253) {
-		generr(h, "Attribute too long");
+		generr(r->h, "Attribute too long");
 		return -1;
 	}
-	if (h->out_len + 2 + len > MSGSIZE) {
-		generr(h, "Maximum message length exceeded");
+	if (r->out_len + 2 + len > MSGSIZE) {
+		generr(r->h, "Maximum message length exceeded");
 		return -1;
 	}
-	h->out[h->out_len++] = type;
-	h->out[h->out_len++] = len + 2;
-	memcpy(&h->out[h->out_len], value, len);
-	h->out_len += len;
+	if (rad_out_reserve(r, r->out_len + 2 + len) == -1)
+		return -1;
+	r->out[r->out_len++] = type;
+	r->out[r->out_len++] = len + 2;
+	memcpy(&r->out[r->out_len], value, len);
+	r->out_len += len;
 	return 0;
 }
 
@@ -400,6 +499,10 @@ rad_add_server_ex(struct rad_handle *h, const char *host, int port,
 {
 	struct rad_server *srvp;
 
+	/* Servers list the clients they answer instead */
+	if (h->type == RADIUS_SERVER)
+		return rad_add_client(h, host, secret);
+
 	if (h->num_servers >= MAXSERVERS) {
 		generr(h, "Too many RADIUS servers specified");
 		return -1;
@@ -459,10 +562,142 @@ rad_close(struct rad_handle *h)
 		    strlen(h->servers[srv].secret));
 		free(h->servers[srv].secret);
 	}
-	clear_password(h);
+	if (h->clients != NULL)
+		rad_client_table_destroy(h->clients);
+	rad_index_free(h->idx);
+	rad_req_slabs_free(h);
+	rad_arena_free(&h->req.arena);
+	rad_arena_free(&h->in_arena);
+	rad_buf_put(h->req.out, h->req.out_size);
+	rad_buf_put(h->in, h->in_size);
+	rad_buf_put(h->stream, h->stream_size);
+	free(h->pending);
+	clear_password(&h->req);
 	free(h);
 }
 
+/*
+ * Add a client to a server handle.  The client is given as a host name,
+ * an address or a network in CIDR notation; requests from an address
+ * covered by several entries use the one with the longest prefix.
+ */
+int
+rad_add_client(struct rad_handle *h, const char *net, const char *secret)
+{
+	struct in_addr addr;
+	char host[256];
+	const char *slash;
+	char *end;
+	long prefix;
+	int len;
+
+	if (h->type != RADIUS_SERVER) {
+		generr(h, "denied function call");
+		return -1;
+	}
+	prefix = 32;
+	len = strlen(net);
+	if ((slash = strchr(net, '/')) != NULL) {
+		prefix = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || prefix < 0 ||
+		    prefix > 32) {
+			generr(h, "%s: invalid prefix length", net);
+			return -1;
+		}
+		len = slash - net;
+	}
+	if (len >= (int)sizeof host) {
+		generr(h, "%s: host name too long", net);
+		return -1;
+	}
+	memcpy(host, net, len);
+	host[len] = '\0';
+
+	if (!inet_aton(host, &addr)) {
+		struct hostent *hent;
+
+		if ((hent = gethostbyname(host)) == NULL) {
+			generr(h, "%s: host not found", host);
+			return -1;
+		}
+		memcpy(&addr, hent->h_addr, sizeof addr);
+	}
+	if (h->clients == NULL &&
+	    (h->clients = rad_client_table_create()) == NULL) {
+		generr(h, "Out of memory");
+		return -1;
+	}
+	if (rad_client_table_add(h->clients, addr, prefix, secret) == -1) {
+		generr(h, "Out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Read the clients of a server handle from a file with one
+ * "address[/prefix] secret" entry per line.
+ */
+int
+rad_load_clients(struct rad_handle *h, const char *path)
+{
+	FILE *fp;
+	char buf[MAXCONFLINE];
+	char *fields[2];
+	char msg[ERRSIZE];
+	int linenum;
+	int nfields;
+	int retval;
+	int len;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		generr(h, "Cannot open \"%s\": %s", path, strerror(errno));
+		return -1;
+	}
+	retval = 0;
+	linenum = 0;
+	while (fgets(buf, sizeof buf, fp) != NULL) {
+		linenum++;
+		len = strlen(buf);
+		if (buf[len - 1] != '\n') {
+			if (len == sizeof buf - 1)
+				generr(h, "%s:%d: line too long", path,
+				    linenum);
+			else
+				generr(h, "%s:%d: missing newline", path,
+				    linenum);
+			retval = -1;
+			break;
+		}
+		buf[len - 1] = '\0';
+
+		nfields = split(buf, fields, 2, msg, sizeof msg);
+		if (nfields == -1) {
+			generr(h, "%s:%d: %s", path, linenum, msg);
+			retval = -1;
+			break;
+		}
+		if (nfields == 0)
+			continue;
+		if (nfields < 2) {
+			generr(h, "%s:%d: missing shared secret", path,
+			    linenum);
+			retval = -1;
+			break;
+		}
+		if (rad_add_client(h, fields[0], fields[1]) == -1) {
+			strcpy(msg, h->errmsg);
+			generr(h, "%s:%d: %s", path, linenum, msg);
+			retval = -1;
+			break;
+		}
+	}
+	/* Clear out the buffer to wipe a possible copy of a shared secret */
+	memset(buf, 0, sizeof buf);
+	fclose(fp);
+	return retval;
+}
+
 void
 rad_bind_to(struct rad_handle *h, in_addr_t addr)
 {
@@ -658,18 +893,24 @@ rad_continue_send_request(struct rad_handle *h, int selected, int *fd,
 	struct sockaddr_in sin;
 	if (selected) {
         TRACE("\n\rselected is set\n\r");
-		struct sockaddr_in from;
-		socklen_t fromlen;
-
-		fromlen = sizeof from;
+		if (rad_in_reserve(h, MSGSIZE) == -1)
+			return -1;
+		RAD_TRACE_BEGIN("recvfrom");
         h->in_len=recvfrom(h->fd,h->in,MSGSIZE,0,NULL, NULL);
+		RAD_TRACE_END("recvfrom");
+        h->idx_valid = 0;
+		RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
 
         TRACE("\n\rrecvfrom in_len %d\n\r", h->in_len);
 		if (h->in_len == -1) {
 			generr(h, "recvfrom: %s", strerror(errno));
 			return -1;
 		}
+		RAD_STAT_ADD(RAD_STAT_RECEIVED, 1);
+		RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, h->in_len);
+		rad_req_received(&h->req);
             TRACE("\n\r!!!!received code %d\n\r", h->in[POS_CODE]);
+		rad_req_complete(&h->req, h->in[POS_CODE]);
 			return h->in[POS_CODE];
 	}
 
@@ -705,6 +946,7 @@ rad_continue_send_request(struct rad_handle *h, int selected, int *fd,
 			generr(h, "No valid RADIUS responses received");
 			return (-1);
 		}
+		RAD_STAT_ADD(RAD_STAT_FAILOVERS, 1);
 	}
 
 	/* Rebind */
@@ -728,36 +970,39 @@ rad_continue_send_request(struct rad_handle *h, int selected, int *fd,
 		}
 	}
 
-	if (h->out[POS_CODE] == RAD_ACCESS_REQUEST) {
-		/* Insert the scrambled password into the request */
-		if (h->pass_pos != 0)
-			insert_scrambled_password(h, h->srv);
-	}
-	insert_message_authenticator(h, 0);
-
-	if (h->out[POS_CODE] != RAD_ACCESS_REQUEST) {
-		/* Insert the request authenticator into the request */
-		memset(&h->out[POS_AUTH], 0, LEN_AUTH);
-		insert_request_authenticator(h, 0);
-	}
+	RAD_TRACE_BEGIN("encode");
+	sign_request(&h->req);
+	RAD_TRACE_END("encode");
 
     TRACE("\n\rconnect called\n\r");
+	RAD_TRACE_BEGIN("connect");
     if(connect(h->fd, (const struct sockaddr *)&h->servers[h->srv].addr,
             sizeof h->servers[h->srv].addr) != 0)
     {
         TRACE("\n\rconnect failed\n\r");
+		RAD_TRACE_END("connect");
         return -1;
     }
+	RAD_TRACE_END("connect");
 
 	/* Send the request */
-	n = sendto(h->fd, h->out, h->out_len, 0,
+	if (h->servers[h->srv].num_tries > 0)
+		RAD_STAT_ADD(RAD_STAT_RETRANSMITS, 1);
+	RAD_TRACE_BEGIN("sendto");
+	n = sendto(h->fd, h->req.out, h->req.out_len, 0,
 	    (const struct sockaddr *)&h->servers[h->srv].addr,
 	    sizeof h->servers[h->srv].addr);
-    TRACE("\n\rlen = %d out_len %d\n\r", n, h->out_len);
-	if (n != h->out_len)
+	RAD_TRACE_END("sendto");
+	RAD_STAT_ADD(RAD_STAT_SYSCALLS, 2);	/* connect() and sendto() */
+	if (n > 0)
+		RAD_STAT_ADD(RAD_STAT_BYTES_SENT, n);
+    TRACE("\n\rlen = %d out_len %d\n\r", n, h->req.out_len);
+	if (n != h->req.out_len)
 		tv->tv_sec = 1; /* Do not wait full timeout if send failed. */
-	else
+	else {
 		tv->tv_sec = h->servers[h->srv].timeout;
+		rad_req_sent(&h->req, 1);
+	}
 	h->servers[h->srv].num_tries++;
 	tv->tv_usec = 0;
 	*fd = h->fd;
@@ -765,64 +1010,195 @@ rad_continue_send_request(struct rad_handle *h, int selected, int *fd,
 	return 0;
 }
 
+/*
+ * Receive a request and validate it.  Returns the request code, -1 on a
+ * receive error, -2 if the sender is not a known client and -3 if the
+ * request is not valid.  With a duplicate cache, -4 is returned for a
+ * retransmission; the cached response, if any, has been sent again and
+ * the caller must not respond to it.
+ */
 int
 rad_receive_request(struct rad_handle *h)
 {
 	struct sockaddr_in from;
 	socklen_t fromlen;
-	int n;
+	ssize_t n;
+	int ret;
 
 	if (h->type != RADIUS_SERVER) {
 		generr(h, "denied function call");
 		return (-1);
 	}
-	h->srv = -1;
+	if (rad_in_reserve(h, MSGSIZE) == -1)
+		return (-1);
 	fromlen = sizeof(from);
-    h->in_len=recvfrom(h->fd,h->in,MSGSIZE,0,NULL,NULL);
-	if (h->in_len == -1) {
+	RAD_TRACE_BEGIN("recvfrom");
+	n = recvfrom(h->fd, h->in, MSGSIZE, 0, (struct sockaddr *)&from,
+	    &fromlen);
+	RAD_TRACE_END("recvfrom");
+	RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+	if (n == -1) {
 		generr(h, "recvfrom: %s", strerror(errno));
 		return (-1);
 	}
-	for (n = 0; n < h->num_servers; n++) {
-		if (h->servers[n].addr.sin_addr.s_addr == from.sin_addr.s_addr) {
-			h->servers[n].addr.sin_port = from.sin_port;
-			h->srv = n;
-			break;
+	RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, n);
+	if ((ret = rad_load_request(h, h->in, n, &from)) == -4) {
+		if (h->req.out_len > 0) {
+			sendto(h->fd, h->req.out, h->req.out_len, 0,
+			    (const struct sockaddr *)&from, sizeof from);
+			RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+			RAD_STAT_ADD(RAD_STAT_BYTES_SENT, h->req.out_len);
 		}
+		return (-4);
+	}
+	if (ret == -1)
+		return (-3);
+	if (ret != 0)
+		return (ret);
+	return (rad_validate_request(h));
+}
+
+/*
+ * Load a request received by the caller into the handle.  This is the
+ * decode half of rad_receive_request() for servers that do their own
+ * socket I/O, e.g. to walk a bundle of requests.  Returns 0 on success,
+ * -1 on a malformed message and -2 if the sender is not a known client.
+ *
+ * With a duplicate cache set, -4 is returned for a retransmission of a
+ * request seen before; h->req.out then holds the response sent to the
+ * original, or h->req.out_len is 0 if there is nothing to send.
+ */
+int
+rad_load_request(struct rad_handle *h, const void *buf, size_t len,
+    const struct sockaddr_in *from)
+{
+	size_t dlen;
+	int ret;
+
+	if (h->type != RADIUS_SERVER) {
+		generr(h, "denied function call");
+		return (-1);
+	}
+	if (len < POS_ATTRS || len > MSGSIZE) {
+		generr(h, "Malformed request length %zu", len);
+		return (-1);
 	}
-	if (h->srv == -1)
+	h->client = rad_client_table_lookup(h->clients, from->sin_addr);
+	if (h->client == NULL) {
+		generr(h, "Request from unknown client %s",
+		    inet_ntoa(from->sin_addr));
 		return (-2);
-	if (is_valid_request(h)) {
+	}
+	h->peer = *from;
+	RAD_STAT_ADD(RAD_STAT_RECEIVED, 1);
+	if (buf != h->in) {
+		if (rad_in_reserve(h, len) == -1)
+			return (-1);
+		memcpy(h->in, buf, len);
+		RAD_STAT_ADD(RAD_STAT_COPIED, len);
+	}
+	h->in_len = len;
+	h->idx_valid = 0;
+
+	if (h->dup != NULL) {
+		/* The previous request was never answered */
+		if (h->dup_pending)
+			rad_dup_cache_store(h->dup, &h->dup_key, NULL, 0);
+		h->dup_pending = 0;
+		h->dup_key.addr = from->sin_addr.s_addr;
+		h->dup_key.port = from->sin_port;
+		h->dup_key.ident = h->in[POS_IDENT];
+		memcpy(h->dup_key.auth, &h->in[POS_AUTH], LEN_AUTH);
+		dlen = h->req.out_size;
+		while ((ret = rad_dup_cache_lookup(h->dup, &h->dup_key,
+		    h->req.out, h->req.out_size, &dlen)) == -1) {
+			/* dlen is the size of the cached response */
+			if (rad_out_reserve(&h->req, dlen) == -1)
+				return (-1);
+		}
+		switch (ret) {
+		case RAD_DUP_NEW:
+			h->dup_pending = 1;
+			break;
+		case RAD_DUP_CACHED:
+			h->req.out_len = dlen;
+			return (-4);
+		default:
+			h->req.out_len = 0;
+			return (-4);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Validate a request loaded with rad_load_request() and prepare it for
+ * rad_get_attr().  Returns the request code, or -3 if it is not valid.
+ */
+int
+rad_validate_request(struct rad_handle *h)
+{
+	int valid;
+
+	RAD_TRACE_BEGIN("validate");
+	valid = is_valid_request(h);
+	RAD_TRACE_END("validate");
+	if (valid) {
 		h->in_len = h->in[POS_LENGTH] << 8 |
 		    h->in[POS_LENGTH+1];
 		h->in_pos = POS_ATTRS;
 		return (h->in[POS_CODE]);
 	}
+	RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+	generr(h, "Invalid request authenticator");
 	return (-3);
 }
 
+/*
+ * Fill in the length and authenticators of the response built with
+ * rad_create_response(), leaving it in the handle for the caller to send.
+ * With a duplicate cache, a caller that sends the response itself stores
+ * it there once it is sent; until then retransmissions are dropped.
+ */
 int
-rad_send_response(struct rad_handle *h)
+rad_encode_response(struct rad_handle *h)
 {
-	int n;
-
 	if (h->type != RADIUS_SERVER) {
 		generr(h, "denied function call");
 		return (-1);
 	}
 	/* Fill in the length field in the message */
-	h->out[POS_LENGTH] = h->out_len >> 8;
-	h->out[POS_LENGTH+1] = h->out_len;
+	h->req.out[POS_LENGTH] = h->req.out_len >> 8;
+	h->req.out[POS_LENGTH+1] = h->req.out_len;
 
-	insert_message_authenticator(h,
+	RAD_TRACE_BEGIN("encode");
+	insert_message_authenticator(&h->req,
 	    (h->in[POS_CODE] == RAD_ACCESS_REQUEST) ? 1 : 0);
-	insert_request_authenticator(h, 1);
+	insert_request_authenticator(&h->req, 1);
+	RAD_TRACE_END("encode");
+	return 0;
+}
+
+int
+rad_send_response(struct rad_handle *h)
+{
+	int n;
+
+	if (rad_encode_response(h) == -1)
+		return -1;
 
 	/* Send the request */
-	n = sendto(h->fd, h->out, h->out_len, 0,
-	    (const struct sockaddr *)&h->servers[h->srv].addr,
-	    sizeof h->servers[h->srv].addr);
-	if (n != h->out_len) {
+	n = sendto(h->fd, h->req.out, h->req.out_len, 0,
+	    (const struct sockaddr *)&h->peer, sizeof h->peer);
+	RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+	if (n > 0)
+		RAD_STAT_ADD(RAD_STAT_BYTES_SENT, n);
+	if (h->dup_pending) {
+		rad_dup_cache_store(h->dup, &h->dup_key, h->req.out,
+		    h->req.out_len);
+		h->dup_pending = 0;
+	}
+	if (n != h->req.out_len) {
 		if (n == -1)
 			generr(h, "sendto: %s", strerror(errno));
 		else
@@ -833,38 +1209,91 @@ rad_send_response(struct rad_handle *h)
 	return 0;
 }
 
-int
-rad_create_request(struct rad_handle *h, int code)
+/* Start a new request in r */
+static int
+req_init(struct rad_request *r, int code)
 {
 	int i;
 
-	if (h->type == RADIUS_SERVER) {
-		generr(h, "denied function call");
+	if (rad_out_reserve(r, RAD_BUF_SMALL) == -1)
 		return (-1);
-	}
-	if (h->num_servers == 0) {
-	    	generr(h, "No RADIUS servers specified");
-		return (-1);
-	}
-	h->out[POS_CODE] = code;
-	h->out[POS_IDENT] = ++h->ident;
+	r->out[POS_CODE] = code;
+	r->out[POS_IDENT] = ++r->h->ident;
 	if (code == RAD_ACCESS_REQUEST) {
 		/* Create a random authenticator */
 		for (i = 0;  i < LEN_AUTH;  i += 2) {
-			long r;
-			r = random();
-			h->out[POS_AUTH+i] = (u_char)r;
-			h->out[POS_AUTH+i+1] = (u_char)(r >> 8);
+			long n;
+			n = random();
+			r->out[POS_AUTH+i] = (u_char)n;
+			r->out[POS_AUTH+i+1] = (u_char)(n >> 8);
 		}
 	} else
-		memset(&h->out[POS_AUTH], 0, LEN_AUTH);
-	h->out_len = POS_ATTRS;
-	clear_password(h);
-	h->authentic_pos = 0;
-	h->out_created = 1;
+		memset(&r->out[POS_AUTH], 0, LEN_AUTH);
+	r->out_len = POS_ATTRS;
+	clear_password(r);
+	r->authentic_pos = 0;
+	close_vendor(r);
+	r->out_created = 1;
+	r->state = RAD_REQ_BUILDING;
+	r->reply_code = 0;
+	rad_arena_reset(&r->arena);
+	r->fields = NULL;
+	r->no_fields = 0;
+	r->t_created = r->h->latency ? rad_lat_now() : 0;
+	r->t_sent = 0;
+	r->t_received = 0;
+	r->bundle = 1;
+	RAD_STAT_ADD(RAD_STAT_REQUESTS, 1);
 	return 0;
 }
 
+static int
+can_create_request(struct rad_handle *h)
+{
+	if (h->type == RADIUS_SERVER) {
+		generr(h, "denied function call");
+		return 0;
+	}
+	if (h->num_servers == 0) {
+	    	generr(h, "No RADIUS servers specified");
+		return 0;
+	}
+	return 1;
+}
+
+int
+rad_create_request(struct rad_handle *h, int code)
+{
+	if (!can_create_request(h))
+		return (-1);
+	return req_init(&h->req, code);
+}
+
+/*
+ * Create a request object of its own, sharing the servers, secrets and
+ * socket of the handle.  Unlike rad_create_request() this may be called
+ * any number of times to build many requests at once; each one must be
+ * released with rad_req_free() or is released by rad_close().  Returns
+ * NULL on error.
+ */
+struct rad_request *
+rad_req_create(struct rad_handle *h, int code)
+{
+	struct rad_request *r;
+
+	if (!can_create_request(h))
+		return NULL;
+	if ((r = rad_req_alloc(h)) == NULL) {
+		generr(h, "Out of memory");
+		return NULL;
+	}
+	if (req_init(r, code) == -1) {
+		rad_req_release(r);
+		return NULL;
+	}
+	return r;
+}
+
 int
 rad_create_response(struct rad_handle *h, int code)
 {
@@ -873,13 +1302,16 @@ rad_create_response(struct rad_handle *h, int code)
 		generr(h, "denied function call");
 		return (-1);
 	}
-	h->out[POS_CODE] = code;
-	h->out[POS_IDENT] = h->in[POS_IDENT];
-	memset(&h->out[POS_AUTH], 0, LEN_AUTH);
-	h->out_len = POS_ATTRS;
-	clear_password(h);
-	h->authentic_pos = 0;
-	h->out_created = 1;
+	if (rad_out_reserve(&h->req, RAD_BUF_SMALL) == -1)
+		return (-1);
+	h->req.out[POS_CODE] = code;
+	h->req.out[POS_IDENT] = h->in[POS_IDENT];
+	memset(&h->req.out[POS_AUTH], 0, LEN_AUTH);
+	h->req.out_len = POS_ATTRS;
+	clear_password(&h->req);
+	h->req.authentic_pos = 0;
+	close_vendor(&h->req);
+	h->req.out_created = 1;
 	return 0;
 }
 
@@ -912,10 +1344,17 @@ rad_cvt_int(const void *data)
 
 char *
 rad_cvt_string(const void *data, size_t len)
+{
+	return rad_arena_cvt_string(NULL, data, len);
+}
+
+/* As rad_cvt_string(), allocating from an arena unless a is NULL */
+char *
+rad_arena_cvt_string(struct rad_arena *a, const void *data, size_t len)
 {
 	char *s;
 
-	s = malloc(len + 1);
+	s = alloc_result(a, len + 1);
 	if (s != NULL) {
 		memcpy(s, data, len);
 		s[len] = '\0';
@@ -949,6 +1388,90 @@ rad_get_attr(struct rad_handle *h, const void **value, size_t *len)
 	return type;
 }
 
+/*
+ * Check the password attributes of a finished request and fill in its
+ * length field.
+ */
+static int
+check_request(struct rad_request *r)
+{
+	if (r->out[POS_CODE] != RAD_ACCESS_REQUEST) {
+		/* Make sure no password given */
+		if (r->pass_pos || r->chap_pass) {
+			generr(r->h, "User or Chap Password"
+			    " in accounting request");
+			return -1;
+		}
+	} else {
+		if (r->eap_msg == 0) {
+			/* Make sure the user gave us a password */
+			if (r->pass_pos == 0 && !r->chap_pass) {
+				generr(r->h, "No User or Chap Password"
+				    " attributes given");
+				return -1;
+			}
+			if (r->pass_pos != 0 && r->chap_pass) {
+				generr(r->h, "Both User and Chap Password"
+				    " attributes given");
+				return -1;
+			}
+		}
+	}
+
+	/* Fill in the length field in the message */
+	r->out[POS_LENGTH] = r->out_len >> 8;
+	r->out[POS_LENGTH+1] = r->out_len;
+	return 0;
+}
+
+/* Scramble the password and authenticate a request for the current server */
+static void
+sign_request(struct rad_request *r)
+{
+	if (r->out[POS_CODE] == RAD_ACCESS_REQUEST) {
+		/* Insert the scrambled password into the request */
+		if (r->pass_pos != 0) {
+			RAD_TRACE_BEGIN("scramble");
+			insert_scrambled_password(r, r->h->srv);
+			RAD_TRACE_END("scramble");
+		}
+	}
+	RAD_TRACE_BEGIN("hmac");
+	insert_message_authenticator(r, 0);
+	RAD_TRACE_END("hmac");
+
+	if (r->out[POS_CODE] != RAD_ACCESS_REQUEST) {
+		/* Insert the request authenticator into the request */
+		RAD_TRACE_BEGIN("authenticator");
+		memset(&r->out[POS_AUTH], 0, LEN_AUTH);
+		insert_request_authenticator(r, 0);
+		RAD_TRACE_END("authenticator");
+	}
+}
+
+/*
+ * Finish a request object for the current server of its handle.  The
+ * encoded request is returned in *data and *len, to be sent, alone or
+ * bundled with others, by the caller.  Returns 0 on success and -1 on
+ * error.  A request may be encoded again, after the handle moved on to
+ * another server, to be retransmitted.
+ */
+int
+rad_req_encode(struct rad_request *r, const void **data, size_t *len)
+{
+	RAD_TRACE_BEGIN("encode");
+	if (check_request(r) == -1) {
+		RAD_TRACE_END("encode");
+		return -1;
+	}
+	sign_request(r);
+	RAD_TRACE_END("encode");
+	r->state = RAD_REQ_SENT;
+	*data = r->out;
+	*len = r->out_len;
+	return 0;
+}
+
 /*
  * Returns -1 on error, 0 to indicate no event and >0 for success
  */
@@ -982,32 +1505,8 @@ rad_init_send_request(struct rad_handle *h, int *fd, struct timeval *tv)
 		}
 	}
 
-	if (h->out[POS_CODE] != RAD_ACCESS_REQUEST) {
-		/* Make sure no password given */
-		if (h->pass_pos || h->chap_pass) {
-			generr(h, "User or Chap Password"
-			    " in accounting request");
-			return -1;
-		}
-	} else {
-		if (h->eap_msg == 0) {
-			/* Make sure the user gave us a password */
-			if (h->pass_pos == 0 && !h->chap_pass) {
-				generr(h, "No User or Chap Password"
-				    " attributes given");
-				return -1;
-			}
-			if (h->pass_pos != 0 && h->chap_pass) {
-				generr(h, "Both User and Chap Password"
-				    " attributes given");
-				return -1;
-			}
-		}
-	}
-
-	/* Fill in the length field in the message */
-	h->out[POS_LENGTH] = h->out_len >> 8;
-	h->out[POS_LENGTH+1] = h->out_len;
+	if (check_request(&h->req) == -1)
+		return -1;
 
 	h->srv = 0;
 	now = time(NULL);
@@ -1056,15 +1555,30 @@ rad_auth_open(void)
 		h->num_servers = 0;
 		h->ident = random();
 		h->errmsg[0] = '\0';
-		memset(h->pass, 0, sizeof h->pass);
-		h->pass_len = 0;
-		h->pass_pos = 0;
-		h->chap_pass = 0;
-		h->authentic_pos = 0;
+		memset(&h->req, 0, sizeof h->req);
+		h->req.h = h;
 		h->type = RADIUS_AUTH;
-		h->out_created = 0;
-		h->eap_msg = 0;
+		h->srv = 0;
 		h->bindto = INADDR_ANY;
+		h->clients = NULL;
+		h->client = NULL;
+		h->in = NULL;
+		h->in_size = 0;
+		h->in_len = 0;
+		h->in_pos = 0;
+		memset(&h->in_arena, 0, sizeof h->in_arena);
+		h->stream = NULL;
+		h->stream_size = 0;
+		h->stream_len = 0;
+		h->stream_srv = -1;
+		h->pending = NULL;
+		h->idx = NULL;
+		h->idx_valid = 0;
+		h->dup = NULL;
+		h->dup_pending = 0;
+		h->slabs = NULL;
+		h->req_free = NULL;
+		h->latency = 0;
 	}
 	return h;
 }
@@ -1102,30 +1616,67 @@ rad_open(void)
 int
 rad_put_addr(struct rad_handle *h, int type, struct in_addr addr)
 {
-	return rad_put_attr(h, type, &addr.s_addr, sizeof addr.s_addr);
+	return rad_req_put_addr(&h->req, type, addr);
 }
 
 int
 rad_put_addr6(struct rad_handle *h, int type, struct in6_addr addr)
 {
-
-	return rad_put_attr(h, type, &addr.s6_addr, sizeof addr.s6_addr);
+	return rad_req_put_addr6(&h->req, type, addr);
 }
 
 int
 rad_put_attr(struct rad_handle *h, int type, const void *value, size_t len)
+{
+	return rad_req_put_attr(&h->req, type, value, len);
+}
+
+int
+rad_put_int(struct rad_handle *h, int type, u_int32_t value)
+{
+	return rad_req_put_int(&h->req, type, value);
+}
+
+int
+rad_put_string(struct rad_handle *h, int type, const char *str)
+{
+	return rad_req_put_string(&h->req, type, str);
+}
+
+int
+rad_put_message_authentic(struct rad_handle *h)
+{
+	return rad_req_put_message_authentic(&h->req);
+}
+
+int
+rad_req_put_addr(struct rad_request *r, int type, struct in_addr addr)
+{
+	return rad_req_put_attr(r, type, &addr.s_addr, sizeof addr.s_addr);
+}
+
+int
+rad_req_put_addr6(struct rad_request *r, int type, struct in6_addr addr)
+{
+
+	return rad_req_put_attr(r, type, &addr.s6_addr, sizeof addr.s6_addr);
+}
+
+int
+rad_req_put_attr(struct rad_request *r, int type, const void *value,
+    size_t len)
 {
 	int result;
 
-	if (!h->out_created) {
-		generr(h, "Please call rad_create_request()"
+	if (!r->out_created) {
+		generr(r->h, "Please call rad_create_request()"
 		    " before putting attributes");
 		return -1;
 	}
 
-	if (h->out[POS_CODE] == RAD_ACCOUNTING_REQUEST) {
+	if (r->out[POS_CODE] == RAD_ACCOUNTING_REQUEST) {
 		if (type == RAD_EAP_MESSAGE) {
-			generr(h, "EAP-Message attribute is not valid"
+			generr(r->h, "EAP-Message attribute is not valid"
 			    " in accounting requests");
 			return -1;
 		}
@@ -1136,21 +1687,21 @@ rad_put_attr(struct rad_handle *h, int type, const void *value, size_t len)
 	 * MUST be present; see RFC 3579.
 	 */
 	if (type == RAD_EAP_MESSAGE) {
-		if (rad_put_message_authentic(h) == -1)
+		if (rad_req_put_message_authentic(r) == -1)
 			return -1;
 	}
 
 	if (type == RAD_USER_PASSWORD) {
-		result = put_password_attr(h, type, value, len);
+		result = put_password_attr(r, type, value, len);
 	} else if (type == RAD_MESSAGE_AUTHENTIC) {
-		result = rad_put_message_authentic(h);
+		result = rad_req_put_message_authentic(r);
 	} else {
-		result = put_raw_attr(h, type, value, len);
+		result = put_raw_attr(r, type, value, len);
 		if (result == 0) {
 			if (type == RAD_CHAP_PASSWORD)
-				h->chap_pass = 1;
+				r->chap_pass = 1;
 			else if (type == RAD_EAP_MESSAGE)
-				h->eap_msg = 1;
+				r->eap_msg = 1;
 		}
 	}
 
@@ -1158,46 +1709,183 @@ rad_put_attr(struct rad_handle *h, int type, const void *value, size_t len)
 }
 
 int
-rad_put_int(struct rad_handle *h, int type, u_int32_t value)
+rad_req_put_int(struct rad_request *r, int type, u_int32_t value)
 {
 	u_int32_t nvalue;
 
 	nvalue = htonl(value);
-	return rad_put_attr(h, type, &nvalue, sizeof nvalue);
+	return rad_req_put_attr(r, type, &nvalue, sizeof nvalue);
 }
 
 int
-rad_put_string(struct rad_handle *h, int type, const char *str)
+rad_req_put_string(struct rad_request *r, int type, const char *str)
 {
-	return rad_put_attr(h, type, str, strlen(str));
+	return rad_req_put_attr(r, type, str, strlen(str));
 }
 
 int
-rad_put_message_authentic(struct rad_handle *h)
+rad_req_put_message_authentic(struct rad_request *r)
 {
 #ifdef WITH_SSL
 	u_char md_zero[MD5_DIGEST_LENGTH];
 
-	if (h->out[POS_CODE] == RAD_ACCOUNTING_REQUEST) {
-		generr(h, "Message-Authenticator is not valid"
+	if (r->out[POS_CODE] == RAD_ACCOUNTING_REQUEST) {
+		generr(r->h, "Message-Authenticator is not valid"
 		    " in accounting requests");
 		return -1;
 	}
 
-	if (h->authentic_pos == 0) {
-		h->authentic_pos = h->out_len;
+	if (r->authentic_pos == 0) {
+		close_vendor(r);
+		r->authentic_pos = r->out_len;
 		memset(md_zero, 0, sizeof(md_zero));
-		return (put_raw_attr(h, RAD_MESSAGE_AUTHENTIC, md_zero,
+		return (put_raw_attr(r, RAD_MESSAGE_AUTHENTIC, md_zero,
 		    sizeof(md_zero)));
 	}
 	return 0;
 #else
-	generr(h, "Message Authenticator not supported,"
+	generr(r->h, "Message Authenticator not supported,"
 	    " please recompile libradius with SSL support");
 	return -1;
 #endif
 }
 
+/*
+ * Take the attributes of a request as a block to be copied into other
+ * requests with rad_req_put_block(), so that attributes that are the same
+ * for every request of a NAS are encoded only once.  The request must not
+ * have a User-Password, which differs per request; it can be freed
+ * afterwards.  The block is immutable and may be shared between handles
+ * and threads.  Returns NULL on error.
+ */
+struct rad_attr_block *
+rad_block_create(struct rad_request *r)
+{
+	struct rad_attr_block *b;
+	size_t len;
+
+	if (!r->out_created) {
+		generr(r->h, "Please call rad_create_request()"
+		    " before putting attributes");
+		return NULL;
+	}
+	if (r->pass_pos != 0) {
+		generr(r->h, "User-Password cannot be part of a block");
+		return NULL;
+	}
+	len = r->out_len - POS_ATTRS;
+	if ((b = malloc(sizeof *b + len)) == NULL) {
+		generr(r->h, "Out of memory");
+		return NULL;
+	}
+	memcpy(b->data, &r->out[POS_ATTRS], len);
+	b->len = len;
+	b->authentic_off = r->authentic_pos ?
+	    r->authentic_pos - POS_ATTRS : -1;
+	if (b->authentic_off != -1)	/* In case r was encoded already */
+		memset(&b->data[b->authentic_off + 2], 0, MD5_DIGEST_LENGTH);
+	b->chap_pass = r->chap_pass;
+	b->eap_msg = r->eap_msg;
+	return b;
+}
+
+void
+rad_block_free(struct rad_attr_block *b)
+{
+	free(b);
+}
+
+/* Copy the attributes of a block into a request */
+int
+rad_req_put_block(struct rad_request *r, const struct rad_attr_block *b)
+{
+	if (!r->out_created) {
+		generr(r->h, "Please call rad_create_request()"
+		    " before putting attributes");
+		return -1;
+	}
+	if (r->out[POS_CODE] == RAD_ACCOUNTING_REQUEST &&
+	    (b->eap_msg || b->authentic_off != -1)) {
+		generr(r->h, "EAP-Message or Message-Authenticator"
+		    " attribute is not valid in accounting requests");
+		return -1;
+	}
+	if (b->authentic_off != -1 && r->authentic_pos != 0) {
+		generr(r->h, "Multiple Message-Authenticator attributes");
+		return -1;
+	}
+	if (r->out_len + b->len > MSGSIZE) {
+		generr(r->h, "Maximum message length exceeded");
+		return -1;
+	}
+	close_vendor(r);
+	if (rad_out_reserve(r, r->out_len + b->len) == -1)
+		return -1;
+	memcpy(&r->out[r->out_len], b->data, b->len);
+	RAD_STAT_ADD(RAD_STAT_COPIED, b->len);
+	if (b->authentic_off != -1)
+		r->authentic_pos = r->out_len + b->authentic_off;
+	r->out_len += b->len;
+	r->chap_pass |= b->chap_pass;
+	r->eap_msg |= b->eap_msg;
+	return 0;
+}
+
+int
+rad_put_block(struct rad_handle *h, const struct rad_attr_block *b)
+{
+	return rad_req_put_block(&h->req, b);
+}
+
+/*
+ * Put an empty attribute whose value is given when the request is used as
+ * a template, see rad_template_create().  width is the length of the
+ * value if fixed, as for integers and addresses, or 0 for strings.
+ * Returns the index of the field, or -1 on error.
+ */
+int
+rad_req_put_field(struct rad_request *r, int type, int width)
+{
+	struct rad_tpl_field *f;
+	u_char zero[253];
+	int i;
+
+	if (width < 0 || width > 253) {
+		generr(r->h, "Attribute too long");
+		return -1;
+	}
+	if (type == RAD_USER_PASSWORD || type == RAD_MESSAGE_AUTHENTIC ||
+	    type == RAD_VENDOR_SPECIFIC) {
+		if (type != RAD_USER_PASSWORD || width != 0) {
+			generr(r->h, "Attribute %d cannot be a field", type);
+			return -1;
+		}
+		for (i = 0; i < r->no_fields; i++)
+			if (r->fields[i].type == RAD_USER_PASSWORD) {
+				generr(r->h, "Multiple User-Password"
+				    " attributes specified");
+				return -1;
+			}
+	}
+	if (r->no_fields == RAD_TEMPLATE_FIELDS) {
+		generr(r->h, "Too many template fields");
+		return -1;
+	}
+	if (r->fields == NULL && (r->fields = rad_arena_alloc(&r->arena,
+	    RAD_TEMPLATE_FIELDS * sizeof *r->fields)) == NULL) {
+		generr(r->h, "Out of memory");
+		return -1;
+	}
+	memset(zero, 0, width);
+	if (put_raw_attr(r, type, zero, width) == -1)
+		return -1;
+	f = &r->fields[r->no_fields];
+	f->off = r->out_len - width - 2 - POS_ATTRS;
+	f->type = type;
+	f->width = width;
+	return r->no_fields++;
+}
+
 /*
  * Returns the response type code on success, or -1 on failure.
  */
@@ -1223,7 +1911,10 @@ rad_send_request(struct rad_handle *h)
 		FD_ZERO(&readfds);
 		FD_SET(fd, &readfds);
 
+		RAD_TRACE_BEGIN("wait");
 		n = select(fd + 1, &readfds, NULL, NULL, &tv);
+		RAD_TRACE_END("wait");
+		RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
 
 		if (n == -1) {
 			generr(h, "select: %s", strerror(errno));
@@ -1241,6 +1932,7 @@ rad_send_request(struct rad_handle *h)
 				/* Continue the select */
 				continue;
             }
+			RAD_STAT_ADD(RAD_STAT_TIMEOUTS, 1);
 		}
 
 		n = rad_continue_send_request(h, n, &fd, &tv);
@@ -1354,66 +2046,164 @@ int
 rad_put_vendor_addr(struct rad_handle *h, int vendor, int type,
     struct in_addr addr)
 {
-	return (rad_put_vendor_attr(h, vendor, type, &addr.s_addr,
-	    sizeof addr.s_addr));
+	return (rad_req_put_vendor_addr(&h->req, vendor, type, addr));
 }
 
 int
 rad_put_vendor_addr6(struct rad_handle *h, int vendor, int type,
     struct in6_addr addr)
 {
+	return (rad_req_put_vendor_addr6(&h->req, vendor, type, addr));
+}
 
-	return (rad_put_vendor_attr(h, vendor, type, &addr.s6_addr,
-	    sizeof addr.s6_addr));
+int
+rad_begin_vendor(struct rad_handle *h, int vendor)
+{
+	return (rad_req_begin_vendor(&h->req, vendor));
+}
+
+int
+rad_end_vendor(struct rad_handle *h)
+{
+	return (rad_req_end_vendor(&h->req));
 }
 
 int
 rad_put_vendor_attr(struct rad_handle *h, int vendor, int type,
     const void *value, size_t len)
 {
-	struct vendor_attribute *attr;
-	int res;
+	return (rad_req_put_vendor_attr(&h->req, vendor, type, value, len));
+}
+
+int
+rad_put_vendor_int(struct rad_handle *h, int vendor, int type, u_int32_t i)
+{
+	return (rad_req_put_vendor_int(&h->req, vendor, type, i));
+}
 
-	if (!h->out_created) {
-		generr(h, "Please call rad_create_request()"
+int
+rad_put_vendor_string(struct rad_handle *h, int vendor, int type,
+    const char *str)
+{
+	return (rad_req_put_vendor_string(&h->req, vendor, type, str));
+}
+
+int
+rad_req_put_vendor_addr(struct rad_request *r, int vendor, int type,
+    struct in_addr addr)
+{
+	return (rad_req_put_vendor_attr(r, vendor, type, &addr.s_addr,
+	    sizeof addr.s_addr));
+}
+
+int
+rad_req_put_vendor_addr6(struct rad_request *r, int vendor, int type,
+    struct in6_addr addr)
+{
+
+	return (rad_req_put_vendor_attr(r, vendor, type, &addr.s6_addr,
+	    sizeof addr.s6_addr));
+}
+
+/*
+ * Pack the vendor attributes of a vendor put next into as few
+ * Vendor-Specific attributes as possible, each holding as many
+ * sub-attributes as fit into 255 bytes, until rad_req_end_vendor() or
+ * until an attribute of another kind or vendor is put.  Without it every
+ * vendor attribute gets a Vendor-Specific attribute of its own.
+ */
+int
+rad_req_begin_vendor(struct rad_request *r, int vendor)
+{
+	close_vendor(r);
+	r->vsa_packing = 1;
+	r->vsa_vendor = vendor;
+	return 0;
+}
+
+int
+rad_req_end_vendor(struct rad_request *r)
+{
+	close_vendor(r);
+	return 0;
+}
+
+/*
+ * Vendor attributes are written straight into the request.  The length
+ * of the enclosing Vendor-Specific attribute is kept up to date as
+ * sub-attributes are added to it, so there is nothing to finish.
+ */
+int
+rad_req_put_vendor_attr(struct rad_request *r, int vendor, int type,
+    const void *value, size_t len)
+{
+	u_int32_t id;
+	size_t need;
+	u_char *p;
+
+	if (!r->out_created) {
+		generr(r->h, "Please call rad_create_request()"
 		    " before putting attributes");
 		return -1;
 	}
-
-	if ((attr = malloc(len + 6)) == NULL) {
-		generr(h, "malloc failure (%zu bytes)", len + 6);
+	if (len + 8 > 255) {
+		generr(r->h, "Attribute too long");
 		return -1;
 	}
 
-	attr->vendor_value = htonl(vendor);
-	attr->attrib_type = type;
-	attr->attrib_len = len + 2;
-	memcpy(attr->attrib_data, value, len);
+	if (!r->vsa_packing || r->vsa_vendor != (u_int32_t)vendor)
+		close_vendor(r);
+	else if (r->vsa_pos != 0 && r->out_len - r->vsa_pos + 2 + len > 255)
+		r->vsa_pos = 0;		/* Full, start another one */
 
-	res = put_raw_attr(h, RAD_VENDOR_SPECIFIC, attr, len + 6);
-	free(attr);
-	if (res == 0 && vendor == RAD_VENDOR_MICROSOFT
+	need = 2 + len + (r->vsa_pos == 0 ? 6 : 0);
+	if (r->out_len + need > MSGSIZE) {
+		generr(r->h, "Maximum message length exceeded");
+		return -1;
+	}
+	if (rad_out_reserve(r, r->out_len + need) == -1)
+		return -1;
+	if (r->vsa_pos == 0) {
+		r->vsa_pos = r->out_len;
+		p = &r->out[r->out_len];
+		p[0] = RAD_VENDOR_SPECIFIC;
+		id = htonl(vendor);
+		memcpy(&p[2], &id, sizeof id);
+		r->out_len += 6;
+	}
+	p = &r->out[r->out_len];
+	p[0] = type;
+	p[1] = len + 2;
+	memcpy(&p[2], value, len);
+	r->out_len += len + 2;
+	r->out[r->vsa_pos + 1] = r->out_len - r->vsa_pos;
+	if (!r->vsa_packing)
+		r->vsa_pos = 0;
+
+	if (vendor == RAD_VENDOR_MICROSOFT
 	    && (type == RAD_MICROSOFT_MS_CHAP_RESPONSE
 	    || type == RAD_MICROSOFT_MS_CHAP2_RESPONSE)) {
-		h->chap_pass = 1;
+		r->chap_pass = 1;
 	}
-	return (res);
+	return 0;
 }
 
 int
-rad_put_vendor_int(struct rad_handle *h, int vendor, int type, u_int32_t i)
+rad_req_put_vendor_int(struct rad_request *r, int vendor, int type,
+    u_int32_t i)
 {
 	u_int32_t value;
 
 	value = htonl(i);
-	return (rad_put_vendor_attr(h, vendor, type, &value, sizeof value));
+	return (rad_req_put_vendor_attr(r, vendor, type, &value,
+	    sizeof value));
 }
 
 int
-rad_put_vendor_string(struct rad_handle *h, int vendor, int type,
+rad_req_put_vendor_string(struct rad_request *r, int vendor, int type,
     const char *str)
 {
-	return (rad_put_vendor_attr(h, vendor, type, str, strlen(str)));
+	return (rad_req_put_vendor_attr(r, vendor, type, str, strlen(str)));
 }
 
 ssize_t
@@ -1421,7 +2211,7 @@ rad_request_authenticator(struct rad_handle *h, char *buf, size_t len)
 {
 	if (len < LEN_AUTH)
 		return (-1);
-	memcpy(buf, h->out + POS_AUTH, LEN_AUTH);
+	memcpy(buf, h->req.out + POS_AUTH, LEN_AUTH);
 	if (len > LEN_AUTH)
 		buf[LEN_AUTH] = '\0';
 	return (LEN_AUTH);
@@ -1429,6 +2219,14 @@ rad_request_authenticator(struct rad_handle *h, char *buf, size_t len)
 
 u_char *
 rad_demangle(struct rad_handle *h, const void *mangled, size_t mlen)
+{
+	return rad_arena_demangle(h, NULL, mangled, mlen);
+}
+
+/* As rad_demangle(), allocating from an arena unless a is NULL */
+u_char *
+rad_arena_demangle(struct rad_handle *h, struct rad_arena *a,
+    const void *mangled, size_t mlen)
 {
 	char R[LEN_AUTH];
 	const char *S;
@@ -1453,7 +2251,7 @@ rad_demangle(struct rad_handle *h, const void *mangled, size_t mlen)
 		return NULL;
 	}
 
-	demangled = malloc(mlen);
+	demangled = alloc_result(a, mlen);
 	if (!demangled)
 		return NULL;
 
@@ -1484,6 +2282,14 @@ rad_demangle(struct rad_handle *h, const void *mangled, size_t mlen)
 u_char *
 rad_demangle_mppe_key(struct rad_handle *h, const void *mangled,
     size_t mlen, size_t *len)
+{
+	return rad_arena_demangle_mppe_key(h, NULL, mangled, mlen, len);
+}
+
+/* As rad_demangle_mppe_key(), allocating from an arena unless a is NULL */
+u_char *
+rad_arena_demangle_mppe_key(struct rad_handle *h, struct rad_arena *a,
+    const void *mangled, size_t mlen, size_t *len)
 {
 	char R[LEN_AUTH];    /* variable names as per rfc2548 */
 	const char *S;
@@ -1551,7 +2357,7 @@ rad_demangle_mppe_key(struct rad_handle *h, const void *mangled,
 		    *len, MPPE_KEY_LEN * 2);
 		return NULL;
 	}
-	demangled = malloc(*len);
+	demangled = alloc_result(a, *len);
 	if (!demangled)
 		return NULL;
 
@@ -1562,5 +2368,18 @@ rad_demangle_mppe_key(struct rad_handle *h, const void *mangled,
 const char *
 rad_server_secret(struct rad_handle *h)
 {
-	return (h->servers[h->srv].secret);
+	size_t len;
+
+	return (peer_secret(h, &len));
+}
+
+/*
+ * Answer retransmitted requests from a duplicate cache created with
+ * rad_dup_cache_create().  The cache may be shared by several handles.
+ */
+void
+rad_set_dup_cache(struct rad_handle *h, struct rad_dup_cache *c)
+{
+	h->dup = c;
+	h->dup_pending = 0;
 }
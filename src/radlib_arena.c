@@ -0,0 +1,101 @@
+/*-
+ * Arenas for memory that lives as long as a message
+ *
+ * Decoded strings and other per-message allocations are carved out of
+ * chunks taken from the packet buffer pool and are all released at once,
+ * when the request object owning the arena is freed or, for the arena of
+ * a handle, when the next message is received.  Once the pool is warm
+ * neither allocating nor releasing calls malloc() or free().
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+#define ARENA_ALIGN	16
+#define ARENA_CHUNK	RAD_BUF_MEDIUM	/* Usual chunk size */
+
+struct rad_arena_chunk {
+	struct rad_arena_chunk	*next;		/* Older chunk */
+	size_t			 size;		/* Including this header */
+};
+
+#define ARENA_HDR	((sizeof(struct rad_arena_chunk) + ARENA_ALIGN - 1) & \
+			    ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * Allocate size bytes, aligned for any type, from an arena.  Returns NULL
+ * if out of memory or if size is too large for a pool buffer.
+ */
+void *
+rad_arena_alloc(struct rad_arena *a, size_t size)
+{
+	struct rad_arena_chunk *c;
+	size_t need, cap;
+	u_char *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size == 0)
+		size = ARENA_ALIGN;
+	if (a->chunks == NULL || a->used + size > a->chunks->size) {
+		need = ARENA_HDR + size;
+		if (need < ARENA_CHUNK)
+			need = ARENA_CHUNK;
+		if ((p = rad_buf_get(need, &cap)) == NULL)
+			return NULL;
+		c = (struct rad_arena_chunk *)p;
+		c->next = a->chunks;
+		c->size = cap;
+		a->chunks = c;
+		a->used = ARENA_HDR;
+	}
+	p = (u_char *)a->chunks + a->used;
+	a->used += size;
+	return p;
+}
+
+/* Release everything allocated from an arena, keeping its newest chunk */
+void
+rad_arena_reset(struct rad_arena *a)
+{
+	struct rad_arena_chunk *c;
+
+	if (a->chunks == NULL)
+		return;
+	while ((c = a->chunks->next) != NULL) {
+		a->chunks->next = c->next;
+		rad_buf_put((u_char *)c, c->size);
+	}
+	a->used = ARENA_HDR;
+}
+
+/* Release an arena and all of its chunks */
+void
+rad_arena_free(struct rad_arena *a)
+{
+	struct rad_arena_chunk *c;
+
+	while ((c = a->chunks) != NULL) {
+		a->chunks = c->next;
+		rad_buf_put((u_char *)c, c->size);
+	}
+	a->used = 0;
+}
+
+/* Arena of the message received into a handle */
+struct rad_arena *
+rad_in_arena(struct rad_handle *h)
+{
+	return &h->in_arena;
+}
+
+/* Arena of a request object, released with it */
+struct rad_arena *
+rad_req_arena(struct rad_request *r)
+{
+	return &r->arena;
+}
@@ -0,0 +1,112 @@
+/*-
+ * Size-classed packet buffer pool
+ *
+ * Handles used to embed two MSGSIZE buffers, about 110 KB, although most
+ * messages are a few hundred bytes.  Packet buffers now come from three
+ * size classes and a handle only takes a larger one when a message grows
+ * beyond its current buffer.  Released buffers are kept on per-thread free
+ * lists, so taking and returning them needs no locking; a buffer may be
+ * returned on a different thread than it was taken on.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+struct buf_class {
+	size_t		 size;
+	int		 max_free;	/* Buffers kept per thread */
+};
+
+static const struct buf_class buf_classes[RAD_BUF_CLASSES] = {
+	{ RAD_BUF_SMALL,	1024 },
+	{ RAD_BUF_MEDIUM,	256 },
+	{ RAD_BUF_LARGE,	16 },
+};
+
+struct buf_free {
+	struct buf_free	*next;
+};
+
+static __thread struct buf_free	*buf_free_list[RAD_BUF_CLASSES];
+static __thread int		 buf_no_free[RAD_BUF_CLASSES];
+
+static int
+buf_class_of(size_t size)
+{
+	int i;
+
+	for (i = 0; i < RAD_BUF_CLASSES; i++)
+		if (size <= buf_classes[i].size)
+			return i;
+	return -1;
+}
+
+/*
+ * Take a buffer of at least size bytes.  Its actual size is returned in
+ * *cap.  Returns NULL if out of memory or if size is above RAD_BUF_LARGE.
+ */
+u_char *
+rad_buf_get(size_t size, size_t *cap)
+{
+	struct buf_free *b;
+	int c;
+
+	if ((c = buf_class_of(size)) == -1)
+		return NULL;
+	if ((b = buf_free_list[c]) != NULL) {
+		buf_free_list[c] = b->next;
+		buf_no_free[c]--;
+	} else if ((b = malloc(buf_classes[c].size)) == NULL)
+		return NULL;
+	*cap = buf_classes[c].size;
+	return (u_char *)b;
+}
+
+/* Return a buffer taken with rad_buf_get() of the given capacity */
+void
+rad_buf_put(u_char *buf, size_t cap)
+{
+	struct buf_free *b = (struct buf_free *)buf;
+	int c;
+
+	if (buf == NULL)
+		return;
+	c = buf_class_of(cap);
+	if (buf_no_free[c] >= buf_classes[c].max_free) {
+		free(buf);
+		return;
+	}
+	b->next = buf_free_list[c];
+	buf_free_list[c] = b;
+	buf_no_free[c]++;
+}
+
+/*
+ * Make room for a message of size bytes in a handle buffer, keeping the
+ * first keep bytes of its contents.  Returns 0 on success, -1 if out of
+ * memory.
+ */
+int
+rad_buf_reserve(u_char **buf, size_t *cap, size_t size, size_t keep)
+{
+	u_char *n;
+	size_t ncap;
+
+	if (*buf != NULL && size <= *cap)
+		return 0;
+	if ((n = rad_buf_get(size, &ncap)) == NULL)
+		return -1;
+	if (*buf != NULL) {
+		if (keep)
+			memcpy(n, *buf, keep);
+		rad_buf_put(*buf, *cap);
+	}
+	*buf = n;
+	*cap = ncap;
+	return 0;
+}
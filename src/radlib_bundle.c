@@ -0,0 +1,91 @@
+/*-
+ * Boundary scan of RADIUS message bundles
+ *
+ * A bundle is a datagram holding several RADIUS messages back to back.
+ * Finding the boundaries is inherently serial, since every message starts
+ * where the length of the previous one says, so the first pass only
+ * follows the length chain, making sure it advances and stays inside the
+ * bundle, while gathering the codes and lengths of a block of messages
+ * into contiguous arrays.  The per-message checks (known code, length
+ * within RFC 2865 limits) are then done on each block in a pass without
+ * branches or loop-carried dependencies, so the compiler can vectorize
+ * it.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "include/radlib_private.h"
+
+#define MSG_MIN_LEN	POS_ATTRS	/* Header only */
+#define MSG_MAX_LEN	4096		/* RFC 2865, section 3 */
+#define SCAN_BLOCK	64		/* Headers gathered per check pass */
+
+/* Returns non-zero if any of the headers of a block is not acceptable */
+static unsigned int
+scan_check(const u_char *codes, const u_int16_t *lens, int n)
+{
+	u_int16_t bad;
+	int i;
+
+	/*
+	 * Known codes are 1-5 (RFC 2865/2866), 11-13 (Access-Challenge,
+	 * Status-Server and Status-Client) and 40-45 (RFC 5176).  The
+	 * tests produce all-ones masks rather than truth values, which
+	 * keeps the compiler from turning them into a 64-bit bit test that
+	 * it cannot vectorize.
+	 */
+	bad = 0;
+	for (i = 0; i < n; i++) {
+		u_int16_t c = codes[i];
+		u_int16_t lo = (u_int16_t)(c - RAD_ACCESS_REQUEST) > 4 ?
+		    0xffff : 0;
+		u_int16_t ch = (u_int16_t)(c - RAD_ACCESS_CHALLENGE) > 2 ?
+		    0xffff : 0;
+		u_int16_t hi = (u_int16_t)(c - RAD_DISCONNECT_REQUEST) > 5 ?
+		    0xffff : 0;
+
+		bad |= (lo & ch & hi) | (lens[i] > MSG_MAX_LEN);
+	}
+	return bad;
+}
+
+/*
+ * Find the messages of a bundle.  On success the number of messages n is
+ * returned and off[0..n] hold their offsets followed by the bundle
+ * length, so message i spans off[i] to off[i + 1].  Returns -1 if the
+ * bundle is malformed and -2 if it holds more than max messages; off
+ * must have room for max + 1 entries.
+ */
+int
+rad_bundle_scan(const void *buf, size_t len, size_t *off, int max)
+{
+	const u_char *p = buf;
+	u_char codes[SCAN_BLOCK];
+	u_int16_t lens[SCAN_BLOCK];
+	size_t pos, mlen;
+	int n, k;
+
+	for (n = 0, k = 0, pos = 0; pos < len; n++, pos += mlen) {
+		if (n == max)
+			return -2;
+		if (len - pos < MSG_MIN_LEN)
+			return -1;
+		mlen = p[pos + 2] << 8 | p[pos + 3];
+		if (mlen < MSG_MIN_LEN || mlen > len - pos)
+			return -1;
+		off[n] = pos;
+		codes[k] = p[pos];
+		lens[k] = mlen;
+		if (++k == SCAN_BLOCK) {
+			if (scan_check(codes, lens, k))
+				return -1;
+			k = 0;
+		}
+	}
+	off[n] = len;
+	return scan_check(codes, lens, k) ? -1 : n;
+}
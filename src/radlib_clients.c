@@ -0,0 +1,247 @@
+/*-
+ * Client (NAS) table of RADIUS server handles
+ *
+ * Clients are looked up by the source address of every request, so the
+ * table is a hash of (network, prefix length) entries.  A lookup probes
+ * one hash slot per prefix length in use, longest first, which is a
+ * single probe when every NAS is listed by its own address.
+ *
+ * Each entry keeps the length of its shared secret and the HMAC-MD5
+ * state after the keyed pads, so that Message-Authenticators are computed
+ * without hashing the secret again for every request.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef WITH_SSL
+#include <openssl/md5.h>
+#else
+#define MD5_DIGEST_LENGTH 16
+#include "md5/md5.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+#define HMAC_BLOCK	64		/* MD5 block size */
+
+struct rad_client {
+	in_addr_t		 net;		/* Network, host order, masked */
+	int			 prefix;	/* Prefix length */
+	char			*secret;
+	size_t			 secret_len;
+	MD5_CTX			 hmac_inner;	/* After key ^ ipad */
+	MD5_CTX			 hmac_outer;	/* After key ^ opad */
+	struct rad_client	*next;		/* Hash chain */
+};
+
+struct rad_client_table {
+	struct rad_client	**buckets;
+	size_t			 no_buckets;	/* Power of two */
+	size_t			 count;
+	u_int64_t		 prefixes;	/* Bit n: a client has prefix n */
+};
+
+static in_addr_t
+client_mask(int prefix)
+{
+	return prefix == 0 ? 0 : 0xffffffffU << (32 - prefix);
+}
+
+static size_t
+client_hash(in_addr_t net, int prefix, size_t no_buckets)
+{
+	u_int32_t h;
+
+	h = (net ^ (u_int32_t)prefix << 24) * 2654435761U;
+	return (h ^ h >> 16) & (no_buckets - 1);
+}
+
+static void
+client_free(struct rad_client *c)
+{
+	memset(c->secret, 0, c->secret_len);
+	free(c->secret);
+	memset(c, 0, sizeof *c);
+	free(c);
+}
+
+/* Precompute the HMAC-MD5 state of the client's secret (RFC 2104) */
+static void
+client_set_secret(struct rad_client *c)
+{
+	u_char key[HMAC_BLOCK], pad[HMAC_BLOCK];
+	MD5_CTX ctx;
+	int i;
+
+	memset(key, 0, sizeof key);
+	if (c->secret_len > HMAC_BLOCK) {
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, c->secret, c->secret_len);
+		MD5_Final(key, &ctx);
+	} else
+		memcpy(key, c->secret, c->secret_len);
+
+	for (i = 0; i < HMAC_BLOCK; i++)
+		pad[i] = key[i] ^ 0x36;
+	MD5_Init(&c->hmac_inner);
+	MD5_Update(&c->hmac_inner, pad, HMAC_BLOCK);
+	for (i = 0; i < HMAC_BLOCK; i++)
+		pad[i] = key[i] ^ 0x5c;
+	MD5_Init(&c->hmac_outer);
+	MD5_Update(&c->hmac_outer, pad, HMAC_BLOCK);
+
+	memset(key, 0, sizeof key);
+	memset(pad, 0, sizeof pad);
+}
+
+static int
+client_table_grow(struct rad_client_table *t)
+{
+	struct rad_client **buckets, *c, *next;
+	size_t n, i, b;
+
+	n = t->no_buckets ? t->no_buckets * 2 : 64;
+	if ((buckets = calloc(n, sizeof *buckets)) == NULL)
+		return -1;
+	for (i = 0; i < t->no_buckets; i++) {
+		for (c = t->buckets[i]; c != NULL; c = next) {
+			next = c->next;
+			b = client_hash(c->net, c->prefix, n);
+			c->next = buckets[b];
+			buckets[b] = c;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->no_buckets = n;
+	return 0;
+}
+
+struct rad_client_table *
+rad_client_table_create(void)
+{
+	return calloc(1, sizeof(struct rad_client_table));
+}
+
+void
+rad_client_table_destroy(struct rad_client_table *t)
+{
+	struct rad_client *c, *next;
+	size_t i;
+
+	for (i = 0; i < t->no_buckets; i++)
+		for (c = t->buckets[i]; c != NULL; c = next) {
+			next = c->next;
+			client_free(c);
+		}
+	free(t->buckets);
+	free(t);
+}
+
+/*
+ * Add the clients of a network, given in network byte order, or replace
+ * the secret of an existing entry for it.  Returns 0 on success and -1 if
+ * out of memory.
+ */
+int
+rad_client_table_add(struct rad_client_table *t, struct in_addr addr,
+    int prefix, const char *secret)
+{
+	struct rad_client *c;
+	in_addr_t net;
+	char *s;
+	size_t b;
+
+	net = ntohl(addr.s_addr) & client_mask(prefix);
+	if ((s = strdup(secret)) == NULL)
+		return -1;
+	if (t->no_buckets != 0) {
+		b = client_hash(net, prefix, t->no_buckets);
+		for (c = t->buckets[b]; c != NULL; c = c->next)
+			if (c->net == net && c->prefix == prefix) {
+				memset(c->secret, 0, c->secret_len);
+				free(c->secret);
+				c->secret = s;
+				c->secret_len = strlen(s);
+				client_set_secret(c);
+				return 0;
+			}
+	}
+
+	if (t->count >= t->no_buckets && client_table_grow(t) == -1) {
+		free(s);
+		return -1;
+	}
+	if ((c = calloc(1, sizeof *c)) == NULL) {
+		free(s);
+		return -1;
+	}
+	c->net = net;
+	c->prefix = prefix;
+	c->secret = s;
+	c->secret_len = strlen(s);
+	client_set_secret(c);
+	b = client_hash(net, prefix, t->no_buckets);
+	c->next = t->buckets[b];
+	t->buckets[b] = c;
+	t->prefixes |= (u_int64_t)1 << prefix;
+	t->count++;
+	return 0;
+}
+
+/* Find the client with the longest prefix matching addr, or NULL */
+const struct rad_client *
+rad_client_table_lookup(const struct rad_client_table *t, struct in_addr addr)
+{
+	const struct rad_client *c;
+	u_int64_t prefixes;
+	in_addr_t host, net;
+	int prefix;
+
+	if (t == NULL || t->count == 0)
+		return NULL;
+	host = ntohl(addr.s_addr);
+	for (prefixes = t->prefixes; prefixes != 0;
+	    prefixes &= ~((u_int64_t)1 << prefix)) {
+		prefix = 63 - __builtin_clzll(prefixes);
+		net = host & client_mask(prefix);
+		c = t->buckets[client_hash(net, prefix, t->no_buckets)];
+		for (; c != NULL; c = c->next)
+			if (c->net == net && c->prefix == prefix)
+				return c;
+	}
+	return NULL;
+}
+
+const char *
+rad_client_secret(const struct rad_client *c, size_t *len)
+{
+	*len = c->secret_len;
+	return c->secret;
+}
+
+/*
+ * HMAC-MD5 of a message with the client's secret as the key, with the
+ * message given as its header, authenticator and attributes.
+ */
+void
+rad_client_hmac(const struct rad_client *c, const void *hdr,
+    const void *auth, const void *attrs, size_t attrs_len, u_char *md)
+{
+	MD5_CTX ctx;
+	u_char inner[MD5_DIGEST_LENGTH];
+
+	ctx = c->hmac_inner;
+	MD5_Update(&ctx, hdr, POS_AUTH - POS_CODE);
+	MD5_Update(&ctx, auth, LEN_AUTH);
+	MD5_Update(&ctx, attrs, attrs_len);
+	MD5_Final(inner, &ctx);
+
+	ctx = c->hmac_outer;
+	MD5_Update(&ctx, inner, sizeof inner);
+	MD5_Final(md, &ctx);
+}
@@ -0,0 +1,288 @@
+/*-
+ * Duplicate request detection for RADIUS servers (RFC 5080, 2.2.2)
+ *
+ * A retransmitted request carries the same source address and port,
+ * identifier and request authenticator as the original.  The cache keeps
+ * the response encoded for each such key for a configurable lifetime so
+ * that duplicates are answered without authenticating them again, and
+ * duplicates of a request still being processed are silently dropped.
+ *
+ * The table is split into shards, each with its own lock, hash buckets
+ * and an insertion ordered list.  Every entry lives for the same time,
+ * so the list is also ordered by expiry and eviction only ever looks at
+ * its head.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+#include "include/radlib_net.h"
+
+#define DUP_SHARDS	64		/* Must be a power of two */
+#define DUP_BUCKETS	1024		/* Per shard, must be a power of two */
+
+struct rad_dup_entry {
+	struct rad_dup_key	 key;
+	u_int64_t		 expires;	/* Monotonic time in ms */
+	struct rad_dup_entry	*hnext;		/* Hash chain */
+	struct rad_dup_entry	*lnext;		/* Expiry list */
+	int			 done;		/* Response has been stored */
+	size_t			 resp_len;	/* 0 if no response is sent */
+	size_t			 resp_size;
+	unsigned char		*resp;
+};
+
+struct rad_dup_shard {
+	pthread_mutex_t		 lock;
+	struct rad_dup_entry	*buckets[DUP_BUCKETS];
+	struct rad_dup_entry	*head;		/* Oldest entry */
+	struct rad_dup_entry	*tail;		/* Newest entry */
+	struct rad_dup_entry	*free;		/* Recycled entries */
+	size_t			 count;
+	size_t			 max;
+};
+
+struct rad_dup_cache {
+	u_int64_t		 lifetime;	/* In ms */
+	struct rad_dup_shard	 shards[DUP_SHARDS];
+};
+
+static u_int64_t
+dup_now(void)
+{
+	return rad_net_now() / 1000000;
+}
+
+/* FNV-1a over the key */
+static u_int32_t
+dup_hash(const struct rad_dup_key *key)
+{
+	const unsigned char *p;
+	u_int32_t h;
+	size_t i;
+
+	h = 2166136261u;
+	p = (const unsigned char *)&key->addr;
+	for (i = 0; i < sizeof key->addr; i++)
+		h = (h ^ p[i]) * 16777619u;
+	p = (const unsigned char *)&key->port;
+	for (i = 0; i < sizeof key->port; i++)
+		h = (h ^ p[i]) * 16777619u;
+	h = (h ^ key->ident) * 16777619u;
+	for (i = 0; i < LEN_AUTH; i++)
+		h = (h ^ key->auth[i]) * 16777619u;
+	return h;
+}
+
+static int
+dup_key_equal(const struct rad_dup_key *a, const struct rad_dup_key *b)
+{
+	return a->addr == b->addr && a->port == b->port &&
+	    a->ident == b->ident && memcmp(a->auth, b->auth, LEN_AUTH) == 0;
+}
+
+static void
+dup_unlink(struct rad_dup_shard *s, struct rad_dup_entry *e, u_int32_t hash)
+{
+	struct rad_dup_entry **pp;
+
+	pp = &s->buckets[(hash / DUP_SHARDS) & (DUP_BUCKETS - 1)];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+}
+
+/* Remove an entry from a shard and recycle it; the lock must be held */
+static void
+dup_remove(struct rad_dup_shard *s, struct rad_dup_entry *e)
+{
+	struct rad_dup_entry *prev;
+
+	dup_unlink(s, e, dup_hash(&e->key));
+	if (s->head == e)
+		s->head = e->lnext;
+	else {
+		for (prev = s->head; prev->lnext != e; prev = prev->lnext)
+			;
+		prev->lnext = e->lnext;
+		if (s->tail == e)
+			s->tail = prev;
+	}
+	if (s->head == NULL)
+		s->tail = NULL;
+	e->lnext = s->free;
+	s->free = e;
+	s->count--;
+}
+
+/* Drop the oldest entry of a shard; the lock must be held */
+static void
+dup_evict_head(struct rad_dup_shard *s)
+{
+	dup_remove(s, s->head);
+}
+
+static void
+dup_expire(struct rad_dup_shard *s, u_int64_t now)
+{
+	while (s->head != NULL && s->head->expires <= now)
+		dup_evict_head(s);
+}
+
+/*
+ * Create a cache keeping responses for lifetime milliseconds and holding
+ * at most max_entries of them.  Returns NULL if out of memory.
+ */
+struct rad_dup_cache *
+rad_dup_cache_create(u_int lifetime, size_t max_entries)
+{
+	struct rad_dup_cache *c;
+	int i;
+
+	if ((c = calloc(1, sizeof *c)) == NULL)
+		return NULL;
+	c->lifetime = lifetime;
+	for (i = 0; i < DUP_SHARDS; i++) {
+		pthread_mutex_init(&c->shards[i].lock, NULL);
+		c->shards[i].max = max_entries / DUP_SHARDS + 1;
+	}
+	return c;
+}
+
+void
+rad_dup_cache_destroy(struct rad_dup_cache *c)
+{
+	struct rad_dup_shard *s;
+	struct rad_dup_entry *e;
+	int i;
+
+	for (i = 0; i < DUP_SHARDS; i++) {
+		s = &c->shards[i];
+		while (s->head != NULL)
+			dup_evict_head(s);
+		while ((e = s->free) != NULL) {
+			s->free = e->lnext;
+			free(e->resp);
+			free(e);
+		}
+		pthread_mutex_destroy(&s->lock);
+	}
+	free(c);
+}
+
+/*
+ * Look a request up.  If it is new, a placeholder is inserted and
+ * RAD_DUP_NEW returned; the response must then be stored with
+ * rad_dup_cache_store().  For a duplicate of an answered request the
+ * cached response is copied to buf and RAD_DUP_CACHED returned, with *len
+ * set to 0 if the original was not answered.  RAD_DUP_IN_PROGRESS means
+ * the original has not been answered yet and the duplicate is dropped.
+ * Returns -1 with *len set to the size needed if the response does not
+ * fit into bufsize bytes.
+ */
+int
+rad_dup_cache_lookup(struct rad_dup_cache *c, const struct rad_dup_key *key,
+    void *buf, size_t bufsize, size_t *len)
+{
+	struct rad_dup_shard *s;
+	struct rad_dup_entry *e, **bucket;
+	u_int32_t hash;
+	u_int64_t now;
+	int ret;
+
+	hash = dup_hash(key);
+	s = &c->shards[hash & (DUP_SHARDS - 1)];
+	bucket = &s->buckets[(hash / DUP_SHARDS) & (DUP_BUCKETS - 1)];
+	now = dup_now();
+
+	pthread_mutex_lock(&s->lock);
+	dup_expire(s, now);
+	for (e = *bucket; e != NULL; e = e->hnext)
+		if (dup_key_equal(&e->key, key))
+			break;
+	if (e != NULL) {
+		if (!e->done)
+			ret = RAD_DUP_IN_PROGRESS;
+		else if (e->resp_len > bufsize) {
+			*len = e->resp_len;
+			ret = -1;
+		}
+		else {
+			memcpy(buf, e->resp, e->resp_len);
+			*len = e->resp_len;
+			ret = RAD_DUP_CACHED;
+		}
+		pthread_mutex_unlock(&s->lock);
+		return ret;
+	}
+
+	/* Remember the new request */
+	if (s->count >= s->max)
+		dup_evict_head(s);
+	if ((e = s->free) != NULL)
+		s->free = e->lnext;
+	else if ((e = calloc(1, sizeof *e)) == NULL) {
+		pthread_mutex_unlock(&s->lock);
+		return RAD_DUP_NEW;
+	}
+	e->key = *key;
+	e->expires = now + c->lifetime;
+	e->done = 0;
+	e->resp_len = 0;
+	e->hnext = *bucket;
+	*bucket = e;
+	e->lnext = NULL;
+	if (s->tail != NULL)
+		s->tail->lnext = e;
+	else
+		s->head = e;
+	s->tail = e;
+	s->count++;
+	pthread_mutex_unlock(&s->lock);
+	return RAD_DUP_NEW;
+}
+
+/*
+ * Store the response to a request that rad_dup_cache_lookup() reported as
+ * new.  A zero len records that the request is not answered.
+ */
+void
+rad_dup_cache_store(struct rad_dup_cache *c, const struct rad_dup_key *key,
+    const void *resp, size_t len)
+{
+	struct rad_dup_shard *s;
+	struct rad_dup_entry *e;
+	unsigned char *p;
+	u_int32_t hash;
+
+	hash = dup_hash(key);
+	s = &c->shards[hash & (DUP_SHARDS - 1)];
+
+	pthread_mutex_lock(&s->lock);
+	for (e = s->buckets[(hash / DUP_SHARDS) & (DUP_BUCKETS - 1)]; e != NULL;
+	    e = e->hnext)
+		if (dup_key_equal(&e->key, key))
+			break;
+	if (e != NULL && !e->done) {
+		if (len > e->resp_size) {
+			if ((p = realloc(e->resp, len)) == NULL) {
+				/* Forget it rather than drop retransmissions */
+				dup_remove(s, e);
+				pthread_mutex_unlock(&s->lock);
+				return;
+			}
+			e->resp = p;
+			e->resp_size = len;
+		}
+		memcpy(e->resp, resp, len);
+		e->resp_len = len;
+		e->done = 1;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
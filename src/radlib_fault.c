@@ -0,0 +1,548 @@
+/*-
+ * Fault injection
+ *
+ * rad_fault_start() puts a layer over the transport (see radlib_net.c)
+ * that damages the datagrams sent through it at the rates of a policy:
+ * it drops, delays, duplicates or truncates whole datagrams, and takes
+ * messages out of a bundle, cuts them short while their length field
+ * still counts the missing bytes, or rewrites their length field.  The
+ * client and the server each damage what they send, so running both
+ * with a policy damages requests and replies.
+ *
+ * A damaged datagram is reported to the caller as sent in full, as a
+ * datagram lost on the way would be.  Delayed datagrams are sent by a
+ * thread of the layer, so the layer is meant for the system transport;
+ * the simulated network of radlib_sim.c has its own delays and losses.
+ * Stream sockets are passed through untouched, and sendmmsg() is taken
+ * apart into one send per datagram.  The type of a socket is recorded
+ * when the layer opens it; one opened past the layer is looked up on its
+ * first send, so it should be closed through rad_net_close() as well.  Every thread draws its chances from
+ * a generator of its own, seeded from the policy.
+ */
+
+#define	_GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/radlib_private.h"
+#include "include/radlib_net.h"
+
+#define	FAULT_MAX_MSGS	(65536 / POS_ATTRS)	/* Header-only messages */
+#define	FAULT_DGRAM_MAX	65536
+#define	FAULT_MAX_FDS	65536		/* Sockets whose type is recorded */
+
+/* fault_types[] */
+#define	FAULT_UNKNOWN	0
+#define	FAULT_DGRAM	1
+#define	FAULT_STREAM	2
+
+/* A datagram held back by the delay */
+struct fault_delayed {
+	struct fault_delayed *next;
+	u_int64_t	 due;
+	int		 fd;
+	struct sockaddr_in to;
+	int		 has_to;
+	size_t		 len;
+	u_char		 data[];
+};
+
+static struct rad_fault fault_policy;
+static struct rad_fault_stats fault_counts;
+static const struct rad_net_ops *fault_inner;
+static void *fault_inner_arg;
+static int fault_running;
+static u_int fault_threads;		/* Generators handed out */
+static __thread u_int64_t fault_rng;
+static __thread size_t fault_off[FAULT_MAX_MSGS + 1];
+static u_char fault_types[FAULT_MAX_FDS];	/* FAULT_*, by descriptor */
+
+/* Delay queue, in due order since every datagram is delayed as long */
+static pthread_mutex_t delay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delay_cond;
+static pthread_t delay_thread;
+static struct fault_delayed *delay_head, *delay_tail;
+static int delay_stop;
+
+#define	FAULT_COUNT(field)						\
+	__atomic_fetch_add(&fault_counts.field, 1, __ATOMIC_RELAXED)
+
+/* xorshift64*, one per thread */
+static u_int64_t
+fault_rand(void)
+{
+	u_int64_t seed;
+
+	if (fault_rng == 0) {
+		seed = fault_policy.seed + 0x9e3779b97f4a7c15ULL *
+		    (__atomic_add_fetch(&fault_threads, 1, __ATOMIC_RELAXED));
+		seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+		fault_rng = (seed ^ (seed >> 31)) | 1;
+	}
+	fault_rng ^= fault_rng >> 12;
+	fault_rng ^= fault_rng << 25;
+	fault_rng ^= fault_rng >> 27;
+	return fault_rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* True with the given chance in percent */
+static int
+fault_chance(double percent)
+{
+	return percent > 0 &&
+	    (fault_rand() >> 11) * (100.0 / 9007199254740992.0) < percent;
+}
+
+static u_int64_t
+fault_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Record the type of a socket, or forget it with FAULT_UNKNOWN */
+static void
+fault_set_type(int fd, int type)
+{
+	if (fd >= 0 && fd < FAULT_MAX_FDS)
+		__atomic_store_n(&fault_types[fd], type, __ATOMIC_RELAXED);
+}
+
+/*
+ * Stream sockets are left alone; what is not a socket is taken as UDP.
+ * The type is asked of the system only the first time a socket is seen.
+ */
+static int
+fault_is_dgram(int fd)
+{
+	socklen_t len;
+	int type;
+
+	if (fd >= 0 && fd < FAULT_MAX_FDS &&
+	    (type = __atomic_load_n(&fault_types[fd], __ATOMIC_RELAXED)) !=
+	    FAULT_UNKNOWN)
+		return type == FAULT_DGRAM;
+	len = sizeof type;
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1)
+		return 1;
+	fault_set_type(fd, type == SOCK_STREAM ? FAULT_STREAM : FAULT_DGRAM);
+	return type != SOCK_STREAM;
+}
+
+/*
+ * Damage the messages of a datagram in place and truncate it.  Returns
+ * its new length, 0 if nothing is left of it.
+ */
+static size_t
+fault_mangle(u_char *p, size_t len)
+{
+	const struct rad_fault *f = &fault_policy;
+	size_t in, out, mlen, cut;
+	u_int16_t bad;
+	int n, i;
+
+	if ((f->msg_drop > 0 || f->msg_trunc > 0 || f->corrupt > 0) &&
+	    (n = rad_bundle_scan(p, len, fault_off, FAULT_MAX_MSGS)) > 0) {
+		out = 0;
+		for (i = 0; i < n; i++) {
+			in = fault_off[i];
+			mlen = fault_off[i + 1] - in;
+			if (fault_chance(f->msg_drop)) {
+				FAULT_COUNT(msg_dropped);
+				continue;
+			}
+			memmove(p + out, p + in, mlen);
+			if (fault_chance(f->msg_trunc)) {
+				/* Keep the length field, so it claims too much */
+				cut = POS_ATTRS + fault_rand() % (mlen - POS_ATTRS + 1);
+				if (cut == mlen)
+					cut--;
+				mlen = cut;
+				FAULT_COUNT(msg_truncated);
+			}
+			if (fault_chance(f->corrupt)) {
+				do
+					bad = fault_rand();
+				while (bad == (p[out + POS_LENGTH] << 8 |
+				    p[out + POS_LENGTH + 1]));
+				p[out + POS_LENGTH] = bad >> 8;
+				p[out + POS_LENGTH + 1] = bad;
+				FAULT_COUNT(corrupted);
+			}
+			out += mlen;
+		}
+		len = out;
+	}
+	if (len > 1 && fault_chance(f->trunc)) {
+		len = 1 + fault_rand() % (len - 1);
+		FAULT_COUNT(truncated);
+	}
+	return len;
+}
+
+static int
+fault_delay(int fd, const u_char *buf, size_t len,
+    const struct sockaddr_in *to)
+{
+	struct fault_delayed *d;
+
+	if ((d = malloc(sizeof *d + len)) == NULL)
+		return -1;
+	d->next = NULL;
+	d->due = fault_now() + (u_int64_t)fault_policy.delay_us * 1000;
+	d->fd = fd;
+	d->has_to = to != NULL;
+	if (to != NULL)
+		d->to = *to;
+	d->len = len;
+	memcpy(d->data, buf, len);
+	pthread_mutex_lock(&delay_lock);
+	if (delay_tail != NULL)
+		delay_tail->next = d;
+	else {
+		delay_head = d;
+		pthread_cond_signal(&delay_cond);
+	}
+	delay_tail = d;
+	pthread_mutex_unlock(&delay_lock);
+	FAULT_COUNT(delayed);
+	return 0;
+}
+
+/* Send the delayed datagrams as they become due */
+static void *
+delay_main(void *arg)
+{
+	struct fault_delayed *d;
+	struct timespec ts;
+	u_int64_t now;
+
+	(void)arg;
+	pthread_mutex_lock(&delay_lock);
+	while (!delay_stop) {
+		if ((d = delay_head) == NULL) {
+			pthread_cond_wait(&delay_cond, &delay_lock);
+			continue;
+		}
+		if ((now = fault_now()) < d->due) {
+			ts.tv_sec = d->due / 1000000000;
+			ts.tv_nsec = d->due % 1000000000;
+			pthread_cond_timedwait(&delay_cond, &delay_lock, &ts);
+			continue;
+		}
+		if ((delay_head = d->next) == NULL)
+			delay_tail = NULL;
+		pthread_mutex_unlock(&delay_lock);
+		/* The socket may be gone by now; nothing to tell anyone */
+		fault_inner->sendto(fault_inner_arg, d->fd, d->data, d->len, 0,
+		    d->has_to ? &d->to : NULL);
+		free(d);
+		pthread_mutex_lock(&delay_lock);
+	}
+	pthread_mutex_unlock(&delay_lock);
+	return NULL;
+}
+
+/* Send one datagram through the policy */
+static ssize_t
+fault_send(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr_in *to)
+{
+	const struct rad_fault *f = &fault_policy;
+	u_char *copy = NULL;
+	const u_char *p = buf;
+	size_t n = len;
+	ssize_t ret;
+	int error;
+
+	if (!fault_is_dgram(fd))
+		return fault_inner->sendto(fault_inner_arg, fd, buf, len, flags,
+		    to);
+	FAULT_COUNT(datagrams);
+	if (fault_chance(f->drop)) {
+		FAULT_COUNT(dropped);
+		return len;
+	}
+	if (f->msg_drop > 0 || f->msg_trunc > 0 || f->corrupt > 0 ||
+	    f->trunc > 0) {
+		if ((copy = malloc(len)) == NULL) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		memcpy(copy, buf, len);
+		if ((n = fault_mangle(copy, len)) == 0) {
+			free(copy);
+			return len;
+		}
+		p = copy;
+	}
+	ret = 0;
+	if (fault_chance(f->dup)) {
+		FAULT_COUNT(duplicated);
+		ret = fault_inner->sendto(fault_inner_arg, fd, p, n, flags, to);
+	}
+	if (ret != -1 && f->delay_us > 0 && fault_chance(f->delay))
+		ret = fault_delay(fd, p, n, to);
+	else if (ret != -1)
+		ret = fault_inner->sendto(fault_inner_arg, fd, p, n, flags, to);
+	error = errno;
+	free(copy);
+	errno = error;
+	return ret == -1 ? -1 : (ssize_t)len;
+}
+
+static int
+fault_socket(void *arg, int type)
+{
+	int fd;
+
+	(void)arg;
+	if ((fd = fault_inner->socket(fault_inner_arg, type)) != -1)
+		fault_set_type(fd, (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) ==
+		    SOCK_STREAM ? FAULT_STREAM : FAULT_DGRAM);
+	return fd;
+}
+
+static int
+fault_bind(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	(void)arg;
+	return fault_inner->bind(fault_inner_arg, fd, addr);
+}
+
+static int
+fault_connect(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	(void)arg;
+	return fault_inner->connect(fault_inner_arg, fd, addr);
+}
+
+static ssize_t
+fault_sendto(void *arg, int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr_in *to)
+{
+	(void)arg;
+	return fault_send(fd, buf, len, flags, to);
+}
+
+static ssize_t
+fault_recvfrom(void *arg, int fd, void *buf, size_t len, int flags,
+    struct sockaddr_in *from)
+{
+	(void)arg;
+	return fault_inner->recvfrom(fault_inner_arg, fd, buf, len, flags,
+	    from);
+}
+
+static int
+fault_sendmmsg(void *arg, int fd, struct mmsghdr *msgs, u_int n, int flags)
+{
+	static __thread u_char buf[FAULT_DGRAM_MAX];
+	const struct msghdr *m;
+	size_t len;
+	ssize_t ret;
+	u_int i, j;
+
+	(void)arg;
+	for (i = 0; i < n; i++) {
+		m = &msgs[i].msg_hdr;
+		for (len = 0, j = 0; j < m->msg_iovlen; j++) {
+			if (len + m->msg_iov[j].iov_len > sizeof buf) {
+				errno = EMSGSIZE;
+				return i > 0 ? (int)i : -1;
+			}
+			memcpy(buf + len, m->msg_iov[j].iov_base,
+			    m->msg_iov[j].iov_len);
+			len += m->msg_iov[j].iov_len;
+		}
+		if ((ret = fault_send(fd, buf, len, flags, m->msg_name)) == -1)
+			return i > 0 ? (int)i : -1;
+		msgs[i].msg_len = ret;
+	}
+	return n;
+}
+
+static int
+fault_close(void *arg, int fd)
+{
+	(void)arg;
+	fault_set_type(fd, FAULT_UNKNOWN);
+	return fault_inner->close(fault_inner_arg, fd);
+}
+
+static int
+fault_wait(void *arg, int fd, u_int64_t timeout_ns)
+{
+	(void)arg;
+	return fault_inner->wait(fault_inner_arg, fd, timeout_ns);
+}
+
+static u_int64_t
+fault_clock(void *arg)
+{
+	(void)arg;
+	return fault_inner->now(fault_inner_arg);
+}
+
+static time_t
+fault_time(void *arg)
+{
+	(void)arg;
+	return fault_inner->time(fault_inner_arg);
+}
+
+static const struct rad_net_ops fault_ops = {
+	fault_socket, fault_bind, fault_connect, fault_sendto, fault_recvfrom,
+	fault_sendmmsg, fault_close, fault_wait, fault_clock, fault_time
+};
+
+/*
+ * Parse a policy: comma separated name=percent pairs out of drop, dup,
+ * trunc, msgdrop, msgtrunc and corrupt, delay=percent:usec and seed=n,
+ * e.g. "drop=1,delay=5:20000,corrupt=0.1".  Returns 0, or -1 if invalid.
+ */
+int
+rad_fault_parse(const char *spec, struct rad_fault *f)
+{
+	static const struct {
+		const char	*name;
+		size_t		 off;
+	} names[] = {
+		{ "drop",	offsetof(struct rad_fault, drop) },
+		{ "delay",	offsetof(struct rad_fault, delay) },
+		{ "dup",	offsetof(struct rad_fault, dup) },
+		{ "trunc",	offsetof(struct rad_fault, trunc) },
+		{ "msgdrop",	offsetof(struct rad_fault, msg_drop) },
+		{ "msgtrunc",	offsetof(struct rad_fault, msg_trunc) },
+		{ "corrupt",	offsetof(struct rad_fault, corrupt) },
+	};
+	const char *p, *eq;
+	char *end;
+	double *v;
+	size_t i;
+
+	memset(f, 0, sizeof *f);
+	f->seed = 1;
+	for (p = spec; *p != '\0'; p = *end == ',' ? end + 1 : end) {
+		if ((eq = strchr(p, '=')) == NULL)
+			return -1;
+		if (eq - p == 4 && strncmp(p, "seed", 4) == 0) {
+			f->seed = strtoull(eq + 1, &end, 0);
+			if (end == eq + 1 || (*end != ',' && *end != '\0'))
+				return -1;
+			continue;
+		}
+		for (i = 0; i < sizeof names / sizeof names[0]; i++)
+			if (strlen(names[i].name) == (size_t)(eq - p) &&
+			    strncmp(p, names[i].name, eq - p) == 0)
+				break;
+		if (i == sizeof names / sizeof names[0])
+			return -1;
+		v = (double *)((char *)f + names[i].off);
+		*v = strtod(eq + 1, &end);
+		if (end == eq + 1 || *v < 0 || *v > 100)
+			return -1;
+		if (v == &f->delay) {
+			if (*end != ':')
+				return -1;
+			f->delay_us = strtoul(end + 1, &end, 10);
+		}
+		if (*end != ',' && *end != '\0')
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Damage what is sent through rad_net_*() from now on, as policy says.
+ * Call it before the threads that send start.  Returns 0, or -1 with
+ * errno set.
+ */
+int
+rad_fault_start(const struct rad_fault *policy)
+{
+	pthread_condattr_t attr;
+	int error;
+
+	if (fault_running) {
+		errno = EBUSY;
+		return -1;
+	}
+	fault_policy = *policy;
+	memset(&fault_counts, 0, sizeof fault_counts);
+	memset(fault_types, 0, sizeof fault_types);
+	rad_net_get(&fault_inner, &fault_inner_arg);
+	if (policy->delay > 0 && policy->delay_us > 0) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&delay_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		delay_stop = 0;
+		if ((error = pthread_create(&delay_thread, NULL, delay_main,
+		    NULL)) != 0) {
+			pthread_cond_destroy(&delay_cond);
+			errno = error;
+			return -1;
+		}
+	}
+	rad_net_set(&fault_ops, NULL);
+	fault_running = 1;
+	return 0;
+}
+
+/* Stop damaging, dropping the datagrams still delayed */
+void
+rad_fault_stop(void)
+{
+	struct fault_delayed *d;
+
+	if (!fault_running)
+		return;
+	rad_net_set(fault_inner, fault_inner_arg);
+	if (fault_policy.delay > 0 && fault_policy.delay_us > 0) {
+		pthread_mutex_lock(&delay_lock);
+		delay_stop = 1;
+		pthread_cond_signal(&delay_cond);
+		pthread_mutex_unlock(&delay_lock);
+		pthread_join(delay_thread, NULL);
+		pthread_cond_destroy(&delay_cond);
+		while ((d = delay_head) != NULL) {
+			delay_head = d->next;
+			free(d);
+		}
+		delay_tail = NULL;
+	}
+	fault_running = 0;
+}
+
+/* What has been done to the datagrams so far */
+void
+rad_fault_stats(struct rad_fault_stats *st)
+{
+	st->datagrams = __atomic_load_n(&fault_counts.datagrams,
+	    __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&fault_counts.dropped, __ATOMIC_RELAXED);
+	st->delayed = __atomic_load_n(&fault_counts.delayed, __ATOMIC_RELAXED);
+	st->duplicated = __atomic_load_n(&fault_counts.duplicated,
+	    __ATOMIC_RELAXED);
+	st->truncated = __atomic_load_n(&fault_counts.truncated,
+	    __ATOMIC_RELAXED);
+	st->msg_dropped = __atomic_load_n(&fault_counts.msg_dropped,
+	    __ATOMIC_RELAXED);
+	st->msg_truncated = __atomic_load_n(&fault_counts.msg_truncated,
+	    __ATOMIC_RELAXED);
+	st->corrupted = __atomic_load_n(&fault_counts.corrupted,
+	    __ATOMIC_RELAXED);
+}
@@ -0,0 +1,296 @@
+/*-
+ * Indexed attribute access for received RADIUS messages
+ *
+ * rad_get_attr() is a cursor, so finding one attribute means walking the
+ * message from the start.  rad_index_attrs() walks it once instead,
+ * checking every attribute length, and records for each attribute type
+ * the first and last occurrence with a chain through the others in
+ * message order.  The sub-attributes of Vendor-Specific attributes are
+ * indexed separately by (vendor, type) in a small open addressing table.
+ * Lookups return pointers into h->in and stay valid until the next
+ * message is received into the handle.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+#define IDX_END		0xffff		/* End of a chain */
+#define VSA_HDR		6		/* Vendor-Id and sub-attribute header */
+
+void	 generr(struct rad_handle *, const char *, ...);
+
+static int
+index_grow(void **p, int *size, size_t elsize)
+{
+	void *n;
+	int sz;
+
+	sz = *size ? *size * 2 : 64;
+	if ((n = realloc(*p, sz * elsize)) == NULL)
+		return -1;
+	*p = n;
+	*size = sz;
+	return 0;
+}
+
+static u_int32_t
+vsa_hash(u_int32_t vendor, int type)
+{
+	u_int32_t h;
+
+	h = (vendor << 8 | type) * 2654435761U;
+	return h ^ h >> 16;
+}
+
+/* Slot of the chain for (vendor, type), or of the free slot ending its probe */
+static int
+vsa_slot(const struct rad_attr_index *x, u_int32_t vendor, int type)
+{
+	const struct rad_vsa_ref *v;
+	int i;
+
+	i = vsa_hash(vendor, type) & (x->hash_size - 1);
+	while (x->vsa_hash[i] != IDX_END) {
+		v = &x->vsas[x->vsa_hash[i]];
+		if (v->vendor == vendor && v->type == type)
+			break;
+		i = (i + 1) & (x->hash_size - 1);
+	}
+	return i;
+}
+
+/* Record the sub-attributes of a Vendor-Specific attribute, if well formed */
+static int
+index_vsa(struct rad_attr_index *x, const u_char *in, int pos, int len)
+{
+	struct rad_vsa_ref *v;
+	u_int32_t vendor;
+	int end, p;
+
+	if (len < VSA_HDR)
+		return 0;
+	end = pos + len;
+	for (p = pos + 4; p < end; p += in[p + 1])
+		if (p + 2 > end || in[p + 1] < 2 || p + in[p + 1] > end)
+			return 0;	/* Not in the RFC 2865 format */
+
+	vendor = (u_int32_t)in[pos] << 24 | in[pos + 1] << 16 |
+	    in[pos + 2] << 8 | in[pos + 3];
+	for (p = pos + 4; p < end; p += in[p + 1]) {
+		if (x->no_vsas == x->vsa_size &&
+		    index_grow((void **)&x->vsas, &x->vsa_size,
+		    sizeof *x->vsas) == -1)
+			return -1;
+		v = &x->vsas[x->no_vsas++];
+		v->vendor = vendor;
+		v->type = in[p];
+		v->len = in[p + 1] - 2;
+		v->off = p + 2;
+		v->next = IDX_END;
+	}
+	return 0;
+}
+
+/* Chain the vendor sub-attributes by (vendor, type) */
+static int
+index_vsa_chains(struct rad_attr_index *x)
+{
+	struct rad_vsa_ref *v;
+	u_int16_t *last;
+	int i, slot, size;
+
+	if (x->no_vsas == 0)
+		return 0;
+	for (size = 16; size < 2 * x->no_vsas; size *= 2)
+		;
+	if (size > x->hash_size) {
+		free(x->vsa_hash);
+		free(x->vsa_last);
+		x->vsa_hash = malloc(size * sizeof *x->vsa_hash);
+		x->vsa_last = malloc(size * sizeof *x->vsa_last);
+		if (x->vsa_hash == NULL || x->vsa_last == NULL) {
+			x->hash_size = 0;
+			return -1;
+		}
+		x->hash_size = size;
+	}
+	memset(x->vsa_hash, 0xff, x->hash_size * sizeof *x->vsa_hash);
+	last = x->vsa_last;
+	for (i = 0; i < x->no_vsas; i++) {
+		v = &x->vsas[i];
+		slot = vsa_slot(x, v->vendor, v->type);
+		if (x->vsa_hash[slot] == IDX_END)
+			x->vsa_hash[slot] = i;
+		else
+			x->vsas[last[slot]].next = i;
+		last[slot] = i;
+	}
+	return 0;
+}
+
+/*
+ * Index the attributes of the message in h->in.  Returns the number of
+ * attributes, or -1 if an attribute length is out of bounds.
+ */
+int
+rad_index_attrs(struct rad_handle *h)
+{
+	struct rad_attr_index *x;
+	struct rad_attr_ref *a;
+	u_int16_t last[256];
+	int pos, type, len;
+
+	h->idx_valid = 0;
+	if (h->idx == NULL && (h->idx = calloc(1, sizeof *h->idx)) == NULL) {
+		generr(h, "Out of memory");
+		return -1;
+	}
+	x = h->idx;
+	x->no_attrs = 0;
+	x->no_vsas = 0;
+	memset(x->first, 0xff, sizeof x->first);
+
+	for (pos = POS_ATTRS; pos < h->in_len; pos += len) {
+		if (pos + 2 > h->in_len) {
+			generr(h, "Malformed attribute in message");
+			return -1;
+		}
+		type = h->in[pos];
+		len = h->in[pos + 1];
+		if (len < 2 || pos + len > h->in_len) {
+			generr(h, "Malformed attribute in message");
+			return -1;
+		}
+		if (x->no_attrs == x->size &&
+		    index_grow((void **)&x->attrs, &x->size,
+		    sizeof *x->attrs) == -1) {
+			generr(h, "Out of memory");
+			return -1;
+		}
+		a = &x->attrs[x->no_attrs];
+		a->off = pos + 2;
+		a->len = len - 2;
+		a->next = IDX_END;
+		if (x->first[type] == IDX_END)
+			x->first[type] = x->no_attrs;
+		else
+			x->attrs[last[type]].next = x->no_attrs;
+		last[type] = x->no_attrs++;
+
+		if (type == RAD_VENDOR_SPECIFIC &&
+		    index_vsa(x, h->in, pos + 2, len - 2) == -1) {
+			generr(h, "Out of memory");
+			return -1;
+		}
+	}
+	if (index_vsa_chains(x) == -1) {
+		generr(h, "Out of memory");
+		return -1;
+	}
+	h->idx_valid = 1;
+	return x->no_attrs;
+}
+
+static int
+index_valid(struct rad_handle *h)
+{
+	if (!h->idx_valid) {
+		generr(h, "Attributes are not indexed");
+		return 0;
+	}
+	return 1;
+}
+
+static int
+attr_ref(struct rad_handle *h, int i, const void **value, size_t *len)
+{
+	if (i == IDX_END)
+		return 0;
+	*value = &h->in[h->idx->attrs[i].off];
+	*len = h->idx->attrs[i].len;
+	return i + 1;
+}
+
+/*
+ * Find the first attribute of a type.  Returns a cursor for
+ * rad_find_next_attr(), 0 if there is none and -1 on error.
+ */
+int
+rad_find_attr(struct rad_handle *h, int type, const void **value,
+    size_t *len)
+{
+	if (!index_valid(h))
+		return -1;
+	if (type < 0 || type > 255)
+		return 0;
+	return attr_ref(h, h->idx->first[type], value, len);
+}
+
+/* Find the next attribute of the same type as the one at cursor */
+int
+rad_find_next_attr(struct rad_handle *h, int cursor, const void **value,
+    size_t *len)
+{
+	if (!index_valid(h))
+		return -1;
+	if (cursor < 1 || cursor > h->idx->no_attrs) {
+		generr(h, "Invalid attribute cursor");
+		return -1;
+	}
+	return attr_ref(h, h->idx->attrs[cursor - 1].next, value, len);
+}
+
+static int
+vsa_ref(struct rad_handle *h, int i, const void **value, size_t *len)
+{
+	if (i == IDX_END)
+		return 0;
+	*value = &h->in[h->idx->vsas[i].off];
+	*len = h->idx->vsas[i].len;
+	return i + 1;
+}
+
+/* As rad_find_attr(), for a sub-attribute of a vendor */
+int
+rad_find_vendor_attr(struct rad_handle *h, u_int32_t vendor, int type,
+    const void **value, size_t *len)
+{
+	const struct rad_attr_index *x = h->idx;
+
+	if (!index_valid(h))
+		return -1;
+	if (x->no_vsas == 0)
+		return 0;
+	return vsa_ref(h, x->vsa_hash[vsa_slot(x, vendor, type)], value, len);
+}
+
+int
+rad_find_next_vendor_attr(struct rad_handle *h, int cursor,
+    const void **value, size_t *len)
+{
+	if (!index_valid(h))
+		return -1;
+	if (cursor < 1 || cursor > h->idx->no_vsas) {
+		generr(h, "Invalid attribute cursor");
+		return -1;
+	}
+	return vsa_ref(h, h->idx->vsas[cursor - 1].next, value, len);
+}
+
+void
+rad_index_free(struct rad_attr_index *x)
+{
+	if (x == NULL)
+		return;
+	free(x->attrs);
+	free(x->vsas);
+	free(x->vsa_hash);
+	free(x->vsa_last);
+	free(x);
+}
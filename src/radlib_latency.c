@@ -0,0 +1,495 @@
+/*-
+ * Request latency histograms
+ *
+ * With rad_set_latency() a handle timestamps its requests when they are
+ * created, sent, when their reply starts to arrive and when they are
+ * completed, and records the intervals in histograms kept per server,
+ * request kind (Access, Accounting, other) and bundle size.  The
+ * histograms are log-linear, as in HdrHistogram: values below 64 ns are
+ * counted exactly and every further power of two is split into 32
+ * buckets, so a value is reported at most 1/32 above what was recorded.
+ *
+ * Every thread records into histograms of its own with plain stores, no
+ * locks or atomic read-modify-write; readers merge the histograms of all
+ * threads.  The histograms of a thread are kept after it exits, so none
+ * of its samples are lost.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/radlib_private.h"
+#include "include/radlib_net.h"
+
+#define LAT_SUB		32		/* Buckets per power of two */
+#define LAT_EXACT	(2 * LAT_SUB)	/* Values counted exactly */
+#define LAT_MAX		(1ULL << 38)	/* About 275 s; larger values are clamped */
+#define LAT_BUCKETS	((38 - 4) * LAT_SUB)
+#define LAT_SERVERS	16		/* Per thread, the last one takes the rest */
+
+struct lat_hist {
+	u_int64_t	 total;		/* Sum of the values */
+	u_int64_t	 min;
+	u_int64_t	 max;
+	u_int64_t	 counts[LAT_BUCKETS];
+};
+
+/* The histograms of one thread, allocated on first use */
+struct lat_thread {
+	struct lat_thread *next;
+	int		 no_servers;
+	struct sockaddr_in servers[LAT_SERVERS];
+	struct lat_hist	*hists[LAT_SERVERS][RAD_LAT_KINDS][RAD_LAT_BUNDLES]
+			    [RAD_LAT_STAGES];
+};
+
+static const char *lat_kind_names[RAD_LAT_KINDS] = {
+	"access", "accounting", "other"
+};
+static const char *lat_bundle_names[RAD_LAT_BUNDLES] = {
+	"1", "2-4", "5-16", "17-64", "65+"
+};
+static const char *lat_stage_names[RAD_LAT_STAGES] = {
+	"queue", "wire", "process", "total"
+};
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lat_thread *lat_threads;	/* Newest first, never shrinks */
+static __thread struct lat_thread *lat_self;
+
+/* Periodic dump */
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dump_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dump_thread;
+static int dump_running, dump_stop;
+static FILE *dump_fp;
+static u_int dump_msec;
+
+/* The transport's clock, so that simulated runs are timed virtually */
+u_int64_t
+rad_lat_now(void)
+{
+	return rad_net_now();
+}
+
+static int
+lat_index(u_int64_t v)
+{
+	int m;
+
+	if (v >= LAT_MAX)
+		v = LAT_MAX - 1;
+	if (v < LAT_EXACT)
+		return v;
+	m = 63 - __builtin_clzll(v);
+	return (m - 5) * LAT_SUB + (v >> (m - 5));
+}
+
+/* Highest value counted in a bucket */
+static u_int64_t
+lat_value(int i)
+{
+	int shift;
+
+	if (i < LAT_EXACT)
+		return i;
+	shift = i / LAT_SUB - 1;
+	return ((u_int64_t)(i % LAT_SUB + LAT_SUB) << shift) +
+	    ((u_int64_t)1 << shift) - 1;
+}
+
+static int
+lat_bundle(int n)
+{
+	int b;
+
+	if (n <= 1)
+		return 0;
+	b = (64 - __builtin_clzll(n - 1) + 1) / 2;
+	return b < RAD_LAT_BUNDLES ? b : RAD_LAT_BUNDLES - 1;
+}
+
+static int
+lat_kind(int code)
+{
+	switch (code) {
+	case RAD_ACCESS_REQUEST:
+		return RAD_LAT_ACCESS;
+	case RAD_ACCOUNTING_REQUEST:
+		return RAD_LAT_ACCOUNTING;
+	default:
+		return RAD_LAT_OTHER;
+	}
+}
+
+static struct lat_thread *
+lat_thread_get(void)
+{
+	struct lat_thread *t;
+
+	if (lat_self != NULL)
+		return lat_self;
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return NULL;
+	pthread_mutex_lock(&lat_lock);
+	t->next = lat_threads;
+	lat_threads = t;
+	pthread_mutex_unlock(&lat_lock);
+	return lat_self = t;
+}
+
+static int
+lat_addr_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+	    a->sin_port == b->sin_port;
+}
+
+static int
+lat_server_slot(struct lat_thread *t, const struct sockaddr_in *addr)
+{
+	int i;
+
+	for (i = 0; i < t->no_servers; i++)
+		if (lat_addr_equal(&t->servers[i], addr))
+			return i;
+	if (i == LAT_SERVERS)
+		return LAT_SERVERS - 1;
+	t->servers[i] = *addr;
+	if (i == LAT_SERVERS - 1)	/* Shared by all the servers from now on */
+		memset(&t->servers[i], 0, sizeof t->servers[i]);
+	__atomic_store_n(&t->no_servers, i + 1, __ATOMIC_RELEASE);
+	return i;
+}
+
+/* Count a value; only the owning thread writes a histogram */
+static void
+lat_add(struct lat_hist **hp, u_int64_t v)
+{
+	struct lat_hist *h;
+	int i;
+
+	if ((h = *hp) == NULL) {
+		if ((h = calloc(1, sizeof *h)) == NULL)
+			return;
+		h->min = ~(u_int64_t)0;
+		__atomic_store_n(hp, h, __ATOMIC_RELEASE);
+	}
+	i = lat_index(v);
+	__atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total + v, __ATOMIC_RELAXED);
+	if (v < h->min)
+		__atomic_store_n(&h->min, v, __ATOMIC_RELAXED);
+	if (v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* Record the latencies of a request that has just been completed */
+void
+rad_lat_record(const struct rad_request *r)
+{
+	struct lat_hist **hists;
+	struct lat_thread *t;
+	u_int64_t now;
+	int slot;
+
+	now = rad_lat_now();
+	if ((t = lat_thread_get()) == NULL)
+		return;
+	slot = lat_server_slot(t, &r->h->servers[r->h->srv].addr);
+	hists = t->hists[slot][lat_kind(r->out[POS_CODE])]
+	    [lat_bundle(r->bundle)];
+	if (r->t_sent != 0) {
+		lat_add(&hists[RAD_LAT_QUEUE], r->t_sent - r->t_created);
+		if (r->t_received != 0) {
+			lat_add(&hists[RAD_LAT_WIRE], r->t_received - r->t_sent);
+			lat_add(&hists[RAD_LAT_PROCESS], now - r->t_received);
+		}
+	}
+	lat_add(&hists[RAD_LAT_TOTAL], now - r->t_created);
+}
+
+/*
+ * Time the requests of a handle from now on, or stop.  Requests created
+ * while it is on are recorded when rad_req_complete() is called.
+ */
+void
+rad_set_latency(struct rad_handle *h, int on)
+{
+	h->latency = on != 0;
+}
+
+/*
+ * Note that a request has been sent in a bundle of the given number of
+ * requests.  Only the first transmission counts.
+ */
+void
+rad_req_sent(struct rad_request *r, int bundle)
+{
+	if (r->t_created == 0 || r->t_sent != 0)
+		return;
+	r->t_sent = rad_lat_now();
+	r->bundle = bundle;
+}
+
+/* Note that the reply to a request has started to arrive */
+void
+rad_req_received(struct rad_request *r)
+{
+	if (r->t_created == 0 || r->t_received != 0)
+		return;
+	r->t_received = rad_lat_now();
+}
+
+/*
+ * Time a request from when it was due to be sent, a CLOCK_MONOTONIC time,
+ * rather than from its creation.  A load generator that falls behind its
+ * schedule then records the delay in the queue and total stages instead
+ * of hiding it.
+ */
+void
+rad_req_schedule(struct rad_request *r, const struct timespec *due)
+{
+	if (r->t_created == 0)
+		return;
+	r->t_created = (u_int64_t)due->tv_sec * 1000000000 + due->tv_nsec;
+}
+
+/* Add the histograms of every thread matching the selection to m */
+static void
+lat_merge(struct lat_hist *m, const struct sockaddr_in *server, int kind,
+    int bundle, int stage)
+{
+	struct lat_thread *t;
+	struct lat_hist *h;
+	int n, s, k, b, i;
+	u_int64_t v;
+
+	memset(m, 0, sizeof *m);
+	m->min = ~(u_int64_t)0;
+	pthread_mutex_lock(&lat_lock);
+	t = lat_threads;
+	pthread_mutex_unlock(&lat_lock);
+	for (; t != NULL; t = t->next) {
+		n = __atomic_load_n(&t->no_servers, __ATOMIC_ACQUIRE);
+		for (s = 0; s < n; s++) {
+			if (server != NULL &&
+			    !lat_addr_equal(&t->servers[s], server))
+				continue;
+			for (k = 0; k < RAD_LAT_KINDS; k++) {
+				if (kind != RAD_LAT_ANY && k != kind)
+					continue;
+				for (b = 0; b < RAD_LAT_BUNDLES; b++) {
+					if (bundle != RAD_LAT_ANY && b != bundle)
+						continue;
+					h = __atomic_load_n(
+					    &t->hists[s][k][b][stage],
+					    __ATOMIC_ACQUIRE);
+					if (h == NULL)
+						continue;
+					for (i = 0; i < LAT_BUCKETS; i++)
+						m->counts[i] += __atomic_load_n(
+						    &h->counts[i],
+						    __ATOMIC_RELAXED);
+					m->total += __atomic_load_n(&h->total,
+					    __ATOMIC_RELAXED);
+					v = __atomic_load_n(&h->min,
+					    __ATOMIC_RELAXED);
+					if (v < m->min)
+						m->min = v;
+					v = __atomic_load_n(&h->max,
+					    __ATOMIC_RELAXED);
+					if (v > m->max)
+						m->max = v;
+				}
+			}
+		}
+	}
+}
+
+static u_int64_t
+lat_percentile(const struct lat_hist *m, u_int64_t count, double p)
+{
+	u_int64_t want, seen, v;
+	int i;
+
+	want = p * count + 0.5;
+	if (want < 1)
+		want = 1;
+	for (i = 0, seen = 0; i < LAT_BUCKETS; i++) {
+		seen += m->counts[i];
+		if (seen >= want)
+			break;
+	}
+	v = lat_value(i < LAT_BUCKETS ? i : LAT_BUCKETS - 1);
+	return v < m->max ? v : m->max;
+}
+
+/*
+ * Merge the latencies recorded by all threads for a stage (RAD_LAT_*)
+ * into *l.  server, kind and bundle select what is merged; pass NULL or
+ * RAD_LAT_ANY to take all.  A server given to rad_add_server() beyond the
+ * 15th of a thread is only found under INADDR_ANY, port 0.  Returns -1
+ * if an argument is out of range.
+ */
+int
+rad_latency_get(const struct sockaddr_in *server, int kind, int bundle,
+    int stage, struct rad_latency *l)
+{
+	struct lat_hist *m;
+	u_int64_t count;
+	int i;
+
+	if (stage < 0 || stage >= RAD_LAT_STAGES ||
+	    kind < RAD_LAT_ANY || kind >= RAD_LAT_KINDS ||
+	    bundle < RAD_LAT_ANY || bundle >= RAD_LAT_BUNDLES)
+		return -1;
+	if ((m = malloc(sizeof *m)) == NULL)
+		return -1;
+	lat_merge(m, server, kind, bundle, stage);
+	memset(l, 0, sizeof *l);
+	for (count = 0, i = 0; i < LAT_BUCKETS; i++)
+		count += m->counts[i];
+	if (count != 0) {
+		l->count = count;
+		l->min = m->min;
+		l->mean = m->total / count;
+		l->p50 = lat_percentile(m, count, 0.5);
+		l->p90 = lat_percentile(m, count, 0.9);
+		l->p99 = lat_percentile(m, count, 0.99);
+		l->p999 = lat_percentile(m, count, 0.999);
+		l->max = m->max;
+	}
+	free(m);
+	return 0;
+}
+
+/*
+ * Print one line per server, request kind, bundle size and stage that has
+ * samples, with the count and the latencies in microseconds.  Returns -1
+ * if out of memory.
+ */
+int
+rad_latency_dump(FILE *fp)
+{
+	struct sockaddr_in servers[LAT_SERVERS * 4];
+	struct lat_thread *t;
+	struct rad_latency l;
+	char addr[INET_ADDRSTRLEN];
+	int no_servers = 0, n, s, i, k, b, st;
+
+	/* Servers seen by any thread */
+	pthread_mutex_lock(&lat_lock);
+	t = lat_threads;
+	pthread_mutex_unlock(&lat_lock);
+	for (; t != NULL; t = t->next) {
+		n = __atomic_load_n(&t->no_servers, __ATOMIC_ACQUIRE);
+		for (s = 0; s < n; s++) {
+			for (i = 0; i < no_servers; i++)
+				if (lat_addr_equal(&servers[i], &t->servers[s]))
+					break;
+			if (i == no_servers && no_servers < LAT_SERVERS * 4)
+				servers[no_servers++] = t->servers[s];
+		}
+	}
+
+	for (i = 0; i < no_servers; i++) {
+		inet_ntop(AF_INET, &servers[i].sin_addr, addr, sizeof addr);
+		for (k = 0; k < RAD_LAT_KINDS; k++)
+			for (b = 0; b < RAD_LAT_BUNDLES; b++)
+				for (st = 0; st < RAD_LAT_STAGES; st++) {
+					if (rad_latency_get(&servers[i], k, b,
+					    st, &l) == -1)
+						return -1;
+					if (l.count == 0)
+						continue;
+					fprintf(fp, "%s:%d %s bundle %s %s"
+					    " count %llu min %.1f mean %.1f"
+					    " p50 %.1f p90 %.1f p99 %.1f"
+					    " p99.9 %.1f max %.1f us\n", addr,
+					    ntohs(servers[i].sin_port),
+					    lat_kind_names[k],
+					    lat_bundle_names[b],
+					    lat_stage_names[st],
+					    (unsigned long long)l.count,
+					    l.min / 1e3, l.mean / 1e3,
+					    l.p50 / 1e3, l.p90 / 1e3,
+					    l.p99 / 1e3, l.p999 / 1e3,
+					    l.max / 1e3);
+				}
+	}
+	fflush(fp);
+	return 0;
+}
+
+static void *
+dump_run(void *arg)
+{
+	struct timespec due;
+
+	pthread_mutex_lock(&dump_lock);
+	clock_gettime(CLOCK_REALTIME, &due);
+	while (!dump_stop) {
+		due.tv_sec += dump_msec / 1000;
+		due.tv_nsec += (dump_msec % 1000) * 1000000;
+		if (due.tv_nsec >= 1000000000) {
+			due.tv_sec++;
+			due.tv_nsec -= 1000000000;
+		}
+		while (!dump_stop &&
+		    pthread_cond_timedwait(&dump_cond, &dump_lock, &due) == 0)
+			;
+		if (!dump_stop)
+			rad_latency_dump(dump_fp);
+	}
+	pthread_mutex_unlock(&dump_lock);
+	return NULL;
+}
+
+/*
+ * Dump the latencies to fp every msec milliseconds from a thread of its
+ * own, until rad_latency_dump_stop().  Returns -1 if a dump is already
+ * running or the thread cannot be started.
+ */
+int
+rad_latency_dump_start(FILE *fp, u_int msec)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&dump_lock);
+	if (dump_running || msec == 0)
+		ret = -1;
+	else {
+		dump_fp = fp;
+		dump_msec = msec;
+		dump_stop = 0;
+		if (pthread_create(&dump_thread, NULL, dump_run, NULL) != 0)
+			ret = -1;
+		else
+			dump_running = 1;
+	}
+	pthread_mutex_unlock(&dump_lock);
+	return ret;
+}
+
+void
+rad_latency_dump_stop(void)
+{
+	pthread_mutex_lock(&dump_lock);
+	if (!dump_running) {
+		pthread_mutex_unlock(&dump_lock);
+		return;
+	}
+	dump_stop = 1;
+	pthread_cond_signal(&dump_cond);
+	pthread_mutex_unlock(&dump_lock);
+	pthread_join(dump_thread, NULL);
+	dump_running = 0;
+}
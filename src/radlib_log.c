@@ -0,0 +1,718 @@
+/*-
+ * Asynchronous logging
+ *
+ * Formatting a line with printf() and writing it to a terminal costs
+ * microseconds, more than handling a request.  RAD_LOG() instead copies
+ * its format pointer and arguments into a binary record in a ring of the
+ * calling thread, with no locks or system calls, and a thread started by
+ * rad_log_start() formats the records of all rings in timestamp order.
+ * Strings are copied into the record, truncated to LOG_STRMAX bytes, as
+ * they may not live until it is formatted; the format itself must be a
+ * literal or otherwise outlive the logger.  A record that does not fit
+ * into a full ring is dropped and counted.
+ *
+ * The levels and categories enabled are in rad_log_mask[], which RAD_LOG()
+ * tests before evaluating anything else, so a disabled call is a load and
+ * a branch.  Before rad_log_start() and after rad_log_stop() records are
+ * formatted by the calling thread, to stderr.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/radlib_log.h"
+
+#define LOG_RING	(1 << 20)	/* Bytes per thread, a power of two */
+#define LOG_RECMAX	4096		/* Largest record */
+#define LOG_STRMAX	255		/* Longest string argument */
+#define LOG_SPECMAX	32		/* Longest conversion specification */
+#define LOG_LINEMAX	2048		/* Longest line, longer ones are cut */
+
+#define ALIGN8(n)	(((n) + 7) & ~(size_t)7)
+
+/* Record types */
+#define REC_ARGS	0		/* Format and arguments */
+#define REC_TEXT	1		/* Formatted by the producer */
+#define REC_PAD		2		/* Skip to the start of the ring */
+
+/* Record header, followed by 8 byte argument slots or text */
+struct log_rec {
+	u_int32_t	 len;		/* Including the header, a multiple of 8 */
+	u_int8_t	 type;
+	u_int8_t	 level;
+	u_int16_t	 cat;
+	u_int64_t	 ts;		/* CLOCK_REALTIME, ns */
+	const char	*fmt;
+};
+
+/*
+ * A ring of one thread.  head is only written by the thread and tail by
+ * the consumer; both count bytes from the start and are never wrapped.
+ */
+struct log_ring {
+	struct log_ring	*next;
+	u_int64_t	 head;
+	u_int64_t	 tail;
+	u_int64_t	 dropped;
+	int		 dead;		/* Thread exited, free when drained */
+	u_char		 buf[LOG_RING] __attribute__((aligned(8)));
+};
+
+u_int32_t rad_log_mask[RAD_LOG_LEVELS] = {
+	RAD_LOGC_ALL, RAD_LOGC_ALL, RAD_LOGC_ALL, 0, 0
+};
+
+static const char *log_level_names[RAD_LOG_LEVELS] = {
+	"error", "warn", "info", "debug", "trace"
+};
+static const struct {
+	const char	*name;
+	u_int32_t	 cat;
+} log_cats[] = {
+	{ "general",	RAD_LOGC_GENERAL },
+	{ "net",	RAD_LOGC_NET },
+	{ "bundle",	RAD_LOGC_BUNDLE },
+	{ "proto",	RAD_LOGC_PROTO },
+	{ "all",	RAD_LOGC_ALL },
+};
+#define NCATS	(sizeof log_cats / sizeof log_cats[0])
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings;	/* Under log_lock */
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static __thread struct log_ring *log_self;
+
+/* Consumer */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t log_thread;
+static int log_async;			/* Producers use their rings */
+static int log_running, log_stopping;
+static FILE *log_fp;
+static u_int64_t log_dropped_gone;	/* By freed rings, under log_lock */
+static u_int64_t log_dropped_seen;	/* Reported, under drain_lock */
+static struct log_ring **drain_rings;	/* Snapshot, under drain_lock */
+static u_int64_t *drain_heads;
+static int drain_size;			/* Entries of both */
+
+static void
+ring_exit(void *arg)
+{
+	struct log_ring *r = arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void
+log_init(void)
+{
+	pthread_key_create(&log_key, ring_exit);
+}
+
+static struct log_ring *
+ring_get(void)
+{
+	struct log_ring *r;
+
+	if (log_self != NULL)
+		return log_self;
+	pthread_once(&log_once, log_init);
+	if ((r = calloc(1, sizeof *r)) == NULL)
+		return NULL;
+	pthread_setspecific(log_key, r);
+	pthread_mutex_lock(&log_lock);
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_lock);
+	log_self = r;
+	return r;
+}
+
+static u_int64_t
+log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Parse the conversion specification at f, just after the '%'.  Returns
+ * its length up to and including the conversion character, and sets the
+ * length modifier, the conversion and the number of '*'s.  Returns 0 for
+ * what cannot be deferred: positional arguments, %n, %m, wide strings and
+ * long doubles.
+ */
+static int
+spec_parse(const char *f, char *mod, char *conv, int *stars)
+{
+	const char *p = f;
+
+	*stars = 0;
+	*mod = 0;
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+		p++;
+	if (*p == '*') {
+		(*stars)++;
+		p++;
+	} else
+		while (*p >= '0' && *p <= '9')
+			p++;
+	if (*p == '$')
+		return 0;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			(*stars)++;
+			p++;
+		} else
+			while (*p >= '0' && *p <= '9')
+				p++;
+	}
+	switch (*p) {
+	case 'h':
+		*mod = *++p == 'h' ? (p++, 'H') : 'h';
+		break;
+	case 'l':
+		*mod = *++p == 'l' ? (p++, 'q') : 'l';
+		break;
+	case 'q':
+	case 'j':
+	case 'z':
+	case 't':
+		*mod = *p++;
+		break;
+	case 'L':
+		return 0;
+	}
+	if (*p == '\0' || strchr("diouxXcseEfFgGaAp", *p) == NULL)
+		return 0;
+	if (*mod == 'l' && (*p == 's' || *p == 'c'))
+		return 0;
+	*conv = *p;
+	return p - f + 1;
+}
+
+/* Copy the arguments of a format into a record, 0 if they do not fit */
+static size_t
+rec_args(u_char *rec, size_t len, const char *fmt, va_list ap)
+{
+	const char *f, *s;
+	char mod, conv;
+	int64_t v;
+	size_t n;
+	int i, stars;
+
+	for (f = fmt; (f = strchr(f, '%')) != NULL; ) {
+		if (f[1] == '%') {
+			f += 2;
+			continue;
+		}
+		n = spec_parse(++f, &mod, &conv, &stars);
+		if (n == 0 || n >= LOG_SPECMAX)
+			return 0;
+		f += n;
+		if (len + 8 * (stars + 1) > LOG_RECMAX)
+			return 0;
+		for (i = 0; i < stars; i++) {
+			v = va_arg(ap, int);
+			memcpy(&rec[len], &v, 8);
+			len += 8;
+		}
+		switch (conv) {
+		case 's':
+			if ((s = va_arg(ap, const char *)) == NULL)
+				s = "(null)";
+			n = strnlen(s, LOG_STRMAX);
+			if (len + 8 + ALIGN8(n + 1) > LOG_RECMAX)
+				return 0;
+			v = n;
+			memcpy(&rec[len], &v, 8);
+			memcpy(&rec[len + 8], s, n);
+			rec[len + 8 + n] = '\0';
+			len += 8 + ALIGN8(n + 1);
+			continue;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A': {
+			double d = va_arg(ap, double);
+
+			memcpy(&rec[len], &d, 8);
+			len += 8;
+			continue;
+		}
+		case 'p':
+			v = (intptr_t)va_arg(ap, void *);
+			break;
+		default:
+			switch (mod) {
+			case 'l':
+				v = va_arg(ap, long);
+				break;
+			case 'q':
+				v = va_arg(ap, long long);
+				break;
+			case 'j':
+				v = va_arg(ap, intmax_t);
+				break;
+			case 'z':
+				v = va_arg(ap, size_t);
+				break;
+			case 't':
+				v = va_arg(ap, ptrdiff_t);
+				break;
+			default:
+				v = va_arg(ap, int);
+				break;
+			}
+			break;
+		}
+		memcpy(&rec[len], &v, 8);
+		len += 8;
+	}
+	return len;
+}
+
+/* Format the arguments of a record, the reverse of rec_args() */
+static void
+rec_format(const struct log_rec *rec, char *out, size_t size)
+{
+	const u_char *a = (const u_char *)(rec + 1);
+	char spec[LOG_SPECMAX + 24], mod, conv, *sp;
+	const char *f, *p;
+	int64_t v, star;
+	size_t o, n;
+	double d;
+	int stars;
+
+	o = 0;
+	for (f = rec->fmt; *f != '\0' && o < size - 1; ) {
+		if (*f != '%' || f[1] == '%') {
+			out[o++] = *f;
+			f += *f == '%' ? 2 : 1;
+			continue;
+		}
+		n = spec_parse(f + 1, &mod, &conv, &stars);
+		if (n >= LOG_SPECMAX)
+			break;
+		/* Copy the specification, with the '*'s replaced */
+		sp = spec;
+		for (p = f; p <= f + n; p++) {
+			if (*p != '*') {
+				*sp++ = *p;
+				continue;
+			}
+			memcpy(&star, a, 8);
+			a += 8;
+			sp += sprintf(sp, "%d", (int)star);
+		}
+		*sp = '\0';
+		f += n + 1;
+
+		memcpy(&v, a, 8);
+		a += 8;
+		switch (conv) {
+		case 's':
+			n = snprintf(&out[o], size - o, spec, (const char *)a);
+			a += ALIGN8(v + 1);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			memcpy(&d, &v, 8);
+			n = snprintf(&out[o], size - o, spec, d);
+			break;
+		case 'p':
+			n = snprintf(&out[o], size - o, spec, (void *)(intptr_t)v);
+			break;
+		default:
+			switch (mod) {
+			case 'l':
+				n = snprintf(&out[o], size - o, spec, (long)v);
+				break;
+			case 'q':
+				n = snprintf(&out[o], size - o, spec, (long long)v);
+				break;
+			case 'j':
+				n = snprintf(&out[o], size - o, spec, (intmax_t)v);
+				break;
+			case 'z':
+				n = snprintf(&out[o], size - o, spec, (size_t)v);
+				break;
+			case 't':
+				n = snprintf(&out[o], size - o, spec, (ptrdiff_t)v);
+				break;
+			default:
+				n = snprintf(&out[o], size - o, spec, (int)v);
+				break;
+			}
+			break;
+		}
+		o += n < size - o ? n : size - o - 1;
+	}
+	out[o] = '\0';
+}
+
+static void
+log_emit(FILE *fp, const struct log_rec *rec)
+{
+	char line[LOG_LINEMAX];
+	const char *text;
+	struct tm tm;
+	time_t sec;
+	size_t n;
+	int i;
+
+	if (rec->type == REC_TEXT)
+		text = (const char *)(rec + 1);
+	else {
+		rec_format(rec, line, sizeof line);
+		text = line;
+	}
+	/* Messages written for printf() may start or end with newlines */
+	while (*text == '\n' || *text == '\r')
+		text++;
+	n = strlen(text);
+	while (n > 0 && (text[n - 1] == '\n' || text[n - 1] == '\r'))
+		n--;
+
+	sec = rec->ts / 1000000000;
+	localtime_r(&sec, &tm);
+	for (i = 0; i < (int)NCATS - 1; i++)
+		if (rec->cat & log_cats[i].cat)
+			break;
+	fprintf(fp, "%02d:%02d:%02d.%06u %-5s %s: %.*s\n", tm.tm_hour,
+	    tm.tm_min, tm.tm_sec, (u_int)(rec->ts % 1000000000 / 1000),
+	    log_level_names[rec->level], log_cats[i].name, (int)n, text);
+}
+
+/* Build a record of a message on the stack, returning its length */
+static size_t
+rec_build(u_char *buf, int level, u_int32_t cat, const char *fmt,
+    va_list ap)
+{
+	struct log_rec *rec = (struct log_rec *)buf;
+	va_list aq;
+	size_t len;
+	int n;
+
+	rec->type = REC_ARGS;
+	rec->level = level;
+	rec->cat = cat;
+	rec->ts = log_now();
+	rec->fmt = fmt;
+	va_copy(aq, ap);
+	len = rec_args(buf, sizeof *rec, fmt, aq);
+	va_end(aq);
+	if (len == 0) {
+		/* Cannot be deferred, format it now */
+		rec->type = REC_TEXT;
+		n = vsnprintf((char *)(rec + 1), LOG_RECMAX - sizeof *rec,
+		    fmt, ap);
+		if (n < 0)
+			n = 0;
+		else if ((size_t)n >= LOG_RECMAX - sizeof *rec)
+			n = LOG_RECMAX - sizeof *rec - 1;
+		len = sizeof *rec + n + 1;
+	}
+	len = ALIGN8(len);
+	rec->len = len;
+	return len;
+}
+
+/* Append a record to the ring of this thread */
+static void
+ring_put(struct log_ring *r, const u_char *rec, size_t len)
+{
+	struct log_rec *pad;
+	u_int64_t tail;
+	size_t pos, need;
+
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	pos = r->head & (LOG_RING - 1);
+	need = len;
+	if (pos + len > LOG_RING)
+		need += LOG_RING - pos;
+	if (r->head + need - tail > LOG_RING) {
+		__atomic_store_n(&r->dropped, r->dropped + 1,
+		    __ATOMIC_RELAXED);
+		return;
+	}
+	if (need != len) {
+		pad = (struct log_rec *)&r->buf[pos];
+		pad->len = LOG_RING - pos;
+		pad->type = REC_PAD;
+		pos = 0;
+	}
+	memcpy(&r->buf[pos], rec, len);
+	__atomic_store_n(&r->head, r->head + need, __ATOMIC_RELEASE);
+}
+
+void
+rad_log_write(int level, u_int32_t cat, const char *fmt, ...)
+{
+	u_int64_t buf[LOG_RECMAX / 8];
+	struct log_ring *r;
+	va_list ap;
+	size_t len;
+
+	if (level < 0 || level >= RAD_LOG_LEVELS)
+		return;
+	va_start(ap, fmt);
+	len = rec_build((u_char *)buf, level, cat, fmt, ap);
+	va_end(ap);
+	if (__atomic_load_n(&log_async, __ATOMIC_ACQUIRE) &&
+	    (r = ring_get()) != NULL)
+		ring_put(r, (u_char *)buf, len);
+	else
+		log_emit(stderr, (struct log_rec *)buf);
+}
+
+/* Next record of a ring before head, skipping padding */
+static struct log_rec *
+ring_peek(struct log_ring *r, u_int64_t head)
+{
+	struct log_rec *rec;
+
+	while (r->tail != head) {
+		rec = (struct log_rec *)&r->buf[r->tail & (LOG_RING - 1)];
+		if (rec->type != REC_PAD)
+			return rec;
+		__atomic_store_n(&r->tail, r->tail + rec->len,
+		    __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* Make room for twice as many rings in the snapshot, -1 if out of memory */
+static int
+drain_grow(void)
+{
+	struct log_ring **rings;
+	u_int64_t *heads;
+	int size = drain_size ? drain_size * 2 : 64;
+
+	if ((rings = realloc(drain_rings, size * sizeof *rings)) == NULL)
+		return -1;
+	drain_rings = rings;
+	if ((heads = realloc(drain_heads, size * sizeof *heads)) == NULL)
+		return -1;
+	drain_heads = heads;
+	drain_size = size;
+	return 0;
+}
+
+/*
+ * Format what is in the rings, merging them by timestamp.  Rings of
+ * threads that have exited are freed once empty.  Every ring is in the
+ * snapshot, which grows with the list.  Returns the number of records
+ * written.
+ */
+static int
+log_drain(FILE *fp)
+{
+	struct log_ring *r, **rp, **rings;
+	u_int64_t *heads, dropped;
+	struct log_rec *rec, *best;
+	int i, n, no_rings, done;
+
+	pthread_mutex_lock(&drain_lock);
+	done = 0;
+	do {
+		/* Snapshot the rings and how far they have been written */
+		pthread_mutex_lock(&log_lock);
+		dropped = log_dropped_gone;
+		no_rings = 0;
+		for (rp = &log_rings; (r = *rp) != NULL; ) {
+			dropped += __atomic_load_n(&r->dropped,
+			    __ATOMIC_RELAXED);
+			if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+			    r->tail == r->head) {
+				*rp = r->next;
+				log_dropped_gone += r->dropped;
+				free(r);
+				continue;
+			}
+			rp = &r->next;
+			/* Out of memory, the ring waits for a later pass */
+			if (no_rings == drain_size && drain_grow() == -1)
+				continue;
+			drain_heads[no_rings] = __atomic_load_n(&r->head,
+			    __ATOMIC_ACQUIRE);
+			drain_rings[no_rings++] = r;
+		}
+		pthread_mutex_unlock(&log_lock);
+		rings = drain_rings;
+		heads = drain_heads;
+
+		for (n = 0; ; n++) {
+			best = NULL;
+			for (i = 0; i < no_rings; i++) {
+				rec = ring_peek(rings[i], heads[i]);
+				if (rec != NULL &&
+				    (best == NULL || rec->ts < best->ts)) {
+					best = rec;
+					r = rings[i];
+				}
+			}
+			if (best == NULL)
+				break;
+			log_emit(fp, best);
+			__atomic_store_n(&r->tail, r->tail + best->len,
+			    __ATOMIC_RELEASE);
+		}
+		done += n;
+	} while (n != 0);
+
+	if (dropped > log_dropped_seen) {
+		fprintf(fp, "log: %" PRIu64 " records dropped\n",
+		    dropped - log_dropped_seen);
+		log_dropped_seen = dropped;
+	}
+	if (done != 0)
+		fflush(fp);
+	pthread_mutex_unlock(&drain_lock);
+	return done;
+}
+
+static void *
+log_main(void *arg)
+{
+	struct timespec idle = { 0, 1000000 };
+
+	(void)arg;
+	while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+		if (log_drain(log_fp) == 0)
+			nanosleep(&idle, NULL);
+	return NULL;
+}
+
+/*
+ * Start the thread formatting log records to fp.  Returns 0 on success,
+ * -1 with errno set if it cannot be started.
+ */
+int
+rad_log_start(FILE *fp)
+{
+	int error;
+
+	if (log_running) {
+		errno = EBUSY;
+		return -1;
+	}
+	log_fp = fp;
+	log_stopping = 0;
+	if ((error = pthread_create(&log_thread, NULL, log_main, NULL)) != 0) {
+		errno = error;
+		return -1;
+	}
+	log_running = 1;
+	__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Format what has been logged so far */
+void
+rad_log_flush(void)
+{
+	if (log_running)
+		log_drain(log_fp);
+}
+
+/*
+ * Stop the logging thread after it has written what is in the rings.
+ * Further records are formatted by the threads logging them.
+ */
+void
+rad_log_stop(void)
+{
+	if (!log_running)
+		return;
+	__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+	log_running = 0;
+	log_drain(log_fp);
+	pthread_mutex_lock(&drain_lock);
+	free(drain_rings);
+	free(drain_heads);
+	drain_rings = NULL;
+	drain_heads = NULL;
+	drain_size = 0;
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/* Enable categories at a level and the ones below it, disable the others */
+void
+rad_log_set(int level, u_int32_t cats)
+{
+	int i;
+
+	for (i = 0; i < RAD_LOG_LEVELS; i++)
+		__atomic_store_n(&rad_log_mask[i], i <= level ? cats : 0,
+		    __ATOMIC_RELAXED);
+}
+
+/*
+ * Set the log mask from a string of the form level[:category,...], for
+ * example "debug:net,bundle" or "off".  Without categories all are
+ * enabled.  Returns -1 if the string is not understood.
+ */
+int
+rad_log_parse(const char *s)
+{
+	u_int32_t cats;
+	size_t n;
+	int i, level;
+
+	n = strcspn(s, ":");
+	if (n == 3 && strncmp(s, "off", 3) == 0)
+		level = -1;
+	else {
+		for (level = 0; level < RAD_LOG_LEVELS; level++)
+			if (strlen(log_level_names[level]) == n &&
+			    strncmp(s, log_level_names[level], n) == 0)
+				break;
+		if (level == RAD_LOG_LEVELS)
+			return -1;
+	}
+	cats = RAD_LOGC_ALL;
+	if (s[n] == ':') {
+		cats = 0;
+		for (s += n + 1; *s != '\0'; s += n + (s[n] == ',')) {
+			n = strcspn(s, ",");
+			for (i = 0; i < (int)NCATS; i++)
+				if (strlen(log_cats[i].name) == n &&
+				    strncmp(s, log_cats[i].name, n) == 0)
+					break;
+			if (i == (int)NCATS)
+				return -1;
+			cats |= log_cats[i].cat;
+		}
+	}
+	rad_log_set(level, cats);
+	return 0;
+}
+
+/* Records dropped because a ring was full */
+u_int64_t
+rad_log_dropped(void)
+{
+	struct log_ring *r;
+	u_int64_t n;
+
+	pthread_mutex_lock(&log_lock);
+	n = log_dropped_gone;
+	for (r = log_rings; r != NULL; r = r->next)
+		n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&log_lock);
+	return n;
+}
@@ -0,0 +1,206 @@
+/*-
+ * Pluggable datagram transport
+ *
+ * The bundling client (radius_dev.c) and the test server move their
+ * datagrams and read the clock through rad_net_*() rather than calling
+ * the system directly.  By default these are the system calls; a program
+ * may install other operations with rad_net_set() before it opens any
+ * socket, as the simulated network of radlib_sim.c does.  The operations
+ * are process wide and are not meant to be changed while other threads
+ * use them.
+ */
+
+#define	_GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/radlib_net.h"
+
+static int
+sys_socket(void *arg, int type)
+{
+	(void)arg;
+	return socket(AF_INET, type, 0);
+}
+
+static int
+sys_bind(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	(void)arg;
+	return bind(fd, (const struct sockaddr *)addr, sizeof *addr);
+}
+
+static int
+sys_connect(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	(void)arg;
+	return connect(fd, (const struct sockaddr *)addr, sizeof *addr);
+}
+
+static ssize_t
+sys_sendto(void *arg, int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr_in *to)
+{
+	(void)arg;
+	return sendto(fd, buf, len, flags, (const struct sockaddr *)to,
+	    to != NULL ? sizeof *to : 0);
+}
+
+static ssize_t
+sys_recvfrom(void *arg, int fd, void *buf, size_t len, int flags,
+    struct sockaddr_in *from)
+{
+	socklen_t fromlen;
+
+	(void)arg;
+	fromlen = sizeof *from;
+	return recvfrom(fd, buf, len, flags, (struct sockaddr *)from,
+	    from != NULL ? &fromlen : NULL);
+}
+
+static int
+sys_sendmmsg(void *arg, int fd, struct mmsghdr *msgs, u_int n, int flags)
+{
+	(void)arg;
+	return sendmmsg(fd, msgs, n, flags);
+}
+
+static int
+sys_close(void *arg, int fd)
+{
+	(void)arg;
+	return close(fd);
+}
+
+static int
+sys_wait(void *arg, int fd, u_int64_t timeout_ns)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+	int n;
+
+	(void)arg;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	ts.tv_sec = timeout_ns / 1000000000;
+	ts.tv_nsec = timeout_ns % 1000000000;
+	n = ppoll(&pfd, 1, timeout_ns == RAD_NET_FOREVER ? NULL : &ts, NULL);
+	return n > 0 ? 1 : n;
+}
+
+static u_int64_t
+sys_now(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static time_t
+sys_time(void *arg)
+{
+	(void)arg;
+	return time(NULL);
+}
+
+static const struct rad_net_ops net_system = {
+	sys_socket, sys_bind, sys_connect, sys_sendto, sys_recvfrom,
+	sys_sendmmsg, sys_close, sys_wait, sys_now, sys_time
+};
+
+static const struct rad_net_ops *net_ops = &net_system;
+static void *net_arg;
+
+/* Use ops from now on, or the system calls again if ops is NULL */
+void
+rad_net_set(const struct rad_net_ops *ops, void *arg)
+{
+	net_ops = ops != NULL ? ops : &net_system;
+	net_arg = ops != NULL ? arg : NULL;
+}
+
+/* The operations in use, so that a layer can be put over them */
+void
+rad_net_get(const struct rad_net_ops **ops, void **arg)
+{
+	*ops = net_ops;
+	*arg = net_arg;
+}
+
+/* A socket of the given type (SOCK_DGRAM, SOCK_STREAM) */
+int
+rad_net_socket(int type)
+{
+	return net_ops->socket(net_arg, type);
+}
+
+int
+rad_net_bind(int fd, const struct sockaddr_in *addr)
+{
+	return net_ops->bind(net_arg, fd, addr);
+}
+
+int
+rad_net_connect(int fd, const struct sockaddr_in *addr)
+{
+	return net_ops->connect(net_arg, fd, addr);
+}
+
+ssize_t
+rad_net_sendto(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr_in *to)
+{
+	return net_ops->sendto(net_arg, fd, buf, len, flags, to);
+}
+
+/* Receive a datagram, or read a stream; from may be NULL */
+ssize_t
+rad_net_recvfrom(int fd, void *buf, size_t len, int flags,
+    struct sockaddr_in *from)
+{
+	return net_ops->recvfrom(net_arg, fd, buf, len, flags, from);
+}
+
+int
+rad_net_sendmmsg(int fd, struct mmsghdr *msgs, u_int n, int flags)
+{
+	return net_ops->sendmmsg(net_arg, fd, msgs, n, flags);
+}
+
+int
+rad_net_close(int fd)
+{
+	return net_ops->close(net_arg, fd);
+}
+
+/*
+ * Wait up to timeout_ns (RAD_NET_FOREVER for no limit) for fd to become
+ * readable.  Returns 1 if it is, 0 on timeout and -1 on an error.
+ */
+int
+rad_net_wait(int fd, u_int64_t timeout_ns)
+{
+	return net_ops->wait(net_arg, fd, timeout_ns);
+}
+
+/* Monotonic clock, nanoseconds */
+u_int64_t
+rad_net_now(void)
+{
+	return net_ops->now(net_arg);
+}
+
+time_t
+rad_net_time(void)
+{
+	return net_ops->time(net_arg);
+}
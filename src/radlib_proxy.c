@@ -0,0 +1,207 @@
+/*-
+ * Proxying
+ *
+ * A proxy passes the requests of its NAS clients on to a home server
+ * under identifiers of its own and passes the replies back.  The two legs
+ * have secrets of their own, so every message is signed again on the way
+ * through: rad_proxy_request() turns a request loaded into a server
+ * handle into one for the home server, and rad_proxy_response() checks
+ * the home server's reply to it and turns that into the reply to the NAS.
+ *
+ * An Access-Request keeps the authenticator of the NAS, so CHAP, which
+ * takes it for the challenge, works unchanged and only User-Password is
+ * scrambled again.  Other requests get a new request authenticator.
+ * Attributes of replies salted with the authenticator (Tunnel-Password,
+ * the MS-MPPE keys) are passed as they are, which is only right when both
+ * legs share one secret.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#ifdef WITH_SSL
+#include <openssl/md5.h>
+#else
+#define MD5_DIGEST_LENGTH 16
+#include "md5/md5.h"
+#endif
+
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+void	 generr(struct rad_handle *, const char *, ...);
+
+/*
+ * Find the User-Password and Message-Authenticator attributes of a
+ * message.  Returns -1 if its attributes do not add up to its length.
+ */
+static int
+proxy_walk(const u_char *msg, size_t len, size_t *pass, size_t *authentic)
+{
+	size_t pos;
+
+	*pass = *authentic = 0;
+	for (pos = POS_ATTRS; pos < len; pos += msg[pos + 1]) {
+		if (len - pos < 2 || msg[pos + 1] < 2 || msg[pos + 1] > len - pos)
+			return -1;
+		if (msg[pos] == RAD_USER_PASSWORD && *pass == 0)
+			*pass = pos;
+		else if (msg[pos] == RAD_MESSAGE_AUTHENTIC && *authentic == 0) {
+			if (msg[pos + 1] != 2 + MD5_DIGEST_LENGTH)
+				return -1;
+			*authentic = pos;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Scramble a User-Password (RFC 2865, section 5.2) hidden with one secret
+ * with another, under the same authenticator.
+ */
+static void
+proxy_rescramble(u_char *p, size_t len, const u_char *auth,
+    const char *from, size_t from_len, const char *to, size_t to_len)
+{
+	u_char prev_in[LEN_AUTH], prev_out[LEN_AUTH];
+	u_char md_in[MD5_DIGEST_LENGTH], md_out[MD5_DIGEST_LENGTH];
+	MD5_CTX ctx;
+	size_t pos;
+	int i;
+
+	memcpy(prev_in, auth, LEN_AUTH);
+	memcpy(prev_out, auth, LEN_AUTH);
+	for (pos = 0; pos < len; pos += 16) {
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, from, from_len);
+		MD5_Update(&ctx, prev_in, LEN_AUTH);
+		MD5_Final(md_in, &ctx);
+		MD5_Init(&ctx);
+		MD5_Update(&ctx, to, to_len);
+		MD5_Update(&ctx, prev_out, LEN_AUTH);
+		MD5_Final(md_out, &ctx);
+
+		/* Each block chains on the one before as it was sent */
+		memcpy(prev_in, &p[pos], 16);
+		for (i = 0; i < 16; i++)
+			p[pos + i] ^= md_in[i] ^ md_out[i];
+		memcpy(prev_out, &p[pos], 16);
+	}
+	memset(md_in, 0, sizeof md_in);
+	memset(md_out, 0, sizeof md_out);
+}
+
+/* The authenticator of a message: its MD5 with auth in place and the secret */
+static void
+proxy_authenticator(const u_char *msg, size_t len, const u_char *auth,
+    const char *secret, size_t secret_len, u_char *md)
+{
+	MD5_CTX ctx;
+
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, &msg[POS_CODE], POS_AUTH - POS_CODE);
+	MD5_Update(&ctx, auth, LEN_AUTH);
+	MD5_Update(&ctx, &msg[POS_ATTRS], len - POS_ATTRS);
+	MD5_Update(&ctx, secret, secret_len);
+	MD5_Final(md, &ctx);
+}
+
+/*
+ * Re-sign the request validated in the server handle h for the home
+ * server home, under the identifier ident, into out, which must hold the
+ * request.  Returns the length of the request, or -1 if it cannot be
+ * passed on.
+ */
+int
+rad_proxy_request(struct rad_handle *h, int ident,
+    const struct rad_client *home, u_char *out)
+{
+	static const u_char zeroes[LEN_AUTH];
+	const char *nas_secret, *home_secret;
+	size_t len, nas_len, home_len, pass, authentic, plen;
+
+	len = h->in_len;
+	memcpy(out, h->in, len);
+	RAD_STAT_ADD(RAD_STAT_COPIED, len);
+	if (proxy_walk(out, len, &pass, &authentic) == -1) {
+		generr(h, "Malformed attributes");
+		return -1;
+	}
+	out[POS_IDENT] = ident;
+	nas_secret = rad_client_secret(h->client, &nas_len);
+	home_secret = rad_client_secret(home, &home_len);
+
+	if (out[POS_CODE] == RAD_ACCESS_REQUEST) {
+		plen = pass != 0 ? out[pass + 1] - 2 : 0;
+		if (pass != 0 && (plen == 0 || plen % 16 != 0)) {
+			generr(h, "Malformed User-Password");
+			return -1;
+		}
+		if (pass != 0 && (nas_len != home_len ||
+		    memcmp(nas_secret, home_secret, nas_len) != 0))
+			proxy_rescramble(&out[pass + 2], plen, &out[POS_AUTH],
+			    nas_secret, nas_len, home_secret, home_len);
+	} else
+		memset(&out[POS_AUTH], 0, LEN_AUTH);
+
+	if (authentic != 0) {
+		memset(&out[authentic + 2], 0, MD5_DIGEST_LENGTH);
+		rad_client_hmac(home, &out[POS_CODE], &out[POS_AUTH],
+		    &out[POS_ATTRS], len - POS_ATTRS, &out[authentic + 2]);
+	}
+	if (out[POS_CODE] != RAD_ACCESS_REQUEST)
+		proxy_authenticator(out, len, zeroes, home_secret, home_len,
+		    &out[POS_AUTH]);
+	return len;
+}
+
+/*
+ * Check the reply msg of the home server home to a request re-signed with
+ * rad_proxy_request() and sent with the authenticator sent_auth, and
+ * re-sign it in place as the reply to the request of nas with the
+ * identifier ident and authenticator nas_auth.  Returns 0, or -1 if the
+ * reply is not valid.
+ */
+int
+rad_proxy_response(struct rad_handle *h, u_char *msg, size_t len,
+    const struct rad_client *home, const u_char *sent_auth,
+    const struct rad_client *nas, int ident, const u_char *nas_auth)
+{
+	u_char md[MD5_DIGEST_LENGTH], sent_md[MD5_DIGEST_LENGTH];
+	const char *secret;
+	size_t secret_len, pass, authentic;
+
+	if (len < POS_ATTRS ||
+	    (size_t)(msg[POS_LENGTH] << 8 | msg[POS_LENGTH + 1]) != len ||
+	    proxy_walk(msg, len, &pass, &authentic) == -1) {
+		generr(h, "Malformed response");
+		return -1;
+	}
+	secret = rad_client_secret(home, &secret_len);
+	proxy_authenticator(msg, len, sent_auth, secret, secret_len, md);
+	if (memcmp(&msg[POS_AUTH], md, sizeof md) != 0) {
+		RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+		generr(h, "Invalid response authenticator");
+		return -1;
+	}
+	if (authentic != 0) {
+		memcpy(sent_md, &msg[authentic + 2], MD5_DIGEST_LENGTH);
+		memset(&msg[authentic + 2], 0, MD5_DIGEST_LENGTH);
+		rad_client_hmac(home, &msg[POS_CODE], sent_auth,
+		    &msg[POS_ATTRS], len - POS_ATTRS, md);
+		if (memcmp(md, sent_md, sizeof md) != 0) {
+			RAD_STAT_ADD(RAD_STAT_INVALID, 1);
+			generr(h, "Invalid Message-Authenticator");
+			return -1;
+		}
+	}
+
+	msg[POS_IDENT] = ident;
+	if (authentic != 0)
+		rad_client_hmac(nas, &msg[POS_CODE], nas_auth,
+		    &msg[POS_ATTRS], len - POS_ATTRS, &msg[authentic + 2]);
+	secret = rad_client_secret(nas, &secret_len);
+	proxy_authenticator(msg, len, nas_auth, secret, secret_len,
+	    &msg[POS_AUTH]);
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*-
+ * Request objects
+ *
+ * A handle carries everything that is shared by the requests to a set of
+ * servers: the server list and secrets, the socket and the error message.
+ * What belongs to a single request, its encoded form and the cleartext
+ * password, lives in a struct rad_request.  rad_create_request() and
+ * rad_put_*() use the request embedded in the handle; rad_req_create()
+ * takes further ones from slabs owned by the handle, so a client can keep
+ * many requests in flight with one handle and a few hundred bytes each.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#ifdef WITH_SSL
+#include <openssl/md5.h>
+#else
+#define MD5_DIGEST_LENGTH 16
+#include "md5/md5.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+#define REQ_SLAB	64		/* Requests per slab */
+
+struct rad_req_slab {
+	struct rad_req_slab	*next;
+	struct rad_request	 reqs[REQ_SLAB];
+};
+
+/* Take an unused request from the slabs of a handle, NULL if out of memory */
+struct rad_request *
+rad_req_alloc(struct rad_handle *h)
+{
+	struct rad_req_slab *s;
+	struct rad_request *r;
+	int i;
+
+	if (h->req_free == NULL) {
+		if ((s = calloc(1, sizeof *s)) == NULL)
+			return NULL;
+		s->next = h->slabs;
+		h->slabs = s;
+		for (i = REQ_SLAB - 1; i >= 0; i--) {
+			s->reqs[i].h = h;
+			s->reqs[i].next = h->req_free;
+			h->req_free = &s->reqs[i];
+		}
+	}
+	r = h->req_free;
+	h->req_free = r->next;
+	r->next = NULL;
+	r->chap_pass = 0;
+	r->eap_msg = 0;
+	return r;
+}
+
+/* Put a request back on the free list of its handle */
+void
+rad_req_release(struct rad_request *r)
+{
+	struct rad_handle *h = r->h;
+
+	rad_buf_put(r->out, r->out_size);
+	rad_arena_free(&r->arena);
+	memset(r, 0, sizeof *r);
+	r->h = h;
+	r->state = RAD_REQ_FREE;
+	r->next = h->req_free;
+	h->req_free = r;
+}
+
+/* Free the slabs of a handle, including the requests still in use */
+void
+rad_req_slabs_free(struct rad_handle *h)
+{
+	struct rad_req_slab *s;
+	int i;
+
+	while ((s = h->slabs) != NULL) {
+		h->slabs = s->next;
+		for (i = 0; i < REQ_SLAB; i++) {
+			rad_buf_put(s->reqs[i].out, s->reqs[i].out_size);
+			rad_arena_free(&s->reqs[i].arena);
+			memset(s->reqs[i].pass, 0, sizeof s->reqs[i].pass);
+		}
+		free(s);
+	}
+	h->req_free = NULL;
+}
+
+void
+rad_req_free(struct rad_request *r)
+{
+	if (r == NULL || r == &r->h->req)
+		return;
+	rad_req_release(r);
+}
+
+int
+rad_req_ident(const struct rad_request *r)
+{
+	return r->out[POS_IDENT];
+}
+
+/*
+ * Is a message the reply to a request from the current server?  Besides
+ * the identifier, which a large bundle reuses, the response authenticator
+ * must follow from the request authenticator and the server's secret.
+ * The caller has checked the length field against len.
+ */
+int
+rad_req_is_reply(const struct rad_request *r, const unsigned char *msg,
+    size_t len)
+{
+	const struct rad_server *srvp = &r->h->servers[r->h->srv];
+	MD5_CTX ctx;
+	unsigned char md5[MD5_DIGEST_LENGTH];
+
+	if (len < POS_ATTRS || r->out == NULL ||
+	    msg[POS_IDENT] != r->out[POS_IDENT])
+		return 0;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, &msg[POS_CODE], POS_AUTH - POS_CODE);
+	MD5_Update(&ctx, &r->out[POS_AUTH], LEN_AUTH);
+	MD5_Update(&ctx, &msg[POS_ATTRS], len - POS_ATTRS);
+	MD5_Update(&ctx, srvp->secret, strlen(srvp->secret));
+	MD5_Final(md5, &ctx);
+	return memcmp(&msg[POS_AUTH], md5, sizeof md5) == 0;
+}
+
+/* Record the reply to a request, matched by the caller */
+void
+rad_req_complete(struct rad_request *r, int code)
+{
+	r->state = RAD_REQ_DONE;
+	r->reply_code = code;
+	if (r->t_created != 0)
+		rad_lat_record(r);
+}
+
+/* Code of the reply to a request, or 0 if it has not been answered */
+int
+rad_req_reply_code(const struct rad_request *r)
+{
+	return r->state == RAD_REQ_DONE ? r->reply_code : 0;
+}
@@ -0,0 +1,651 @@
+/*-
+ * Simulated network on a virtual clock
+ *
+ * rad_sim_start() installs a transport (see radlib_net.c) that never
+ * touches the system: sockets are entries of a table, datagrams are
+ * events on a heap ordered by virtual delivery time, and the clock only
+ * moves when the next event is run.  A client waiting for its reply with
+ * rad_net_wait() runs the events up to the reply or its timeout, so an
+ * hour of retransmits and failovers takes as long as the code between
+ * the events does.
+ *
+ * Every datagram crosses a link described by struct rad_sim_link: it
+ * waits for the earlier datagrams of its sender to be serialized at the
+ * link bandwidth, is split into IP fragments of the MTU, each of which
+ * may be lost, and arrives after the latency plus a uniform jitter, or
+ * later still when it is picked to be reordered.  All the chance comes
+ * from one generator seeded at creation, so a run driven the same way
+ * is reproduced exactly by its seed.
+ *
+ * Only UDP is simulated.  Sockets bound to the wildcard address with port
+ * 0 get 127.0.0.1 and the next ephemeral port; sockets bound to a port of
+ * the wildcard address receive datagrams to any address.  A socket given
+ * to rad_sim_listen() has its function called as datagrams arrive, which
+ * is how a server runs inside the simulation, and rad_sim_timer() calls a
+ * function at a virtual time.  The simulation is single threaded.
+ */
+
+#define	_GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_net.h"
+
+#define	SIM_FD_BASE	(1 << 20)	/* Far above the descriptors of the system */
+#define	SIM_SOCKETS	1024
+#define	SIM_PORT_FIRST	32768		/* Ephemeral ports */
+#define	SIM_PORT_LAST	60999
+#define	SIM_RCVBUF	(208 * 1024)	/* Bytes queued per socket */
+#define	SIM_IP_HDR	20
+#define	SIM_UDP_HDR	8
+#define	SIM_UDP_MAX	(65535 - SIM_IP_HDR - SIM_UDP_HDR)
+#define	SIM_START	1000000000ULL	/* Virtual clock at creation, not 0 */
+#define	SIM_EPOCH	1700000000	/* Wall clock at the start */
+#define	SIM_HEAP_MIN	1024
+
+struct sim_dgram {
+	struct sim_dgram *next;
+	struct sockaddr_in from;
+	struct sockaddr_in to;
+	size_t		 len;
+	u_char		 data[];
+};
+
+struct sim_sock {
+	int		 used;
+	int		 bound;
+	int		 down;		/* Drops what is sent to it */
+	struct sockaddr_in addr;
+	struct sockaddr_in peer;	/* From connect(), or port 0 */
+	struct sim_dgram *head;		/* Receive queue */
+	struct sim_dgram *tail;
+	size_t		 queued;	/* Bytes in the queue */
+	u_int64_t	 busy_until;	/* Sender side of the link */
+	rad_sim_fn	*fn;
+	void		*arg;
+};
+
+/* A datagram arriving, or a timer if dgram is NULL */
+struct sim_event {
+	u_int64_t	 when;
+	u_int64_t	 seq;		/* Orders events of the same time */
+	struct sim_dgram *dgram;
+	rad_sim_fn	*fn;
+	void		*arg;
+};
+
+struct rad_sim {
+	struct rad_sim_link link;
+	u_int64_t	 rng;
+	u_int64_t	 now;
+	u_int64_t	 seq;
+	u_int		 next_port;
+	int		 no_socks;	/* Highest entry used, plus one */
+	struct sim_event *heap;
+	size_t		 count;
+	size_t		 size;
+	struct rad_sim_stats stats;
+	struct sim_sock	 socks[SIM_SOCKETS];
+};
+
+/* xorshift64* */
+static u_int64_t
+sim_rand(struct rad_sim *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+	return sim->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1) */
+static double
+sim_uniform(struct rad_sim *sim)
+{
+	return (sim_rand(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static struct sim_sock *
+sim_sock(struct rad_sim *sim, int fd)
+{
+	struct sim_sock *s;
+
+	if (fd < SIM_FD_BASE || fd >= SIM_FD_BASE + sim->no_socks ||
+	    !(s = &sim->socks[fd - SIM_FD_BASE])->used) {
+		errno = EBADF;
+		return NULL;
+	}
+	return s;
+}
+
+/* The socket a datagram to addr is delivered to, or NULL */
+static struct sim_sock *
+sim_lookup(struct rad_sim *sim, const struct sockaddr_in *addr)
+{
+	struct sim_sock *s;
+	int i;
+
+	for (i = 0; i < sim->no_socks; i++) {
+		s = &sim->socks[i];
+		if (s->used && s->bound && s->addr.sin_port == addr->sin_port &&
+		    (s->addr.sin_addr.s_addr == addr->sin_addr.s_addr ||
+		    s->addr.sin_addr.s_addr == htonl(INADDR_ANY)))
+			return s;
+	}
+	return NULL;
+}
+
+static int
+sim_before(const struct sim_event *a, const struct sim_event *b)
+{
+	return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static int
+sim_push(struct rad_sim *sim, u_int64_t when, struct sim_dgram *dgram,
+    rad_sim_fn *fn, void *arg)
+{
+	struct sim_event *heap, ev;
+	size_t i;
+
+	if (sim->count == sim->size) {
+		if ((heap = realloc(sim->heap, 2 * sim->size *
+		    sizeof *heap)) == NULL)
+			return -1;
+		sim->heap = heap;
+		sim->size *= 2;
+	}
+	ev.when = when;
+	ev.seq = sim->seq++;
+	ev.dgram = dgram;
+	ev.fn = fn;
+	ev.arg = arg;
+	for (i = sim->count++; i > 0; i = (i - 1) / 2) {
+		if (!sim_before(&ev, &sim->heap[(i - 1) / 2]))
+			break;
+		sim->heap[i] = sim->heap[(i - 1) / 2];
+	}
+	sim->heap[i] = ev;
+	return 0;
+}
+
+static void
+sim_pop(struct rad_sim *sim, struct sim_event *ev)
+{
+	struct sim_event last;
+	size_t i, c;
+
+	*ev = sim->heap[0];
+	last = sim->heap[--sim->count];
+	for (i = 0; (c = 2 * i + 1) < sim->count; i = c) {
+		if (c + 1 < sim->count &&
+		    sim_before(&sim->heap[c + 1], &sim->heap[c]))
+			c++;
+		if (!sim_before(&sim->heap[c], &last))
+			break;
+		sim->heap[i] = sim->heap[c];
+	}
+	sim->heap[i] = last;
+}
+
+/* Run the next event */
+static void
+sim_step(struct rad_sim *sim)
+{
+	struct sim_event ev;
+	struct sim_dgram *d;
+	struct sim_sock *s;
+
+	sim_pop(sim, &ev);
+	if (ev.when > sim->now)
+		sim->now = ev.when;
+	sim->stats.events++;
+	if ((d = ev.dgram) == NULL) {
+		ev.fn(ev.arg, -1);
+		return;
+	}
+	if ((s = sim_lookup(sim, &d->to)) == NULL || s->down) {
+		sim->stats.unreachable++;
+		free(d);
+		return;
+	}
+	if (s->queued + d->len > SIM_RCVBUF) {
+		sim->stats.overflows++;
+		free(d);
+		return;
+	}
+	d->next = NULL;
+	if (s->tail != NULL)
+		s->tail->next = d;
+	else
+		s->head = d;
+	s->tail = d;
+	s->queued += d->len;
+	sim->stats.delivered++;
+	if (s->fn != NULL)
+		s->fn(s->arg, SIM_FD_BASE + (int)(s - sim->socks));
+}
+
+/* Give a socket the next free ephemeral port of 127.0.0.1 */
+static int
+sim_autobind(struct rad_sim *sim, struct sim_sock *s, in_addr_t ip)
+{
+	struct sockaddr_in addr;
+	u_int tries;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ip != htonl(INADDR_ANY) ? ip :
+	    htonl(INADDR_LOOPBACK);
+	for (tries = SIM_PORT_LAST - SIM_PORT_FIRST + 1; tries > 0; tries--) {
+		addr.sin_port = htons(sim->next_port);
+		if (++sim->next_port > SIM_PORT_LAST)
+			sim->next_port = SIM_PORT_FIRST;
+		if (sim_lookup(sim, &addr) == NULL) {
+			s->addr = addr;
+			s->bound = 1;
+			return 0;
+		}
+	}
+	errno = EADDRINUSE;
+	return -1;
+}
+
+/* Put a datagram on the link from s */
+static ssize_t
+sim_send(struct rad_sim *sim, struct sim_sock *s, const struct iovec *iov,
+    size_t iovcnt, const struct sockaddr_in *to)
+{
+	const struct rad_sim_link *l = &sim->link;
+	struct sim_dgram *d;
+	u_int64_t frags, wire, start, when;
+	size_t len, i;
+	int lost;
+
+	if (to == NULL) {
+		if (s->peer.sin_port == 0) {
+			errno = EDESTADDRREQ;
+			return -1;
+		}
+		to = &s->peer;
+	}
+	if (!s->bound && sim_autobind(sim, s, htonl(INADDR_ANY)) == -1)
+		return -1;
+	for (len = 0, i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > SIM_UDP_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* Fragments carry multiples of 8 bytes of the UDP datagram */
+	frags = 1;
+	if (l->mtu > SIM_IP_HDR + 8)
+		frags = (len + SIM_UDP_HDR + ((l->mtu - SIM_IP_HDR) & ~7) - 1) /
+		    ((l->mtu - SIM_IP_HDR) & ~7);
+	wire = len + SIM_UDP_HDR + frags * SIM_IP_HDR;
+	sim->stats.datagrams++;
+	sim->stats.bytes += len;
+	sim->stats.fragments += frags;
+
+	/* Serialize behind what the sender put on the link before */
+	start = s->busy_until > sim->now ? s->busy_until : sim->now;
+	s->busy_until = start + (l->bandwidth ?
+	    wire * 8 * 1000000000 / l->bandwidth : 0);
+
+	/* Losing any fragment loses the datagram */
+	lost = 0;
+	if (l->loss > 0)
+		for (i = 0; i < frags; i++)
+			if (sim_uniform(sim) < l->loss)
+				lost = 1;
+	if (lost) {
+		sim->stats.lost++;
+		return len;
+	}
+	when = s->busy_until + l->latency_ns;
+	if (l->jitter_ns)
+		when += sim_rand(sim) % l->jitter_ns;
+	if (l->reorder > 0 && sim_uniform(sim) < l->reorder) {
+		when += l->reorder_ns;
+		sim->stats.reordered++;
+	}
+
+	if ((d = malloc(sizeof *d + len)) == NULL) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	d->from = s->addr;
+	d->to = *to;
+	d->len = len;
+	for (len = 0, i = 0; i < iovcnt; i++) {
+		memcpy(d->data + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	if (sim_push(sim, when, d, NULL, NULL) == -1) {
+		free(d);
+		errno = ENOBUFS;
+		return -1;
+	}
+	return len;
+}
+
+static int
+sim_socket(void *arg, int type)
+{
+	struct rad_sim *sim = arg;
+	struct sim_sock *s;
+	int i;
+
+	if (type != SOCK_DGRAM) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	for (i = 0; i < SIM_SOCKETS && sim->socks[i].used; i++)
+		;
+	if (i == SIM_SOCKETS) {
+		errno = EMFILE;
+		return -1;
+	}
+	s = &sim->socks[i];
+	memset(s, 0, sizeof *s);
+	s->used = 1;
+	if (i >= sim->no_socks)
+		sim->no_socks = i + 1;
+	return SIM_FD_BASE + i;
+}
+
+static int
+sim_bind(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	struct rad_sim *sim = arg;
+	struct sim_sock *s;
+
+	if ((s = sim_sock(sim, fd)) == NULL)
+		return -1;
+	if (s->bound) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (addr->sin_port == 0)
+		return sim_autobind(sim, s, addr->sin_addr.s_addr);
+	if (sim_lookup(sim, addr) != NULL) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	s->addr = *addr;
+	s->bound = 1;
+	return 0;
+}
+
+static int
+sim_connect(void *arg, int fd, const struct sockaddr_in *addr)
+{
+	struct sim_sock *s;
+
+	if ((s = sim_sock(arg, fd)) == NULL)
+		return -1;
+	s->peer = *addr;
+	return 0;
+}
+
+static ssize_t
+sim_sendto(void *arg, int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr_in *to)
+{
+	struct sim_sock *s;
+	struct iovec iov;
+
+	(void)flags;
+	if ((s = sim_sock(arg, fd)) == NULL)
+		return -1;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return sim_send(arg, s, &iov, 1, to);
+}
+
+/* Never blocks: callers wait with rad_net_wait() first */
+static ssize_t
+sim_recvfrom(void *arg, int fd, void *buf, size_t len, int flags,
+    struct sockaddr_in *from)
+{
+	struct sim_sock *s;
+	struct sim_dgram *d;
+
+	if ((s = sim_sock(arg, fd)) == NULL)
+		return -1;
+	if ((d = s->head) == NULL) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > d->len)
+		len = d->len;
+	memcpy(buf, d->data, len);
+	if (from != NULL)
+		*from = d->from;
+	if (flags & MSG_PEEK)
+		return len;
+	if ((s->head = d->next) == NULL)
+		s->tail = NULL;
+	s->queued -= d->len;
+	free(d);
+	return len;
+}
+
+static int
+sim_sendmmsg(void *arg, int fd, struct mmsghdr *msgs, u_int n, int flags)
+{
+	struct sim_sock *s;
+	ssize_t len;
+	u_int i;
+
+	(void)flags;
+	if ((s = sim_sock(arg, fd)) == NULL)
+		return -1;
+	for (i = 0; i < n; i++) {
+		len = sim_send(arg, s, msgs[i].msg_hdr.msg_iov,
+		    msgs[i].msg_hdr.msg_iovlen, msgs[i].msg_hdr.msg_name);
+		if (len == -1)
+			return i > 0 ? (int)i : -1;
+		msgs[i].msg_len = len;
+	}
+	return n;
+}
+
+static int
+sim_close(void *arg, int fd)
+{
+	struct sim_sock *s;
+	struct sim_dgram *d;
+
+	if ((s = sim_sock(arg, fd)) == NULL)
+		return -1;
+	while ((d = s->head) != NULL) {
+		s->head = d->next;
+		free(d);
+	}
+	memset(s, 0, sizeof *s);
+	return 0;
+}
+
+/* Run the events until fd is readable or the timeout has passed */
+static int
+sim_wait(void *arg, int fd, u_int64_t timeout_ns)
+{
+	struct rad_sim *sim = arg;
+	struct sim_sock *s;
+	u_int64_t deadline;
+
+	deadline = timeout_ns > RAD_NET_FOREVER - sim->now ?
+	    RAD_NET_FOREVER : sim->now + timeout_ns;
+	for (;;) {
+		if ((s = sim_sock(sim, fd)) == NULL)
+			return -1;
+		if (s->head != NULL)
+			return 1;
+		if (sim->count == 0 || sim->heap[0].when > deadline) {
+			if (deadline == RAD_NET_FOREVER) {
+				/* Nothing left that could ever wake it */
+				errno = EDEADLK;
+				return -1;
+			}
+			sim->now = deadline;
+			return 0;
+		}
+		sim_step(sim);
+	}
+}
+
+static u_int64_t
+sim_now(void *arg)
+{
+	return ((struct rad_sim *)arg)->now;
+}
+
+static time_t
+sim_time(void *arg)
+{
+	return SIM_EPOCH + (((struct rad_sim *)arg)->now - SIM_START) / 1000000000;
+}
+
+static const struct rad_net_ops sim_ops = {
+	sim_socket, sim_bind, sim_connect, sim_sendto, sim_recvfrom,
+	sim_sendmmsg, sim_close, sim_wait, sim_now, sim_time
+};
+
+/*
+ * Create a network whose links behave as link describes, with its chance
+ * drawn from seed.  Returns NULL if out of memory.
+ */
+struct rad_sim *
+rad_sim_create(u_int64_t seed, const struct rad_sim_link *link)
+{
+	struct rad_sim *sim;
+
+	if ((sim = calloc(1, sizeof *sim)) == NULL)
+		return NULL;
+	if ((sim->heap = malloc(SIM_HEAP_MIN * sizeof *sim->heap)) == NULL) {
+		free(sim);
+		return NULL;
+	}
+	sim->size = SIM_HEAP_MIN;
+	sim->link = *link;
+	/* splitmix64, so that nearby seeds give unrelated runs */
+	seed += 0x9e3779b97f4a7c15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+	sim->rng = (seed ^ (seed >> 31)) | 1;
+	sim->next_port = SIM_PORT_FIRST;
+	sim->now = SIM_START;
+	return sim;
+}
+
+void
+rad_sim_destroy(struct rad_sim *sim)
+{
+	struct sim_event ev;
+	int i;
+
+	while (sim->count > 0) {
+		sim_pop(sim, &ev);
+		free(ev.dgram);
+	}
+	for (i = 0; i < sim->no_socks; i++)
+		if (sim->socks[i].used)
+			sim_close(sim, SIM_FD_BASE + i);
+	free(sim->heap);
+	free(sim);
+}
+
+/* Route rad_net_*() to the simulation, until rad_sim_stop() */
+void
+rad_sim_start(struct rad_sim *sim)
+{
+	rad_net_set(&sim_ops, sim);
+}
+
+void
+rad_sim_stop(struct rad_sim *sim)
+{
+	(void)sim;
+	rad_net_set(NULL, NULL);
+}
+
+/* Call fn(arg, fd) whenever a datagram arrives on fd, NULL to stop */
+int
+rad_sim_listen(struct rad_sim *sim, int fd, rad_sim_fn *fn, void *arg)
+{
+	struct sim_sock *s;
+
+	if ((s = sim_sock(sim, fd)) == NULL)
+		return -1;
+	s->fn = fn;
+	s->arg = arg;
+	return 0;
+}
+
+/* Call fn(arg, -1) at virtual time when, or now if that has passed */
+int
+rad_sim_timer(struct rad_sim *sim, u_int64_t when, rad_sim_fn *fn, void *arg)
+{
+	if (sim_push(sim, when > sim->now ? when : sim->now, NULL, fn,
+	    arg) == -1) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Take the socket bound to addr off the network (down 1), dropping what
+ * is sent to it, or bring it back (0).  Returns -1 if nothing is bound.
+ */
+int
+rad_sim_down(struct rad_sim *sim, const struct sockaddr_in *addr, int down)
+{
+	struct sim_sock *s;
+
+	if ((s = sim_lookup(sim, addr)) == NULL) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+	s->down = down;
+	return 0;
+}
+
+/*
+ * Run the events up to virtual time until, or all of them with
+ * RAD_NET_FOREVER; returns how many were run
+ */
+int
+rad_sim_run(struct rad_sim *sim, u_int64_t until)
+{
+	int n;
+
+	for (n = 0; sim->count > 0 && sim->heap[0].when <= until; n++)
+		sim_step(sim);
+	if (until != RAD_NET_FOREVER && until > sim->now)
+		sim->now = until;
+	return n;
+}
+
+u_int64_t
+rad_sim_now(const struct rad_sim *sim)
+{
+	return sim->now;
+}
+
+void
+rad_sim_stats(const struct rad_sim *sim, struct rad_sim_stats *st)
+{
+	*st = sim->stats;
+	st->now = sim->now - SIM_START;
+}
@@ -0,0 +1,280 @@
+/*-
+ * Library counters
+ *
+ * The library counts what it does: requests built, bundles and the
+ * requests in them, bytes and messages sent and received, retransmits,
+ * timeouts, failovers, invalid messages, bytes copied between buffers and
+ * system calls.  Every thread counts into an array of its own with plain
+ * stores (RAD_STAT_ADD()); rad_stats_snapshot() sums the arrays of all
+ * threads, including the ones that have exited, and rad_stats_diff() turns
+ * two snapshots into the counts of an interval.
+ *
+ * rad_stats_export_start() serves snapshots on a Unix socket, for watching
+ * a live process: every connection gets the counters and is closed.  A
+ * peer that sends "prometheus" or an HTTP GET (curl --unix-socket) gets
+ * the Prometheus text format, one that sends "text" the plain one, and one
+ * that sends nothing within 100 ms the format given at start.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "include/radlib_private.h"
+
+/* The counters of one thread, allocated on first use */
+struct stats_thread {
+	struct stats_thread *next;
+	u_int64_t	 counters[RAD_STAT_COUNTERS];
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+} stats_names[RAD_STAT_COUNTERS] = {
+	{ "requests",		"Requests created" },
+	{ "bundles",		"Bundles sent" },
+	{ "bundled_requests",	"Requests sent in bundles" },
+	{ "messages_received",	"Requests or replies received" },
+	{ "bytes_sent",		"Bytes sent" },
+	{ "bytes_received",	"Bytes received" },
+	{ "retransmits",	"Requests or bundles sent again" },
+	{ "timeouts",		"Waits for a reply that timed out" },
+	{ "failovers",		"Switches to another server" },
+	{ "invalid",		"Requests or replies failing validation" },
+	{ "bytes_copied",	"Bytes copied between buffers" },
+	{ "syscalls",		"System calls" },
+};
+
+__thread u_int64_t *rad_stats_self;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *stats_threads;	/* Never shrinks */
+static u_int64_t stats_lost[RAD_STAT_COUNTERS];	/* Out of memory */
+
+/* Exporter */
+static pthread_t export_thread;
+static int export_running, export_stop, export_fd = -1, export_format;
+static char export_path[sizeof ((struct sockaddr_un *)0)->sun_path];
+
+/* Counters of the calling thread, for RAD_STAT_ADD() */
+u_int64_t *
+rad_stats_thread(void)
+{
+	struct stats_thread *t;
+
+	if (rad_stats_self != NULL)
+		return rad_stats_self;
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return stats_lost;
+	pthread_mutex_lock(&stats_lock);
+	t->next = stats_threads;
+	stats_threads = t;
+	pthread_mutex_unlock(&stats_lock);
+	rad_stats_self = t->counters;
+	return rad_stats_self;
+}
+
+const char *
+rad_stats_name(int counter)
+{
+	if (counter < 0 || counter >= RAD_STAT_COUNTERS)
+		return NULL;
+	return stats_names[counter].name;
+}
+
+/*
+ * Sum the counters of all threads.  They are read while being updated, so
+ * counters of the same event may be a count apart.
+ */
+void
+rad_stats_snapshot(struct rad_stats *s)
+{
+	struct stats_thread *t;
+	struct timespec ts;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s->time = (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	for (i = 0; i < RAD_STAT_COUNTERS; i++)
+		s->counters[i] = __atomic_load_n(&stats_lost[i],
+		    __ATOMIC_RELAXED);
+	pthread_mutex_lock(&stats_lock);
+	for (t = stats_threads; t != NULL; t = t->next)
+		for (i = 0; i < RAD_STAT_COUNTERS; i++)
+			s->counters[i] += __atomic_load_n(&t->counters[i],
+			    __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* The counts between snapshot then and snapshot now, into d */
+void
+rad_stats_diff(const struct rad_stats *now, const struct rad_stats *then,
+    struct rad_stats *d)
+{
+	int i;
+
+	d->time = now->time - then->time;
+	for (i = 0; i < RAD_STAT_COUNTERS; i++)
+		d->counters[i] = now->counters[i] - then->counters[i];
+}
+
+/*
+ * Print counters in the plain (RAD_STATS_TEXT) or Prometheus text
+ * (RAD_STATS_PROMETHEUS) format.  Returns -1 on an output error.
+ */
+int
+rad_stats_print(FILE *fp, const struct rad_stats *s, int format)
+{
+	const u_int64_t *c = s->counters;
+	double per_bundle;
+	int i;
+
+	per_bundle = c[RAD_STAT_BUNDLES] ? (double)c[RAD_STAT_BUNDLED] /
+	    c[RAD_STAT_BUNDLES] : 0;
+	for (i = 0; i < RAD_STAT_COUNTERS; i++) {
+		if (format == RAD_STATS_PROMETHEUS)
+			fprintf(fp, "# HELP radius_%s_total %s\n"
+			    "# TYPE radius_%s_total counter\n"
+			    "radius_%s_total %llu\n", stats_names[i].name,
+			    stats_names[i].help, stats_names[i].name,
+			    stats_names[i].name, (unsigned long long)c[i]);
+		else
+			fprintf(fp, "%-20s %llu\n", stats_names[i].name,
+			    (unsigned long long)c[i]);
+	}
+	if (format == RAD_STATS_PROMETHEUS)
+		fprintf(fp, "# HELP radius_requests_per_bundle"
+		    " Mean requests in a bundle\n"
+		    "# TYPE radius_requests_per_bundle gauge\n"
+		    "radius_requests_per_bundle %.2f\n", per_bundle);
+	else
+		fprintf(fp, "%-20s %.2f\n", "requests_per_bundle",
+		    per_bundle);
+	return ferror(fp) ? -1 : 0;
+}
+
+/* Answer one connection to the exporter */
+static void
+export_serve(int fd)
+{
+	struct pollfd pfd;
+	struct rad_stats s;
+	char req[512];
+	ssize_t n;
+	FILE *fp;
+	int format;
+
+	format = export_format;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 100) == 1 &&
+	    (n = read(fd, req, sizeof req - 1)) > 0) {
+		req[n] = '\0';
+		if (strncmp(req, "GET ", 4) == 0 ||
+		    strncmp(req, "prometheus", 10) == 0)
+			format = RAD_STATS_PROMETHEUS;
+		else if (strncmp(req, "text", 4) == 0)
+			format = RAD_STATS_TEXT;
+	} else
+		req[0] = '\0';
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+	if (strncmp(req, "GET ", 4) == 0)
+		fprintf(fp, "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+	rad_stats_snapshot(&s);
+	rad_stats_print(fp, &s, format);
+	fclose(fp);
+}
+
+static void *
+export_main(void *arg)
+{
+	struct pollfd pfd;
+	int fd;
+
+	(void)arg;
+	pfd.fd = export_fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&export_stop, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, 200) != 1)
+			continue;
+		if ((fd = accept(export_fd, NULL, NULL)) != -1)
+			export_serve(fd);
+	}
+	return NULL;
+}
+
+/*
+ * Serve the counters on a Unix stream socket at path, replacing an old
+ * socket there.  Returns 0 on success, -1 with errno set on failure.
+ */
+int
+rad_stats_export_start(const char *path, int format)
+{
+	struct sockaddr_un addr;
+	int error;
+
+	if (export_running) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (strlen(path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((export_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	unlink(path);
+	if (bind(export_fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+	    listen(export_fd, 16) == -1)
+		goto fail;
+	strcpy(export_path, path);
+	export_format = format;
+	export_stop = 0;
+	if ((error = pthread_create(&export_thread, NULL, export_main,
+	    NULL)) != 0) {
+		unlink(path);
+		errno = error;
+		goto fail;
+	}
+	export_running = 1;
+	return 0;
+
+fail:
+	error = errno;
+	close(export_fd);
+	export_fd = -1;
+	errno = error;
+	return -1;
+}
+
+/* Stop the exporter and remove its socket */
+void
+rad_stats_export_stop(void)
+{
+	if (!export_running)
+		return;
+	__atomic_store_n(&export_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(export_thread, NULL);
+	close(export_fd);
+	export_fd = -1;
+	unlink(export_path);
+	export_running = 0;
+}
@@ -0,0 +1,174 @@
+/*-
+ * Request templates
+ *
+ * Requests from a NAS or a load generator mostly differ in a few values:
+ * the user name, the password, a port number.  A template is a request
+ * encoded once, with those attributes left empty as fields (see
+ * rad_req_put_field()).  Stamping it copies the encoded attributes
+ * between the fields and writes the field values, fixing up the lengths
+ * of variable ones, instead of encoding every attribute again.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/radlib_private.h"
+
+void	 generr(struct rad_handle *, const char *, ...);
+
+/* Length of the value a field gets, or -1 if it is not acceptable */
+static int
+field_len(struct rad_handle *h, const struct rad_tpl_field *f,
+    const struct rad_value *v)
+{
+	size_t len;
+
+	if (f->width != 0) {
+		if (v->len != f->width) {
+			generr(h, "Value of %zu bytes for a field of %d",
+			    v->len, f->width);
+			return -1;
+		}
+		return f->width;
+	}
+	if (f->type == RAD_USER_PASSWORD) {
+		len = v->len > PASSSIZE ? PASSSIZE : v->len;
+		return len == 0 ? 16 : (len + 15) & ~0xf;
+	}
+	if (v->len > 253) {
+		generr(h, "Attribute too long");
+		return -1;
+	}
+	return v->len;
+}
+
+/* Copy template attributes [from, to) to the end of a request */
+static void
+copy_segment(struct rad_request *r, const struct rad_template *t,
+    size_t from, size_t to)
+{
+	if (t->authentic_off >= 0 && (size_t)t->authentic_off >= from &&
+	    (size_t)t->authentic_off < to)
+		r->authentic_pos = r->out_len + t->authentic_off - from;
+	memcpy(&r->out[r->out_len], &t->data[from], to - from);
+	RAD_STAT_ADD(RAD_STAT_COPIED, to - from);
+	r->out_len += to - from;
+}
+
+/*
+ * Compile a request built with rad_req_put_field() for its variable
+ * attributes into a template.  The request itself must not hold a
+ * User-Password; use a field for it.  It can be freed afterwards, and the
+ * template may be shared between handles and threads.  Returns NULL on
+ * error.
+ */
+struct rad_template *
+rad_template_create(struct rad_request *r)
+{
+	struct rad_template *t;
+	size_t len;
+
+	if (!r->out_created) {
+		generr(r->h, "Please call rad_create_request()"
+		    " before putting attributes");
+		return NULL;
+	}
+	if (r->pass_pos != 0) {
+		generr(r->h, "User-Password must be a template field");
+		return NULL;
+	}
+	len = r->out_len - POS_ATTRS;
+	if ((t = malloc(sizeof *t + len)) == NULL) {
+		generr(r->h, "Out of memory");
+		return NULL;
+	}
+	t->code = r->out[POS_CODE];
+	memcpy(t->data, &r->out[POS_ATTRS], len);
+	t->len = len;
+	t->authentic_off = r->authentic_pos ?
+	    r->authentic_pos - POS_ATTRS : -1;
+	if (t->authentic_off != -1)	/* In case r was encoded already */
+		memset(&t->data[t->authentic_off + 2], 0, LEN_AUTH);
+	t->chap_pass = r->chap_pass;
+	t->eap_msg = r->eap_msg;
+	t->no_fields = r->no_fields;
+	memcpy(t->fields, r->fields, r->no_fields * sizeof *r->fields);
+	return t;
+}
+
+void
+rad_template_free(struct rad_template *t)
+{
+	free(t);
+}
+
+/*
+ * Create a request from a template, with values[i] as the value of field
+ * i.  Values of fixed width fields must have that length and be in
+ * network byte order.  The request is used like one from
+ * rad_req_create(); more attributes may be put into it.  Returns NULL on
+ * error.
+ */
+struct rad_request *
+rad_template_stamp(struct rad_handle *h, const struct rad_template *t,
+    const struct rad_value *values)
+{
+	const struct rad_tpl_field *f;
+	struct rad_request *r;
+	size_t size, pos;
+	int i, len, vlen;
+	u_char *p;
+
+	if ((r = rad_req_create(h, t->code)) == NULL)
+		return NULL;
+
+	size = POS_ATTRS + t->len;
+	for (i = 0; i < t->no_fields; i++) {
+		if ((len = field_len(h, &t->fields[i], &values[i])) == -1) {
+			rad_req_free(r);
+			return NULL;
+		}
+		size += len - t->fields[i].width;
+	}
+	if (size > MSGSIZE) {
+		generr(h, "Maximum message length exceeded");
+		rad_req_free(r);
+		return NULL;
+	}
+	if (rad_out_reserve(r, size) == -1) {
+		rad_req_free(r);
+		return NULL;
+	}
+
+	pos = 0;
+	for (i = 0; i < t->no_fields; i++) {
+		f = &t->fields[i];
+		copy_segment(r, t, pos, f->off);
+		pos = f->off + 2 + f->width;
+
+		len = field_len(h, f, &values[i]);
+		p = &r->out[r->out_len];
+		p[0] = f->type;
+		p[1] = len + 2;
+		if (f->type == RAD_USER_PASSWORD) {
+			/* Scrambled by rad_req_encode(), as put_password_attr() */
+			vlen = values[i].len > PASSSIZE ?
+			    PASSSIZE : values[i].len;
+			memset(&p[2], 0, len);
+			r->pass_pos = r->out_len + 2;
+			memcpy(r->pass, values[i].data, vlen);
+			r->pass_len = vlen;
+			memset(r->pass + vlen, 0, len - vlen);
+		} else
+			memcpy(&p[2], values[i].data, len);
+		r->out_len += len + 2;
+	}
+	copy_segment(r, t, pos, t->len);
+	r->chap_pass = t->chap_pass;
+	r->eap_msg = t->eap_msg;
+	return r;
+}
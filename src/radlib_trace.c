@@ -0,0 +1,206 @@
+/*-
+ * Request path tracing
+ *
+ * Built with RADLIB_TRACE defined, the request path is marked with
+ * RAD_TRACE_BEGIN() and RAD_TRACE_END() around its stages: stamping and
+ * encoding a request, scrambling the password, the authenticators,
+ * copying it into a bundle, the system calls, waiting for the reply and
+ * splitting it.  Between rad_trace_start() and rad_trace_stop() every
+ * thread records the marks into a buffer of its own, 16 bytes each with
+ * a time stamp counter reading, without locks.  When the buffer of a
+ * thread is full its further marks are counted and dropped, so a capture
+ * should be short.  rad_trace_write() writes the marks in the Chrome
+ * trace event format, for chrome://tracing or ui.perfetto.dev.
+ */
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "include/radlib_trace.h"
+
+#define TRACE_DEFAULT	(1 << 16)	/* Marks per thread */
+
+#define MARK_END	(1ULL << 63)	/* In tsc: an 'E' mark */
+
+struct trace_mark {
+	u_int64_t	 tsc;
+	const char	*name;
+};
+
+/* The marks of one thread, allocated on first use */
+struct trace_thread {
+	struct trace_thread *next;
+	pid_t		 tid;
+	u_int		 gen;		/* Capture the marks belong to */
+	size_t		 size;
+	size_t		 count;
+	u_int64_t	 dropped;
+	struct trace_mark *marks;
+};
+
+int rad_trace_on;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_thread *trace_threads;	/* Never shrinks */
+static __thread struct trace_thread *trace_self;
+static u_int trace_gen;
+static size_t trace_size;
+
+/* Clock at the start of the capture, to convert counter readings */
+static u_int64_t trace_tsc0, trace_ns0;
+
+static u_int64_t
+trace_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static u_int64_t
+trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_thread *
+trace_thread_get(void)
+{
+	struct trace_thread *t;
+
+	if (trace_self != NULL)
+		return trace_self;
+	if ((t = calloc(1, sizeof *t)) == NULL)
+		return NULL;
+	t->tid = syscall(SYS_gettid);
+	pthread_mutex_lock(&trace_lock);
+	t->next = trace_threads;
+	trace_threads = t;
+	pthread_mutex_unlock(&trace_lock);
+	trace_self = t;
+	return t;
+}
+
+/* Record a mark of the calling thread, phase 'B' or 'E' */
+void
+rad_trace_event(const char *name, int phase)
+{
+	struct trace_thread *t;
+	u_int gen;
+
+	if ((t = trace_thread_get()) == NULL)
+		return;
+	gen = __atomic_load_n(&trace_gen, __ATOMIC_ACQUIRE);
+	if (t->gen != gen) {
+		/* First mark of this capture */
+		free(t->marks);
+		t->size = trace_size;
+		t->marks = malloc(t->size * sizeof *t->marks);
+		__atomic_store_n(&t->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->dropped, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&t->gen, gen, __ATOMIC_RELEASE);
+	}
+	if (t->marks == NULL || t->count == t->size) {
+		__atomic_store_n(&t->dropped, t->dropped + 1,
+		    __ATOMIC_RELAXED);
+		return;
+	}
+	t->marks[t->count].tsc = trace_tsc() |
+	    (phase == 'E' ? MARK_END : 0);
+	t->marks[t->count].name = name;
+	__atomic_store_n(&t->count, t->count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start a capture of up to marks marks per thread (0 for the default),
+ * discarding the previous one.  Returns 0, or -1 if tracing was not
+ * compiled in.
+ */
+int
+rad_trace_start(size_t marks)
+{
+#ifndef RADLIB_TRACE
+	(void)marks;
+	errno = ENOTSUP;
+	return -1;
+#else
+	pthread_mutex_lock(&trace_lock);
+	trace_size = marks != 0 ? marks : TRACE_DEFAULT;
+	trace_ns0 = trace_ns();
+	trace_tsc0 = trace_tsc();
+	__atomic_store_n(&trace_gen, trace_gen + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	__atomic_store_n(&rad_trace_on, 1, __ATOMIC_RELEASE);
+	return 0;
+#endif
+}
+
+void
+rad_trace_stop(void)
+{
+	__atomic_store_n(&rad_trace_on, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the marks of the last capture as a Chrome trace, with times in
+ * microseconds since its start.  Returns -1 on an output error.
+ */
+int
+rad_trace_write(FILE *fp)
+{
+	struct trace_thread *t;
+	const struct trace_mark *m;
+	u_int64_t dropped, tsc1, ns1;
+	double us_per_tick;
+	size_t i, count;
+	const char *sep;
+
+	/* Calibrate the counter against the clock over the capture */
+	ns1 = trace_ns();
+	tsc1 = trace_tsc();
+	us_per_tick = tsc1 > trace_tsc0 ?
+	    (double)(ns1 - trace_ns0) / (tsc1 - trace_tsc0) / 1000 : 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	sep = "\n";
+	dropped = 0;
+	pthread_mutex_lock(&trace_lock);
+	for (t = trace_threads; t != NULL; t = t->next) {
+		if (__atomic_load_n(&t->gen, __ATOMIC_ACQUIRE) != trace_gen)
+			continue;
+		count = __atomic_load_n(&t->count, __ATOMIC_ACQUIRE);
+		dropped += __atomic_load_n(&t->dropped, __ATOMIC_RELAXED);
+		for (i = 0; i < count; i++) {
+			m = &t->marks[i];
+			fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\","
+			    "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}", sep,
+			    m->name, m->tsc & MARK_END ? 'E' : 'B',
+			    (double)((m->tsc & ~MARK_END) - trace_tsc0) *
+			    us_per_tick, (int)getpid(), (int)t->tid);
+			sep = ",\n";
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	fprintf(fp, "\n],\"otherData\":{\"dropped\":\"%llu\"}}\n",
+	    (unsigned long long)dropped);
+	return ferror(fp) ? -1 : 0;
+}
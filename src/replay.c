@@ -0,0 +1,1104 @@
+/*
+ * Replay of captured RADIUS traffic
+ *
+ * The replay tool reads a pcap or pcapng capture, takes the RADIUS
+ * requests out of the UDP datagrams sent to the RADIUS ports, plain or
+ * bundled, and sends them again to a server at the pace they were
+ * captured, N times faster, or as fast as it answers.  That reproduces the
+ * attribute mix and the bursts of production traffic offline.
+ *
+ * Every request is rebuilt through the library for the secret of the
+ * replay: its attributes are put into a new request as captured, except
+ * that User-Password is decrypted with the original secret if one is
+ * given (and otherwise sent with its captured bytes as the password), and
+ * Message-Authenticator and the authenticators are computed anew.  CHAP
+ * responses that use the request authenticator as their challenge cannot
+ * be carried over; the server sees them as wrong passwords.
+ *
+ * By default the requests of a captured datagram are sent together again,
+ * so a plain capture is replayed plain and a bundled one bundled.  With
+ * -b they are bundled afresh: the requests that are due are held until
+ * the bundle is full or the oldest has waited for the bundle window, as
+ * the load generator does, to try bundle sizes on real traffic.
+ *
+ * Latency is measured from the time a request was due, as the capture
+ * timing says, so a replay that falls behind shows it in the queue
+ * stage.  At maximum speed it is measured from when it was built.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef WITH_SSL
+#include <openssl/md5.h>
+#else
+#define MD5_DIGEST_LENGTH 16
+#include "md5/md5.h"
+#endif
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+
+#define RP_PORT 1812
+#define RP_SECRET "testing123"
+#define RP_MAX_BUNDLE 256           /* Identifiers within a bundle must differ */
+#define RP_MAX_CONNS 64
+#define RP_MAX_PORTS 16
+#define RP_MAX_IFACES 64            /* pcapng interfaces per section */
+#define RP_TIMEOUT_MS 1000
+#define RP_SWEEP_NS 10000000        /* Look for timed out requests every 10 ms */
+#define RP_IDLE_NS 1000000          /* Wait while every socket is full */
+#define RP_START_NS 10000000
+#define RP_RCVBUF (4 * 1024 * 1024)
+#define REPLY_MAX_MSGS (MSGSIZE / 20)   /* Header-only messages in a datagram */
+
+/* Link types, as in pcap-linktype(7) */
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW_OLD 12
+#define LINKTYPE_RAW_BSD 14
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+/* pcapng blocks */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 1
+#define PCAPNG_OPB 2                /* Obsolete packet block */
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAPNG_BOM 0x1a2b3c4d
+#define PCAPNG_IF_TSRESOL 9
+
+typedef struct _rp_config_t
+{
+    struct in_addr server;
+    const char *host;
+    int port;
+    const char *secret;
+    const char *orig_secret;    /* Secret of the capture, for User-Password */
+    int ports[RP_MAX_PORTS];    /* Destination ports of requests */
+    int no_ports;
+    double speed;               /* 0 for as fast as possible */
+    int bundle;                 /* 0 to keep the captured datagrams */
+    long long window_ns;
+    int conns;
+    int timeout_ms;
+}rp_config_t;
+
+/* A captured request, pointing into the capture */
+typedef struct _rp_request_t
+{
+    long long t_ns;             /* Capture time */
+    long long group;            /* Datagram it was captured in */
+    const unsigned char *msg;
+    int len;
+}rp_request_t;
+
+/* Time stamps of a pcapng interface */
+typedef struct _rp_iface_t
+{
+    int linktype;
+    long long mul;              /* ns per unit, for decimal resolutions */
+    long long div;              /* Units per ns, for resolutions below 1 ns */
+    double scale;               /* ns per unit, for binary ones */
+}rp_iface_t;
+
+typedef struct _rp_capture_t
+{
+    unsigned char *data;
+    size_t size;
+    rp_request_t *reqs;
+    long long no_reqs;
+    long long max_reqs;
+    long long packets;
+    long long datagrams;        /* To a RADIUS port */
+    long long bundled;          /* Of which held more than one message */
+    long long fragments;        /* IP fragments, not reassembled */
+    long long malformed;
+    long long others;           /* Messages that are not requests */
+    long long by_code[256];
+}rp_capture_t;
+
+typedef struct _rp_pending_t
+{
+    struct rad_request *r;
+    long long deadline;
+}rp_pending_t;
+
+typedef struct _rp_conn_t
+{
+    int fd;
+    struct rad_handle *h;
+    int used;
+    int last_ident;
+    int outstanding;
+    rp_pending_t pending[256];
+}rp_conn_t;
+
+typedef struct _rp_state_t
+{
+    const rp_config_t *cfg;
+    const rp_capture_t *cap;
+    long long start;            /* When the first request is due */
+    long long next;             /* Next request to take */
+    long long due[RP_MAX_BUNDLE];
+    int no_due;
+    rp_conn_t conns[RP_MAX_CONNS];
+    int next_conn;
+    long long end;              /* When the last request was sent */
+    long long sent;
+    long long datagrams;
+    long long completed;
+    long long rejected;
+    long long timeouts;
+    long long errors;
+    long long stray;
+    long long unusable;         /* Requests the library would not rebuild */
+    long long authentic_dropped;    /* Message-Authenticators not supported */
+    struct rad_request *bundle[RP_MAX_BUNDLE];
+    unsigned char msg[MSGSIZE];
+    unsigned char in[MSGSIZE];
+    size_t reply_off[REPLY_MAX_MSGS + 1];
+}rp_state_t;
+
+static volatile sig_atomic_t rp_stop;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ns_ts(long long ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+/* Read a big endian (be) or little endian number */
+static unsigned int rd16(const unsigned char *p, int be)
+{
+    return be ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static unsigned int rd32(const unsigned char *p, int be)
+{
+    return be ? (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] :
+        (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/*
+ * Reading captures
+ */
+
+static int rp_read_file(const char *path, rp_capture_t *cap)
+{
+    size_t alloc = 1 << 20;
+    unsigned char *p;
+    ssize_t n;
+    int fd;
+
+    if (strcmp(path, "-") == 0)
+        fd = STDIN_FILENO;
+    else if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    cap->size = 0;
+    cap->data = NULL;
+    for (;;) {
+        if (cap->data == NULL || cap->size == alloc) {
+            if (cap->data != NULL)
+                alloc *= 2;
+            if ((p = realloc(cap->data, alloc)) == NULL) {
+                errno = ENOMEM;
+                break;
+            }
+            cap->data = p;
+        }
+        if ((n = read(fd, cap->data + cap->size, alloc - cap->size)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == 0) {
+                if (fd != STDIN_FILENO)
+                    close(fd);
+                return 0;
+            }
+            break;
+        }
+        cap->size += n;
+    }
+    if (fd != STDIN_FILENO)
+        close(fd);
+    return -1;
+}
+
+static int rp_port_wanted(const rp_config_t *cfg, int port)
+{
+    int i;
+
+    for (i = 0; i < cfg->no_ports; i++)
+        if (cfg->ports[i] == port)
+            return 1;
+    return 0;
+}
+
+static int rp_add(rp_capture_t *cap, long long t_ns, long long group,
+                  const unsigned char *msg, int len)
+{
+    rp_request_t *reqs;
+
+    if (cap->no_reqs == cap->max_reqs) {
+        cap->max_reqs = cap->max_reqs ? 2 * cap->max_reqs : 4096;
+        if ((reqs = realloc(cap->reqs, cap->max_reqs * sizeof(*reqs))) == NULL)
+            return -1;
+        cap->reqs = reqs;
+    }
+    reqs = &cap->reqs[cap->no_reqs++];
+    reqs->t_ns = t_ns;
+    reqs->group = group;
+    reqs->msg = msg;
+    reqs->len = len;
+    return 0;
+}
+
+/* Take the requests out of the UDP payload of one datagram */
+static int rp_datagram(const rp_config_t *cfg, rp_capture_t *cap, long long t_ns,
+                       const unsigned char *p, size_t len)
+{
+    size_t off[REPLY_MAX_MSGS + 1];
+    long long group;
+    int n, i, code;
+
+    if ((n = rad_bundle_scan(p, len, off, REPLY_MAX_MSGS)) < 0) {
+        cap->malformed++;
+        return 0;
+    }
+    group = cap->datagrams++;
+    cap->bundled += n > 1;
+    for (i = 0; i < n; i++) {
+        code = p[off[i] + POS_CODE];
+        switch (code) {
+            case RAD_ACCESS_REQUEST:
+            case RAD_ACCOUNTING_REQUEST:
+            case RAD_DISCONNECT_REQUEST:
+            case RAD_COA_REQUEST:
+                cap->by_code[code]++;
+                if (rp_add(cap, t_ns, group, p + off[i], off[i + 1] - off[i]) == -1)
+                    return -1;
+                break;
+            default:
+                cap->others++;
+        }
+    }
+    return 0;
+}
+
+/* Decode one captured packet down to UDP */
+static int rp_packet(const rp_config_t *cfg, rp_capture_t *cap, int linktype,
+                     long long t_ns, const unsigned char *p, size_t len)
+{
+    unsigned int type = 0, hlen, frag;
+    size_t ulen;
+
+    cap->packets++;
+    switch (linktype) {
+        case LINKTYPE_NULL:
+            if (len < 4)
+                return 0;
+            p += 4;
+            len -= 4;
+            break;
+        case LINKTYPE_ETHERNET:
+            if (len < 14)
+                return 0;
+            type = rd16(p + 12, 1);
+            p += 14;
+            len -= 14;
+            while ((type == 0x8100 || type == 0x88a8) && len >= 4) {
+                type = rd16(p + 2, 1);
+                p += 4;
+                len -= 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if (len < 16)
+                return 0;
+            type = rd16(p + 14, 1);
+            p += 16;
+            len -= 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if (len < 20)
+                return 0;
+            type = rd16(p, 1);
+            p += 20;
+            len -= 20;
+            break;
+        case LINKTYPE_RAW_OLD:
+        case LINKTYPE_RAW_BSD:
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+        case LINKTYPE_IPV6:
+            break;
+        default:
+            return 0;
+    }
+    if (type != 0 && type != 0x0800 && type != 0x86dd)
+        return 0;
+    if (len < 1)
+        return 0;
+
+    if (p[0] >> 4 == 4) {
+        hlen = (p[0] & 0xf) * 4;
+        if (hlen < 20 || len < hlen || p[9] != IPPROTO_UDP)
+            return 0;
+        frag = rd16(p + 6, 1);
+        if ((frag & 0x3fff) != 0) {
+            cap->fragments++;
+            return 0;
+        }
+        if (rd16(p + 2, 1) < len)
+            len = rd16(p + 2, 1);
+    } else if (p[0] >> 4 == 6) {
+        hlen = 40;
+        if (len < hlen || p[6] != IPPROTO_UDP)
+            return 0;
+        if (hlen + rd16(p + 4, 1) < len)
+            len = hlen + rd16(p + 4, 1);
+    } else
+        return 0;
+    if (len < hlen + 8)
+        return 0;
+    p += hlen;
+    len -= hlen;
+
+    if (!rp_port_wanted(cfg, rd16(p + 2, 1)))
+        return 0;
+    ulen = rd16(p + 4, 1);
+    if (ulen < 8 || ulen > len) {
+        cap->malformed++;   /* Truncated by the snap length, or bad */
+        return 0;
+    }
+    return rp_datagram(cfg, cap, t_ns, p + 8, ulen - 8);
+}
+
+static int rp_read_pcap(const rp_config_t *cfg, rp_capture_t *cap)
+{
+    const unsigned char *p = cap->data, *end = cap->data + cap->size;
+    unsigned int magic, caplen;
+    int be, nsec, linktype;
+    long long t_ns;
+
+    magic = rd32(p, 0);
+    be = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    if (cap->size < 24)
+        return -1;
+    linktype = rd32(p + 20, be) & 0xffff;
+    for (p += 24; end - p >= 16; p += 16 + caplen) {
+        caplen = rd32(p + 8, be);
+        if (caplen > (size_t)(end - p - 16))
+            break;          /* Cut short */
+        t_ns = rd32(p, be) * 1000000000LL +
+            rd32(p + 4, be) * (nsec ? 1LL : 1000LL);
+        if (rp_packet(cfg, cap, linktype, t_ns, p + 16, caplen) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Set the time stamp resolution of an interface from if_tsresol */
+static void rp_iface_resol(rp_iface_t *iface, int resol)
+{
+    int i;
+
+    iface->mul = 1;
+    iface->div = 1;
+    iface->scale = 0;
+    if (resol & 0x80) {
+        iface->scale = 1e9 / (double)(1ULL << (resol & 0x3f));
+        return;
+    }
+    for (i = resol; i < 9; i++)
+        iface->mul *= 10;
+    for (i = 9; i < resol && i < 18; i++)
+        iface->div *= 10;
+}
+
+static long long rp_iface_ns(const rp_iface_t *iface, unsigned long long ts)
+{
+    if (iface->scale != 0)
+        return ts * iface->scale;
+    return ts * iface->mul / iface->div;
+}
+
+static int rp_read_pcapng(const rp_config_t *cfg, rp_capture_t *cap)
+{
+    const unsigned char *p = cap->data, *end = cap->data + cap->size, *body, *opt;
+    rp_iface_t ifaces[RP_MAX_IFACES];
+    unsigned int type, blen, id, caplen, code, olen;
+    int be = 0, no_ifaces = 0;
+    long long t_ns = 0;
+
+    for (; end - p >= 12; p += blen) {
+        type = rd32(p, be);
+        if (type == PCAPNG_SHB) {
+            /* A new section, which may have the other byte order */
+            if (end - p < 28)
+                break;
+            be = rd32(p + 8, 0) != PCAPNG_BOM;
+            no_ifaces = 0;
+        }
+        blen = rd32(p + 4, be);
+        if (blen < 12 || blen % 4 != 0 || blen > (size_t)(end - p))
+            break;
+        body = p + 8;
+        switch (type) {
+            case PCAPNG_IDB:
+                if (blen < 20 || no_ifaces == RP_MAX_IFACES)
+                    break;
+                ifaces[no_ifaces].linktype = rd16(body, be);
+                rp_iface_resol(&ifaces[no_ifaces], 6);
+                for (opt = body + 8; opt + 4 <= p + blen - 4; opt += 4 + ((olen + 3) & ~3)) {
+                    code = rd16(opt, be);
+                    olen = rd16(opt + 2, be);
+                    if (code == 0)
+                        break;
+                    if (code == PCAPNG_IF_TSRESOL && olen == 1)
+                        rp_iface_resol(&ifaces[no_ifaces], opt[4]);
+                }
+                no_ifaces++;
+                break;
+            case PCAPNG_EPB:
+            case PCAPNG_OPB:
+                if (blen < 32)
+                    break;
+                id = type == PCAPNG_EPB ? rd32(body, be) : rd16(body, be);
+                caplen = rd32(body + 12, be);
+                if (id >= (unsigned int)no_ifaces || caplen > blen - 32)
+                    break;
+                t_ns = rp_iface_ns(&ifaces[id],
+                                   (unsigned long long)rd32(body + 4, be) << 32 |
+                                   rd32(body + 8, be));
+                if (rp_packet(cfg, cap, ifaces[id].linktype, t_ns, body + 20, caplen) == -1)
+                    return -1;
+                break;
+            case PCAPNG_SPB:
+                /* No time stamp; taken as sent with the previous packet */
+                if (blen < 16 || no_ifaces == 0)
+                    break;
+                caplen = rd32(body, be);
+                if (caplen > blen - 16)
+                    caplen = blen - 16;
+                if (rp_packet(cfg, cap, ifaces[0].linktype, t_ns, body + 4, caplen) == -1)
+                    return -1;
+                break;
+        }
+    }
+    return 0;
+}
+
+static int cmp_request(const void *a, const void *b)
+{
+    const rp_request_t *x = a, *y = b;
+
+    if (x->t_ns != y->t_ns)
+        return x->t_ns < y->t_ns ? -1 : 1;
+    return x->msg < y->msg ? -1 : x->msg > y->msg;
+}
+
+/* Read a capture and take its requests, in time order */
+static int rp_load(const rp_config_t *cfg, const char *path, rp_capture_t *cap)
+{
+    unsigned int magic;
+    long long i;
+    int ret;
+
+    memset(cap, 0, sizeof(*cap));
+    if (rp_read_file(path, cap) == -1) {
+        fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    magic = cap->size >= 4 ? rd32(cap->data, 0) : 0;
+    if (magic == PCAPNG_SHB)
+        ret = rp_read_pcapng(cfg, cap);
+    else if (magic == 0xa1b2c3d4 || magic == 0xd4c3b2a1 ||
+             magic == 0xa1b23c4d || magic == 0x4d3cb2a1)
+        ret = rp_read_pcap(cfg, cap);
+    else {
+        fprintf(stderr, "%s is not a pcap or pcapng capture\n", path);
+        return -1;
+    }
+    if (ret == -1) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    /* Interfaces of a pcapng capture need not be in step */
+    for (i = 1; i < cap->no_reqs; i++)
+        if (cap->reqs[i].t_ns < cap->reqs[i - 1].t_ns) {
+            qsort(cap->reqs, cap->no_reqs, sizeof(*cap->reqs), cmp_request);
+            break;
+        }
+    return 0;
+}
+
+/*
+ * Rebuilding requests
+ */
+
+/* Decrypt a captured User-Password with the secret of the capture */
+static size_t rp_password(const char *secret, const unsigned char *auth,
+                          const unsigned char *c, size_t len, unsigned char *out)
+{
+    unsigned char b[MD5_DIGEST_LENGTH];
+    MD5_CTX ctx;
+    size_t i, j;
+
+    for (i = 0; i < len; i += 16) {
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, secret, strlen(secret));
+        MD5_Update(&ctx, i == 0 ? auth : c + i - 16, 16);
+        MD5_Final(b, &ctx);
+        for (j = 0; j < 16; j++)
+            out[i + j] = c[i + j] ^ b[j];
+    }
+    while (len > 0 && out[len - 1] == '\0')
+        len--;
+    return len;
+}
+
+/* A new request on c with the attributes of a captured one */
+static struct rad_request *rp_build(rp_state_t *s, rp_conn_t *c, const rp_request_t *q)
+{
+    const unsigned char *msg = q->msg, *value;
+    unsigned char clear[128];
+    struct rad_request *r;
+    int pos, type, vlen, ret;
+
+    if ((r = rad_req_create(c->h, msg[POS_CODE])) == NULL)
+        return NULL;
+    c->used = 1;
+    c->last_ident = rad_req_ident(r);
+    for (pos = POS_ATTRS; pos + 2 <= q->len; pos += vlen + 2) {
+        type = msg[pos];
+        vlen = msg[pos + 1] - 2;
+        value = msg + pos + 2;
+        if (vlen < 0 || pos + 2 + vlen > q->len)
+            goto bad;
+        if (type == RAD_USER_PASSWORD && s->cfg->orig_secret != NULL &&
+                vlen % 16 == 0 && vlen > 0 && vlen <= (int)sizeof(clear))
+            ret = rad_req_put_attr(r, type, clear,
+                                   rp_password(s->cfg->orig_secret, msg + POS_AUTH,
+                                               value, vlen, clear));
+        else if (type == RAD_MESSAGE_AUTHENTIC) {
+            if ((ret = rad_req_put_message_authentic(r)) == -1) {
+                s->authentic_dropped++;     /* Built without SSL */
+                ret = 0;
+            }
+        } else
+            ret = rad_req_put_attr(r, type, value, vlen);
+        if (ret == -1)
+            goto bad;
+    }
+    return r;
+
+bad:
+    rad_req_free(r);
+    return NULL;
+}
+
+/*
+ * Sending and receiving
+ */
+
+static int rp_connect(rp_state_t *s, rp_conn_t *c)
+{
+    const rp_config_t *cfg = s->cfg;
+    struct sockaddr_in sin;
+    int size = RP_RCVBUF;
+
+    if ((c->h = rad_auth_open()) == NULL ||
+            rad_add_server(c->h, cfg->host, cfg->port, cfg->secret, 1, 1) == -1) {
+        fprintf(stderr, "Client setup: %s\n", c->h ? rad_strerror(c->h) : "Out of memory");
+        return -1;
+    }
+    rad_set_latency(c->h, 1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr = cfg->server;
+    sin.sin_port = htons(cfg->port);
+    if ((c->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+            connect(c->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+        fprintf(stderr, "Cannot connect to the server: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return 0;
+}
+
+static void rp_disconnect(rp_conn_t *c)
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+        if (c->pending[i].r != NULL)
+            rad_req_free(c->pending[i].r);
+    if (c->h != NULL)
+        rad_close(c->h);
+    if (c->fd != -1)
+        close(c->fd);
+}
+
+static int rp_room(const rp_conn_t *c)
+{
+    return !c->used || c->pending[(c->last_ident + 1) & 0xff].r == NULL;
+}
+
+/* When a captured request is due to be replayed */
+static long long rp_due(const rp_state_t *s, long long i)
+{
+    if (s->cfg->speed == 0)
+        return s->start;
+    return s->start + (s->cap->reqs[i].t_ns - s->cap->reqs[0].t_ns) / s->cfg->speed;
+}
+
+/*
+ * Send the due requests, as many as fit into one datagram on the next
+ * socket with room.  Returns the number taken, 0 if every socket is full.
+ */
+static int rp_send(rp_state_t *s)
+{
+    const rp_config_t *cfg = s->cfg;
+    const rp_request_t *q;
+    struct rad_request *r;
+    struct timespec due;
+    rp_conn_t *c = NULL;
+    const void *data;
+    size_t data_len, len = 0;
+    long long now;
+    int n = 0, taken = 0, i, id;
+
+    for (i = 0; i < cfg->conns; i++) {
+        c = &s->conns[(s->next_conn + i) % cfg->conns];
+        if (rp_room(c))
+            break;
+    }
+    if (i == cfg->conns)
+        return 0;
+    s->next_conn = (s->next_conn + i + 1) % cfg->conns;
+
+    for (; taken < s->no_due && rp_room(c); taken++) {
+        q = &s->cap->reqs[s->due[taken]];
+        /* A rebuilt request may gain a Message-Authenticator */
+        if (n > 0 && len + q->len + 18 > MSGSIZE)
+            break;
+        if ((r = rp_build(s, c, q)) == NULL || rad_req_encode(r, &data, &data_len) == -1) {
+            if (r != NULL)
+                rad_req_free(r);
+            s->unusable++;
+            continue;
+        }
+        if (cfg->speed != 0) {
+            ns_ts(rp_due(s, s->due[taken]), &due);
+            rad_req_schedule(r, &due);
+        }
+        memcpy(s->msg + len, data, data_len);
+        RAD_STAT_ADD(RAD_STAT_COPIED, data_len);
+        len += data_len;
+        s->bundle[n++] = r;
+    }
+
+    if (n > 0) {
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        if (send(c->fd, s->msg, len, 0) == -1)
+            s->errors++;    /* The requests will time out */
+        else {
+            RAD_STAT_ADD(RAD_STAT_BYTES_SENT, len);
+            RAD_STAT_ADD(RAD_STAT_BUNDLES, 1);
+            RAD_STAT_ADD(RAD_STAT_BUNDLED, n);
+        }
+        s->end = now = now_ns();
+        for (i = 0; i < n; i++) {
+            rad_req_sent(s->bundle[i], n);
+            id = rad_req_ident(s->bundle[i]);
+            c->pending[id].r = s->bundle[i];
+            c->pending[id].deadline = now + (long long)cfg->timeout_ms * 1000000;
+        }
+        c->outstanding += n;
+        s->sent += n;
+        s->datagrams++;
+    }
+    s->no_due -= taken;
+    memmove(s->due, s->due + taken, s->no_due * sizeof(s->due[0]));
+    return taken;
+}
+
+static void rp_receive(rp_state_t *s, rp_conn_t *c)
+{
+    rp_pending_t *e;
+    const unsigned char *p;
+    ssize_t len;
+    int n, i;
+
+    for (;;) {
+        len = recv(c->fd, s->in, sizeof(s->in), MSG_DONTWAIT);
+        RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+        if (len <= 0)
+            return;
+        RAD_STAT_ADD(RAD_STAT_BYTES_RECEIVED, len);
+        if ((n = rad_bundle_scan(s->in, len, s->reply_off, REPLY_MAX_MSGS)) < 0) {
+            s->stray++;
+            continue;
+        }
+        RAD_STAT_ADD(RAD_STAT_RECEIVED, n);
+        for (i = 0; i < n; i++) {
+            p = s->in + s->reply_off[i];
+            e = &c->pending[p[POS_IDENT]];
+            if (e->r == NULL) {
+                s->stray++;
+                continue;
+            }
+            rad_req_received(e->r);
+            rad_req_complete(e->r, p[POS_CODE]);
+            rad_req_free(e->r);
+            e->r = NULL;
+            c->outstanding--;
+            s->completed++;
+            s->rejected += p[POS_CODE] == RAD_ACCESS_REJECT;
+        }
+    }
+}
+
+static void rp_sweep(rp_state_t *s, long long now, int force)
+{
+    rp_conn_t *c;
+    int i, j;
+
+    for (i = 0; i < s->cfg->conns; i++) {
+        c = &s->conns[i];
+        for (j = 0; j < 256 && c->outstanding > 0; j++) {
+            if (c->pending[j].r == NULL || (!force && c->pending[j].deadline > now))
+                continue;
+            rad_req_free(c->pending[j].r);
+            c->pending[j].r = NULL;
+            c->outstanding--;
+            s->timeouts++;
+            RAD_STAT_ADD(RAD_STAT_TIMEOUTS, 1);
+        }
+    }
+}
+
+static int rp_wait(rp_state_t *s, long long now, long long wake)
+{
+    struct pollfd pfd[RP_MAX_CONNS];
+    struct timespec ts;
+    int i, n;
+
+    for (i = 0; i < s->cfg->conns; i++) {
+        pfd[i].fd = s->conns[i].fd;
+        pfd[i].events = POLLIN;
+    }
+    ns_ts(wake > now ? wake - now : 0, &ts);
+    n = ppoll(pfd, s->cfg->conns, &ts, NULL);
+    RAD_STAT_ADD(RAD_STAT_SYSCALLS, 1);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+    for (i = 0; i < s->cfg->conns && n > 0; i++)
+        if (pfd[i].revents) {
+            rp_receive(s, &s->conns[i]);
+            n--;
+        }
+    return 0;
+}
+
+static int rp_outstanding(const rp_state_t *s)
+{
+    int i, n = 0;
+
+    for (i = 0; i < s->cfg->conns; i++)
+        n += s->conns[i].outstanding;
+    return n;
+}
+
+/* Whether the due requests make a bundle to send now */
+static int rp_ready(const rp_state_t *s, long long now)
+{
+    const rp_request_t *reqs = s->cap->reqs;
+
+    if (s->no_due == 0)
+        return 0;
+    if (s->no_due == RP_MAX_BUNDLE || s->next == s->cap->no_reqs)
+        return 1;
+    if (s->cfg->bundle == 0)
+        return reqs[s->next].group != reqs[s->due[0]].group;
+    return s->no_due == s->cfg->bundle || now >= rp_due(s, s->due[0]) + s->cfg->window_ns;
+}
+
+static int rp_run(rp_state_t *s)
+{
+    const rp_config_t *cfg = s->cfg;
+    const rp_request_t *reqs = s->cap->reqs;
+    long long now, wake, sweep, drain;
+    int max = cfg->bundle ? cfg->bundle : RP_MAX_BUNDLE, full, i;
+
+    for (i = 0; i < cfg->conns; i++)
+        s->conns[i].fd = -1;
+    for (i = 0; i < cfg->conns; i++)
+        if (rp_connect(s, &s->conns[i]) == -1)
+            return -1;
+    s->start = now_ns() + RP_START_NS;
+    sweep = s->start + RP_SWEEP_NS;
+
+    while (!rp_stop && (s->next < s->cap->no_reqs || s->no_due > 0)) {
+        now = now_ns();
+        while (s->no_due < max && s->next < s->cap->no_reqs && rp_due(s, s->next) <= now) {
+            if (cfg->bundle == 0 && s->no_due > 0 &&
+                    reqs[s->next].group != reqs[s->due[0]].group)
+                break;
+            s->due[s->no_due++] = s->next++;
+        }
+        full = 0;
+        if (rp_ready(s, now)) {
+            if ((i = rp_send(s)) > 0)
+                continue;
+            full = 1;
+        }
+        if (now >= sweep) {
+            rp_sweep(s, now, 0);
+            sweep = now + RP_SWEEP_NS;
+        }
+
+        /* Sleep until the next request or bundle deadline, or a reply */
+        wake = s->next < s->cap->no_reqs ? rp_due(s, s->next) : sweep;
+        if (s->no_due > 0 && cfg->bundle != 0 && rp_due(s, s->due[0]) + cfg->window_ns < wake)
+            wake = rp_due(s, s->due[0]) + cfg->window_ns;
+        if (wake > sweep)
+            wake = sweep;
+        if (full)
+            wake = now + RP_IDLE_NS;
+        if (rp_wait(s, now, wake) == -1) {
+            fprintf(stderr, "Poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    drain = now_ns() + (long long)cfg->timeout_ms * 1000000;
+    while (!rp_stop && rp_outstanding(s) > 0 && (now = now_ns()) < drain)
+        if (rp_wait(s, now, now + RP_SWEEP_NS < drain ? now + RP_SWEEP_NS : drain) == -1)
+            break;
+    rp_sweep(s, 0, 1);
+    return 0;
+}
+
+/*
+ * Reports
+ */
+
+static void rp_print_stage(const char *name, int stage)
+{
+    struct rad_latency l;
+
+    if (rad_latency_get(NULL, RAD_LAT_ANY, RAD_LAT_ANY, stage, &l) == -1 || l.count == 0)
+        return;
+    printf("%-6s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+           l.mean / 1e6, l.p50 / 1e6, l.p90 / 1e6, l.p99 / 1e6, l.p999 / 1e6,
+           l.max / 1e6);
+}
+
+static void rp_report(const rp_state_t *s, const char *path, double elapsed)
+{
+    const rp_capture_t *cap = s->cap;
+    double span = 0;
+
+    if (cap->no_reqs > 1)
+        span = (cap->reqs[cap->no_reqs - 1].t_ns - cap->reqs[0].t_ns) / 1e9;
+    printf("Capture %s: %lld packets, %lld RADIUS datagrams (%lld bundled),"
+           " %lld fragments skipped, %lld malformed\n", path, cap->packets,
+           cap->datagrams, cap->bundled, cap->fragments, cap->malformed);
+    printf("%lld requests over %.3f s (%.0f/s): %lld access, %lld accounting,"
+           " %lld CoA, %lld disconnect; %lld other messages\n", cap->no_reqs, span,
+           span > 0 ? cap->no_reqs / span : 0.0, cap->by_code[RAD_ACCESS_REQUEST],
+           cap->by_code[RAD_ACCOUNTING_REQUEST], cap->by_code[RAD_COA_REQUEST],
+           cap->by_code[RAD_DISCONNECT_REQUEST], cap->others);
+
+    if (s->cfg->speed == 0)
+        printf("\nReplayed at maximum speed");
+    else
+        printf("\nReplayed at %gx", s->cfg->speed);
+    if (s->cfg->bundle == 0)
+        printf(" as captured\n");
+    else
+        printf(" in bundles of up to %d\n", s->cfg->bundle);
+    printf("Sent %lld requests in %lld datagrams (%.2f per datagram), %.0f/s over %.3f s\n",
+           s->sent, s->datagrams, s->datagrams ? (double)s->sent / s->datagrams : 0.0,
+           elapsed > 0 ? s->sent / elapsed : 0.0, elapsed);
+    printf("Answered %lld (%lld rejected), %lld timed out, %lld send errors,"
+           " %lld stray replies, %lld not rebuilt\n", s->completed, s->rejected,
+           s->timeouts, s->errors, s->stray, s->unusable);
+    if (s->authentic_dropped > 0)
+        printf("%lld Message-Authenticators dropped: built without SSL\n",
+               s->authentic_dropped);
+
+    printf("\nLatency from the %s, ms\n",
+           s->cfg->speed == 0 ? "time built" : "captured send time");
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "stage", "mean", "p50", "p90", "p99",
+           "p99.9", "max");
+    rp_print_stage("queue", RAD_LAT_QUEUE);
+    rp_print_stage("wire", RAD_LAT_WIRE);
+    rp_print_stage("total", RAD_LAT_TOTAL);
+}
+
+static void rp_signal(int sig)
+{
+    rp_stop = 1;
+}
+
+/* Parse a comma separated list of ports. Returns the count, -1 if invalid. */
+static int parse_ports(char *s, int *ports)
+{
+    char *arg;
+    int n = 0;
+
+    for (arg = strtok(s, ","); arg != NULL; arg = strtok(NULL, ",")) {
+        if (n == RP_MAX_PORTS || (ports[n] = atoi(arg)) < 1 || ports[n] > 65535)
+            return -1;
+        n++;
+    }
+    return n > 0 ? n : -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-H server] [-p port] [-s secret] [-o secret] [-P ports]\n"
+            "          [-x speed|max] [-b bundle] [-w usec] [-c sockets] [-T msec] capture\n"
+            "  -H server   server address (default 127.0.0.1)\n"
+            "  -p port     server port (default %d)\n"
+            "  -s secret   shared secret of the server (default %s)\n"
+            "  -o secret   shared secret of the capture, to decrypt User-Password\n"
+            "  -P ports    destination ports of captured requests (default 1812,1813)\n"
+            "  -x speed    replay speed, a factor of the captured timing or max (default 1)\n"
+            "  -b bundle   bundle up to this many requests afresh, 1 to %d;\n"
+            "              0 sends them as they were captured (default 0)\n"
+            "  -w usec     with -b, longest a request waits for its bundle (default 1000)\n"
+            "  -c sockets  sockets to send on, 1 to %d (default 4)\n"
+            "  -T msec     time to wait for a reply (default %d)\n"
+            "The capture is a pcap or pcapng file, or - for standard input.\n",
+            prog, RP_PORT, RP_SECRET, RP_MAX_BUNDLE, RP_MAX_CONNS, RP_TIMEOUT_MS);
+}
+
+int main(int argc, char **argv)
+{
+    rp_config_t cfg;
+    rp_capture_t cap;
+    rp_state_t *s;
+    int opt, ret, i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = "127.0.0.1";
+    cfg.port = RP_PORT;
+    cfg.secret = RP_SECRET;
+    cfg.ports[0] = 1812;
+    cfg.ports[1] = 1813;
+    cfg.no_ports = 2;
+    cfg.speed = 1;
+    cfg.window_ns = 1000000;
+    cfg.conns = 4;
+    cfg.timeout_ms = RP_TIMEOUT_MS;
+
+    while ((opt = getopt(argc, argv, "H:p:s:o:P:x:b:w:c:T:")) != -1) {
+        switch (opt) {
+            case 'H':
+                cfg.host = optarg;
+                break;
+            case 'p':
+                cfg.port = atoi(optarg);
+                break;
+            case 's':
+                cfg.secret = optarg;
+                break;
+            case 'o':
+                cfg.orig_secret = optarg;
+                break;
+            case 'P':
+                if ((cfg.no_ports = parse_ports(optarg, cfg.ports)) == -1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'x':
+                cfg.speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+                break;
+            case 'b':
+                cfg.bundle = atoi(optarg);
+                break;
+            case 'w':
+                cfg.window_ns = atoll(optarg) * 1000;
+                break;
+            case 'c':
+                cfg.conns = atoi(optarg);
+                break;
+            case 'T':
+                cfg.timeout_ms = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || cfg.speed < 0 || cfg.bundle < 0 ||
+            cfg.bundle > RP_MAX_BUNDLE || cfg.window_ns < 0 || cfg.conns < 1 ||
+            cfg.conns > RP_MAX_CONNS || cfg.timeout_ms < 1 || cfg.port < 1 ||
+            cfg.port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (inet_pton(AF_INET, cfg.host, &cfg.server) != 1) {
+        fprintf(stderr, "Invalid server address %s\n", cfg.host);
+        return 1;
+    }
+
+    if (rp_load(&cfg, argv[optind], &cap) == -1)
+        return 1;
+    if (cap.no_reqs == 0) {
+        fprintf(stderr, "No RADIUS requests to ports");
+        for (i = 0; i < cfg.no_ports; i++)
+            fprintf(stderr, "%s%d", i ? "," : " ", cfg.ports[i]);
+        fprintf(stderr, " in %s\n", argv[optind]);
+        return 1;
+    }
+
+    if ((s = calloc(1, sizeof(*s))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    s->cfg = &cfg;
+    s->cap = &cap;
+    signal(SIGINT, rp_signal);
+    signal(SIGTERM, rp_signal);
+
+    ret = rp_run(s);
+    rp_report(s, argv[optind], s->end > s->start ? (s->end - s->start) / 1e9 : 0);
+    if (s->completed == 0)
+        ret = -1;
+    for (i = 0; i < cfg.conns; i++)
+        rp_disconnect(&s->conns[i]);
+    free(s);
+    free(cap.reqs);
+    free(cap.data);
+    return ret == -1;
+}
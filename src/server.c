@@ -1,90 +1,302 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
-#define MSG_SIZE 55000
-#define AUTH_SIZE 16
-#define AVP_SIZE 14
-#define RAD_REQUEST 1
-#define RAD_ACCEPT 2
-#define RAD_PKT_ID 1
+#include "include/server.h"
+#include "include/radlib_net.h"
 
-#define LOG(args...) printf(args)
-#define TRACE_ENABLE 0
-#define TRACE(args...) if(TRACE_ENABLE) printf(args) 
+#define RAD_HDR_SIZE 20     /* Code, identifier, length and authenticator */
 
-/* RADIUS Packet Structure */
-typedef struct _radius_pkt_t
+/*
+ * Print the request and system call totals of the workers on shutdown.  They
+ * are read without stopping the workers, so they may be off by a request.
+ */
+static void server_report(const server_worker_t *workers, int no_workers)
 {
-    uint8_t code;
-    uint8_t id;
-    uint16_t length;
-    char auth[AUTH_SIZE];
-    char avp[AVP_SIZE];
-}rad_pkt_t;
+    long long msgs = 0, dropped = 0, duplicates = 0, syscalls = 0;
+    int i;
+
+    for (i = 0; i < no_workers; i++) {
+        msgs += workers[i].msg_no;
+        dropped += workers[i].dropped;
+        duplicates += workers[i].duplicates;
+        syscalls += workers[i].syscalls;
+    }
+    printf("\nServed %lld requests, %lld dropped, %lld duplicates, %lld syscalls\n",
+           msgs, dropped, duplicates, syscalls);
+    fflush(stdout);
+}
+
+/* Print what the fault policy did to the replies, after the totals */
+static void server_report_faults(void)
+{
+    struct rad_fault_stats st;
+
+    rad_fault_stats(&st);
+    printf("Faults in %llu datagrams: %llu dropped, %llu delayed, %llu duplicated,"
+           " %llu truncated, %llu messages dropped, %llu messages truncated,"
+           " %llu lengths corrupted\n",
+           (unsigned long long)st.datagrams, (unsigned long long)st.dropped,
+           (unsigned long long)st.delayed, (unsigned long long)st.duplicated,
+           (unsigned long long)st.truncated, (unsigned long long)st.msg_dropped,
+           (unsigned long long)st.msg_truncated, (unsigned long long)st.corrupted);
+    fflush(stdout);
+}
+
+/* Log one level more (delta 1) or less (-1) verbosely, on SIGUSR1 and SIGUSR2 */
+static void server_log_adjust(int delta)
+{
+    u_int32_t cats;
+    int level;
+
+    for (level = RAD_LOG_LEVELS - 1; level >= 0 && rad_log_mask[level] == 0; level--)
+        ;
+    cats = level >= 0 ? rad_log_mask[0] : RAD_LOGC_ALL;
+    level += delta;
+    if (level < -1)
+        level = -1;
+    if (level >= RAD_LOG_LEVELS)
+        level = RAD_LOG_LEVELS - 1;
+    rad_log_set(level, cats);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-p port] [-P udp|tcp|both] [-w workers] [-n] [-r per|bundle]"
+            " [-m size] [-l usec]\n"
+            "          [-s secret] [-C file] [-H handler] [-L latency] [-D msec]"
+            " [-v level] [-E path]\n"
+            "          [-F faults]\n"
+            "  -p port     UDP and TCP port to listen on (default %d)\n"
+            "  -P proto    transports to serve (default both)\n"
+            "  -w workers  number of worker threads, each with its own\n"
+            "              SO_REUSEPORT sockets (default 1)\n"
+            "  -n          do not pin workers to CPUs\n"
+            "  -r mode     'bundle' packs the replies to a request bundle into\n"
+            "              as few datagrams as fit (default), 'per' sends one\n"
+            "              datagram per sub-request\n"
+            "  -m size     largest bundled reply datagram (default %d)\n"
+            "  -l usec     linger window for gathering replies across\n"
+            "              request datagrams (default 0)\n"
+            "  -s secret   secret shared with the local clients (default %s)\n"
+            "  -C file     NAS clients, one 'address[/prefix] secret' per line\n"
+            "  -H handler  request handler (default accept):\n",
+            prog, SERVER_PORT, REPLY_MAX_SIZE, SERVER_SECRET);
+    server_handler_list(stderr);
+    fprintf(stderr,
+            "  -L latency  synthetic processing time per request: none,\n"
+            "              fixed:US, exp:US (exponential with mean US) or\n"
+            "              uniform:MIN-MAX; prefix with async: to queue the\n"
+            "              delayed replies instead of blocking the worker\n"
+            "  -D msec     answer retransmitted requests from a cache of the\n"
+            "              responses kept for msec (default 0, disabled)\n"
+            "  -v level    log level[:category,...]: off, error, warn, info,\n"
+            "              debug or trace, and general, net, bundle, proto\n"
+            "              (default info); SIGUSR1 and SIGUSR2 raise and\n"
+            "              lower the level\n"
+            "  -E path     serve the library counters on a Unix socket, in\n"
+            "              text or, to an HTTP GET, Prometheus format\n"
+            "  -F faults   damage the replies sent, e.g. drop=1,delay=5:20000:\n"
+            "              drop, dup, trunc, msgdrop, msgtrunc and corrupt in\n"
+            "              percent, delay=percent:usec and seed=n\n");
+}
 
 int main(int argc, char**argv)
 {
-    long long sockfd,n;
-    uint8_t recvd_pkt_id = 0;
-    struct sockaddr_in servaddr,cliaddr;
-    socklen_t len;
-    char mesg[MSG_SIZE]= {0};
-    char reply_msg[MSG_SIZE]= {0};
-    char authentic[AUTH_SIZE] = {0xec, 0xfe, 0x3d, 0x2f, 0xe4, 0x47, 0x3e, 0xc6, 0x29, 0x90, 
-                          0x95, 0xee, 0x46, 0xae, 0xdf, 0x77};
-    char avp[AVP_SIZE] = {0x05, 0x06, 0x00, 0x00, 0x10, 0x7f, 
-                    0x01, 0x08, 0x61, 0x64, 0x6d, 0x69, 0x6e, '\0'};
-    long long data_len, msg_start;
-    uint16_t packet_len = 0;
-    long long msg_no = 0;
-    
-    /* Create a UDP Socket */
-    sockfd=socket(AF_INET,SOCK_DGRAM,0);
-
-    memset(&servaddr,0,sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr=htonl(INADDR_ANY);
-    servaddr.sin_port=htons(1812);
-    bind(sockfd,(struct sockaddr *)&servaddr,sizeof(servaddr));
-
-    /* Construct the Reply Msg */
-    rad_pkt_t *pkt;
-    pkt = (rad_pkt_t *)reply_msg;
-    pkt->code = RAD_ACCEPT;
-    pkt->id = RAD_PKT_ID;
-    memcpy(&pkt->auth, authentic, sizeof(authentic));
-    memcpy(&pkt->avp, avp, sizeof(avp));
-    pkt->length = htons(sizeof(rad_pkt_t));
-    for (;;)
-    {
-        LOG("\n\r====== LISTENING TO UDP CLIENT MESSAGES ======\n\r");
-        len = sizeof(cliaddr);
-        data_len = recvfrom(sockfd,mesg,MSG_SIZE,0, (struct sockaddr *)&cliaddr,&len);
-        TRACE("\n\rdata_len = %llu\n\r", data_len);
-
-        msg_start = 0;
-        msg_no = 0;
-        while(msg_start < data_len)
-        {
-            LOG("\n\r====== RECEIVED MSG FROM CLIENT ======");
-            if(mesg[msg_start] == RAD_REQUEST)
-                LOG("\n\rRADIUS Request from Client (Code = %d)", mesg[msg_start]);
-            recvd_pkt_id = mesg[msg_start +1];
-            LOG("\n\rPacket ID %d", recvd_pkt_id);
-            packet_len = (mesg[msg_start + 2] * 256) + mesg[msg_start + 3];
-            LOG("  Packet_len = %d", packet_len);
-
-            TRACE("\n\rmsg_start = %llu\n\r", msg_start);
-            pkt->id = recvd_pkt_id;
-            msg_start += packet_len;
-            sendto(sockfd,reply_msg,sizeof(rad_pkt_t),0,(struct sockaddr *)&cliaddr,sizeof(cliaddr));
-            msg_no++;
-            LOG("\n\rReplied back to the Client with RADIUS ACCEPT (Code = %d)", RAD_REQUEST);
-            LOG("\n\rNo of Clients serviced %llu\n\r", msg_no);
-            usleep(2000);
+    server_worker_t *workers;
+    server_config_t cfg;
+    int no_workers = 1;
+    int pin = 1;
+    int dup_ms = 0;
+    const char *stats_path = NULL;
+    struct rad_fault faults;
+    int faulty = 0;
+    sigset_t sigs;
+    int ncpus, i, c, sig;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.port = SERVER_PORT;
+    cfg.protocols = PROTO_UDP | PROTO_TCP;
+    cfg.reply_mode = REPLY_MODE_BUNDLE;
+    cfg.reply_max = REPLY_MAX_SIZE;
+    cfg.secret = SERVER_SECRET;
+    cfg.handler = server_handler_find("accept");
+
+    while ((c = getopt(argc, argv, "p:P:w:nr:m:l:s:C:H:L:D:v:E:F:")) != -1) {
+        switch (c) {
+            case 'p':
+                cfg.port = atoi(optarg);
+                break;
+            case 'P':
+                if (strcmp(optarg, "udp") == 0)
+                    cfg.protocols = PROTO_UDP;
+                else if (strcmp(optarg, "tcp") == 0)
+                    cfg.protocols = PROTO_TCP;
+                else if (strcmp(optarg, "both") == 0)
+                    cfg.protocols = PROTO_UDP | PROTO_TCP;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'w':
+                no_workers = atoi(optarg);
+                break;
+            case 'n':
+                pin = 0;
+                break;
+            case 'r':
+                if (strcmp(optarg, "per") == 0)
+                    cfg.reply_mode = REPLY_MODE_PER_REQUEST;
+                else if (strcmp(optarg, "bundle") == 0)
+                    cfg.reply_mode = REPLY_MODE_BUNDLE;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'm':
+                cfg.reply_max = atoi(optarg);
+                break;
+            case 'l':
+                cfg.linger_us = atol(optarg);
+                break;
+            case 's':
+                cfg.secret = optarg;
+                break;
+            case 'C':
+                cfg.clients = optarg;
+                break;
+            case 'H':
+                if ((cfg.handler = server_handler_find(optarg)) == NULL) {
+                    fprintf(stderr, "Unknown handler %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'L':
+                if (server_latency_parse(optarg, &cfg.latency) == -1) {
+                    fprintf(stderr, "Invalid latency model %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'D':
+                dup_ms = atoi(optarg);
+                break;
+            case 'E':
+                stats_path = optarg;
+                break;
+            case 'F':
+                if (rad_fault_parse(optarg, &faults) == -1) {
+                    fprintf(stderr, "Invalid fault policy %s\n", optarg);
+                    return 1;
+                }
+                faulty = 1;
+                break;
+            case 'v':
+                if (rad_log_parse(optarg) == -1) {
+                    fprintf(stderr, "Invalid log level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
         }
-        memset(mesg, 0, sizeof(mesg));
     }
+    if ((no_workers < 1) || (no_workers > MAX_WORKERS)) {
+        fprintf(stderr, "Invalid number of workers (1 - %d)\n", MAX_WORKERS);
+        return 1;
+    }
+    if ((cfg.reply_max < RAD_HDR_SIZE) || (cfg.reply_max > MSG_SIZE)) {
+        fprintf(stderr, "Invalid reply size (%d - %d)\n", RAD_HDR_SIZE, MSG_SIZE);
+        return 1;
+    }
+    if (cfg.linger_us < 0) {
+        fprintf(stderr, "Invalid linger window\n");
+        return 1;
+    }
+    if (cfg.clients != NULL) {
+        /* Report a bad client list before any worker starts */
+        struct rad_handle *h = rad_server_open(-1);
+
+        if (h == NULL || rad_load_clients(h, cfg.clients) == -1) {
+            fprintf(stderr, "%s\n", h ? rad_strerror(h) : "Out of memory");
+            return 1;
+        }
+        rad_close(h);
+    }
+    if (dup_ms < 0) {
+        fprintf(stderr, "Invalid duplicate cache lifetime\n");
+        return 1;
+    }
+    if (dup_ms && (cfg.dup = rad_dup_cache_create(dup_ms, DUP_MAX_ENTRIES)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+
+    if ((workers = calloc(no_workers, sizeof(*workers))) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* Open all the sockets up front so a bind failure is reported before serving */
+    for (i = 0; i < no_workers; i++) {
+        workers[i].id = i;
+        workers[i].cpu = pin ? i % ncpus : -1;
+        workers[i].cfg = &cfg;
+        workers[i].sockfd = -1;
+        workers[i].listenfd = -1;
+        if ((cfg.protocols & PROTO_UDP) &&
+                (workers[i].sockfd = server_socket(SOCK_DGRAM, cfg.port)) == -1)
+            return 1;
+        if ((cfg.protocols & PROTO_TCP) &&
+                (workers[i].listenfd = server_socket(SOCK_STREAM, cfg.port)) == -1)
+            return 1;
+    }
+
+    /* The workers inherit the mask; only the main thread takes the signals */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    if (rad_log_start(stdout) == -1)
+        fprintf(stderr, "Cannot start the logging thread, logging synchronously\n");
+    if (stats_path != NULL && rad_stats_export_start(stats_path, RAD_STATS_TEXT) == -1) {
+        fprintf(stderr, "Cannot serve counters on %s: %s\n", stats_path, strerror(errno));
+        return 1;
+    }
+    if (faulty && rad_fault_start(&faults) == -1) {
+        fprintf(stderr, "Cannot inject faults: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < no_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, server_worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "Cannot start worker %d\n", i);
+            return 1;
+        }
+    }
+    while (sigwait(&sigs, &sig) == 0 && (sig == SIGUSR1 || sig == SIGUSR2))
+        server_log_adjust(sig == SIGUSR1 ? 1 : -1);
+    rad_stats_export_stop();
+    rad_log_stop();
+    server_report(workers, no_workers);
+    if (faulty)
+        server_report_faults();
+
+    return 0;
 }
@@ -0,0 +1,367 @@
+/*
+ * Request handling pipeline of the bundle-aware RADIUS test server
+ *
+ * Every sub-request of a bundle goes through the same stages:
+ *   decode -> validate -> handler -> (latency) -> encode -> send
+ * The handler and the synthetic latency model are selected at start-up.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+#include "include/server.h"
+
+/* Copy User-Name and NAS-Port of the request into the response */
+static int handler_echo_attrs(struct rad_handle *h)
+{
+    static const int echoed[] = { RAD_USER_NAME, RAD_NAS_PORT };
+    const void *data;
+    size_t len;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(echoed) / sizeof(echoed[0]); i++)
+        if (rad_find_attr(h, echoed[i], &data, &len) > 0 &&
+                rad_put_attr(h, echoed[i], data, len) == -1)
+            return -1;
+    return 0;
+}
+
+/* Response code that acknowledges a request of the given code */
+static int handler_ack_code(int code)
+{
+    switch (code) {
+        case RAD_ACCESS_REQUEST:
+            return RAD_ACCESS_ACCEPT;
+        case RAD_ACCOUNTING_REQUEST:
+            return RAD_ACCOUNTING_RESPONSE;
+        case RAD_DISCONNECT_REQUEST:
+            return RAD_DISCONNECT_ACK;
+        case RAD_COA_REQUEST:
+            return RAD_COA_ACK;
+    }
+    return 0;
+}
+
+static int handler_accept(struct rad_handle *h, int code, void *arg)
+{
+    int resp_code = handler_ack_code(code);
+
+    if (resp_code == 0 || rad_create_response(h, resp_code) == -1)
+        return -1;
+    return handler_echo_attrs(h);
+}
+
+static int handler_reject(struct rad_handle *h, int code, void *arg)
+{
+    int resp_code = handler_ack_code(code);
+
+    if (code == RAD_ACCESS_REQUEST)
+        resp_code = RAD_ACCESS_REJECT;
+    if (resp_code == 0 || rad_create_response(h, resp_code) == -1)
+        return -1;
+    return handler_echo_attrs(h);
+}
+
+static int handler_drop(struct rad_handle *h, int code, void *arg)
+{
+    return -1;
+}
+
+static const server_handler_t server_handlers[] = {
+    { "accept", handler_accept, "accept every request, echoing User-Name and NAS-Port" },
+    { "reject", handler_reject, "reject Access-Requests, acknowledge everything else" },
+    { "drop", handler_drop, "never answer" },
+    { NULL, NULL, NULL }
+};
+
+const server_handler_t *server_handler_find(const char *name)
+{
+    const server_handler_t *hd;
+
+    for (hd = server_handlers; hd->name != NULL; hd++)
+        if (strcmp(hd->name, name) == 0)
+            return hd;
+    return NULL;
+}
+
+void server_handler_list(FILE *fp)
+{
+    const server_handler_t *hd;
+
+    for (hd = server_handlers; hd->name != NULL; hd++)
+        fprintf(fp, "              %-8s %s\n", hd->name, hd->help);
+}
+
+/*
+ * Parse a latency model: "fixed:US", "exp:US" or "uniform:MIN-MAX",
+ * optionally prefixed with "async:".  Returns 0 on success, -1 on error.
+ */
+int server_latency_parse(const char *spec, server_latency_t *lat)
+{
+    char *end;
+
+    memset(lat, 0, sizeof(*lat));
+    if (strncmp(spec, "async:", 6) == 0) {
+        lat->async = 1;
+        spec += 6;
+    }
+    if (strcmp(spec, "none") == 0) {
+        lat->model = LATENCY_NONE;
+        return 0;
+    }
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        lat->model = LATENCY_FIXED;
+        spec += 6;
+    } else if (strncmp(spec, "exp:", 4) == 0) {
+        lat->model = LATENCY_EXP;
+        spec += 4;
+    } else if (strncmp(spec, "uniform:", 8) == 0) {
+        lat->model = LATENCY_UNIFORM;
+        spec += 8;
+    } else
+        return -1;
+
+    lat->delay_us = strtol(spec, &end, 10);
+    if (end == spec || lat->delay_us < 0)
+        return -1;
+    if (lat->model == LATENCY_UNIFORM) {
+        if (*end != '-')
+            return -1;
+        spec = end + 1;
+        lat->max_us = strtol(spec, &end, 10);
+        if (end == spec || lat->max_us < lat->delay_us)
+            return -1;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/* Draw the processing delay of one request from the latency model */
+static long latency_draw(server_worker_t *w)
+{
+    const server_latency_t *lat = &w->cfg->latency;
+
+    switch (lat->model) {
+        case LATENCY_FIXED:
+            return lat->delay_us;
+        case LATENCY_EXP:
+            return (long)(-log(1.0 - erand48(w->rng)) * lat->delay_us);
+        case LATENCY_UNIFORM:
+            return lat->delay_us +
+                (long)(erand48(w->rng) * (lat->max_us - lat->delay_us + 1));
+    }
+    return 0;
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void pending_swap(pending_reply_t *a, pending_reply_t *b)
+{
+    pending_reply_t t = *a;
+
+    *a = *b;
+    *b = t;
+}
+
+/*
+ * Queue the encoded reply of the handle to be sent once its delay has
+ * passed.  It goes into the duplicate cache then, not before, so that a
+ * retransmission meanwhile is dropped as one of a request in progress.
+ */
+static int pending_push(server_worker_t *w, long delay_us, struct rad_handle *h,
+                        const struct sockaddr_in *dest, server_conn_t *conn)
+{
+    pending_queue_t *q = &w->pending;
+    pending_reply_t *p;
+    int i;
+
+    if (q->count == MAX_PENDING || h->req.out_len > REPLY_MAX_PACKET)
+        return -1;
+    p = &q->heap[q->count];
+    if (q->no_free)
+        p->data = q->free_bufs[--q->no_free];
+    else if ((p->data = malloc(REPLY_MAX_PACKET)) == NULL)
+        return -1;
+    server_clock(&p->due);
+    p->due.tv_nsec += (delay_us % 1000000) * 1000;
+    p->due.tv_sec += delay_us / 1000000 + p->due.tv_nsec / 1000000000;
+    p->due.tv_nsec %= 1000000000;
+    p->dest = *dest;
+    p->conn_fd = conn ? conn->fd : -1;
+    p->conn_gen = conn ? conn->gen : 0;
+    p->len = h->req.out_len;
+    memcpy(p->data, h->req.out, p->len);
+    p->dup = h->dup_pending;
+    p->dup_key = h->dup_key;
+    h->dup_pending = 0;
+
+    /* Sift up */
+    for (i = q->count++; i > 0; i = (i - 1) / 2) {
+        if (!timespec_before(&q->heap[i].due, &q->heap[(i - 1) / 2].due))
+            break;
+        pending_swap(&q->heap[i], &q->heap[(i - 1) / 2]);
+    }
+    return 0;
+}
+
+static void pending_pop(server_worker_t *w)
+{
+    pending_queue_t *q = &w->pending;
+    int i, c;
+
+    q->free_bufs[q->no_free++] = q->heap[0].data;
+    q->heap[0] = q->heap[--q->count];
+
+    /* Sift down */
+    for (i = 0; (c = 2 * i + 1) < q->count; i = c) {
+        if (c + 1 < q->count && timespec_before(&q->heap[c + 1].due, &q->heap[c].due))
+            c++;
+        if (!timespec_before(&q->heap[c].due, &q->heap[i].due))
+            break;
+        pending_swap(&q->heap[i], &q->heap[c]);
+    }
+}
+
+/*
+ * Send the delayed replies that are due.  Returns 1 and sets *next to the
+ * due time of the earliest reply still queued, or 0 if none is left.
+ */
+int server_pipeline_due(server_worker_t *w, struct timespec *next)
+{
+    pending_queue_t *q = &w->pending;
+    pending_reply_t *p;
+    server_conn_t *c;
+    struct timespec now;
+
+    if (q->count == 0)
+        return 0;
+    server_clock(&now);
+    while (q->count && !timespec_before(&now, &q->heap[0].due)) {
+        p = &q->heap[0];
+        if (p->conn_fd == -1)
+            server_reply_add(w, p->data, p->len, &p->dest);
+        else if ((c = server_tcp_conn(w, p->conn_fd, p->conn_gen)) != NULL)
+            server_tcp_reply(w, c, p->data, p->len);
+        if (p->dup)
+            rad_dup_cache_store(w->cfg->dup, &p->dup_key, p->data, p->len);
+        pending_pop(w);
+    }
+    if (q->count == 0)
+        return 0;
+    *next = q->heap[0].due;
+    return 1;
+}
+
+/* Set up the server handle and queues of a worker */
+int server_pipeline_init(server_worker_t *w)
+{
+    const server_config_t *cfg = w->cfg;
+
+    if ((w->h = rad_server_open(w->sockfd)) == NULL)
+        return -1;
+    if (rad_add_client(w->h, "127.0.0.1", cfg->secret) == -1 ||
+            (cfg->clients != NULL && rad_load_clients(w->h, cfg->clients) == -1)) {
+        fprintf(stderr, "Worker %d: %s\n", w->id, rad_strerror(w->h));
+        return -1;
+    }
+    if (cfg->dup != NULL)
+        rad_set_dup_cache(w->h, cfg->dup);
+    w->rng[0] = w->id;
+    w->rng[1] = getpid();
+    w->rng[2] = time(NULL);
+    if (cfg->latency.async) {
+        w->pending.heap = calloc(MAX_PENDING, sizeof(*w->pending.heap));
+        w->pending.free_bufs = calloc(MAX_PENDING, sizeof(*w->pending.free_bufs));
+        if (w->pending.heap == NULL || w->pending.free_bufs == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run one sub-request of a received bundle through the pipeline.  The
+ * reply goes back over conn, or as a datagram to from when conn is NULL.
+ */
+void server_pipeline_process(server_worker_t *w, const unsigned char *msg, int len,
+                             const struct sockaddr_in *from, server_conn_t *conn)
+{
+    const server_config_t *cfg = w->cfg;
+    struct rad_handle *h = w->h;
+    struct timespec ts;
+    long delay_us;
+    int code, ret;
+
+    /* Decode */
+    if ((ret = rad_load_request(h, msg, len, from)) == -4) {
+        /* Retransmission: resend the cached response, if any, as it is */
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Duplicate request %d", msg[POS_IDENT]);
+        w->duplicates++;
+        if (h->req.out_len == 0)
+            return;
+        if (conn != NULL)
+            server_tcp_reply(w, conn, h->req.out, h->req.out_len);
+        else
+            server_reply_add(w, h->req.out, h->req.out_len, from);
+        return;
+    }
+    if (ret != 0) {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Decode failed: %s", rad_strerror(h));
+        w->dropped++;
+        return;
+    }
+
+    /* Validate, and index the attributes for the handler */
+    if ((code = rad_validate_request(h)) < 0 || rad_index_attrs(h) == -1) {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Validation failed: %s", rad_strerror(h));
+        w->dropped++;
+        return;
+    }
+
+    /* Handler */
+    if (cfg->handler->fn(h, code, cfg->handler_arg) == -1) {
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_PROTO, "Handler dropped request %d", msg[POS_IDENT]);
+        return;
+    }
+
+    /* Synthetic processing time */
+    delay_us = latency_draw(w);
+    if (delay_us && !cfg->latency.async) {
+        ts.tv_sec = delay_us / 1000000;
+        ts.tv_nsec = (delay_us % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+            ;
+    }
+
+    /* Encode */
+    if (rad_encode_response(h) == -1) {
+        RAD_LOG(RAD_LOG_ERR, RAD_LOGC_PROTO, "Encode failed: %s", rad_strerror(h));
+        return;
+    }
+
+    /* Send */
+    if (delay_us && cfg->latency.async) {
+        if (pending_push(w, delay_us, h, from, conn) == -1)
+            w->dropped++;
+        w->msg_no++;
+        return;
+    }
+    if (conn != NULL)
+        server_tcp_reply(w, conn, h->req.out, h->req.out_len);
+    else
+        server_reply_add(w, h->req.out, h->req.out_len, from);
+    if (h->dup_pending) {
+        rad_dup_cache_store(h->dup, &h->dup_key, h->req.out, h->req.out_len);
+        h->dup_pending = 0;
+    }
+    w->msg_no++;
+}
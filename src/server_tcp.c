@@ -0,0 +1,281 @@
+/*
+ * TCP transport of the bundle-aware RADIUS test server
+ *
+ * Every worker accepts connections on its own SO_REUSEPORT listener and
+ * drives them from its epoll loop with non-blocking sockets.  A NAS may
+ * stream any number of (bundled) requests over a connection; the framer
+ * pulls complete RADIUS messages out of the byte stream using their
+ * length field and the replies are queued per connection and written
+ * back with writev() once per read.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+
+#include "include/server.h"
+
+#define RAD_HDR_SIZE 20         /* Code, identifier, length and authenticator */
+
+/* Look up an open connection, ignoring references to an earlier one on the same fd */
+server_conn_t *server_tcp_conn(server_worker_t *w, int fd, unsigned int gen)
+{
+    server_conn_t *c;
+
+    if (fd < 0 || fd >= w->no_conns || (c = w->conns[fd]) == NULL)
+        return NULL;
+    if (!c->open || c->gen != gen)
+        return NULL;
+    return c;
+}
+
+static void conn_set_events(server_worker_t *w, server_conn_t *c, int events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events)
+        return;
+    ev.events = events;
+    ev.data.fd = c->fd;
+    w->syscalls++;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->events = events;
+}
+
+static void conn_close(server_worker_t *w, server_conn_t *c)
+{
+    out_chunk_t *ch;
+
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_NET, "Closing TCP connection %d", c->fd);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    while ((ch = c->out_head) != NULL) {
+        c->out_head = ch->next;
+        ch->next = w->free_chunks;
+        w->free_chunks = ch;
+    }
+    c->out_tail = NULL;
+    c->out_bytes = 0;
+    c->in_len = 0;
+    c->open = 0;
+    c->gen++;
+}
+
+/* Accept every pending connection on the worker's listener */
+void server_tcp_accept(server_worker_t *w)
+{
+    struct sockaddr_in peer;
+    struct epoll_event ev;
+    server_conn_t *c;
+    socklen_t len;
+    int fd, opt = 1;
+
+    for (;;) {
+        len = sizeof(peer);
+        fd = accept4(w->listenfd, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK);
+        w->syscalls++;
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                fprintf(stderr, "Worker %d: accept: %s\n", w->id, strerror(errno));
+            return;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        if (fd >= w->no_conns) {
+            int n = w->no_conns ? w->no_conns : 64;
+            server_conn_t **conns;
+
+            while (n <= fd)
+                n *= 2;
+            if ((conns = realloc(w->conns, n * sizeof(*conns))) == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(conns + w->no_conns, 0, (n - w->no_conns) * sizeof(*conns));
+            w->conns = conns;
+            w->no_conns = n;
+        }
+        if ((c = w->conns[fd]) == NULL) {
+            if ((c = calloc(1, sizeof(*c))) == NULL) {
+                close(fd);
+                continue;
+            }
+            w->conns[fd] = c;
+        }
+        c->fd = fd;
+        c->peer = peer;
+        c->in_len = 0;
+        c->events = EPOLLIN;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            continue;
+        }
+        c->open = 1;
+        RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_NET, "Worker %d accepted TCP connection %d", w->id, fd);
+    }
+}
+
+/* Queue one reply on a connection; it is written by server_tcp_flush() */
+void server_tcp_reply(server_worker_t *w, server_conn_t *c, const unsigned char *reply,
+                      int len)
+{
+    out_chunk_t *ch = c->out_tail;
+
+    if (ch == NULL || ch->len + len > CONN_CHUNK_SIZE) {
+        if ((ch = w->free_chunks) != NULL)
+            w->free_chunks = ch->next;
+        else if ((ch = malloc(sizeof(*ch))) == NULL)
+            return;
+        ch->next = NULL;
+        ch->off = 0;
+        ch->len = 0;
+        if (c->out_tail)
+            c->out_tail->next = ch;
+        else
+            c->out_head = ch;
+        c->out_tail = ch;
+    }
+    memcpy(ch->data + ch->len, reply, len);
+    ch->len += len;
+    c->out_bytes += len;
+
+    if (!c->dirty) {
+        c->dirty = 1;
+        c->next_dirty = w->dirty;
+        w->dirty = c;
+    }
+}
+
+/* Write as much of the queued replies as the socket takes. Returns -1 on error. */
+static int conn_write(server_worker_t *w, server_conn_t *c)
+{
+    struct iovec iov[CONN_MAX_IOV];
+    out_chunk_t *ch;
+    ssize_t n;
+    int cnt;
+
+    while (c->out_head != NULL) {
+        for (cnt = 0, ch = c->out_head; ch != NULL && cnt < CONN_MAX_IOV; ch = ch->next) {
+            iov[cnt].iov_base = ch->data + ch->off;
+            iov[cnt].iov_len = ch->len - ch->off;
+            cnt++;
+        }
+        n = writev(c->fd, iov, cnt);
+        w->syscalls++;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        c->out_bytes -= n;
+        while (n > 0) {
+            ch = c->out_head;
+            if (n < ch->len - ch->off) {
+                ch->off += n;
+                break;
+            }
+            n -= ch->len - ch->off;
+            c->out_head = ch->next;
+            ch->next = w->free_chunks;
+            w->free_chunks = ch;
+        }
+        if (c->out_head == NULL)
+            c->out_tail = NULL;
+    }
+
+    /* Wait for room when the socket is full; stop reading when too far behind */
+    if (c->out_head == NULL)
+        conn_set_events(w, c, EPOLLIN);
+    else if (c->out_bytes > CONN_OUT_MAX)
+        conn_set_events(w, c, EPOLLOUT);
+    else
+        conn_set_events(w, c, EPOLLIN | EPOLLOUT);
+    return 0;
+}
+
+/* Write out the replies queued since the last flush */
+void server_tcp_flush(server_worker_t *w)
+{
+    server_conn_t *c;
+
+    while ((c = w->dirty) != NULL) {
+        w->dirty = c->next_dirty;
+        c->dirty = 0;
+        if (c->open && conn_write(w, c) == -1)
+            conn_close(w, c);
+    }
+}
+
+/*
+ * Pull every complete message out of the connection's stream buffer and
+ * run it through the pipeline.  Returns -1 if the stream is malformed.
+ */
+static int conn_frame(server_worker_t *w, server_conn_t *c)
+{
+    int pos = 0, packet_len;
+
+    while (c->in_len - pos >= RAD_HDR_SIZE) {
+        packet_len = (c->in[pos + 2] << 8) | c->in[pos + 3];
+        if (packet_len < RAD_HDR_SIZE || packet_len > REPLY_MAX_PACKET) {
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Bad message length %d on connection %d",
+                    packet_len, c->fd);
+            return -1;
+        }
+        if (c->in_len - pos < packet_len)
+            break;
+        server_pipeline_process(w, c->in + pos, packet_len, &c->peer, c);
+        if (!c->open)
+            return 0;
+        pos += packet_len;
+    }
+
+    /* Keep the partial message for the next read */
+    if (pos) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+    return 0;
+}
+
+/* Handle readiness of a connection */
+void server_tcp_event(server_worker_t *w, int fd, uint32_t events)
+{
+    server_conn_t *c;
+    ssize_t n;
+
+    if (fd >= w->no_conns || (c = w->conns[fd]) == NULL || !c->open)
+        return;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(w, c);
+        return;
+    }
+    if ((events & EPOLLOUT) && conn_write(w, c) == -1) {
+        conn_close(w, c);
+        return;
+    }
+    if (!(events & EPOLLIN))
+        return;
+
+    n = read(c->fd, c->in + c->in_len, CONN_IN_SIZE - c->in_len);
+    w->syscalls++;
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        conn_close(w, c);
+        return;
+    }
+    if (n > 0) {
+        c->in_len += n;
+        if (conn_frame(w, c) == -1)
+            conn_close(w, c);
+    }
+}
@@ -0,0 +1,343 @@
+/*
+ * Worker threads of the bundle-aware RADIUS test server
+ *
+ * Every worker owns SO_REUSEPORT sockets of its own and runs an epoll
+ * loop over them: it reads the UDP datagrams, runs their bundled
+ * requests through the pipeline, and sends the replies back gathered
+ * into as few datagrams and system calls as it can.  The datagrams and
+ * the clock go through rad_net_*(), so that a worker can also be stepped
+ * with server_worker_poll() inside the simulated network of sim.c.
+ */
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include "include/server.h"
+#include "include/radlib_net.h"
+
+/* Read the transport's monotonic clock */
+void server_clock(struct timespec *ts)
+{
+    u_int64_t now = rad_net_now();
+
+    ts->tv_sec = now / 1000000000;
+    ts->tv_nsec = now % 1000000000;
+}
+
+/*
+ * Create a UDP socket or a non-blocking TCP listener bound to the server
+ * port that shares the port with the other workers
+ */
+int server_socket(int type, int port)
+{
+    int sockfd, opt = 1;
+    struct sockaddr_in servaddr;
+
+    if ((sockfd = socket(AF_INET, type, 0)) == -1) {
+        fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Let the kernel spread clients across the workers listening on the same port */
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        fprintf(stderr, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    memset(&servaddr,0,sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr=htonl(INADDR_ANY);
+    servaddr.sin_port=htons(port);
+    if (bind(sockfd,(struct sockaddr *)&servaddr,sizeof(servaddr)) == -1) {
+        fprintf(stderr, "bind: %s\n", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    if (type == SOCK_STREAM) {
+        if (listen(sockfd, SOMAXCONN) == -1 ||
+                fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+            fprintf(stderr, "listen: %s\n", strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+    }
+    return sockfd;
+}
+
+/* Send all the gathered replies with a single syscall */
+static void reply_flush(server_worker_t *w)
+{
+    reply_batch_t *b = &w->batch;
+    int i, sent = 0, n;
+
+    if (b->no_replies == 0)
+        return;
+    for (i = 0; i < b->no_dgrams; i++) {
+        b->msgs[i].msg_hdr.msg_name = &b->dest;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->dest);
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < b->no_dgrams) {
+        n = rad_net_sendmmsg(w->sockfd, &b->msgs[sent], b->no_dgrams - sent, 0);
+        w->syscalls++;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            RAD_LOG(RAD_LOG_ERR, RAD_LOGC_NET, "sendmmsg: %s", strerror(errno));
+            break;
+        }
+        sent += n;
+    }
+    RAD_LOG(RAD_LOG_DEBUG, RAD_LOGC_BUNDLE, "Flushed %d replies in %d datagrams",
+            b->no_replies, b->no_dgrams);
+    b->no_dgrams = 0;
+    b->no_replies = 0;
+}
+
+/* Queue one reply for a client, or send it straight away in per-request mode */
+void server_reply_add(server_worker_t *w, const unsigned char *reply, int len,
+                      const struct sockaddr_in *dest)
+{
+    const server_config_t *cfg = w->cfg;
+    reply_batch_t *b = &w->batch;
+    struct iovec *iov;
+
+    if (cfg->reply_mode == REPLY_MODE_PER_REQUEST) {
+        rad_net_sendto(w->sockfd, reply, len, 0, dest);
+        w->syscalls++;
+        return;
+    }
+
+    /* A batch only ever holds replies for one client */
+    if (b->no_replies && (b->dest.sin_addr.s_addr != dest->sin_addr.s_addr ||
+                b->dest.sin_port != dest->sin_port))
+        reply_flush(w);
+
+    if (b->no_replies == 0) {
+        b->dest = *dest;
+        if (cfg->linger_us) {
+            server_clock(&b->deadline);
+            b->deadline.tv_nsec += (cfg->linger_us % 1000000) * 1000;
+            b->deadline.tv_sec += cfg->linger_us / 1000000 + b->deadline.tv_nsec / 1000000000;
+            b->deadline.tv_nsec %= 1000000000;
+        }
+    }
+
+    /*
+     * Open a new datagram when the reply does not fit into the current one.
+     * A reply larger than the limit still goes out, alone in its datagram.
+     */
+    iov = b->no_dgrams ? &b->iov[b->no_dgrams - 1] : NULL;
+    if (iov == NULL || iov->iov_len + len > (size_t)cfg->reply_max) {
+        if (b->no_dgrams == REPLY_MAX_DGRAMS) {
+            reply_flush(w);
+            b->dest = *dest;
+        }
+        iov = &b->iov[b->no_dgrams];
+        iov->iov_base = b->buf + b->no_dgrams * b->slot_size;
+        iov->iov_len = 0;
+        b->no_dgrams++;
+    }
+    memcpy((unsigned char *)iov->iov_base + iov->iov_len, reply, len);
+    iov->iov_len += len;
+    b->no_replies++;
+}
+
+static int timespec_passed(const struct timespec *t, const struct timespec *now)
+{
+    return now->tv_sec > t->tv_sec ||
+        (now->tv_sec == t->tv_sec && now->tv_nsec >= t->tv_nsec);
+}
+
+/*
+ * Wait up to the deadline for any of the worker's sockets to become ready.
+ * Returns 1 when there is something to handle, 0 when the deadline passed.
+ */
+static int server_wait(server_worker_t *w, const struct timespec *deadline)
+{
+    struct timespec now, left;
+    struct pollfd pfd;
+
+    server_clock(&now);
+    if (timespec_passed(deadline, &now))
+        return 0;
+    left.tv_sec = deadline->tv_sec - now.tv_sec;
+    left.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+    }
+
+    /* epoll_wait() only has millisecond timeouts; ppoll() the epoll descriptor */
+    pfd.fd = w->epfd;
+    pfd.events = POLLIN;
+    w->syscalls++;
+    return ppoll(&pfd, 1, &left, NULL) > 0;
+}
+
+/*
+ * Receive one datagram and run its bundled requests through the pipeline.
+ * Returns 0 when there was none to receive.
+ */
+static int server_udp_read(server_worker_t *w)
+{
+    struct sockaddr_in cliaddr;
+    long long data_len;
+    int no_msgs, i;
+
+    data_len = rad_net_recvfrom(w->sockfd, w->mesg, MSG_SIZE, MSG_DONTWAIT, &cliaddr);
+    w->syscalls++;
+    RAD_LOG(RAD_LOG_TRACE, RAD_LOGC_NET, "Received %lld bytes", data_len);
+    if (data_len <= 0)
+        return data_len == 0;
+
+    /* Find and check every sub-request before processing any of them */
+    no_msgs = rad_bundle_scan(w->mesg, data_len, w->bundle_off, BUNDLE_MAX_MSGS);
+    if (no_msgs < 0) {
+        RAD_LOG(RAD_LOG_WARN, RAD_LOGC_PROTO, "Malformed bundle of %lld bytes", data_len);
+        w->dropped++;
+        return 1;
+    }
+    for (i = 0; i < no_msgs; i++)
+        server_pipeline_process(w, w->mesg + w->bundle_off[i],
+                                w->bundle_off[i + 1] - w->bundle_off[i], &cliaddr, NULL);
+    return 1;
+}
+
+static int server_epoll_add(server_worker_t *w, int fd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Set up the reply batch and the pipeline of a worker */
+int server_worker_init(server_worker_t *w)
+{
+    w->batch.slot_size = w->cfg->reply_max > REPLY_MAX_PACKET ?
+        w->cfg->reply_max : REPLY_MAX_PACKET;
+    if ((w->batch.buf = malloc(REPLY_MAX_DGRAMS * w->batch.slot_size)) == NULL) {
+        fprintf(stderr, "Worker %d: out of memory\n", w->id);
+        return -1;
+    }
+    if (server_pipeline_init(w) == -1) {
+        fprintf(stderr, "Worker %d: cannot set up the request pipeline\n", w->id);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * One round of a worker driven from outside rather than by its own event
+ * loop, as in the simulated network: read what has arrived on the UDP
+ * socket if it is readable, send the delayed replies that are due and
+ * the gathered ones whose linger window is over.  Returns 1 and sets
+ * *next to when it wants to run again, or 0 if nothing is waiting.
+ */
+int server_worker_poll(server_worker_t *w, int readable, struct timespec *next)
+{
+    struct timespec next_due, now;
+    int have_due;
+
+    if (readable)
+        while (server_udp_read(w))
+            ;
+    have_due = server_pipeline_due(w, &next_due);
+    if (w->batch.no_replies) {
+        server_clock(&now);
+        if (w->cfg->linger_us == 0 || timespec_passed(&w->batch.deadline, &now))
+            reply_flush(w);
+    }
+    if (w->batch.no_replies) {
+        *next = w->batch.deadline;
+        if (have_due && timespec_passed(&next_due, next))
+            *next = next_due;
+        return 1;
+    }
+    if (have_due)
+        *next = next_due;
+    return have_due;
+}
+
+/* Event loop of a single worker: UDP datagrams, TCP connections and delayed replies */
+void *server_worker_run(void *arg)
+{
+    server_worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct timespec next_due, now;
+    const struct timespec *deadline;
+    int have_due, n, i;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            RAD_LOG(RAD_LOG_WARN, RAD_LOGC_GENERAL, "Worker %d: cannot pin to CPU %d",
+                    w->id, w->cpu);
+    }
+
+    /* Allocate the reply batch on the worker's own CPU */
+    if (server_worker_init(w) == -1)
+        return NULL;
+    if ((w->epfd = epoll_create1(0)) == -1 ||
+            (w->sockfd != -1 && server_epoll_add(w, w->sockfd) == -1) ||
+            (w->listenfd != -1 && server_epoll_add(w, w->listenfd) == -1)) {
+        fprintf(stderr, "Worker %d: epoll: %s\n", w->id, strerror(errno));
+        return NULL;
+    }
+
+    for (;;)
+    {
+        /* Release the delayed replies that have become due */
+        have_due = server_pipeline_due(w, &next_due);
+        server_tcp_flush(w);
+        if (w->batch.no_replies && w->cfg->linger_us == 0)
+            reply_flush(w);
+
+        /* Hold back the gathered replies while more requests keep arriving */
+        deadline = NULL;
+        if (w->batch.no_replies)
+            deadline = &w->batch.deadline;
+        if (have_due && (deadline == NULL || timespec_passed(&next_due, deadline)))
+            deadline = &next_due;
+        if (deadline != NULL && !server_wait(w, deadline)) {
+            server_clock(&now);
+            if (w->batch.no_replies && timespec_passed(&w->batch.deadline, &now))
+                reply_flush(w);
+            continue;
+        }
+
+        n = epoll_wait(w->epfd, events, MAX_EVENTS, deadline != NULL ? 0 : -1);
+        w->syscalls++;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == w->sockfd)
+                server_udp_read(w);
+            else if (events[i].data.fd == w->listenfd)
+                server_tcp_accept(w);
+            else
+                server_tcp_event(w, events[i].data.fd, events[i].events);
+        }
+
+        /* Replies to what was read in this round go out together */
+        server_tcp_flush(w);
+        if (w->cfg->linger_us == 0)
+            reply_flush(w);
+    }
+    return NULL;
+}
@@ -0,0 +1,497 @@
+/*
+ * Bundling experiments on a simulated network
+ *
+ * Runs the bundling client of radius_dev.c against test server workers
+ * (server_worker.c) in one process, over the simulated network of
+ * radlib_sim.c instead of sockets.  Nothing waits for real time: the
+ * virtual clock jumps from one datagram or timer to the next, so hours of
+ * retransmits and failovers take seconds, and a run is reproduced exactly
+ * by its seed and options.  This is for tuning the bundle size, the
+ * server's reply bundling and linger window, and the client's timeout,
+ * tries and dead time against a link with a given latency, jitter, loss,
+ * reordering, bandwidth and MTU.
+ *
+ * The client sends bundles one after the other: it stamps a bundle of
+ * Access-Requests, sends it with my_rad_send_request(), which waits for
+ * all the replies, retransmits and fails over to the next server as it
+ * would on a real network, and pauses for the gap before the next one.
+ * The servers are at 10.0.0.1, 10.0.0.2 and so on, port 1812, and can be
+ * taken off the network for a while to watch the failover.
+ *
+ * The report on standard output depends only on the options; the wall
+ * time of the run goes to standard error.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "include/radlib.h"
+#include "include/radlib_private.h"
+#include "include/radlib_net.h"
+#include "include/server.h"
+
+#define SIM_SECRET "testing123"
+#define SIM_MAX_SERVERS 8
+#define SIM_MAX_BUNDLE 1000         /* Requests radius_dev.c tracks in a bundle */
+#define SIM_MAX_OUTAGES 16
+
+struct rad_attr_block *my_rad_nas_block(struct rad_handle *h);
+struct rad_template *my_rad_template(struct rad_handle *h,
+                                     const struct rad_attr_block *nas);
+struct rad_request *my_rad_init(struct rad_handle *h,
+                                const struct rad_template *tpl);
+int my_rad_add_request(unsigned char *msg, long long *len, struct rad_request *r);
+int my_rad_send_request(struct rad_handle *h, unsigned char *msg, long long len,
+                        uint proto_tcp, long long msg_count);
+
+/* A server inside the simulation */
+typedef struct _sim_server_t
+{
+    server_worker_t w;
+    struct rad_sim *sim;
+    struct sockaddr_in addr;
+    u_int64_t timer;            /* Earliest wakeup asked for, 0 for none */
+}sim_server_t;
+
+/* A server taken off the network from start to end */
+typedef struct _sim_outage_t
+{
+    struct rad_sim *sim;
+    int server;
+    u_int64_t start;
+    u_int64_t end;
+    struct sockaddr_in addr;
+}sim_outage_t;
+
+typedef struct _sim_config_t
+{
+    double duration;            /* Virtual seconds */
+    long long bundles;          /* Stop after so many, 0 for no limit */
+    int bundle;
+    long long gap_ns;           /* Between a bundle's replies and the next */
+    int servers;
+    int timeout;                /* Seconds */
+    int tries;                  /* Per server */
+    int dead_time;              /* Seconds */
+    unsigned long long seed;
+    struct rad_sim_link link;
+    int no_outages;
+    sim_outage_t outages[SIM_MAX_OUTAGES];
+}sim_config_t;
+
+static sim_server_t servers[SIM_MAX_SERVERS];
+
+static u_int64_t ts_ns(const struct timespec *ts)
+{
+    return (u_int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* A datagram has arrived for a server (fd), or its timer has fired (-1) */
+static void sim_server_event(void *arg, int fd)
+{
+    sim_server_t *s = arg;
+    struct timespec next;
+    u_int64_t at;
+
+    if (fd == -1 && s->timer <= rad_sim_now(s->sim))
+        s->timer = 0;
+    if (!server_worker_poll(&s->w, fd != -1, &next))
+        return;
+    /* Wake up for the linger window or the next delayed reply */
+    at = ts_ns(&next);
+    if (s->timer == 0 || at < s->timer) {
+        s->timer = at;
+        rad_sim_timer(s->sim, at, sim_server_event, s);
+    }
+}
+
+static void sim_outage_event(void *arg, int fd)
+{
+    sim_outage_t *o = arg;
+    int down = rad_sim_now(o->sim) < o->end;
+
+    rad_sim_down(o->sim, &o->addr, down);
+    if (down)
+        rad_sim_timer(o->sim, o->end, sim_outage_event, o);
+}
+
+/* Open server i at 10.0.0.i+1 */
+static int sim_server_start(struct rad_sim *sim, int i, server_config_t *cfg,
+                            unsigned long long seed)
+{
+    sim_server_t *s = &servers[i];
+
+    s->sim = sim;
+    s->addr.sin_family = AF_INET;
+    s->addr.sin_addr.s_addr = htonl(0x0a000001 + i);
+    s->addr.sin_port = htons(SERVER_PORT);
+    s->w.id = i;
+    s->w.cpu = -1;
+    s->w.cfg = cfg;
+    s->w.listenfd = -1;
+    s->w.epfd = -1;
+    if ((s->w.sockfd = rad_net_socket(SOCK_DGRAM)) == -1 ||
+            rad_net_bind(s->w.sockfd, &s->addr) == -1 ||
+            rad_sim_listen(sim, s->w.sockfd, sim_server_event, s) == -1) {
+        fprintf(stderr, "Server %d: %s\n", i, strerror(errno));
+        return -1;
+    }
+    if (server_worker_init(&s->w) == -1)
+        return -1;
+    /* Draw the processing times from the seed too */
+    s->w.rng[0] = i;
+    s->w.rng[1] = seed;
+    s->w.rng[2] = seed >> 16;
+    return 0;
+}
+
+static void sim_print_stage(const char *name, int stage)
+{
+    struct rad_latency l;
+
+    if (rad_latency_get(NULL, RAD_LAT_ANY, RAD_LAT_ANY, stage, &l) == -1 || l.count == 0)
+        return;
+    printf("%-6s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+           l.mean / 1e6, l.p50 / 1e6, l.p90 / 1e6, l.p99 / 1e6, l.p999 / 1e6,
+           l.max / 1e6);
+}
+
+static void sim_report(const sim_config_t *cfg, const server_config_t *scfg,
+                       struct rad_sim *sim, long long bundles, long long failed)
+{
+    struct rad_sim_stats st;
+    struct rad_stats stats;
+    struct rad_latency l;
+    const u_int64_t *c = stats.counters;
+    long long answered;
+    int i;
+
+    rad_sim_stats(sim, &st);
+    rad_stats_snapshot(&stats);
+    answered = rad_latency_get(NULL, RAD_LAT_ANY, RAD_LAT_ANY, RAD_LAT_TOTAL, &l) == 0 ?
+        (long long)l.count : 0;
+
+    printf("Simulated %.3f s: %lld bundles of %d requests, %d server(s), seed %llu\n",
+           st.now / 1e9, bundles, cfg->bundle, cfg->servers, cfg->seed);
+    printf("Link: latency %.3f ms, jitter %.3f ms, loss %g, reorder %g by %.3f ms,"
+           " %.1f Mbit/s, MTU %u\n",
+           cfg->link.latency_ns / 1e6, cfg->link.jitter_ns / 1e6, cfg->link.loss,
+           cfg->link.reorder, cfg->link.reorder_ns / 1e6, cfg->link.bandwidth / 1e6,
+           cfg->link.mtu);
+    printf("Server: %s replies of up to %d bytes, linger %ld us\n",
+           scfg->reply_mode == REPLY_MODE_BUNDLE ? "bundled" : "per-request",
+           scfg->reply_max, scfg->linger_us);
+    printf("\nRequests %lld, answered %lld, unanswered %lld; %lld bundles failed\n",
+           bundles * cfg->bundle, answered, bundles * cfg->bundle - answered, failed);
+    printf("Goodput %.1f requests/s\n", st.now ? answered * 1e9 / st.now : 0.0);
+    printf("Client: %llu bundles sent, %llu retransmits, %llu timeouts, %llu failovers\n",
+           (unsigned long long)c[RAD_STAT_BUNDLES],
+           (unsigned long long)c[RAD_STAT_RETRANSMITS],
+           (unsigned long long)c[RAD_STAT_TIMEOUTS],
+           (unsigned long long)c[RAD_STAT_FAILOVERS]);
+    printf("Network: %llu datagrams, %llu bytes, %llu fragments, %llu lost, %llu reordered,"
+           " %llu unreachable, %llu overflows\n",
+           (unsigned long long)st.datagrams, (unsigned long long)st.bytes,
+           (unsigned long long)st.fragments, (unsigned long long)st.lost,
+           (unsigned long long)st.reordered, (unsigned long long)st.unreachable,
+           (unsigned long long)st.overflows);
+    for (i = 0; i < cfg->servers; i++)
+        printf("Server %s: %lld served, %lld duplicates, %lld dropped\n",
+               inet_ntoa(servers[i].addr.sin_addr), servers[i].w.msg_no,
+               servers[i].w.duplicates, servers[i].w.dropped);
+
+    printf("\nLatency of the answered requests, ms\n");
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "stage", "mean", "p50", "p90", "p99",
+           "p99.9", "max");
+    sim_print_stage("wire", RAD_LAT_WIRE);
+    sim_print_stage("total", RAD_LAT_TOTAL);
+}
+
+/* Parse "server:start-end", seconds of virtual time */
+static int sim_outage_parse(const char *spec, sim_config_t *cfg)
+{
+    sim_outage_t *o;
+    double start, end;
+    int server, n;
+
+    if (cfg->no_outages == SIM_MAX_OUTAGES)
+        return -1;
+    if (sscanf(spec, "%d:%lf-%lf%n", &server, &start, &end, &n) != 3 ||
+            spec[n] != '\0' || server < 0 || start < 0 || end <= start)
+        return -1;
+    o = &cfg->outages[cfg->no_outages++];
+    o->server = server;
+    o->start = start * 1e9;
+    o->end = end * 1e9;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d seconds] [-c bundles] [-b bundle] [-g usec] [-n servers]\n"
+            "          [-T sec] [-R tries] [-Z sec] [-l usec] [-j usec] [-e loss]\n"
+            "          [-o share] [-O usec] [-B mbit] [-M mtu] [-r per|bundle] [-m size]\n"
+            "          [-w usec] [-P latency] [-D msec] [-k server:start-end] [-S seed]\n"
+            "          [-v level]\n"
+            "  -d seconds  virtual time to run for (default 60)\n"
+            "  -c bundles  stop after so many bundles (default 0, no limit)\n"
+            "  -b bundle   requests per bundle, 1 to %d (default 16)\n"
+            "  -g usec     pause between a bundle's replies and the next (default 1000)\n"
+            "  -n servers  servers to fail over between, 1 to %d (default 1)\n"
+            "  -T sec      time to wait for the replies to a bundle (default 3)\n"
+            "  -R tries    sends of a bundle to a server before the next (default 3)\n"
+            "  -Z sec      how long a server that failed is skipped (default 0)\n"
+            "  -l usec     one way latency of the link (default 500)\n"
+            "  -j usec     jitter on top of it, uniform (default 0)\n"
+            "  -e loss     chance of losing an IP fragment (default 0)\n"
+            "  -o share    share of datagrams delayed out of order (default 0)\n"
+            "  -O usec     by how much (default 2000)\n"
+            "  -B mbit     bandwidth of every sender in Mbit/s (default 0, unlimited)\n"
+            "  -M mtu      IP packet size, datagrams above it are fragmented (default 1500)\n"
+            "  -r mode     server replies 'per' request or 'bundle'd (default bundle)\n"
+            "  -m size     largest bundled reply datagram (default %d)\n"
+            "  -w usec     server linger window (default 0)\n"
+            "  -P latency  server processing time, as the server's -L; always\n"
+            "              asynchronous (default none)\n"
+            "  -D msec     server duplicate cache lifetime (default 0, disabled)\n"
+            "  -k outage   take a server (0 is the first) off the network for a\n"
+            "              while, e.g. 0:10-70; may be repeated\n"
+            "  -S seed     seed of the network and the requests (default 1)\n"
+            "  -v level    log level[:category,...], to standard error\n",
+            prog, SIM_MAX_BUNDLE, SIM_MAX_SERVERS, REPLY_MAX_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    sim_config_t cfg;
+    server_config_t scfg;
+    struct rad_sim *sim;
+    struct rad_handle *h;
+    struct rad_attr_block *nas;
+    struct rad_template *tpl;
+    struct rad_request *r;
+    struct in_addr any;
+    struct timespec t0, t1;
+    unsigned char *msg;
+    long long len, bundles = 0, failed = 0;
+    u_int64_t start, end;
+    double wall;
+    int opt, dup_ms = 0, i, rc;
+    char host[INET_ADDRSTRLEN];
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.duration = 60;
+    cfg.bundle = 16;
+    cfg.gap_ns = 1000000;
+    cfg.servers = 1;
+    cfg.timeout = 3;
+    cfg.tries = 3;
+    cfg.seed = 1;
+    cfg.link.latency_ns = 500000;
+    cfg.link.reorder_ns = 2000000;
+    cfg.link.mtu = 1500;
+
+    memset(&scfg, 0, sizeof(scfg));
+    scfg.port = SERVER_PORT;
+    scfg.protocols = PROTO_UDP;
+    scfg.reply_mode = REPLY_MODE_BUNDLE;
+    scfg.reply_max = REPLY_MAX_SIZE;
+    scfg.secret = SIM_SECRET;
+    scfg.handler = server_handler_find("accept");
+
+    while ((opt = getopt(argc, argv, "d:c:b:g:n:T:R:Z:l:j:e:o:O:B:M:r:m:w:P:D:k:S:v:")) != -1) {
+        switch (opt) {
+            case 'd':
+                cfg.duration = atof(optarg);
+                break;
+            case 'c':
+                cfg.bundles = atoll(optarg);
+                break;
+            case 'b':
+                cfg.bundle = atoi(optarg);
+                break;
+            case 'g':
+                cfg.gap_ns = atoll(optarg) * 1000;
+                break;
+            case 'n':
+                cfg.servers = atoi(optarg);
+                break;
+            case 'T':
+                cfg.timeout = atoi(optarg);
+                break;
+            case 'R':
+                cfg.tries = atoi(optarg);
+                break;
+            case 'Z':
+                cfg.dead_time = atoi(optarg);
+                break;
+            case 'l':
+                cfg.link.latency_ns = atof(optarg) * 1000;
+                break;
+            case 'j':
+                cfg.link.jitter_ns = atof(optarg) * 1000;
+                break;
+            case 'e':
+                cfg.link.loss = atof(optarg);
+                break;
+            case 'o':
+                cfg.link.reorder = atof(optarg);
+                break;
+            case 'O':
+                cfg.link.reorder_ns = atof(optarg) * 1000;
+                break;
+            case 'B':
+                cfg.link.bandwidth = atof(optarg) * 1e6;
+                break;
+            case 'M':
+                cfg.link.mtu = atoi(optarg);
+                break;
+            case 'r':
+                if (strcmp(optarg, "per") == 0)
+                    scfg.reply_mode = REPLY_MODE_PER_REQUEST;
+                else if (strcmp(optarg, "bundle") == 0)
+                    scfg.reply_mode = REPLY_MODE_BUNDLE;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'm':
+                scfg.reply_max = atoi(optarg);
+                break;
+            case 'w':
+                scfg.linger_us = atol(optarg);
+                break;
+            case 'P':
+                if (server_latency_parse(optarg, &scfg.latency) == -1) {
+                    fprintf(stderr, "Invalid latency model %s\n", optarg);
+                    return 1;
+                }
+                /* A blocking delay would take real time */
+                scfg.latency.async = 1;
+                break;
+            case 'D':
+                dup_ms = atoi(optarg);
+                break;
+            case 'k':
+                if (sim_outage_parse(optarg, &cfg) == -1) {
+                    fprintf(stderr, "Invalid outage %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S':
+                cfg.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'v':
+                if (rad_log_parse(optarg) == -1) {
+                    fprintf(stderr, "Invalid log level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (cfg.duration <= 0 || cfg.bundles < 0 || cfg.bundle < 1 ||
+            cfg.bundle > SIM_MAX_BUNDLE || cfg.gap_ns < 0 || cfg.servers < 1 ||
+            cfg.servers > SIM_MAX_SERVERS || cfg.timeout < 1 || cfg.tries < 1 ||
+            cfg.dead_time < 0 || cfg.link.loss < 0 || cfg.link.loss > 1 ||
+            cfg.link.reorder < 0 || cfg.link.reorder > 1 || cfg.link.mtu > 65535 ||
+            scfg.reply_max < 20 || scfg.reply_max > MSG_SIZE || scfg.linger_us < 0 ||
+            dup_ms < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < cfg.no_outages; i++)
+        if (cfg.outages[i].server >= cfg.servers) {
+            fprintf(stderr, "No server %d\n", cfg.outages[i].server);
+            return 1;
+        }
+    if (dup_ms && (scfg.dup = rad_dup_cache_create(dup_ms, DUP_MAX_ENTRIES)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if ((msg = malloc(MSGSIZE)) == NULL ||
+            (sim = rad_sim_create(cfg.seed, &cfg.link)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (rad_log_start(stderr) == -1)
+        fprintf(stderr, "Cannot start the logging thread, logging synchronously\n");
+    rad_sim_start(sim);
+    start = rad_sim_now(sim);
+
+    for (i = 0; i < cfg.servers; i++)
+        if (sim_server_start(sim, i, &scfg, cfg.seed) == -1)
+            return 1;
+    for (i = 0; i < cfg.no_outages; i++) {
+        cfg.outages[i].sim = sim;
+        cfg.outages[i].addr = servers[cfg.outages[i].server].addr;
+        cfg.outages[i].start += start;
+        cfg.outages[i].end += start;
+        rad_sim_timer(sim, cfg.outages[i].start, sim_outage_event, &cfg.outages[i]);
+    }
+
+    /* The client, with its identifiers and authenticators drawn from the seed */
+    if ((h = rad_auth_open()) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    srandom(cfg.seed);
+    h->ident = random();
+    any.s_addr = htonl(INADDR_ANY);
+    for (i = 0; i < cfg.servers; i++) {
+        inet_ntop(AF_INET, &servers[i].addr.sin_addr, host, sizeof(host));
+        if (rad_add_server_ex(h, host, SERVER_PORT, SIM_SECRET, cfg.timeout, cfg.tries,
+                    cfg.dead_time, &any) == -1) {
+            fprintf(stderr, "%s\n", rad_strerror(h));
+            return 1;
+        }
+    }
+    rad_set_latency(h, 1);
+    if ((nas = my_rad_nas_block(h)) == NULL || (tpl = my_rad_template(h, nas)) == NULL) {
+        fprintf(stderr, "Request template failure %s\n", rad_strerror(h));
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    end = start + (u_int64_t)(cfg.duration * 1e9);
+    while (rad_sim_now(sim) < end && (cfg.bundles == 0 || bundles < cfg.bundles)) {
+        len = 0;
+        for (i = 0; i < cfg.bundle; i++) {
+            if ((r = my_rad_init(h, tpl)) == NULL || my_rad_add_request(msg, &len, r) == -1) {
+                fprintf(stderr, "Cannot build the bundle: %s\n", rad_strerror(h));
+                return 1;
+            }
+        }
+        rc = my_rad_send_request(h, msg, len, 0, cfg.bundle);
+        bundles++;
+        if (rc == -1)
+            failed++;
+        rad_sim_run(sim, rad_sim_now(sim) + cfg.gap_ns);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    rad_log_stop();
+    sim_report(&cfg, &scfg, sim, bundles, failed);
+    wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "\n%.3f s of wall time, %.0f times faster than real time\n", wall,
+            wall > 0 ? (rad_sim_now(sim) - start) / 1e9 / wall : 0.0);
+
+    rad_template_free(tpl);
+    rad_block_free(nas);
+    rad_close(h);
+    rad_sim_stop(sim);
+    rad_sim_destroy(sim);
+    free(msg);
+    return 0;
+}